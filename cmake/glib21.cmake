@@ -31,6 +31,12 @@ if (BUILD_MONOLITHIC OR BUILD_DAEMON)
 	endif()
 
 	check_function_exists (posix_fallocate HAVE_POSIX_FALLOCATE)
+	check_function_exists (posix_fadvise HAVE_POSIX_FADVISE)
+	check_function_exists (pread HAVE_PREAD)
+	check_function_exists (pwritev HAVE_PWRITEV)
+	check_function_exists (sendfile HAVE_SENDFILE)
+	check_include_file (sys/sendfile.h HAVE_SYS_SENDFILE_H)
+	check_include_file (netinet/tcp.h HAVE_NETINET_TCP_H)
 endif()
 
 if (BUILD_DAEMON)
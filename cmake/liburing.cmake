@@ -0,0 +1,17 @@
+include (FindPkgConfig)
+pkg_check_modules (LIBURING liburing)
+
+if (LIBURING_FOUND)
+	add_library (LIBURING::LIBURING SHARED IMPORTED)
+
+	set_target_properties (LIBURING::LIBURING PROPERTIES
+		IMPORTED_LOCATION "${pkgcfg_lib_LIBURING_uring}"
+		INTERFACE_INCLUDE_DIRECTORIES "${LIBURING_INCLUDE_DIRS}"
+		INTERFACE_LINK_LIBRARIES "${LIBURING_LIBRARIES}"
+	)
+
+	set (HAVE_LIBURING TRUE)
+else()
+	set (ENABLE_IO_URING FALSE)
+	message (STATUS "liburing not found, disabling io_uring")
+endif()
@@ -47,6 +47,7 @@ option (BUILD_WEBSERVER "compile aMule WebServer")
 option (BUILD_WXCAS "compile aMule GUI Statistics")
 option (BUILD_XAS "install xas XChat2 plugin")
 option (BUILD_TESTING "Run Tests after compile" ON)
+option (BUILD_BENCHMARKS "compile the benchmarks next to the tests, they are not run by ctest")
 
 if (PREFIX)
 	set (CMAKE_INSTALL_PREFIX "${PREFIX}")
@@ -186,6 +187,7 @@ endif()
 if (NEED_LIB_MULEAPPCOMMON)
 	option (ENABLE_BOOST "compile with Boost.ASIO Sockets" ON)
 	option (ENABLE_IP2COUNTRY "compile with GeoIP IP2Country library" ON)
+	option (ENABLE_IO_URING "use io_uring for file I/O if supported (Linux only)")
 	option (ENABLE_MMAP "enable using mapped memory if supported")
 	option (ENABLE_NLS "enable national language support" ON)
 	option (ENABLE_SEARCH_WINDOW_DEBUG "enable search window debug logging" ON)
@@ -194,6 +196,7 @@ if (NEED_LIB_MULEAPPCOMMON)
 else()
 	set (ENABLE_BOOST FALSE)
 	set (ENABLE_IP2COUNTRY FALSE)
+	set (ENABLE_IO_URING FALSE)
 	set (ENABLE_MMAP FALSE)
 	set (ENABLE_NLS FALSE)
 endif()
@@ -10,6 +10,7 @@ if (BUILD_MONOLITHIC OR BUILD_DAEMON)
 		kademlia/routing/RoutingZone.cpp
 		amule.cpp
 		BaseClient.cpp
+		ChunkSelector.cpp
 		ClientCreditsList.cpp
 		ClientList.cpp
 		ClientTCPSocket.cpp
@@ -17,16 +18,23 @@ if (BUILD_MONOLITHIC OR BUILD_DAEMON)
 		CorruptionBlackBox.cpp
 		DownloadClient.cpp
 		DownloadQueue.cpp
+		DownloadQueueIndex.cpp
 		ECSpecialCoreTags.cpp
 		EMSocket.cpp
 		EncryptedStreamSocket.cpp
 		EncryptedDatagramSocket.cpp
+		EndGame.cpp
 		ExternalConn.cpp
 		FriendList.cpp
 		IPFilter.cpp
 		KnownFileList.cpp
 		ListenSocket.cpp
 		MuleUDPSocket.cpp
+		PartAvailability.cpp
+		PartFileJournal.cpp
+		PartFileWriteThread.cpp
+		PartHashStates.cpp
+		PartHashing.cpp
 		SearchFile.cpp
 		ServerConnect.cpp
 		ServerList.cpp
@@ -34,9 +42,12 @@ if (BUILD_MONOLITHIC OR BUILD_DAEMON)
 		ServerUDPSocket.cpp
 		SHAHashSet.cpp
 		SharedFileList.cpp
+		SourceExchangeCache.cpp
 		UploadBandwidthThrottler.cpp
 		UploadClient.cpp
+		UploadCompressor.cpp
 		UploadQueue.cpp
+		UploadScheduler.cpp
 		ThreadTasks.cpp
 		protocol/ProtocolCoordinator.cpp
 	)
@@ -0,0 +1,51 @@
+#                                               -*- Autoconf -*-
+# This file is part of the aMule Project.
+#
+# Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+#
+# Any parts of this program derived from the xMule, lMule or eMule project,
+# or contributed by third-party developers are copyrighted by their
+# respective authors.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+#
+
+
+dnl ---------------------------------------------------------------------------
+dnl MULE_CHECK_IO_URING
+dnl
+dnl Checks if io_uring based file I/O is requested and whether liburing is
+dnl available. Whether the kernel supports it is only known at runtime.
+dnl ---------------------------------------------------------------------------
+AC_DEFUN([MULE_CHECK_IO_URING],
+[
+	MULE_ARG_ENABLE([io-uring], [no], [use io_uring for file I/O if supported (Linux only)])
+
+	MULE_IF_ENABLED([io-uring], [
+		AC_CHECK_HEADER([liburing.h], [
+			AC_CHECK_LIB([uring], [io_uring_queue_init], [
+				AC_DEFINE([HAVE_LIBURING], [1], [Define to 1 if liburing is available and should be used for file I/O.])
+				LIBURING_LIBS="-luring"
+			], [
+				MULE_ENABLEVAR([io-uring])=disabled
+				MULE_WARNING([io_uring support has been disabled because liburing was not found])
+			])
+		], [
+			MULE_ENABLEVAR([io-uring])=disabled
+			MULE_WARNING([io_uring support has been disabled because the liburing header files were not found])
+		])
+	])
+])
+AC_SUBST([LIBURING_LIBS])dnl
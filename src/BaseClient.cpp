@@ -188,6 +188,7 @@ void CUpDownClient::Init()
 	m_fSentOutOfPartReqs = 0;
 	m_nCurQueueSessionPayloadUp = 0;
 	m_addedPayloadQueueSession = 0;
+	m_blockReads = NULL;
 	m_nUpDatarate = 0;
 	m_nSumForAvgUpDataRate = 0;
 
@@ -226,6 +227,7 @@ void CUpDownClient::Init()
 	m_LastFileRequest = 0;
 
 	m_clientState = CS_NEW;
+	m_dwUserIP = 0;
 
 	ClearHelloProperties();
 
@@ -236,12 +238,12 @@ void CUpDownClient::Init()
 	m_fExtMultiPacket = 0;
 	m_fIsSpammer = 0;
 
-	m_dwUserIP = 0;
 	m_nConnectIP = 0;
 	m_dwServerIP = 0;
 
 	m_fNeedOurPublicIP = false;
 	m_bHashsetRequested = false;
+	m_bBlockRequestsDeferred = false;
 
 	m_lastDownloadingPart = 0;
 
@@ -331,7 +333,7 @@ CUpDownClient::~CUpDownClient()
 
 void CUpDownClient::ClearHelloProperties()
 {
-	m_nUDPPort = 0;
+	SetUDPPort(0);
 	m_byUDPVer = 0;
 	m_byDataCompVer = 0;
 	m_byEmuleVersion = 0;
@@ -506,7 +508,7 @@ bool CUpDownClient::ProcessHelloTypePacket(const CMemFile& data)
 				// 16 KAD Port
 				// 16 UDP Port
 				SetKadPort((temptag.GetInt() >> 16) & 0xFFFF);
-				m_nUDPPort = temptag.GetInt() & 0xFFFF;
+				SetUDPPort(temptag.GetInt() & 0xFFFF);
 				dwEmuleTags |= 1;
 				#ifdef __PACKET_DEBUG__
 				AddLogLineNS(CFormat(wxT("Hello type packet processing with eMule ports UDP=%i KAD=%i")) % m_nUDPPort % m_nKadPort);
@@ -906,7 +908,7 @@ bool CUpDownClient::ProcessMuleInfoPacket(const uint8_t* pachPacket, uint32 nSiz
 				case ET_UDPPORT:
 					// Bits 31-16: 0 - reserved
 					// Bits 15- 0: UDP port
-					m_nUDPPort = temptag.GetInt();
+					SetUDPPort(temptag.GetInt());
 					break;
 
 				case ET_UDPVER:
@@ -974,7 +976,7 @@ bool CUpDownClient::ProcessMuleInfoPacket(const uint8_t* pachPacket, uint32 nSiz
 			m_bySourceExchange1Ver = 0;
 			m_byExtendedRequestsVer = 0;
 			m_byAcceptCommentVer = 0;
-			m_nUDPPort = 0;
+			SetUDPPort(0);
 		}
 
 		//implicitly supported options by older clients
@@ -1214,7 +1216,7 @@ void CUpDownClient::ClearDownloadBlockRequests()
 			Requested_Block_Struct* cur_block = *it;
 
 			if (m_reqfile){
-				m_reqfile->RemoveBlockFromList(cur_block->StartOffset, cur_block->EndOffset);
+				m_reqfile->RemoveBlockFromList(cur_block);
 			}
 
 			delete cur_block;
@@ -1229,7 +1231,7 @@ void CUpDownClient::ClearDownloadBlockRequests()
 			Pending_Block_Struct* pending = *it;
 
 			if (m_reqfile) {
-				m_reqfile->RemoveBlockFromList(pending->block->StartOffset, pending->block->EndOffset);
+				m_reqfile->RemoveBlockFromList(pending->block);
 			}
 
 			delete pending->block;
@@ -1244,6 +1246,9 @@ void CUpDownClient::ClearDownloadBlockRequests()
 
 		m_PendingBlocks_list.clear();
 	}
+
+	m_cancelledBlocks.clear();
+	m_bBlockRequestsDeferred = false;
 }
 
 
@@ -2427,6 +2432,12 @@ void CUpDownClient::SetUserIDHybrid(uint32 nUserID)
 void CUpDownClient::SetIP( uint32 val )
 {
 	theApp->clientlist->UpdateClientIP( this, val );
+	if (theApp->uploadqueue) {
+		theApp->uploadqueue->UpdateWaitingClientIP( this, val );
+	}
+	if (theApp->downloadqueue) {
+		theApp->downloadqueue->UpdateSourceEndpoint( this, val, m_nUDPPort );
+	}
 
 	m_dwUserIP = val;
 
@@ -2436,6 +2447,16 @@ void CUpDownClient::SetIP( uint32 val )
 }
 
 
+void CUpDownClient::SetUDPPort(uint16 nPort)
+{
+	if (theApp->downloadqueue) {
+		theApp->downloadqueue->UpdateSourceEndpoint(this, m_dwUserIP, nPort);
+	}
+
+	m_nUDPPort = nPort;
+}
+
+
 void CUpDownClient::SetUserHash(const CMD4Hash& userhash)
 {
 	theApp->clientlist->UpdateClientHash( this, userhash );
@@ -26,6 +26,12 @@
 #ifndef BITVECTOR_H
 #define BITVECTOR_H
 
+#include "Types.h"		// Needed for uint8 and uint32
+
+#include <wx/debug.h>		// Needed for wxFAIL
+#include <bit>			// Needed for std::popcount and std::countr_zero
+#include <cstring>		// Needed for memset
+
 //
 // Packed bit vector
 //
@@ -110,19 +116,7 @@ public:
 	{
 		if (m_allTrue == 2) {
 			// don't know, have to check
-			bool foundFalse = false;
-			uint32 lastByte = m_bytes;
-			if (m_bits & 7) {
-				// uneven: check bits of last byte individually
-				lastByte--;
-				for (uint32 i = m_bits & 0xfffffff8; !foundFalse && i < m_bits; i++) {
-					foundFalse = !get(i);
-				}
-			}
-			// check bytewise
-			for (uint32 i = 0; !foundFalse && i < lastByte; i++) {
-				foundFalse = m_vector[i] != 0xff;
-			}
+			bool foundFalse = AnyWord(NULL, [](uint64 a, uint64) { return ~a; });
 			// This is really just a caching of information,
 			// so m_allTrue is mutable and AllTrue() still const.
 			m_allTrue = foundFalse ? 0 : 1;
@@ -131,7 +125,66 @@ public:
 	}
 
 	// set all bits to true
-	void SetAllTrue() { if (m_bytes) { memset(m_vector, 0xFF, m_bytes); } }
+	void SetAllTrue() { if (m_bytes) { memset(m_vector, 0xFF, m_bytes); m_allTrue = 1; } }
+
+	// is any bit true ?
+	bool Any() const
+	{
+		return AnyWord(NULL, [](uint64 a, uint64) { return a; });
+	}
+
+	// number of true bits
+	uint32 Count() const
+	{
+		const uint32 fullBytes = m_bits / 8;
+		uint32 count = 0;
+		uint32 i = 0;
+		for (; i + 8 <= fullBytes; i += 8) {
+			count += std::popcount(LoadWord(m_vector + i));
+		}
+		for (; i < fullBytes; i++) {
+			count += std::popcount(m_vector[i]);
+		}
+		if (m_bits & 7) {
+			count += std::popcount((uint8)(m_vector[fullBytes] & TailMask()));
+		}
+		return count;
+	}
+
+	// is any bit true in both vectors ? (false if the sizes differ)
+	bool Intersects(const BitVector& other) const
+	{
+		if (other.m_bits != m_bits) {
+			return false;
+		}
+		return AnyWord(other.m_vector, [](uint64 a, uint64 b) { return a & b; });
+	}
+
+	// is any bit true here and false in the other vector ? (false if the sizes differ)
+	bool HasAnyNotIn(const BitVector& other) const
+	{
+		if (other.m_bits != m_bits) {
+			return false;
+		}
+		return AnyWord(other.m_vector, [](uint64 a, uint64 b) { return a & ~b; });
+	}
+
+	// call visit(index) for each true bit, in order
+	template<typename Visit>
+	void ForEachSet(Visit visit) const
+	{
+		for (uint32 i = 0; i < m_bytes; i++) {
+			// skip empty words at once
+			if (i + 8 <= m_bytes && LoadWord(m_vector + i) == 0) {
+				i += 7;
+				continue;
+			}
+			uint8 bits = (i == m_bytes - 1) ? (uint8)(m_vector[i] & TailMask()) : m_vector[i];
+			for (; bits; bits &= bits - 1) {
+				visit(i * 8 + std::countr_zero(bits));
+			}
+		}
+	}
 
 	// handling of the internal buffer (for EC)
 	// get size
@@ -142,12 +195,42 @@ public:
 	void SetBuffer(const void* src) { memcpy(m_vector, src, m_bytes); m_allTrue = 2; }
 
 private:
+	// read 8 bytes at once; the byte order doesn't matter to the callers
+	static uint64 LoadWord(const uint8* src) { uint64 word; memcpy(&word, src, 8); return word; }
+
+	// the valid bits of the last byte
+	uint8 TailMask() const { return (m_bits & 7) ? (uint8)((1 << (m_bits & 7)) - 1) : 0xFF; }
+
+	// is op(a, b) nonzero for any word of this vector and the same word
+	// of 'other' (zero if NULL) ?  Bits past the size are ignored.
+	// Whole words are handled at once, so the compiler can vectorise.
+	template<typename Op>
+	bool AnyWord(const uint8* other, Op op) const
+	{
+		const uint32 fullBytes = m_bits / 8;
+		uint32 i = 0;
+		for (; i + 8 <= fullBytes; i += 8) {
+			if (op(LoadWord(m_vector + i), other ? LoadWord(other + i) : 0)) {
+				return true;
+			}
+		}
+		for (; i < fullBytes; i++) {
+			if ((uint8)op(m_vector[i], other ? other[i] : 0)) {
+				return true;
+			}
+		}
+		if (m_bits & 7) {
+			return ((uint8)op(m_vector[fullBytes], other ? other[fullBytes] : 0) & TailMask()) != 0;
+		}
+		return false;
+	}
+
 	uint32	m_bits;			// number of bits
 	uint32	m_bytes;		// number of bytes in the vector
 	uint8 *	m_vector;		// the storage
 	mutable uint8 m_allTrue;// All true ? 0: no  1: yes  2: don't know
-	static const uint8 s_posMask[]; // = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80}; implemented in OtherFunctions.cpp
-	static const uint8 s_negMask[]; // = {0xFE, 0xFD, 0xFB, 0xF7, 0xEF, 0xDF, 0xBF, 0x7F};
+	static constexpr uint8 s_posMask[] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80};
+	static constexpr uint8 s_negMask[] = {0xFE, 0xFD, 0xFB, 0xF7, 0xEF, 0xDF, 0xBF, 0x7F};
 };
 
 #endif
@@ -33,6 +33,25 @@
 #include <sys/param.h>
 #endif
 
+#ifdef HAVE_POSIX_FADVISE
+#include <fcntl.h>			// Needed for posix_fadvise
+#endif
+
+#ifdef HAVE_PREAD
+#include <unistd.h>			// Needed for pread
+#include <errno.h>
+#endif
+
+#ifdef HAVE_PWRITEV
+#include <sys/uio.h>			// Needed for pwritev
+#include <limits.h>			// Needed for IOV_MAX
+#include <errno.h>
+#include <algorithm>			// Needed for std::min
+#ifndef IOV_MAX
+#	define IOV_MAX	16
+#endif
+#endif
+
 // standard
 #if defined(__WINDOWS__) && !defined(__GNUWIN32__) && !defined(__WXWINE__) && !defined(__WXMICROWIN__)
 #	include <io.h>
@@ -357,6 +376,103 @@ sint64 CFile::doWrite(const void* buffer, size_t nCount)
 }
 
 
+void CFile::ReadAt(void* buffer, uint64 offset, size_t count)
+{
+	MULE_VALIDATE_PARAMS(buffer, wxT("CFile: Invalid buffer in read operation."));
+	MULE_VALIDATE_STATE(IsOpened(), wxT("CFile: Cannot read from closed file."));
+
+#ifdef HAVE_PREAD
+	size_t totalRead = 0;
+	while (totalRead < count) {
+		ssize_t current = ::pread(m_fd, (char*)buffer + totalRead, count - totalRead, offset + totalRead);
+
+		if (current == -1 && errno == EINTR) {
+			continue;
+		} else if (current == -1) {
+			throw CIOFailureException(wxString(wxT("Error reading from file: ")) + wxSysErrorMsg());
+		} else if (current == 0) {
+			throw CEOFException(wxT("Attempt to read past end of file."));
+		}
+
+		totalRead += current;
+	}
+#else
+	Seek(offset);
+	Read(buffer, count);
+#endif
+}
+
+
+void CFile::WriteAtV(const IOVector& buffers, uint64 offset)
+{
+	MULE_VALIDATE_STATE(IsOpened(), wxT("CFile: Cannot write to closed file."));
+
+#ifdef HAVE_PWRITEV
+	std::vector<struct iovec> iov(buffers.size());
+	for (size_t i = 0; i < buffers.size(); ++i) {
+		iov[i].iov_base = const_cast<uint8_t*>(buffers[i].first);
+		iov[i].iov_len = buffers[i].second;
+	}
+
+	size_t first = 0;
+	while (first < iov.size()) {
+		int count = std::min<size_t>(iov.size() - first, IOV_MAX);
+		ssize_t result = ::pwritev(m_fd, &iov[first], count, offset);
+
+		if (result == -1 && errno == EINTR) {
+			continue;
+		} else if (result <= 0) {
+			throw CIOFailureException(wxString(wxT("Error writing to file: ")) + wxSysErrorMsg());
+		}
+
+		offset += result;
+
+		// Skip what has been written, a short write may end within a buffer
+		while (result > 0) {
+			if ((size_t)result >= iov[first].iov_len) {
+				result -= iov[first].iov_len;
+				++first;
+			} else {
+				iov[first].iov_base = (char*)iov[first].iov_base + result;
+				iov[first].iov_len -= result;
+				result = 0;
+			}
+		}
+	}
+#else
+	Seek(offset);
+	for (IOVector::const_iterator it = buffers.begin(); it != buffers.end(); ++it) {
+		Write(it->first, it->second);
+	}
+#endif
+}
+
+
+void CFile::Advise(uint64 offset, uint64 length, AccessHint hint)
+{
+	MULE_VALIDATE_STATE(IsOpened(), wxT("CFile: Cannot advise on closed file."));
+
+#ifdef HAVE_POSIX_FADVISE
+	int advice = POSIX_FADV_NORMAL;
+	switch (hint) {
+		case hint_sequential:	advice = POSIX_FADV_SEQUENTIAL; break;
+		case hint_willneed:	advice = POSIX_FADV_WILLNEED; break;
+		case hint_dontneed:	advice = POSIX_FADV_DONTNEED; break;
+	}
+
+	// Failures are harmless, the data is simply read as usual.
+	int result = posix_fadvise(m_fd, offset, length, advice);
+	if (result != 0) {
+		AddDebugLogLineN(logCFile, CFormat(wxT("posix_fadvise failed on '%s': %s")) % m_filePath % wxSysErrorMsg(result));
+	}
+#else
+	(void)offset;
+	(void)length;
+	(void)hint;
+#endif
+}
+
+
 sint64 CFile::doSeek(sint64 offset) const
 {
 	if (!IsOpened()) {
@@ -31,6 +31,9 @@
 
 #include <wx/file.h>		// Needed for constants
 
+#include <vector>
+#include <utility>		// Needed for std::pair
+
 #ifdef _MSC_VER  // silly warnings about deprecated functions
 #pragma warning(disable:4996)
 #endif
@@ -53,6 +56,19 @@ public:
 	/** @see wxFile::OpenMode */
 	enum OpenMode { read, write, read_write, write_append, write_excl, write_safe };
 
+	//! A list of buffers and their lengths, see WriteAtV.
+	typedef std::vector<std::pair<const uint8_t*, size_t> > IOVector;
+
+	//! Expected access patterns, see Advise.
+	enum AccessHint {
+		//! The data will be read sequentially.
+		hint_sequential,
+		//! The data will be read soon.
+		hint_willneed,
+		//! The data will not be read again soon.
+		hint_dontneed
+	};
+
 
 	/**
 	 * Creates a closed file.
@@ -182,6 +198,39 @@ public:
 	 */
 	bool IsOpened() const;
 
+	/**
+	 * Reads 'count' bytes at 'offset' into 'buffer'.
+	 *
+	 * Where available, this is done with pread, which leaves the file
+	 * position untouched. Otherwise this is equivalent to a Seek
+	 * followed by a Read.
+	 *
+	 * @throws CIOFailureException on read errors.
+	 * @throws CEOFException if the file ends before 'count' bytes.
+	 */
+	void ReadAt(void* buffer, uint64 offset, size_t count);
+
+	/**
+	 * Writes several buffers back to back, starting at 'offset'.
+	 *
+	 * Where available, the buffers are written with as few pwritev
+	 * calls as possible. Otherwise this is equivalent to a Seek
+	 * followed by a Write of each buffer. The file position is
+	 * undefined afterwards.
+	 *
+	 * @throws CIOFailureException on write errors.
+	 */
+	void WriteAtV(const IOVector& buffers, uint64 offset);
+
+	/**
+	 * Tells the system how a range of the file is going to be used.
+	 *
+	 * This is just a hint for read-ahead and caching, which is
+	 * ignored where posix_fadvise is not available. A length of
+	 * zero covers everything from 'offset' to the end of the file.
+	 */
+	void Advise(uint64 offset, uint64 length, AccessHint hint);
+
 protected:
 	/** @see CFileDataIO::doRead **/
 	virtual sint64 doRead(void* buffer, size_t count) const;
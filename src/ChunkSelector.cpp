@@ -0,0 +1,124 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+
+
+#include "ChunkSelector.h"	// Interface declarations
+
+
+const uint16 CChunkSelector::NONE;
+
+
+CChunkSelector::CChunkSelector()
+	: m_allInvalid(true),
+	  m_partCount(0),
+	  m_veryRareBound(0),
+	  m_rareBound(0)
+{
+}
+
+
+uint16 CChunkSelector::GetRank(const ChunkInfo& info, uint16 veryRareBound, uint16 rareBound)
+{
+	// The request state only counts outside the very rare zone
+	const bool requested = info.requested && info.frequency > veryRareBound;
+	const uint16 completion = info.completion;
+
+	if (info.frequency <= veryRareBound) {
+		// 0..xxxx unrequested + requested very rare chunks
+		return (25 * info.frequency) + (info.preview ? 0 : 1) + (100 - completion);
+	} else if (info.preview) {
+		// 10000..10100  unrequested preview chunks
+		// 30000..30100  requested preview chunks
+		return (requested ? 30000 : 10000) + (100 - completion);
+	} else if (info.frequency <= rareBound) {
+		// 10101..1xxxx  unrequested rare chunks
+		// 30101..3xxxx  requested rare chunks
+		return (25 * info.frequency) + (requested ? 30101 : 10101) + (100 - completion);
+	} else if (!requested) {
+		// 20000..2xxxx  unrequested common chunks
+		return 20000 + (100 - completion);
+	} else {
+		// 40000..4xxxx  requested common chunks
+		// The weight of the completion is inversed to spread the requests
+		// over the completing chunks.
+		return 40000 + completion;
+	}
+}
+
+
+void CChunkSelector::SetPartCount(uint16 partCount)
+{
+	if (partCount != m_partCount) {
+		m_partCount = partCount;
+		m_ranks.assign(partCount, NONE);
+		m_isInvalid.assign(partCount, false);
+		m_invalid.clear();
+		m_ranked.clear();
+		m_allInvalid = true;
+	}
+}
+
+
+void CChunkSelector::SetBounds(uint16 veryRareBound, uint16 rareBound)
+{
+	if (veryRareBound != m_veryRareBound || rareBound != m_rareBound) {
+		m_veryRareBound = veryRareBound;
+		m_rareBound = rareBound;
+		m_allInvalid = true;
+	}
+}
+
+
+void CChunkSelector::Invalidate(uint16 part)
+{
+	if (part < m_partCount && !m_isInvalid[part]) {
+		m_isInvalid[part] = true;
+		m_invalid.push_back(part);
+	}
+}
+
+
+void CChunkSelector::Invalidate(uint16 first, uint16 last)
+{
+	for (uint32 part = first; part <= last && part < m_partCount; ++part) {
+		Invalidate((uint16)part);
+	}
+}
+
+
+void CChunkSelector::SetRank(uint16 part, uint16 rank)
+{
+	if (m_ranks[part] == rank) {
+		return;
+	}
+	if (m_ranks[part] != NONE) {
+		m_ranked.erase(std::make_pair(m_ranks[part], part));
+	}
+	m_ranks[part] = rank;
+	if (rank != NONE) {
+		m_ranked.insert(std::make_pair(rank, part));
+	}
+}
+// File_checked_for_headers
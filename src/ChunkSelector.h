@@ -0,0 +1,178 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+
+
+#ifndef CHUNKSELECTOR_H
+#define CHUNKSELECTOR_H
+
+#include "Types.h"
+
+#include <set>
+#include <vector>
+
+
+/**
+ * Keeps the chunks (parts) of a file ordered by their download priority,
+ * see CPartFile::GetNextRequestedBlock.
+ *
+ * The state of a chunk is only evaluated again once it has been
+ * invalidated, which the file does whenever the availability, the gaps
+ * or the requested blocks of a chunk change. Selecting the next chunk for
+ * a source then takes O(log n), unless the best chunks are missing on the
+ * source.
+ *
+ * Not thread-safe.
+ */
+class CChunkSelector
+{
+public:
+	//! Returned if there is no chunk to select.
+	static const uint16 NONE = 0xffff;
+
+	//! The state of a chunk, as far as its priority is concerned.
+	struct ChunkInfo
+	{
+		//! Number of sources that have the chunk.
+		uint16	frequency;
+		//! Downloaded share of the chunk, in percent.
+		uint16	completion;
+		//! True if the chunk is needed for preview.
+		bool	preview;
+		//! True if blocks of the chunk are being downloaded.
+		bool	requested;
+	};
+
+	CChunkSelector();
+
+	/**
+	 * Returns the priority of a chunk, highest = 0, lowest = 0xffff.
+	 *
+	 * @param veryRareBound Chunks up to this frequency are very rare.
+	 * @param rareBound Chunks up to this frequency are rare.
+	 */
+	static uint16 GetRank(const ChunkInfo& info, uint16 veryRareBound, uint16 rareBound);
+
+	/** Sets the number of chunks, invalidating all of them if it changed. */
+	void SetPartCount(uint16 partCount);
+
+	/** Sets the frequency bounds, invalidating all chunks if they changed. */
+	void SetBounds(uint16 veryRareBound, uint16 rareBound);
+
+	/** Marks a chunk to be evaluated again. */
+	void Invalidate(uint16 part);
+
+	/** Marks the chunks from 'first' to 'last' to be evaluated again. */
+	void Invalidate(uint16 first, uint16 last);
+
+	/** Marks all chunks to be evaluated again. */
+	void InvalidateAll()	{ m_allInvalid = true; }
+
+	/**
+	 * Evaluates the invalidated chunks.
+	 *
+	 * @param getChunk Called as getChunk(part, info), fills 'info' and
+	 *        returns true if the chunk has blocks left to request.
+	 */
+	template<typename GetChunk>
+	void Refresh(GetChunk getChunk)
+	{
+		if (m_allInvalid) {
+			m_allInvalid = false;
+			m_invalid.clear();
+			m_ranked.clear();
+			for (uint16 part = 0; part < m_partCount; ++part) {
+				m_isInvalid[part] = false;
+				ChunkInfo info;
+				m_ranks[part] = getChunk(part, info) ? GetRank(info, m_veryRareBound, m_rareBound) : NONE;
+				if (m_ranks[part] != NONE) {
+					m_ranked.insert(std::make_pair(m_ranks[part], part));
+				}
+			}
+		} else {
+			for (std::vector<uint16>::const_iterator it = m_invalid.begin(); it != m_invalid.end(); ++it) {
+				ChunkInfo info;
+				SetRank(*it, getChunk(*it, info) ? GetRank(info, m_veryRareBound, m_rareBound) : NONE);
+				m_isInvalid[*it] = false;
+			}
+			m_invalid.clear();
+		}
+	}
+
+	/**
+	 * Selects one of the chunks with the highest priority among those
+	 * accepted by 'isAvailable'. Chunks must be refreshed before.
+	 *
+	 * @param isAvailable Called as isAvailable(part).
+	 * @param random Picks the chunk when several have the same priority.
+	 * @return The selected chunk, or NONE.
+	 */
+	template<typename IsAvailable>
+	uint16 Select(IsAvailable isAvailable, uint32 random) const
+	{
+		// The highest priority among the available chunks
+		RankedSet::const_iterator first = m_ranked.begin();
+		while (first != m_ranked.end() && !isAvailable(first->second)) {
+			++first;
+		}
+		if (first == m_ranked.end()) {
+			return NONE;
+		}
+
+		// Continue from a random chunk with that priority, wrapping around
+		// to the first one, so sources spread over the chunks
+		const uint16 rank = first->first;
+		RankedSet::const_iterator it = m_ranked.lower_bound(std::make_pair(rank, (uint16)(random % m_partCount)));
+		for (; it != m_ranked.end() && it->first == rank; ++it) {
+			if (isAvailable(it->second)) {
+				return it->second;
+			}
+		}
+		return first->second;
+	}
+
+	/** Returns the priority of a chunk as of the last refresh, NONE if it has nothing left to request. */
+	uint16 GetRank(uint16 part) const	{ return part < m_partCount ? m_ranks[part] : NONE; }
+
+private:
+	void SetRank(uint16 part, uint16 rank);
+
+	//! Pairs of priority and chunk.
+	typedef std::set<std::pair<uint16, uint16> > RankedSet;
+	//! The chunks with blocks left to request.
+	RankedSet	m_ranked;
+	//! The priority of each chunk, NONE if not in m_ranked.
+	std::vector<uint16>	m_ranks;
+	//! The chunks invalidated since the last refresh.
+	std::vector<uint16>	m_invalid;
+	std::vector<bool>	m_isInvalid;
+	//! True if all chunks must be evaluated again.
+	bool	m_allInvalid;
+	uint16	m_partCount;
+	uint16	m_veryRareBound;
+	uint16	m_rareBound;
+};
+
+#endif // CHUNKSELECTOR_H
+// File_checked_for_headers
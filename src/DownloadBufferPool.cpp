@@ -0,0 +1,254 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+#include "DownloadBufferPool.h"	// Interface declarations
+
+#include <algorithm>		// Needed for std::max
+#include <vector>
+
+#include <wx/thread.h>		// Needed for wxMutex
+
+
+//! Step of the small size classes, which cover the usual packet payloads.
+static const size_t SMALL_CLASS_STEP = 2 * 1024;
+//! Number of small size classes (2 KB to 16 KB).
+static const unsigned SMALL_CLASS_COUNT = 8;
+//! Number of size classes doubling in size after the small ones (32 KB to 256 KB).
+static const unsigned LARGE_CLASS_COUNT = 4;
+//! Total number of size classes.
+static const unsigned CLASS_COUNT = SMALL_CLASS_COUNT + LARGE_CLASS_COUNT;
+//! Memory kept on the free lists if the pool is unlimited.
+static const uint64 UNLIMITED_CACHE_SIZE = 16 * 1024 * 1024;
+//! Data held for hashing if the pool is unlimited.
+static const uint64 UNLIMITED_PARKED_SIZE = 32 * 1024 * 1024;
+
+
+//! Protects the free lists and the statistics.
+static wxMutex s_lock;
+//! Released buffers, per size class.
+static std::vector<uint8_t*> s_freeLists[CLASS_COUNT];
+//! The statistics, including the limit.
+static CDownloadBufferPool::Stats s_stats = { 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+//! Specifies if the pool is throttling.
+static bool s_throttling = false;
+
+
+/**
+ * Returns the size class of a buffer, or -1 if it is too large to be pooled.
+ *
+ * @param size The requested size.
+ * @param classSize Set to the size of the buffers of the class.
+ */
+static int GetSizeClass(size_t size, size_t& classSize)
+{
+	if (size <= SMALL_CLASS_COUNT * SMALL_CLASS_STEP) {
+		const size_t index = (size + SMALL_CLASS_STEP - 1) / SMALL_CLASS_STEP;
+		if (index == 0) {
+			classSize = SMALL_CLASS_STEP;
+			return 0;
+		}
+
+		classSize = index * SMALL_CLASS_STEP;
+		return index - 1;
+	}
+
+	classSize = SMALL_CLASS_COUNT * SMALL_CLASS_STEP;
+	for (unsigned i = SMALL_CLASS_COUNT; i < CLASS_COUNT; ++i) {
+		classSize *= 2;
+		if (size <= classSize) {
+			return i;
+		}
+	}
+
+	classSize = size;
+	return -1;
+}
+
+
+/** Updates the throttling state, must be called with s_lock held. */
+static void UpdateThrottling()
+{
+	if (s_stats.limit == 0) {
+		s_throttling = false;
+	} else if (!s_throttling && s_stats.used > s_stats.limit) {
+		s_throttling = true;
+		++s_stats.throttled;
+	} else if (s_throttling && s_stats.used <= s_stats.limit / 4 * 3) {
+		s_throttling = false;
+	}
+}
+
+
+uint8_t* CDownloadBufferPool::Allocate(size_t size)
+{
+	size_t classSize = 0;
+	const int sizeClass = GetSizeClass(size, classSize);
+	uint8_t* buffer = NULL;
+
+	{
+		wxMutexLocker lock(s_lock);
+
+		if (sizeClass >= 0 && !s_freeLists[sizeClass].empty()) {
+			buffer = s_freeLists[sizeClass].back();
+			s_freeLists[sizeClass].pop_back();
+			s_stats.cached -= classSize;
+			++s_stats.reused;
+		}
+
+		s_stats.used += classSize;
+		s_stats.peak = std::max(s_stats.peak, s_stats.used);
+		++s_stats.allocations;
+		UpdateThrottling();
+	}
+
+	if (buffer == NULL) {
+		buffer = new uint8_t[classSize];
+	}
+
+	return buffer;
+}
+
+
+void CDownloadBufferPool::Free(uint8_t* buffer, size_t size)
+{
+	size_t classSize = 0;
+	const int sizeClass = GetSizeClass(size, classSize);
+
+	{
+		wxMutexLocker lock(s_lock);
+
+		wxASSERT(s_stats.used >= classSize);
+		s_stats.used -= classSize;
+		UpdateThrottling();
+
+		// Only as much memory is kept as is likely to be needed again soon.
+		const uint64 cacheSize = s_stats.limit ? (s_stats.limit / 4) : UNLIMITED_CACHE_SIZE;
+		if (sizeClass >= 0 && s_stats.cached + classSize <= cacheSize) {
+			s_freeLists[sizeClass].push_back(buffer);
+			s_stats.cached += classSize;
+			buffer = NULL;
+		}
+	}
+
+	delete [] buffer;
+}
+
+
+bool CDownloadBufferPool::ReserveParked(size_t size)
+{
+	wxMutexLocker lock(s_lock);
+
+	// Like the free lists, at most a quarter of the limit
+	const uint64 maxParked = s_stats.limit ? (s_stats.limit / 4) : UNLIMITED_PARKED_SIZE;
+	if (s_stats.parked + size > maxParked) {
+		return false;
+	}
+
+	s_stats.parked += size;
+	s_stats.used += size;
+	s_stats.peak = std::max(s_stats.peak, s_stats.used);
+	UpdateThrottling();
+
+	return true;
+}
+
+
+void CDownloadBufferPool::ReleaseParked(size_t size)
+{
+	wxMutexLocker lock(s_lock);
+
+	wxASSERT(s_stats.parked >= size && s_stats.used >= size);
+	s_stats.parked -= size;
+	s_stats.used -= size;
+	UpdateThrottling();
+}
+
+
+void CDownloadBufferPool::SetLimit(uint64 limit)
+{
+	wxMutexLocker lock(s_lock);
+
+	s_stats.limit = limit;
+	s_throttling = false;
+	UpdateThrottling();
+}
+
+
+bool CDownloadBufferPool::IsThrottling()
+{
+	wxMutexLocker lock(s_lock);
+
+	return s_throttling;
+}
+
+
+uint64 CDownloadBufferPool::GetExcess()
+{
+	wxMutexLocker lock(s_lock);
+
+	if (!s_throttling) {
+		return 0;
+	}
+
+	return s_stats.used - s_stats.limit / 4 * 3;
+}
+
+
+void CDownloadBufferPool::AddDeferredRequest()
+{
+	wxMutexLocker lock(s_lock);
+
+	++s_stats.deferredRequests;
+}
+
+
+void CDownloadBufferPool::GetStats(Stats& stats)
+{
+	wxMutexLocker lock(s_lock);
+
+	stats = s_stats;
+}
+
+
+void CDownloadBufferPool::Purge()
+{
+	std::vector<uint8_t*> freeLists[CLASS_COUNT];
+
+	{
+		wxMutexLocker lock(s_lock);
+
+		for (unsigned i = 0; i < CLASS_COUNT; ++i) {
+			freeLists[i].swap(s_freeLists[i]);
+		}
+
+		s_stats.cached = 0;
+	}
+
+	for (unsigned i = 0; i < CLASS_COUNT; ++i) {
+		for (size_t j = 0; j < freeLists[i].size(); ++j) {
+			delete [] freeLists[i][j];
+		}
+	}
+}
+// File_checked_for_headers
@@ -0,0 +1,118 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+#ifndef DOWNLOADBUFFERPOOL_H
+#define DOWNLOADBUFFERPOOL_H
+
+#include "Types.h"
+
+
+/**
+ * Process-wide pool of the buffers holding downloaded data until it is
+ * written to disk.
+ *
+ * Buffers are handed out in a small number of size classes and kept on
+ * per-class free lists when released, so that the constant stream of
+ * received blocks reuses the same memory instead of going through the
+ * heap for every packet.
+ *
+ * The memory handed out is accounted against a global limit. Once the
+ * limit is exceeded, the pool is throttling: the download queue flushes
+ * the files holding the most data first, and clients stop requesting new
+ * blocks. Throttling ends when usage has dropped to three quarters of the
+ * limit, so that requests aren't switched on and off with every packet.
+ *
+ * Data held in memory for hashing, see CPartHashStates, is accounted as
+ * well, and limited to a share of the limit.
+ *
+ * All functions may be called from any thread.
+ */
+class CDownloadBufferPool
+{
+public:
+	//! Snapshot of the state of the pool.
+	struct Stats
+	{
+		//! Bytes currently handed out.
+		uint64	used;
+		//! Highest value of used so far.
+		uint64	peak;
+		//! Bytes kept on the free lists.
+		uint64	cached;
+		//! The limit, 0 if unlimited.
+		uint64	limit;
+		//! Number of buffers handed out.
+		uint64	allocations;
+		//! Number of buffers taken from the free lists.
+		uint64	reused;
+		//! Number of times throttling started.
+		uint64	throttled;
+		//! Number of block requests deferred while throttling.
+		uint64	deferredRequests;
+		//! Bytes of the used ones held for hashing, see ReserveParked.
+		uint64	parked;
+	};
+
+	/**
+	 * Returns a buffer of at least the given size.
+	 *
+	 * The buffer must be released with Free, passing the same size.
+	 */
+	static uint8_t* Allocate(size_t size);
+
+	/** Releases a buffer returned by Allocate. */
+	static void Free(uint8_t* buffer, size_t size);
+
+	/**
+	 * Accounts data held in memory until it can be hashed.
+	 *
+	 * @return False, without accounting anything, if that would exceed the
+	 *         share of the limit allowed for such data.
+	 */
+	static bool ReserveParked(size_t size);
+
+	/** Releases data accounted by ReserveParked. */
+	static void ReleaseParked(size_t size);
+
+	/** Sets the limit in bytes, 0 meaning unlimited. */
+	static void SetLimit(uint64 limit);
+
+	/** Returns true while the limit is exceeded (see above). */
+	static bool IsThrottling();
+
+	/** Returns the number of bytes that must be released to stop throttling. */
+	static uint64 GetExcess();
+
+	/** Counts a block request deferred because of throttling. */
+	static void AddDeferredRequest();
+
+	/** Retrieves the current statistics. */
+	static void GetStats(Stats& stats);
+
+	/** Releases the memory kept on the free lists. */
+	static void Purge();
+};
+
+#endif // DOWNLOADBUFFERPOOL_H
+// File_checked_for_headers
@@ -34,10 +34,13 @@
 
 #include <zlib.h>
 #include <cmath>		// Needed for std:exp
+#include <algorithm>	// Needed for std::find
 
 #include "ClientCredits.h"	// Needed for CClientCredits
 #include "ClientUDPSocket.h"	// Needed for CClientUDPSocket
 #include "DownloadQueue.h"	// Needed for CDownloadQueue
+#include "DownloadBufferPool.h"	// Needed for CDownloadBufferPool
+#include "EndGame.h"		// Needed for CEndGame
 #include "Preferences.h"	// Needed for thePrefs
 #include "Packet.h"		// Needed for CPacket
 #include "MemFile.h"		// Needed for CMemFile
@@ -51,6 +54,9 @@
 #include "GuiEvents.h"		// Needed for Notify_*
 #include "UploadQueue.h"	// Needed for CUploadQueue
 
+// Cancelled blocks remembered per source, see CancelBlockRequest
+static const size_t MAX_CANCELLED_BLOCKS = 32;
+
 
 #ifdef __MULE_UNUSED_CODE__
 // This function is left as a reminder.
@@ -436,12 +442,6 @@ void CUpDownClient::ProcessFileStatus(bool bUdpPacket, const CMemFile* data, con
 				for ( uint8 i = 0;i < 8; i++ ) {
 					bool status = ((toread>>i)&1)? 1:0;
 					m_downPartStatus.set(done, status);
-
-					if (status) {
-						if (!m_reqfile->IsComplete(done)){
-							bPartsNeeded = true;
-						}
-					}
 					done++;
 					if (done == m_nPartCount) {
 						break;
@@ -454,6 +454,8 @@ void CUpDownClient::ProcessFileStatus(bool bUdpPacket, const CMemFile* data, con
 
 			throw;
 		}
+
+		bPartsNeeded = m_downPartStatus.HasAnyNotIn(m_reqfile->GetCompleteParts());
 	}
 
 	m_reqfile->UpdatePartsFrequency( this, true );	// Increment
@@ -588,6 +590,8 @@ void CUpDownClient::ProcessHashSet(const uint8_t* packet, uint32 size)
 
 void CUpDownClient::SendBlockRequests()
 {
+	m_bBlockRequestsDeferred = false;
+
 	uint32 current_time = ::GetTickCount();
 	if (GetVBTTags()) {
 
@@ -830,6 +834,81 @@ The requests will still not exceed 180k, but may be smaller to
 fill a gap.
 */
 
+void CUpDownClient::ResumeBlockRequests()
+{
+	if (m_bBlockRequestsDeferred && GetDownloadState() == DS_DOWNLOADING) {
+		SendBlockRequests();
+	}
+}
+
+
+const Requested_Block_Struct* CUpDownClient::FindBlockRequest(uint64 start, uint64 end) const
+{
+	std::list<Pending_Block_Struct*>::const_iterator it = m_PendingBlocks_list.begin();
+	for (; it != m_PendingBlocks_list.end(); ++it) {
+		if ((*it)->block->StartOffset == start && (*it)->block->EndOffset == end) {
+			return (*it)->block;
+		}
+	}
+
+	std::list<Requested_Block_Struct*>::const_iterator it2 = m_DownloadBlocks_list.begin();
+	for (; it2 != m_DownloadBlocks_list.end(); ++it2) {
+		if ((*it2)->StartOffset == start && (*it2)->EndOffset == end) {
+			return *it2;
+		}
+	}
+
+	return NULL;
+}
+
+
+void CUpDownClient::CancelBlockRequest(const Requested_Block_Struct* block)
+{
+	std::list<Requested_Block_Struct*>::iterator it2 =
+		std::find(m_DownloadBlocks_list.begin(), m_DownloadBlocks_list.end(), block);
+	if (it2 != m_DownloadBlocks_list.end()) {
+		// Not sent yet, just forget it
+		m_reqfile->RemoveBlockFromList(block);
+		delete *it2;
+		m_DownloadBlocks_list.erase(it2);
+		return;
+	}
+
+	std::list<Pending_Block_Struct*>::iterator it = m_PendingBlocks_list.begin();
+	while (it != m_PendingBlocks_list.end() && (*it)->block != block) {
+		++it;
+	}
+	if (it == m_PendingBlocks_list.end()) {
+		return;
+	}
+
+	// ed2k can't cancel a single block, so its data may still arrive
+	CancelledBlock cancelled = { block->StartOffset, block->EndOffset };
+	m_cancelledBlocks.push_back(cancelled);
+	if (m_cancelledBlocks.size() > MAX_CANCELLED_BLOCKS) {
+		m_cancelledBlocks.pop_front();
+	}
+
+	Pending_Block_Struct* pending = *it;
+	m_reqfile->RemoveBlockFromList(pending->block);
+	delete pending->block;
+	// Not always allocated
+	if (pending->zStream) {
+		inflateEnd(pending->zStream);
+		delete pending->zStream;
+	}
+	delete pending;
+	m_PendingBlocks_list.erase(it);
+
+	// Ask for other blocks, but not from within the packet handler of
+	// the source that completed this one. See ResumeBlockRequests.
+	if (m_PendingBlocks_list.empty() && !m_bBlockRequestsDeferred && GetDownloadState() == DS_DOWNLOADING) {
+		m_bBlockRequestsDeferred = true;
+		m_reqfile->AddDeferredSource(this);
+	}
+}
+
+
 void CUpDownClient::ProcessBlockPacket(const uint8_t* packet, uint32 size, bool packed, bool largeblocks)
 {
 	// Ignore if no data required
@@ -910,7 +989,7 @@ void CUpDownClient::ProcessBlockPacket(const uint8_t* packet, uint32 size, bool
 					AddDebugLogLineN(logZLib,
 						CFormat(wxT("Ignoring %u bytes of block %u-%u because of erroneous zstream state for file: %s"))
 							% (size - header_size) % nStartPos % nEndPos % m_reqfile->GetFileName());
-					m_reqfile->RemoveBlockFromList(cur_block->block->StartOffset, cur_block->block->EndOffset);
+					m_reqfile->RemoveBlockFromList(cur_block->block);
 					return;
 				}
 
@@ -926,7 +1005,7 @@ void CUpDownClient::ProcessBlockPacket(const uint8_t* packet, uint32 size, bool
 					// security sanitize check
 					if (nEndPos > cur_block->block->EndOffset) {
 						AddDebugLogLineN(logRemoteClient, CFormat(wxT("Received Blockpacket exceeds requested boundaries (requested end: %u, Part: %u, received end: %u, Part: %u), file: %s remote IP: %s")) % cur_block->block->EndOffset % (uint32)(cur_block->block->EndOffset / PARTSIZE) % nEndPos % (uint32)(nEndPos / PARTSIZE) % m_reqfile->GetFileName() % Uint32toStringIP(GetIP()));
-						m_reqfile->RemoveBlockFromList(cur_block->block->StartOffset, cur_block->block->EndOffset);
+						m_reqfile->RemoveBlockFromList(cur_block->block);
 						return;
 					}
 					// Write to disk (will be buffered in part file class)
@@ -961,7 +1040,7 @@ void CUpDownClient::ProcessBlockPacket(const uint8_t* packet, uint32 size, bool
 							if (nStartPos > cur_block->block->EndOffset || nEndPos > cur_block->block->EndOffset) {
 								AddDebugLogLineN(logZLib,
 									CFormat(wxT("Corrupted compressed packet for '%s' received (error 666)")) % m_reqfile->GetFileName());
-								m_reqfile->RemoveBlockFromList(cur_block->block->StartOffset, cur_block->block->EndOffset);
+								m_reqfile->RemoveBlockFromList(cur_block->block);
 							} else {
 								// Write uncompressed data to file
 								lenWritten = m_reqfile->WriteToBuffer( size - header_size,
@@ -982,7 +1061,7 @@ void CUpDownClient::ProcessBlockPacket(const uint8_t* packet, uint32 size, bool
 							CFormat(wxT("Corrupted compressed packet for '%s' received (error %i): %s"))
 								% m_reqfile->GetFileName() % result % strZipError);
 
-						m_reqfile->RemoveBlockFromList(cur_block->block->StartOffset, cur_block->block->EndOffset);
+						m_reqfile->RemoveBlockFromList(cur_block->block);
 
 						// If we had an zstream error, there is no chance that we could recover from it nor that we
 						// could use the current zstream (which is in error state) any longer.
@@ -1018,7 +1097,7 @@ void CUpDownClient::ProcessBlockPacket(const uint8_t* packet, uint32 size, bool
 
 						m_lastaverage = ((cur_block->block->EndOffset - cur_block->block->StartOffset) * 1000) / average_time;
 
-						m_reqfile->RemoveBlockFromList(cur_block->block->StartOffset, cur_block->block->EndOffset);
+						m_reqfile->RemoveBlockFromList(cur_block->block);
 						delete cur_block->block;
 						// Not always allocated
 						if (cur_block->zStream) {
@@ -1028,14 +1107,30 @@ void CUpDownClient::ProcessBlockPacket(const uint8_t* packet, uint32 size, bool
 						delete cur_block;
 						m_PendingBlocks_list.erase(it);
 
-						// Request next block
-						SendBlockRequests();
+						// Request next block, unless the download buffers
+						// are full. See ResumeBlockRequests.
+						if (CDownloadBufferPool::IsThrottling()) {
+							m_bBlockRequestsDeferred = true;
+							m_reqfile->AddDeferredSource(this);
+							CDownloadBufferPool::AddDeferredRequest();
+						} else {
+							SendBlockRequests();
+						}
 					}
 				}
 				// Stop looping and exit method
 				return;
 			}
 		}
+
+		// Data of a block whose request was cancelled, see CancelBlockRequest
+		std::list<CancelledBlock>::const_iterator it2 = m_cancelledBlocks.begin();
+		for (; it2 != m_cancelledBlocks.end(); ++it2) {
+			if (it2->start <= nStartPos && it2->end >= nStartPos) {
+				CEndGame::AddWasted(size - header_size);
+				break;
+			}
+		}
 	} catch (const CEOFException& e) {
 		wxString error = wxString(wxT("Error reading "));
 		if (packed) error += CFormat(wxT("packed (LU: %i) largeblocks ")) % lenUnzipped;
@@ -1202,12 +1297,7 @@ float CUpDownClient::CalculateKBpsDown()
 
 uint16 CUpDownClient::GetAvailablePartCount() const
 {
-	uint16 result = 0;
-	for (int i = 0;i != m_nPartCount;i++){
-		if (IsPartAvailable(i))
-			result++;
-	}
-	return result;
+	return m_downPartStatus.Count();
 }
 
 void CUpDownClient::SetRemoteQueueRank(uint16 nr)
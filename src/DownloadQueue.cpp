@@ -44,6 +44,7 @@
 #include "SearchList.h"		// Needed for CSearchFile
 #include "SharedFileList.h"	// Needed for CSharedFileList
 #include "PartFile.h"		// Needed for CPartFile
+#include "DownloadBufferPool.h"	// Needed for CDownloadBufferPool
 #include "Preferences.h"	// Needed for thePrefs
 #include "amule.h"		// Needed for theApp
 #include "AsyncDNS.h"		// Needed for CAsyncDNS
@@ -142,6 +143,7 @@ void CDownloadQueue::LoadMetFiles(const CPath& path)
 			{
 				wxMutexLocker lock(m_mutex);
 				m_filelist.push_back(std::unique_ptr<CPartFile>(toadd));
+				m_index.AddFile(toadd, toadd->GetFileHash());
 			}
 			NotifyObservers(EventType(EventType::INSERTED, toadd));
 			Notify_DownloadCtrlAddFile(toadd);
@@ -374,6 +376,7 @@ void CDownloadQueue::AddDownload(CPartFile* file, bool paused, uint8 category)
 	{
 		wxMutexLocker lock(m_mutex);
 		m_filelist.push_back( std::unique_ptr<CPartFile>(file) );
+		m_index.AddFile(file, file->GetFileHash());
 		DoSortByPriority();
 	}
 
@@ -426,6 +429,10 @@ void CDownloadQueue::Process()
 	// send src requests to local server
 	ProcessLocalRequests();
 
+	if (CDownloadBufferPool::IsThrottling()) {
+		FlushLargestBuffers();
+	}
+
 	{
 		wxMutexLocker lock(m_mutex);
 
@@ -562,19 +569,8 @@ CPartFile* CDownloadQueue::GetFileByID(const CMD4Hash& filehash) const
 {
 	wxMutexLocker lock( m_mutex );
 
-	for ( uint16 i = 0; i < m_filelist.size(); ++i ) {
-		if ( filehash == m_filelist[i].get()->GetFileHash()) {
-			return m_filelist[ i ].get();
-		}
-	}
-	// Check completed too so we can execute remote commands (like change cat) on them
-	for (FileList::const_iterator it = m_completedDownloads.begin(); it != m_completedDownloads.end(); ++it) {
-		if ( filehash == (*it)->GetFileHash()) {
-			return *it;
-		}
-	}
-
-	return NULL;
+	// Completed files are indexed too so we can execute remote commands (like change cat) on them
+	return m_index.GetFile(filehash);
 }
 
 
@@ -823,6 +819,8 @@ void CDownloadQueue::RemoveFile(CPartFile* file, bool keepAsCompleted)
 			if (keepAsCompleted) {
 				// Transfer ownership to m_completedDownloads
 				m_completedDownloads.push_back(it->release());
+			} else {
+				UnindexFile(file);
 			}
 			// unique_ptr will automatically delete the file if not released
 			m_filelist.erase(it);
@@ -840,6 +838,7 @@ void CDownloadQueue::ClearCompleted(const ListOfUInts32 & ecids)
 			CPartFile * file = *it;
 			if (file->ECID() == ecid) {
 				m_completedDownloads.erase(it);
+				UnindexFile(file);
 				// get a new EC ID so it is resent and cleared in remote gui
 				file->RenewECID();
 				Notify_DownloadCtrlRemoveFile(file);
@@ -854,16 +853,52 @@ CUpDownClient* CDownloadQueue::GetDownloadClientByIP_UDP(uint32 dwIP, uint16 nUD
 {
 	wxMutexLocker lock( m_mutex );
 
-	for ( unsigned int i = 0; i < m_filelist.size(); i++ ) {
-		const CKnownFile::SourceSet& set = m_filelist[i].get()->GetSourceList();
+	return m_index.GetSource(dwIP, nUDPPort);
+}
+
+
+void CDownloadQueue::AddSourceToIndex(CUpDownClient* source)
+{
+	wxMutexLocker lock( m_mutex );
+
+	m_index.AddSource(source, source->GetIP(), source->GetUDPPort());
+}
+
+
+void CDownloadQueue::RemoveSourceFromIndex(const CUpDownClient* source)
+{
+	wxMutexLocker lock( m_mutex );
+
+	m_index.RemoveSource(source);
+}
+
+
+void CDownloadQueue::UpdateSourceEndpoint(const CUpDownClient* source, uint32 ip, uint16 udpPort)
+{
+	wxMutexLocker lock( m_mutex );
+
+	m_index.UpdateSource(source, ip, udpPort);
+}
+
+
+/**
+ * Removes a file that is no longer queued or displayed from the index,
+ * where a completed download with the same hash may take its place.
+ */
+void CDownloadQueue::UnindexFile(CPartFile* file)
+{
+	wxMutexLocker lock( m_mutex );
 
-		for ( CKnownFile::SourceSet::const_iterator it = set.begin(); it != set.end(); ++it ) {
-			if ( it->GetIP() == dwIP && it->GetUDPPort() == nUDPPort ) {
-				return it->GetClient();
+	const CMD4Hash& hash = file->GetFileHash();
+	m_index.RemoveFile(file, hash);
+	if (!m_index.GetFile(hash)) {
+		for (FileList::const_iterator it = m_completedDownloads.begin(); it != m_completedDownloads.end(); ++it) {
+			if (hash == (*it)->GetFileHash()) {
+				m_index.AddFile(*it, hash);
+				break;
 			}
 		}
 	}
-	return NULL;
 }
 
 
@@ -1053,6 +1088,38 @@ void CDownloadQueue::RemoveLocalServerRequest( CPartFile* file )
 }
 
 
+// Comparison function needed by sort. Places files with more buffered data first.
+static bool CompareBufferedData(const CPartFile* file1, const CPartFile* file2)
+{
+	return file1->GetBufferedDataSize() > file2->GetBufferedDataSize();
+}
+
+
+void CDownloadQueue::FlushLargestBuffers()
+{
+	std::vector<CPartFile*> files;
+
+	{
+		wxMutexLocker lock(m_mutex);
+
+		for (uint16 i = 0; i < m_filelist.size(); ++i) {
+			CPartFile* file = m_filelist[i].get();
+			if (file->GetBufferedDataSize()) {
+				files.push_back(file);
+			}
+		}
+	}
+
+	std::sort(files.begin(), files.end(), CompareBufferedData);
+
+	uint64 excess = CDownloadBufferPool::GetExcess();
+	for (size_t i = 0; i < files.size() && excess; ++i) {
+		excess -= std::min<uint64>(excess, files[i]->GetBufferedDataSize());
+		files[i]->FlushBufferInBackground();
+	}
+}
+
+
 void CDownloadQueue::ProcessLocalRequests()
 {
 	wxMutexLocker lock( m_mutex );
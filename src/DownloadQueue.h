@@ -29,6 +29,7 @@
 #include "MD4Hash.h"		// Needed for CMD4Hash
 #include "ObservableQueue.h"	// Needed for CObservableQueue
 #include "GetTickCount.h"	// Needed for GetTickCount
+#include "DownloadQueueIndex.h"	// Needed for CDownloadQueueIndex
 
 #include <deque>
 #include <memory>
@@ -217,6 +218,16 @@ public:
 	 */
 	CUpDownClient* GetDownloadClientByIP_UDP(uint32 dwIP, uint16 nUDPPort) const;
 
+	/**
+	 * Keeps track of the sources of the files, see GetDownloadClientByIP_UDP.
+	 *
+	 * Called when a client is added to or removed from the sources of a
+	 * file, and before the IP or UDP-port of a client changes.
+	 */
+	void	AddSourceToIndex(CUpDownClient* source);
+	void	RemoveSourceFromIndex(const CUpDownClient* source);
+	void	UpdateSourceEndpoint(const CUpDownClient* source, uint32 ip, uint16 udpPort);
+
 
 	/**
 	 * Queues the specified file for source-requestion from the connected server.
@@ -355,10 +366,19 @@ private:
 
 	void	ProcessLocalRequests();
 
+	/**
+	 * Flushes the files holding the most buffered data, until enough data
+	 * is being written to end the throttling of the CDownloadBufferPool.
+	 */
+	void	FlushLargestBuffers();
+
 	bool	SendNextUDPPacket();
 	int		GetMaxFilesPerUDPServerPacket() const;
 	bool	SendGlobGetSourcesUDPPacket(CMemFile& data);
 
+	/** Removes a file from the index of the files by hash. */
+	void	UnindexFile(CPartFile* file);
+
 	void	AddToResolve(const CMD4Hash& fileid, const wxString& pszHostname, uint16 port, const wxString& hash, uint8 cryptoptions);
 
 	//! The mutex associated with this class, mutable to allow for const functions.
@@ -396,6 +416,9 @@ private:
 
 	std::deque<Hostname_Entry>	m_toresolve;
 
+	//! The files by hash and their sources by IP and UDP-port, outlives the files.
+	CDownloadQueueIndex	m_index;
+
 	// FileQueue owns CPartFile objects, using unique_ptr for automatic memory management
 	typedef std::deque<std::unique_ptr<CPartFile>> FileQueue;
 	FileQueue m_filelist;
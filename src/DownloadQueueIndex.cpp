@@ -0,0 +1,114 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+
+#include "DownloadQueueIndex.h"	// Interface declarations
+
+
+void CDownloadQueueIndex::AddFile(CPartFile* file, const CMD4Hash& hash)
+{
+	m_files[hash] = file;
+}
+
+
+void CDownloadQueueIndex::RemoveFile(const CPartFile* file, const CMD4Hash& hash)
+{
+	FileMap::iterator it = m_files.find(hash);
+	if (it != m_files.end() && it->second == file) {
+		m_files.erase(it);
+	}
+}
+
+
+CPartFile* CDownloadQueueIndex::GetFile(const CMD4Hash& hash) const
+{
+	FileMap::const_iterator it = m_files.find(hash);
+
+	return it != m_files.end() ? it->second : NULL;
+}
+
+
+void CDownloadQueueIndex::AddSource(CUpDownClient* client, uint32 ip, uint16 port)
+{
+	std::pair<SourceMap::iterator, bool> added = m_sources.insert(SourceMap::value_type(client, Source()));
+	Source& source = added.first->second;
+	if (added.second) {
+		source.endpoint = GetEndpoint(ip, port);
+		source.references = 1;
+		m_endpoints.insert(EndpointMap::value_type(source.endpoint, client));
+	} else {
+		++source.references;
+	}
+}
+
+
+void CDownloadQueueIndex::RemoveSource(const CUpDownClient* client)
+{
+	SourceMap::iterator it = m_sources.find(client);
+	if (it != m_sources.end() && --it->second.references == 0) {
+		RemoveEndpoint(client, it->second.endpoint);
+		m_sources.erase(it);
+	}
+}
+
+
+void CDownloadQueueIndex::UpdateSource(const CUpDownClient* client, uint32 ip, uint16 port)
+{
+	SourceMap::iterator it = m_sources.find(client);
+	const uint64 endpoint = GetEndpoint(ip, port);
+	if (it != m_sources.end() && it->second.endpoint != endpoint) {
+		RemoveEndpoint(client, it->second.endpoint);
+		it->second.endpoint = endpoint;
+		m_endpoints.insert(EndpointMap::value_type(endpoint, const_cast<CUpDownClient*>(client)));
+	}
+}
+
+
+CUpDownClient* CDownloadQueueIndex::GetSource(uint32 ip, uint16 port) const
+{
+	EndpointMap::const_iterator it = m_endpoints.find(GetEndpoint(ip, port));
+
+	return it != m_endpoints.end() ? it->second : NULL;
+}
+
+
+void CDownloadQueueIndex::Clear()
+{
+	m_files.clear();
+	m_sources.clear();
+	m_endpoints.clear();
+}
+
+
+void CDownloadQueueIndex::RemoveEndpoint(const CUpDownClient* client, uint64 endpoint)
+{
+	std::pair<EndpointMap::iterator, EndpointMap::iterator> range = m_endpoints.equal_range(endpoint);
+	for (EndpointMap::iterator it = range.first; it != range.second; ++it) {
+		if (it->second == client) {
+			m_endpoints.erase(it);
+			break;
+		}
+	}
+}
+// File_checked_for_headers
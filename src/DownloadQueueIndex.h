@@ -0,0 +1,104 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+
+#ifndef DOWNLOADQUEUEINDEX_H
+#define DOWNLOADQUEUEINDEX_H
+
+#include "MD4Hash.h"		// Needed for CMD4Hash
+
+#include <unordered_map>
+
+class CPartFile;
+class CUpDownClient;
+
+
+/**
+ * Indexes of the download queue: the files by hash, and the sources of
+ * the files by IP and UDP port.
+ *
+ * A client that is a source of several files is indexed once, and stays
+ * indexed until it has been removed as often as it was added.
+ *
+ * Not thread-safe, see CDownloadQueue.
+ */
+class CDownloadQueueIndex
+{
+public:
+	/** Adds a file, replacing any other file with the same hash. */
+	void AddFile(CPartFile* file, const CMD4Hash& hash);
+
+	/** Removes a file, unless another file took its place. */
+	void RemoveFile(const CPartFile* file, const CMD4Hash& hash);
+
+	/** Returns the file with the given hash, or NULL. */
+	CPartFile* GetFile(const CMD4Hash& hash) const;
+
+	/** Adds a source with the given IP and UDP port. */
+	void AddSource(CUpDownClient* client, uint32 ip, uint16 port);
+
+	/** Removes a source added before. */
+	void RemoveSource(const CUpDownClient* client);
+
+	/** Updates the IP and UDP port of a source, if it is indexed. */
+	void UpdateSource(const CUpDownClient* client, uint32 ip, uint16 port);
+
+	/** Returns a source with the given IP and UDP port, or NULL. */
+	CUpDownClient* GetSource(uint32 ip, uint16 port) const;
+
+	/** Returns the number of indexed files. */
+	size_t GetFileCount() const	{ return m_files.size(); }
+
+	/** Returns the number of indexed sources. */
+	size_t GetSourceCount() const	{ return m_sources.size(); }
+
+	/** Removes all files and sources. */
+	void Clear();
+
+private:
+	static uint64 GetEndpoint(uint32 ip, uint16 port)	{ return ((uint64)ip << 16) | port; }
+
+	/** Removes the endpoint of a source from the endpoint index. */
+	void RemoveEndpoint(const CUpDownClient* client, uint64 endpoint);
+
+	struct Source
+	{
+		//! The IP and UDP port the source is indexed by.
+		uint64	endpoint;
+		//! The number of times the source was added.
+		uint32	references;
+	};
+
+	typedef std::unordered_map<CMD4Hash, CPartFile*, CMD4HashHasher> FileMap;
+	FileMap		m_files;
+
+	typedef std::unordered_map<const CUpDownClient*, Source> SourceMap;
+	SourceMap	m_sources;
+
+	typedef std::unordered_multimap<uint64, CUpDownClient*> EndpointMap;
+	EndpointMap	m_endpoints;
+};
+
+#endif // DOWNLOADQUEUEINDEX_H
+// File_checked_for_headers
@@ -39,6 +39,10 @@
 
 
 const uint32 MAX_PACKET_SIZE = 2000000;
+// Time between round-trip time samples of an uploading socket (ms)
+const uint32 DELAY_SAMPLE_INTERVAL = 100;
+// The lowest round-trip time is kept for one to two of these (ms)
+const uint32 BASE_DELAY_WINDOW = MIN2MS(5);
 
 // cppcheck-suppress uninitMemberVar CEMSocket::pendingHeader
 CEMSocket::CEMSocket(const CProxyData *ProxyData)
@@ -76,6 +80,9 @@ CEMSocket::CEMSocket(const CProxyData *ProxyData)
 	sendbuffer = NULL;
 	sendblen = 0;
 	sent = 0;
+	sendheadlen = 0;
+	sendpayloadoffset = 0;
+	sendfileoffset = 0;
 
     m_currentPacket_is_controlpacket = false;
 	m_currentPackageIsFromPartFile = false;
@@ -96,6 +103,10 @@ CEMSocket::CEMSocket(const CProxyData *ProxyData)
     m_hasSent = false;
 
 	lastFinishedStandard = 0;
+
+	m_lastDelaySample = 0;
+	m_baseDelayStart = ::GetTickCount();
+	m_baseDelay[0] = m_baseDelay[1] = 0xFFFFFFFF;
 }
 
 CEMSocket::~CEMSocket()
@@ -154,6 +165,9 @@ void CEMSocket::ClearQueues()
 	sendbuffer = NULL;
 	sendblen = 0;
 	sent = 0;
+	sendheadlen = 0;
+	sendpayload.reset();
+	sendpayloadfile.reset();
 }
 
 
@@ -358,6 +372,9 @@ void CEMSocket::SendPacket(CPacket* packet, bool delpacket, bool controlpacket,
 	    if (first) {
 		lastFinishedStandard = ::GetTickCount();
 		m_bAccelerateUpload = true;	// Always accelerate first packet in a block
+
+		// the throttler only runs while there is something to send
+		theApp->uploadBandwidthThrottler->Wakeup();
 	    }
 	    }
     }
@@ -424,11 +441,46 @@ void CEMSocket::OnSend(int nErrorCode)
 	    if (m_currentPacket_is_controlpacket) {
 		// queue up for control packet
 	    theApp->uploadBandwidthThrottler->QueueForSendingControlPacket(this, HasSent());
+		} else if (sendbuffer || !m_standard_queue.empty()) {
+			// the throttler skipped us while we were busy
+			theApp->uploadBandwidthThrottler->Wakeup();
+
+			if (thePrefs::IsDelayBasedUpload()) {
+				SampleQueueingDelay();
+			}
 		}
     }
 }
 
 
+/**
+ * Reports the queueing delay of the connection to the throttler, which is
+ * how much its round-trip time exceeds the lowest one seen lately. Only
+ * done while uploading, as the time isn't updated on idle connections.
+ */
+void CEMSocket::SampleQueueingDelay()
+{
+	const uint32 now = ::GetTickCount();
+	uint32 rtt;
+	if (now - m_lastDelaySample < DELAY_SAMPLE_INTERVAL || !GetRoundTripTime(rtt)) {
+		return;
+	}
+	m_lastDelaySample = now;
+
+	// The lowest time is taken from the current and the previous window,
+	// so that route changes are eventually noticed
+	if (now - m_baseDelayStart > BASE_DELAY_WINDOW) {
+		m_baseDelay[1] = m_baseDelay[0];
+		m_baseDelay[0] = rtt;
+		m_baseDelayStart = now;
+	} else {
+		m_baseDelay[0] = std::min(m_baseDelay[0], rtt);
+	}
+
+	theApp->uploadBandwidthThrottler->AddDelaySample(rtt - std::min(m_baseDelay[0], m_baseDelay[1]));
+}
+
+
 /**
  * Try to put queued up data on the socket.
  *
@@ -525,11 +577,20 @@ SocketSentBytes CEMSocket::Send(uint32 maxNumberOfBytesToSend, uint32 minFragSiz
 				// We found a packet to send. Get the data to send from the
 				// package container and dispose of the container.
 				sendblen = curPacket->GetRealPacketSize();
-				sendbuffer = curPacket->DetachPacket();
+				if (curPacket->HasFilePayload() && CanSendFiles()) {
+					// Referenced files are sent by the kernel
+					sendbuffer = curPacket->DetachPacketHead(sendheadlen, sendpayloadfile, sendfileoffset);
+				} else if (m_StreamCryptState != ECS_ENCRYPTING) {
+					// Referenced payloads are written from where they are
+					sendbuffer = curPacket->DetachPacketHead(sendheadlen, sendpayload, sendpayloadoffset);
+				} else {
+					sendbuffer = curPacket->DetachPacket();
+					sendheadlen = sendblen;
+				}
 				sent = 0;
 				delete curPacket;
 
-				CryptPrepareSendData((uint8_t*)sendbuffer, sendblen);
+				CryptPrepareSendData((uint8_t*)sendbuffer, sendheadlen);
 			}
 
 			// At this point we've got a packet to send in sendbuffer. Try to send it. Loop until entire packet
@@ -562,7 +623,7 @@ SocketSentBytes CEMSocket::Send(uint32 maxNumberOfBytesToSend, uint32 minFragSiz
 
 				lastSent = ::GetTickCount();
 
-				uint32 result = CEncryptedStreamSocket::Write(sendbuffer+sent,tosend);
+				uint32 result = WriteSendData(tosend);
 
 				if (BlocksWrite()) {
 					m_bBusy = true;
@@ -600,6 +661,9 @@ SocketSentBytes CEMSocket::Send(uint32 maxNumberOfBytesToSend, uint32 minFragSiz
 				delete[] sendbuffer;
 				sendbuffer = NULL;
 				sendblen = 0;
+				sendheadlen = 0;
+				sendpayload.reset();
+				sendpayloadfile.reset();
 
 				if(!m_currentPacket_is_controlpacket) {
 					m_actualPayloadSizeSent += m_actualPayloadSize;
@@ -631,6 +695,41 @@ SocketSentBytes CEMSocket::Send(uint32 maxNumberOfBytesToSend, uint32 minFragSiz
 }
 
 
+/**
+ * Writes the next 'tosend' bytes of the current packet, which may be split
+ * between sendbuffer and a referenced payload or file.
+ */
+uint32 CEMSocket::WriteSendData(uint32 tosend)
+{
+	if (sent + tosend <= sendheadlen) {
+		return CEncryptedStreamSocket::Write(sendbuffer + sent, tosend);
+	}
+
+	if (sendpayloadfile) {
+		const uint32 head = (sent < sendheadlen) ? sendheadlen - sent : 0;
+
+		CSocketFileRegion region;
+		region.owner = sendpayloadfile;
+		region.fd = sendpayloadfile->GetFD();
+		region.offset = sendfileoffset + (sent + head - sendheadlen);
+		region.length = tosend - head;
+
+		return CEncryptedStreamSocket::WriteFile(sendbuffer + sent, head, region);
+	}
+
+	const uint8_t* payload = &(*sendpayload)[sendpayloadoffset];
+	if (sent >= sendheadlen) {
+		return CEncryptedStreamSocket::Write(payload + (sent - sendheadlen), tosend);
+	}
+
+	CSocketIOVector buffers;
+	buffers.push_back(std::make_pair((const void*)(sendbuffer + sent), sendheadlen - sent));
+	buffers.push_back(std::make_pair((const void*)payload, tosend - (sendheadlen - sent)));
+
+	return CEncryptedStreamSocket::WriteV(buffers);
+}
+
+
 uint32 CEMSocket::GetNextFragSize(uint32 current, uint32 minFragSize)
 {
     if(current % minFragSize == 0) {
@@ -641,6 +740,19 @@ uint32 CEMSocket::GetNextFragSize(uint32 current, uint32 minFragSize)
 }
 
 
+/**
+ * Tells the throttler whether giving this socket bandwidth would do anything.
+ * Busy sockets are woken up again in OnSend.
+ */
+bool CEMSocket::HasStandardData()
+{
+	wxMutexLocker lock(m_sendLocker);
+
+	return byConnected != ES_DISCONNECTED && !m_bBusy
+		&& ((sendbuffer && !m_currentPacket_is_controlpacket) || !m_standard_queue.empty());
+}
+
+
 /**
  * Decides the (minimum) amount the socket needs to send to prevent timeout.
  *
@@ -29,8 +29,7 @@
 #include "EncryptedStreamSocket.h"				// Needed for CEncryptedStreamSocket
 
 #include "ThrottledSocket.h"	// Needed for ThrottledFileSocket
-
-class CPacket;
+#include "Packet.h"		// Needed for CSharedPacketData
 
 #define ERR_WRONGHEADER		0x01
 #define ERR_TOOBIG			0x02
@@ -70,6 +69,10 @@ public:
     virtual SocketSentBytes SendFileAndControlData(uint32 maxNumberOfBytesToSend, uint32 minFragSize) { return Send(maxNumberOfBytesToSend, minFragSize, false); };
 
     uint32	GetNeededBytes();
+    bool	HasStandardData();
+
+	// True if packets referencing a file can be sent without reading it
+	bool	CanSendFiles() const { return m_StreamCryptState == ECS_NONE && CanWriteFile(); }
 
 	//protected:
 	// these functions are public on our code because of the amuleDlg::socketHandler
@@ -89,8 +92,10 @@ protected:
 private:
     virtual SocketSentBytes Send(uint32 maxNumberOfBytesToSend, uint32 minFragSize, bool onlyAllowedToSendControlPacket);
 	void	ClearQueues();
+	uint32	WriteSendData(uint32 tosend);
 
     uint32	GetNextFragSize(uint32 current, uint32 minFragSize);
+	void	SampleQueueingDelay();
     bool    HasSent() { return m_hasSent; }
 
 	// Download (pseudo) rate control
@@ -110,6 +115,13 @@ private:
 	uint8*	sendbuffer;
 	uint32	sendblen;
 	uint32	sent;
+	// Size of sendbuffer, the rest of the packet is in sendpayload
+	uint32	sendheadlen;
+	CSharedPacketData	sendpayload;
+	uint32	sendpayloadoffset;
+	// Or in sendpayloadfile, starting at sendfileoffset
+	CSharedPacketFile	sendpayloadfile;
+	uint64	sendfileoffset;
 
 	typedef std::list<CPacket*> CPacketQueue;
 	CPacketQueue m_control_queue;
@@ -142,6 +154,11 @@ private:
 
     bool m_bBusy;
     bool m_hasSent;
+
+	// Round-trip time sampling for the delay-based upload rate
+	uint32	m_lastDelaySample;
+	uint32	m_baseDelayStart;
+	uint32	m_baseDelay[2];
 };
 
 
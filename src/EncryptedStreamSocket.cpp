@@ -210,6 +210,28 @@ int CEncryptedStreamSocket::Write(const void* lpBuf, uint32_t nBufLen)
 	return CSocketClientProxy::Write(lpBuf, nBufLen);
 }
 
+int CEncryptedStreamSocket::WriteV(const CSocketIOVector& buffers)
+{
+	// Only data needing no further processing can be passed through.
+	if (m_StreamCryptState == ECS_ENCRYPTING || !m_pfiSendBuffer.IsEmpty()) {
+		wxFAIL;
+		return 0;
+	}
+
+	return CSocketClientProxy::WriteV(buffers);
+}
+
+int CEncryptedStreamSocket::WriteFile(const void* head, uint32_t headLength, const CSocketFileRegion& region)
+{
+	// The kernel sends the file as it is, so nothing may be encrypted.
+	if (m_StreamCryptState != ECS_NONE || !m_pfiSendBuffer.IsEmpty()) {
+		wxFAIL;
+		return 0;
+	}
+
+	return CSocketClientProxy::WriteFile(head, headLength, region);
+}
+
 int CEncryptedStreamSocket::Read(void* lpBuf, uint32_t nBufLen)
 {
 	m_nObfusicationBytesReceived = CSocketClientProxy::Read(lpBuf, nBufLen);
@@ -105,6 +105,10 @@ public:
 
 protected:
 	int	Write(const void* lpBuf, uint32_t nBufLen);
+	//! Writes unencrypted buffers back to back (see CLibSocket::WriteV).
+	int	WriteV(const CSocketIOVector& buffers);
+	//! Writes an unencrypted head followed by a file region (see CLibSocket::WriteFile).
+	int	WriteFile(const void* head, uint32_t headLength, const CSocketFileRegion& region);
 	int	Read(void* lpBuf, uint32_t nBufLen);
 
 	virtual void OnError(int /*nErrorCode*/) {};
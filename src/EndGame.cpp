@@ -0,0 +1,136 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+
+
+#include "EndGame.h"		// Interface declarations
+
+#include <protocol/ed2k/Constants.h>	// Needed for DOWNLOADTIMEOUT
+
+#include <algorithm>
+
+
+//! The most sources a block is requested from at once.
+static const uint32 MAX_REQUESTS = 3;
+
+static CEndGame::Stats s_stats = { 0, 0, 0, 0 };
+
+
+void CEndGame::SelectBlocks(std::vector<Candidate>& candidates, uint32 count)
+{
+	candidates.erase(std::remove_if(candidates.begin(), candidates.end(),
+		[](const Candidate& candidate) { return candidate.requests >= MAX_REQUESTS; }),
+		candidates.end());
+
+	std::stable_sort(candidates.begin(), candidates.end(),
+		[](const Candidate& a, const Candidate& b) {
+			if (a.requests != b.requests) {
+				return a.requests < b.requests;
+			}
+			return a.transferred < b.transferred;
+		});
+
+	if (candidates.size() > count) {
+		candidates.resize(count);
+	}
+}
+
+
+uint32 CEndGame::EstimateDelay(uint64 remaining, uint64 rate)
+{
+	if (rate == 0 || remaining * 1000 / rate > DOWNLOADTIMEOUT) {
+		return DOWNLOADTIMEOUT;
+	}
+	return remaining * 1000 / rate;
+}
+
+
+void CEndGame::AddDuplicated(uint32 blocks)
+{
+	s_stats.duplicated += blocks;
+}
+
+
+void CEndGame::AddWon(uint32 saved)
+{
+	++s_stats.won;
+	s_stats.saved += saved;
+}
+
+
+void CEndGame::AddWasted(uint64 bytes)
+{
+	s_stats.wasted += bytes;
+}
+
+
+void CEndGame::GetStats(Stats& stats)
+{
+	stats = s_stats;
+}
+
+
+bool CEndGameRequests::Receive(bool complete, uint64 bytes) const
+{
+	if (!complete) {
+		return true;
+	}
+
+	// Another copy of the block arrived first
+	if (IsActive()) {
+		CEndGame::AddWasted(bytes);
+	}
+	return false;
+}
+
+
+std::vector<size_t> CEndGameRequests::Complete(const void* winner, const std::vector<Request>& requests) const
+{
+	std::vector<size_t> cancelled;
+	const bool byDuplicate = IsDuplicate(winner);
+	bool firstLost = false;
+	uint32 saved = 0;
+
+	for (size_t i = 0; i < requests.size(); ++i) {
+		const Request& request = requests[i];
+		if (request.request == winner) {
+			continue;
+		}
+
+		if (byDuplicate && !IsDuplicate(request.request)) {
+			// The first request would have taken that much longer at its current rate
+			saved = std::max(saved, CEndGame::EstimateDelay(request.remaining, request.rate));
+			firstLost = true;
+		}
+
+		cancelled.push_back(i);
+	}
+
+	if (firstLost) {
+		CEndGame::AddWon(saved);
+	}
+
+	return cancelled;
+}
+// File_checked_for_headers
@@ -0,0 +1,174 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+
+
+#ifndef ENDGAME_H
+#define ENDGAME_H
+
+#include "Types.h"
+
+#include <set>
+#include <vector>
+
+
+/**
+ * Helpers of the end-game mode of downloads.
+ *
+ * Once all missing blocks of a download are requested, a single slow
+ * source can hold up its completion for minutes. In end-game mode,
+ * sources which run out of blocks are asked for blocks already requested
+ * from other sources. Whichever copy of a block arrives first is written,
+ * and the other requests of the block are cancelled, see CPartFile and
+ * CEndGameRequests.
+ *
+ * Must only be used from the main thread.
+ */
+class CEndGame
+{
+public:
+	//! Statistics of all downloads.
+	struct Stats
+	{
+		//! Number of requests of blocks requested already.
+		uint64	duplicated;
+		//! Number of blocks completed by such a request before the first one.
+		uint64	won;
+		//! Bytes received for blocks completed by another request.
+		uint64	wasted;
+		//! Estimated time the blocks won were completed earlier, in ms.
+		uint64	saved;
+	};
+
+	//! A requested block which may be requested once more.
+	struct Candidate
+	{
+		uint64	start;
+		uint64	end;
+		//! Number of requests of the block.
+		uint32	requests;
+		//! The most bytes received by any of the requests.
+		uint32	transferred;
+	};
+
+	/**
+	 * Sorts out the blocks to request once more, keeping at most 'count'.
+	 *
+	 * Blocks requested the most times allowed are dropped. Those with the
+	 * fewest requests come first, and among them those with the least
+	 * progress, as they are the most likely to be stuck at a slow source.
+	 */
+	static void SelectBlocks(std::vector<Candidate>& candidates, uint32 count);
+
+	/**
+	 * Estimates how much longer a request would have needed for a block.
+	 *
+	 * @param remaining The bytes it had still to receive.
+	 * @param rate The rate it was receiving at, in bytes per second.
+	 * @return The time in ms, at most DOWNLOADTIMEOUT, after which stalled
+	 *         sources are dropped anyway.
+	 */
+	static uint32 EstimateDelay(uint64 remaining, uint64 rate);
+
+	/** Counts blocks requested once more. */
+	static void AddDuplicated(uint32 blocks);
+
+	/** Counts a block completed before its first request, by 'saved' ms. */
+	static void AddWon(uint32 saved);
+
+	/** Counts bytes received for a block completed by another request. */
+	static void AddWasted(uint64 bytes);
+
+	/** Retrieves the current statistics. */
+	static void GetStats(Stats& stats);
+};
+
+
+/**
+ * The requests of a download made in end-game mode, for blocks which were
+ * requested from another source already.
+ *
+ * Requests are only told apart by their addresses here.
+ *
+ * Must only be used from the main thread.
+ */
+class CEndGameRequests
+{
+public:
+	//! A request of a block, see Complete.
+	struct Request
+	{
+		const void*	request;
+		//! The bytes it had still to receive.
+		uint64	remaining;
+		//! The rate of its source, in bytes per second.
+		uint64	rate;
+	};
+
+	/** Adds a request of a block requested already. */
+	void Add(const void* request)		{ m_requests.insert(request); }
+
+	/**
+	 * Forgets a request which was cancelled or is done. The other
+	 * requests of the same block are kept.
+	 */
+	void Remove(const void* request)	{ m_requests.erase(request); }
+
+	/** Forgets all requests. */
+	void Clear()				{ m_requests.clear(); }
+
+	/** Returns true if any block is requested from several sources. */
+	bool IsActive() const			{ return !m_requests.empty(); }
+
+	/** Returns true if the request was made for a block requested already. */
+	bool IsDuplicate(const void* request) const	{ return m_requests.count(request) != 0; }
+
+	/**
+	 * Checks data received for a block. Data of a range completed already,
+	 * by another request of the block, is dropped.
+	 *
+	 * @param complete True if the range is complete already.
+	 * @param bytes The bytes received, which are counted as wasted if dropped.
+	 * @return True if the data must be written.
+	 */
+	bool Receive(bool complete, uint64 bytes) const;
+
+	/**
+	 * Sorts out the requests to cancel once a block is complete, which are
+	 * all of its requests but the one which completed it. If that was made
+	 * for a block requested already and a first request is cancelled, the
+	 * block is counted as won.
+	 *
+	 * @param winner The request which completed the block.
+	 * @param requests The requests of the block, may include the winner.
+	 * @return The indexes in 'requests' of the requests to cancel.
+	 */
+	std::vector<size_t> Complete(const void* winner, const std::vector<Request>& requests) const;
+
+private:
+	std::set<const void*>	m_requests;
+};
+
+#endif // ENDGAME_H
+// File_checked_for_headers
@@ -40,6 +40,7 @@
 #include "PartFile.h"				// Needed for CPartFile
 #include "ServerConnect.h"			// Needed for CServerConnect
 #include "UploadQueue.h"			// Needed for CUploadQueue
+#include "UploadBandwidthThrottler.h"		// Needed for UploadBandwidthThrottler
 #include "amule.h"				// Needed for theApp
 #include "SearchList.h"				// Needed for GetSearchResults
 #include "ClientList.h"
@@ -589,6 +590,14 @@ static CECPacket *Get_EC_Response_StatRequest(const CECPacket *request, CLoggerA
 			response->AddTag(CECTag(EC_TAG_STATS_DL_SPEED, (uint32)(theStats::GetDownloadRate())));
 			response->AddTag(CECTag(EC_TAG_STATS_UL_SPEED_LIMIT, (uint32)(thePrefs::GetMaxUpload()*1024.0)));
 			response->AddTag(CECTag(EC_TAG_STATS_DL_SPEED_LIMIT, (uint32)(thePrefs::GetMaxDownload()*1024.0)));
+			if (thePrefs::IsDelayBasedUpload()) {
+				uint64 currentRate, targetRate;
+				uint32 delay;
+				theApp->uploadBandwidthThrottler->GetDelayStats(currentRate, targetRate, delay);
+				response->AddTag(CECTag(EC_TAG_STATS_UL_CURRENT_RATE, currentRate));
+				response->AddTag(CECTag(EC_TAG_STATS_UL_TARGET_RATE, targetRate));
+				response->AddTag(CECTag(EC_TAG_STATS_UL_QUEUEING_DELAY, delay / 1000));
+			}
 			response->AddTag(CECTag(EC_TAG_STATS_UL_QUEUE_LEN, /*(uint32)*/theStats::GetWaitingUserCount()));
 			response->AddTag(CECTag(EC_TAG_STATS_TOTAL_SRC_COUNT, /*(uint32)*/theStats::GetFoundSources()));
 			// User/Filecounts
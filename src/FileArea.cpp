@@ -36,6 +36,8 @@
 
 #include "FileArea.h"		// Interface declarations.
 #include "FileAutoClose.h"	// Needed for CFileAutoClose
+#include "DownloadBufferPool.h"	// Needed for CDownloadBufferPool
+#include "FileIOBatch.h"		// Needed for CFileIOBatch
 
 #ifndef ENABLE_MMAP
 #	define ENABLE_MMAP	0
@@ -181,7 +183,7 @@ void CFileAreaSigHandler::Remove(CFileArea& area)
 #endif
 
 CFileArea::CFileArea()
-	: m_buffer(NULL), m_mmap_buffer(NULL), m_length(0), m_next(NULL), m_file(NULL), m_error(false)
+	: m_buffer(NULL), m_mmap_buffer(NULL), m_length(0), m_pooled(false), m_next(NULL), m_file(NULL), m_batch(NULL), m_batchIndex(0), m_error(false)
 {
 	CFileAreaSigHandler::Init();
 }
@@ -197,7 +199,12 @@ bool CFileArea::Close()
 {
 	if (m_buffer != NULL && m_mmap_buffer == NULL)
 	{
-		delete[] m_buffer;
+		if (m_pooled) {
+			CDownloadBufferPool::Free(m_buffer, m_length);
+			m_pooled = false;
+		} else {
+			delete[] m_buffer;
+		}
 		m_buffer = NULL;
 	}
 #ifdef USE_MMAP
@@ -208,17 +215,19 @@ bool CFileArea::Close()
 		CFileAreaSigHandler::Remove(*this);
 		m_buffer = NULL;
 		m_mmap_buffer = NULL;
-		if (m_file) {
-			m_file->Unlock();
-			m_file = NULL;
-		}
 	}
 #endif
+	// Release the file pinned for mapping or for a batched operation
+	m_batch = NULL;
+	if (m_file) {
+		m_file->Unlock();
+		m_file = NULL;
+	}
 	return true;
 }
 
 
-void CFileArea::ReadAt(CFileAutoClose& file, uint64 offset, size_t count)
+void CFileArea::ReadAt(CFileAutoClose& file, uint64 offset, size_t count, CFileIOBatch* batch)
 {
 	Close();
 
@@ -241,7 +250,13 @@ void CFileArea::ReadAt(CFileAutoClose& file, uint64 offset, size_t count)
 	file.Unlock();
 #endif
 	m_buffer = new uint8_t[count];
-	file.ReadAt(m_buffer, offset, count);
+	if (batch) {
+		m_batchIndex = batch->AddRead(file.Pin(), offset, m_buffer, count);
+		m_batch = batch;
+		m_file = &file;
+	} else {
+		file.ReadAt(m_buffer, offset, count);
+	}
 }
 
 #ifdef USE_MMAP
@@ -266,18 +281,22 @@ void CFileArea::StartWriteAt(CFileAutoClose& file, uint64 offset, size_t count)
 		}
 		file.Unlock();
 	}
-	m_buffer = new uint8_t[count];
+	m_buffer = CDownloadBufferPool::Allocate(count);
+	m_length = count;
+	m_pooled = true;
 }
 #else
 void CFileArea::StartWriteAt(CFileAutoClose&, uint64, size_t count)
 {
 	Close();
-	m_buffer = new uint8_t[count];
+	m_buffer = CDownloadBufferPool::Allocate(count);
+	m_length = count;
+	m_pooled = true;
 }
 #endif
 
 
-bool CFileArea::FlushAt(CFileAutoClose& file, uint64 offset, size_t count)
+bool CFileArea::FlushAt(CFileAutoClose& file, uint64 offset, size_t count, CFileIOBatch* batch)
 {
 	if (!m_buffer)
 		return false;
@@ -290,6 +309,14 @@ bool CFileArea::FlushAt(CFileAutoClose& file, uint64 offset, size_t count)
 		return true;
 	}
 #endif
+	if (batch) {
+		// The buffer is released by Close, once the batch is done
+		CFile::IOVector buffers(1, CFile::IOVector::value_type(m_buffer, count));
+		m_batchIndex = batch->AddWrite(file.Pin(), buffers, offset);
+		m_batch = batch;
+		m_file = &file;
+		return true;
+	}
 	file.WriteAt(m_buffer, offset, count);
 	Close();
 	return true;
@@ -297,6 +324,12 @@ bool CFileArea::FlushAt(CFileAutoClose& file, uint64 offset, size_t count)
 
 void CFileArea::CheckError()
 {
+	if (m_batch) {
+		const CFileIOBatch* batch = m_batch;
+		m_batch = NULL;
+		batch->CheckResult(m_batchIndex);
+	}
+
 	bool err = m_error;
 	m_error = false;
 	if (err)
@@ -26,6 +26,7 @@
 
 class CFileAreaSigHandler;
 class CFileAutoClose;
+class CFileIOBatch;
 
 /**
  * This class is used to optimize file read/write using mapped memory
@@ -58,21 +59,34 @@ public:
 	 * @param offset seek address in file.
 	 * @param count  bytes to read.
 	 *
+	 * @param batch  if not NULL, the read is queued to this batch
+	 *               instead of being done right away.
+	 *
 	 * Initialize buffer. Buffer will contain data from current file
 	 * position for count length. Buffer will be a memory mapped area
-	 * or a allocated buffer depending on systems.
+	 * or a allocated buffer depending on systems. A queued read must
+	 * be executed and checked (see CFileIOBatch) before the buffer
+	 * is used, the file is kept open until then.
 	 */
-	void ReadAt(CFileAutoClose& file, uint64 offset, size_t count);
+	void ReadAt(CFileAutoClose& file, uint64 offset, size_t count, CFileIOBatch* batch = NULL);
 
 	/**
 	 * Start a new write
+	 *
+	 * Unless the area is mapped, the buffer is taken from the
+	 * CDownloadBufferPool, since writes hold downloaded data.
 	 */
 	void StartWriteAt(CFileAutoClose& file, uint64 offset, size_t count);
 
         /**
 	 * Flushes data not yet written.
+	 *
+	 * @param batch  if not NULL and the area isn't mapped, the write is
+	 *               queued to this batch instead of being done right away.
+	 *               It must be executed and checked before the area is
+	 *               closed, the file is kept open until then.
 	 */
-	bool FlushAt(CFileAutoClose& file, uint64 offset, size_t count);
+	bool FlushAt(CFileAutoClose& file, uint64 offset, size_t count, CFileIOBatch* batch = NULL);
 
 	/**
 	 * Get buffer that contains data read or to write.
@@ -81,7 +95,13 @@ public:
 	uint8_t *GetBuffer() const { return m_buffer; };
 
 	/**
-	 * Report error pending
+	 * Returns true if the buffer is mapped to the file, in which
+	 * case it must be written using FlushAt.
+	 */
+	bool IsMapped() const { return m_mmap_buffer != NULL; }
+
+	/**
+	 * Report error pending, including the error of a queued read
 	 */
 	void CheckError();
 
@@ -103,17 +123,29 @@ private:
 	 */
 	uint8_t *m_mmap_buffer;
 	/**
-	 * Length of the mapped region, currently used only for munmap.
+	 * Length of the mapped region or of the pooled buffer.
 	 */
 	size_t m_length;
+	/**
+	 * true if m_buffer was taken from CDownloadBufferPool.
+	 */
+	bool m_pooled;
 	/**
 	 * Global chain
 	 */
 	CFileArea* m_next;
 	/**
-	 * File handle to release
+	 * File handle to release, pinned while mapped or an operation is queued
 	 */
 	CFileAutoClose * m_file;
+	/**
+	 * Batch the read or write was queued to, until checked
+	 */
+	const CFileIOBatch* m_batch;
+	/**
+	 * Index of the operation in m_batch
+	 */
+	size_t m_batchIndex;
 	/**
 	 * true if error detected
 	 */
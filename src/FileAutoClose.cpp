@@ -35,16 +35,19 @@ CFileAutoClose::CFileAutoClose()
 	  m_autoClosed(false),
 	  m_locked(0),
 	  m_size(0),
-	  m_lastAccess(TheTime)
+	  m_lastAccess(TheTime),
+	  m_mutex(wxMUTEX_RECURSIVE)
 {}
 
 CFileAutoClose::CFileAutoClose(const CPath& path, CFile::OpenMode mode)
+	: m_mutex(wxMUTEX_RECURSIVE)
 {
 	Open(path, mode);
 }
 
 bool CFileAutoClose::Open(const CPath& path, CFile::OpenMode mode)
 {
+	wxMutexLocker lock(m_mutex);
 	m_mode = mode;
 	m_autoClosed = false;
 	m_locked = 0;
@@ -55,6 +58,7 @@ bool CFileAutoClose::Open(const CPath& path, CFile::OpenMode mode)
 
 bool CFileAutoClose::Create(const CPath& path, bool overwrite)
 {
+	wxMutexLocker lock(m_mutex);
 	m_mode = CFile::write;
 	m_autoClosed = false;
 	m_lastAccess = TheTime;
@@ -63,6 +67,7 @@ bool CFileAutoClose::Create(const CPath& path, bool overwrite)
 
 bool CFileAutoClose::Close()
 {
+	wxMutexLocker lock(m_mutex);
 	bool state = m_autoClosed ? true : m_file.Close();
 	m_autoClosed = false;
 	return state;
@@ -70,11 +75,13 @@ bool CFileAutoClose::Close()
 
 uint64 CFileAutoClose::GetLength() const
 {
+	wxMutexLocker lock(m_mutex);
 	return m_autoClosed ? m_size : m_file.GetLength();
 }
 
 bool CFileAutoClose::SetLength(uint64 newLength)
 {
+	wxMutexLocker lock(m_mutex);
 	Reopen();
 	return m_file.SetLength(newLength);
 }
@@ -86,11 +93,13 @@ const CPath& CFileAutoClose::GetFilePath() const
 
 bool CFileAutoClose::IsOpened() const
 {
+	wxMutexLocker lock(m_mutex);
 	return m_autoClosed || m_file.IsOpened();
 }
 
 void CFileAutoClose::ReadAt(void* buffer, uint64 offset, size_t count)
 {
+	wxMutexLocker lock(m_mutex);
 	Reopen();
 	m_file.Seek(offset);
 	m_file.Read(buffer, count);
@@ -98,26 +107,52 @@ void CFileAutoClose::ReadAt(void* buffer, uint64 offset, size_t count)
 
 void CFileAutoClose::WriteAt(const void* buffer, uint64 offset, size_t count)
 {
+	wxMutexLocker lock(m_mutex);
 	Reopen();
 	m_file.Seek(offset);
 	m_file.Write(buffer, count);
 }
 
+void CFileAutoClose::WriteAtV(const CFile::IOVector& buffers, uint64 offset)
+{
+	wxMutexLocker lock(m_mutex);
+	Reopen();
+	m_file.WriteAtV(buffers, offset);
+}
+
+void CFileAutoClose::Advise(uint64 offset, uint64 length, CFile::AccessHint hint)
+{
+	wxMutexLocker lock(m_mutex);
+	Reopen();
+	m_file.Advise(offset, length, hint);
+}
+
 bool CFileAutoClose::Eof()
 {
+	wxMutexLocker lock(m_mutex);
 	Reopen();
 	return m_file.Eof();
 }
 
 int CFileAutoClose::fd()
 {
+	wxMutexLocker lock(m_mutex);
 	Reopen();
 	m_locked++;
 	return m_file.fd();
 }
 
+CFile& CFileAutoClose::Pin()
+{
+	wxMutexLocker lock(m_mutex);
+	Reopen();
+	m_locked++;
+	return m_file;
+}
+
 void CFileAutoClose::Unlock()
 {
+	wxMutexLocker lock(m_mutex);
 	if (m_locked) {
 		m_locked--;
 	}
@@ -138,6 +173,7 @@ void CFileAutoClose::Reopen()
 
 bool CFileAutoClose::Release(bool now)
 {
+	wxMutexLocker lock(m_mutex);
 	if (!m_autoClosed
 			&& (now || TheTime - m_lastAccess >= ReleaseTime)
 			&& !m_locked
@@ -26,6 +26,8 @@
 #ifndef FILEAUTOCLOSE_H
 #define FILEAUTOCLOSE_H
 
+#include <wx/thread.h>		// Needed for wxMutex
+
 #include "CFile.h"			// Needed for CFile
 
 /**
@@ -34,6 +36,9 @@
  * It allows to close the used file handle and reopen
  * it on usage to minimize the number of used file handles.
  *
+ * All operations are serialized by an internal lock, so that
+ * a part-file may be written by the CPartFileWriteThread while
+ * the main thread reads from it for uploading.
  */
 class CFileAutoClose
 {
@@ -134,6 +139,20 @@ public:
 	 */
 	void WriteAt(const void* buffer, uint64 offset, size_t count);
 
+	/**
+	 * Writes several buffers back to back, starting at 'offset'.
+	 *
+	 * See CFile::WriteAtV
+	 */
+	void WriteAtV(const CFile::IOVector& buffers, uint64 offset);
+
+	/**
+	 * Tells the system how a range of the file is going to be used.
+	 *
+	 * See CFile::Advise
+	 */
+	void Advise(uint64 offset, uint64 length, CFile::AccessHint hint);
+
 	/**
 	 * Returns true when the file-position is past or at the end of the file.
 	 */
@@ -151,7 +170,16 @@ public:
 	int fd();
 
 	/**
-	 * Reenables AutoClose disabled by fd() before.
+	 * Returns the wrapped file, for positioned I/O that is done
+	 * without the lock (see CFileIOBatch).
+	 *
+	 * Like fd(), this reopens the file if needed and disables
+	 * AutoClose until Unlock is called.
+	 */
+	CFile& Pin();
+
+	/**
+	 * Reenables AutoClose disabled by fd() or Pin() before.
 	 */
 	void Unlock();
 
@@ -184,6 +212,9 @@ private:
 
 	//! Last access time (s)
 	uint32 m_lastAccess;
+
+	//! Serializes access to the file (recursive).
+	mutable wxMutex m_mutex;
 };
 
 
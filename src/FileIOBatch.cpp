@@ -0,0 +1,548 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+
+#include "FileIOBatch.h"	// Interface declarations
+
+#include "config.h"		// Needed for HAVE_LIBURING
+
+#include <algorithm>		// Needed for std::min
+#include <deque>
+
+#include <wx/thread.h>		// Needed for wxMutex
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#include <errno.h>
+#include <wx/log.h>		// Needed for wxSysErrorMsg
+
+#include "MuleThread.h"		// Needed for CMuleThread
+#endif
+
+
+//! Protects the ring, the state of running batches and the statistics.
+static wxMutex s_lock;
+//! Signalled whenever a batch has completed.
+static wxCondition s_batchDone(s_lock);
+//! The counters of all batches.
+static CFileIOBatch::Stats s_stats = { 0, 0, 0 };
+
+#ifdef HAVE_LIBURING
+
+//! Number of submission entries of the ring, larger batches are submitted in parts.
+static const unsigned RING_ENTRIES = 128;
+
+//! Operations in the ring at most, so that its completion queue, which is
+//! twice as large as the submission queue, can't overflow. One entry is
+//! kept for stopping the reaper.
+static const size_t RING_CAPACITY = 2 * RING_ENTRIES - 1;
+
+//! The ring shared by all batches, NULL if not set up or shut down.
+static struct io_uring* s_ring = NULL;
+
+//! Whether the kernel supports io_uring, which is known after the first try.
+static enum { ringsUnknown, ringsAvailable, ringsUnavailable } s_ringState = ringsUnknown;
+
+//! Serializes the submissions to the ring, taken before s_lock.
+static wxMutex s_submitLock;
+
+//! Number of operations in the ring, including the skipped ones.
+static size_t s_inRing = 0;
+
+//! Batches which found the ring full, finished by the reaper.
+static std::deque<CFileIOBatch*> s_deferred;
+
+//! Marks the entry that stops the reaper.
+static char s_stopMarker;
+//! Marks entries that couldn't be submitted along with their batch.
+static char s_skipMarker;
+
+
+/**
+ * This thread collects the completions of the ring and finishes the
+ * batches whose operations are all done.
+ */
+class CFileIOReaper : public CMuleThread
+{
+public:
+	CFileIOReaper(struct io_uring* ring)
+		: CMuleThread(wxTHREAD_JOINABLE),
+		  m_ring(ring)
+	{}
+
+protected:
+	/** @see wxThread::Entry */
+	virtual void* Entry();
+
+private:
+	struct io_uring*	m_ring;
+};
+
+
+void* CFileIOReaper::Entry()
+{
+	bool stopping = false;
+
+	for (;;) {
+		struct io_uring_cqe* cqe = NULL;
+		uint64 syscalls = 0;
+
+		// Only waiting for a completion takes a system call
+		int result = io_uring_peek_cqe(m_ring, &cqe);
+		if (result != 0) {
+			++syscalls;
+			do {
+				result = io_uring_wait_cqe(m_ring, &cqe);
+			} while (result == -EINTR);
+		}
+
+		void* data = NULL;
+		if (result == 0) {
+			data = io_uring_cqe_get_data(cqe);
+			result = cqe->res;
+			io_uring_cqe_seen(m_ring, cqe);
+		}
+
+		std::vector<CFileIOBatch*> finished;
+
+		{
+			wxMutexLocker lock(s_lock);
+			s_stats.syscalls += syscalls;
+
+			if (data == &s_stopMarker) {
+				stopping = true;
+			} else if (data == &s_skipMarker) {
+				--s_inRing;
+			} else if (data) {
+				CFileIOBatch::Operation& op = *static_cast<CFileIOBatch::Operation*>(data);
+				--s_inRing;
+
+				if (result >= 0) {
+					// Short transfers are completed synchronously
+					op.done = result;
+				} else if (result != -EINVAL && result != -EOPNOTSUPP && result != -EAGAIN) {
+					op.result = CFileIOBatch::resultError;
+					op.error = wxString(op.write ? wxT("Error writing to file: ") : wxT("Error reading from file: ")) + wxSysErrorMsg(-result);
+				}
+
+				if (--op.batch->m_inRing == 0) {
+					finished.push_back(op.batch);
+				}
+			}
+
+			// Room has been made for the batches that found the ring full
+			finished.insert(finished.end(), s_deferred.begin(), s_deferred.end());
+			s_deferred.clear();
+		}
+
+		for (size_t i = 0; i < finished.size(); ++i) {
+			finished[i]->Finish();
+		}
+
+		if (stopping) {
+			wxMutexLocker lock(s_lock);
+			if (s_inRing == 0 && s_deferred.empty()) {
+				return NULL;
+			}
+		}
+	}
+}
+
+//! The thread collecting the completions of s_ring.
+static CFileIOReaper* s_reaper = NULL;
+
+#endif
+
+
+CFileIOBatch::CFileIOBatch()
+	: m_executed(0),
+	  m_first(0),
+	  m_inRing(0),
+	  m_running(false),
+	  m_handler(NULL)
+{
+}
+
+
+CFileIOBatch::~CFileIOBatch()
+{
+	Wait();
+}
+
+
+size_t CFileIOBatch::AddRead(CFile& file, uint64 offset, uint8_t* buffer, size_t count)
+{
+	CFile::IOVector buffers;
+	buffers.push_back(CFile::IOVector::value_type(buffer, count));
+
+	size_t index = AddWrite(file, buffers, offset);
+	m_operations[index].write = false;
+
+	return index;
+}
+
+
+size_t CFileIOBatch::AddWrite(CFile& file, const CFile::IOVector& buffers, uint64 offset)
+{
+	// The reaper refers to the operations while running
+	wxASSERT(!m_running);
+
+	Operation op;
+	op.batch = this;
+	op.file = &file;
+	op.write = true;
+	op.offset = offset;
+	op.buffers = buffers;
+	op.length = 0;
+	op.iov = NULL;
+	op.done = 0;
+	op.result = resultPending;
+
+	for (CFile::IOVector::const_iterator it = buffers.begin(); it != buffers.end(); ++it) {
+		op.length += it->second;
+	}
+
+	m_operations.push_back(op);
+
+	return m_operations.size() - 1;
+}
+
+
+void CFileIOBatch::Execute(wxEvtHandler* handler)
+{
+	wxASSERT(!m_running);
+
+	m_first = m_executed;
+	m_executed = m_operations.size();
+	m_handler = handler;
+	m_running = true;
+
+	if (m_first == m_executed || !ExecuteRing(m_first)) {
+		Finish();
+	}
+}
+
+
+void CFileIOBatch::Wait()
+{
+	wxMutexLocker lock(s_lock);
+
+	while (m_running) {
+		s_batchDone.Wait();
+	}
+}
+
+
+bool CFileIOBatch::ExecuteRing(size_t first)
+{
+#ifdef HAVE_LIBURING
+	if (!IsBatched()) {
+		return false;
+	}
+
+	wxMutexLocker submitLock(s_submitLock);
+
+	size_t count = 0;
+	{
+		wxMutexLocker lock(s_lock);
+
+		if (s_ring == NULL) {
+			return false;
+		} else if (s_inRing == RING_CAPACITY) {
+			// Done by the reaper, which is woken by the next completion
+			s_deferred.push_back(this);
+			return true;
+		}
+
+		// Counted beforehand, as the reaper may see the first completions
+		// before the rest is submitted
+		count = std::min(m_operations.size() - first, RING_CAPACITY - s_inRing);
+		s_inRing += count;
+		m_inRing = count;
+	}
+
+	const size_t end = first + count;
+	size_t submitted = 0;
+	size_t skipped = 0;
+	uint64 syscalls = 0;
+
+	for (size_t next = first; next < end; ) {
+		std::vector<struct io_uring_sqe*> entries;
+
+		for (; next < end && entries.size() < RING_ENTRIES; ++next) {
+			struct io_uring_sqe* sqe = io_uring_get_sqe(s_ring);
+			if (sqe == NULL) {
+				break;
+			}
+
+			Operation& op = m_operations[next];
+			op.iov = new struct iovec[op.buffers.size()];
+			for (size_t j = 0; j < op.buffers.size(); ++j) {
+				op.iov[j].iov_base = const_cast<uint8_t*>(op.buffers[j].first);
+				op.iov[j].iov_len = op.buffers[j].second;
+			}
+
+			if (op.write) {
+				io_uring_prep_writev(sqe, op.file->fd(), op.iov, op.buffers.size(), op.offset);
+			} else {
+				io_uring_prep_readv(sqe, op.file->fd(), op.iov, op.buffers.size(), op.offset);
+			}
+			io_uring_sqe_set_data(sqe, &op);
+			entries.push_back(sqe);
+		}
+
+		if (entries.empty()) {
+			break;
+		}
+
+		int result;
+		do {
+			result = io_uring_submit(s_ring);
+			++syscalls;
+		} while (result == -EINTR);
+
+		const size_t taken = std::max(result, 0);
+		submitted += taken;
+
+		if (taken < entries.size()) {
+			// Entries left in the queue would go with the next submission,
+			// when their operations have been done synchronously already
+			for (size_t j = taken; j < entries.size(); ++j) {
+				io_uring_prep_nop(entries[j]);
+				io_uring_sqe_set_data(entries[j], &s_skipMarker);
+			}
+			skipped = entries.size() - taken;
+			break;
+		}
+	}
+
+	wxMutexLocker lock(s_lock);
+	s_stats.syscalls += syscalls;
+
+	if (submitted == count) {
+		// The reaper may have finished the batch already
+		return true;
+	}
+
+	// The rest is done when the batch is finished
+	s_inRing -= count - submitted - skipped;
+	m_inRing -= count - submitted;
+
+	return m_inRing != 0;
+#else
+	(void)first;
+
+	return false;
+#endif
+}
+
+
+void CFileIOBatch::Finish()
+{
+	uint64 syscalls = 0;
+	uint64 bytes = 0;
+
+	// Whatever the ring didn't complete is done the usual way
+	for (size_t i = m_first; i < m_operations.size(); ++i) {
+		Operation& op = m_operations[i];
+		bytes += op.length;
+
+#ifdef HAVE_LIBURING
+		delete[] op.iov;
+		op.iov = NULL;
+#endif
+
+		if (op.result != resultPending) {
+			continue;
+		} else if (op.done == op.length) {
+			op.result = resultOk;
+		} else {
+			ExecuteSync(op);
+			syscalls += op.write ? 1 : op.buffers.size();
+		}
+	}
+
+	wxEvtHandler* handler = NULL;
+
+	{
+		wxMutexLocker lock(s_lock);
+		s_stats.operations += m_operations.size() - m_first;
+		s_stats.bytes += bytes;
+		s_stats.syscalls += syscalls;
+
+		handler = m_handler;
+		m_running = false;
+		s_batchDone.Broadcast();
+	}
+
+	// The batch may be gone once waited for or handled
+	if (handler) {
+		CFileIOBatchEvent evt(this);
+		wxPostEvent(handler, evt);
+	}
+}
+
+
+void CFileIOBatch::ExecuteSync(Operation& op)
+{
+	// Skip what has been transferred by the ring already
+	CFile::IOVector buffers;
+	size_t skip = op.done;
+	for (CFile::IOVector::const_iterator it = op.buffers.begin(); it != op.buffers.end(); ++it) {
+		if (skip >= it->second) {
+			skip -= it->second;
+		} else {
+			buffers.push_back(CFile::IOVector::value_type(it->first + skip, it->second - skip));
+			skip = 0;
+		}
+	}
+
+	try {
+		uint64 offset = op.offset + op.done;
+		if (op.write) {
+			op.file->WriteAtV(buffers, offset);
+		} else {
+			for (CFile::IOVector::const_iterator it = buffers.begin(); it != buffers.end(); ++it) {
+				op.file->ReadAt(const_cast<uint8_t*>(it->first), offset, it->second);
+				offset += it->second;
+			}
+		}
+
+		op.result = resultOk;
+	} catch (const CEOFException& e) {
+		op.result = resultEOF;
+		op.error = e.what();
+	} catch (const CIOFailureException& e) {
+		op.result = resultError;
+		op.error = e.what();
+	}
+}
+
+
+void CFileIOBatch::CheckResult(size_t index) const
+{
+	const Operation& op = m_operations[index];
+	wxASSERT(op.result != resultPending);
+
+	if (op.result == resultError) {
+		throw CIOFailureException(op.error);
+	} else if (op.result == resultEOF) {
+		throw CEOFException(op.error);
+	}
+}
+
+
+bool CFileIOBatch::IsBatched()
+{
+#ifdef HAVE_LIBURING
+	wxMutexLocker lock(s_lock);
+
+	if (s_ringState == ringsUnknown) {
+		s_ringState = ringsUnavailable;
+
+		struct io_uring* ring = new struct io_uring;
+		if (io_uring_queue_init(RING_ENTRIES, ring, 0) < 0) {
+			delete ring;
+		} else {
+			CFileIOReaper* reaper = new CFileIOReaper(ring);
+			if (reaper->Create() == wxTHREAD_NO_ERROR && reaper->Run() == wxTHREAD_NO_ERROR) {
+				s_ring = ring;
+				s_reaper = reaper;
+				s_ringState = ringsAvailable;
+			} else {
+				delete reaper;
+				io_uring_queue_exit(ring);
+				delete ring;
+			}
+		}
+	}
+
+	return s_ringState == ringsAvailable;
+#else
+	return false;
+#endif
+}
+
+
+void CFileIOBatch::GetStats(Stats& stats)
+{
+	wxMutexLocker lock(s_lock);
+
+	stats = s_stats;
+}
+
+
+void CFileIOBatch::Shutdown()
+{
+#ifdef HAVE_LIBURING
+	struct io_uring* ring = NULL;
+	CFileIOReaper* reaper = NULL;
+
+	{
+		wxMutexLocker submitLock(s_submitLock);
+
+		{
+			wxMutexLocker lock(s_lock);
+
+			ring = s_ring;
+			reaper = s_reaper;
+			s_ring = NULL;
+			s_reaper = NULL;
+			s_ringState = ringsUnavailable;
+		}
+
+		if (ring == NULL) {
+			return;
+		}
+
+		// The reaper stops once the batches submitted before are done
+		struct io_uring_sqe* sqe = io_uring_get_sqe(ring);
+		int result = -EBUSY;
+		if (sqe) {
+			io_uring_prep_nop(sqe);
+			io_uring_sqe_set_data(sqe, &s_stopMarker);
+
+			do {
+				result = io_uring_submit(ring);
+			} while (result == -EINTR);
+		}
+
+		if (result <= 0) {
+			// The reaper can't be woken, it ends with the process
+			return;
+		}
+	}
+
+	reaper->Wait();
+	delete reaper;
+
+	io_uring_queue_exit(ring);
+	delete ring;
+#endif
+}
+
+
+DEFINE_LOCAL_EVENT_TYPE(MULE_EVT_FILEIO_BATCH)
+
+// File_checked_for_headers
@@ -0,0 +1,229 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+
+#ifndef FILEIOBATCH_H
+#define FILEIOBATCH_H
+
+#include <vector>
+
+#include <wx/event.h>		// Needed for wxEvent
+
+#include "CFile.h"		// Needed for CFile
+
+struct iovec;
+
+/**
+ * A batch of positioned reads and writes, executed in the background.
+ *
+ * If aMule was built with liburing and the kernel supports it, the
+ * operations of a batch are submitted to an io_uring together, so that
+ * many transfers cost a single system call and are carried out by the
+ * kernel in parallel. Execute returns once they have been submitted; a
+ * reaper thread collects their completions and then posts a
+ * MULE_EVT_FILEIO_BATCH event to the handler of the batch, so the main
+ * thread never waits for the disk. Transfers the ring could not complete
+ * are finished on the reaper thread with CFile::ReadAt and CFile::WriteAtV.
+ *
+ * Without a ring, Execute does the operations one by one before returning,
+ * as the regular file I/O would. Callers on the main thread should only
+ * batch if IsBatched() returns true, and read and write directly otherwise.
+ *
+ * Neither the file position nor the lock of a CFileAutoClose is used,
+ * callers must keep the files open (see CFileAutoClose::Pin) and the
+ * buffers valid until the batch has completed. A batch may be used by one
+ * thread at a time, different batches from any number of threads.
+ */
+class CFileIOBatch
+{
+public:
+	//! Counters of all batches, for diagnostics and benchmarks.
+	struct Stats
+	{
+		//! Number of operations executed.
+		uint64	operations;
+		//! Number of bytes transferred.
+		uint64	bytes;
+		//! Number of system calls used to submit and complete operations.
+		uint64	syscalls;
+	};
+
+	CFileIOBatch();
+
+	/** Waits for the batch, if still running. */
+	~CFileIOBatch();
+
+	/**
+	 * Queues a read of 'count' bytes at 'offset' into 'buffer'.
+	 *
+	 * @return The index of the operation, see CheckResult.
+	 */
+	size_t AddRead(CFile& file, uint64 offset, uint8_t* buffer, size_t count);
+
+	/**
+	 * Queues a write of several buffers back to back, starting at 'offset'.
+	 *
+	 * @return The index of the operation, see CheckResult.
+	 */
+	size_t AddWrite(CFile& file, const CFile::IOVector& buffers, uint64 offset);
+
+	/**
+	 * Starts executing the operations queued since the last call, and
+	 * returns once they have been submitted. Errors are kept with the
+	 * operations.
+	 *
+	 * Once all operations have completed, a CFileIOBatchEvent is posted to
+	 * 'handler', if not NULL. No operations may be added until then.
+	 */
+	void Execute(wxEvtHandler* handler = NULL);
+
+	/** Blocks until the operations started by Execute have completed. */
+	void Wait();
+
+	/**
+	 * Throws the error of a completed operation, if it failed.
+	 *
+	 * @throws CIOFailureException on read or write errors.
+	 * @throws CEOFException if a read went past the end of the file.
+	 */
+	void CheckResult(size_t index) const;
+
+	/** Returns the number of operations queued, executed or not. */
+	size_t GetCount() const		{ return m_operations.size(); }
+
+	/**
+	 * Returns true if the operations of a batch are submitted to the
+	 * kernel together and complete in the background, that is if an
+	 * io_uring is available.
+	 *
+	 * This is decided on the first call, by trying to set up the ring.
+	 */
+	static bool IsBatched();
+
+	/** Retrieves the counters of all batches. */
+	static void GetStats(Stats& stats);
+
+	/**
+	 * Stops the reaper thread once all running batches have completed,
+	 * and releases the ring. Later batches are executed synchronously.
+	 */
+	static void Shutdown();
+
+private:
+	//! A CFileIOBatch is neither copyable nor assignable.
+	//@{
+	CFileIOBatch(const CFileIOBatch&);
+	CFileIOBatch& operator=(const CFileIOBatch&);
+	//@}
+
+	//! The outcome of an operation.
+	enum Result { resultPending, resultOk, resultError, resultEOF };
+
+	struct Operation
+	{
+		//! The batch the operation belongs to, for the reaper.
+		CFileIOBatch*	batch;
+		CFile*		file;
+		bool		write;
+		uint64		offset;
+		CFile::IOVector	buffers;
+		//! Total length of the buffers.
+		size_t		length;
+		//! The buffers as handed to the ring, while in it.
+		struct iovec*	iov;
+		//! Bytes transferred by the ring, the rest is done synchronously.
+		size_t		done;
+		Result		result;
+		//! Error message, if failed.
+		wxString	error;
+	};
+
+	/**
+	 * Submits the operations from 'first' on to the ring, as far as it
+	 * has room for them. If it has none, the batch is left to the reaper.
+	 *
+	 * @return False if the batch wasn't handed to the ring, in which case
+	 *         the caller has to Finish it.
+	 */
+	bool ExecuteRing(size_t first);
+
+	/**
+	 * Completes the operations the ring didn't, counts the batch and
+	 * notifies the handler. Called by the thread that ends the batch.
+	 */
+	void Finish();
+
+	/** Completes an operation with the regular system calls. */
+	static void ExecuteSync(Operation& op);
+
+	friend class CFileIOReaper;
+
+	//! The queued operations.
+	std::vector<Operation>	m_operations;
+	//! Number of operations executed so far.
+	size_t			m_executed;
+	//! Index of the first operation of the running execution.
+	size_t			m_first;
+	//! Number of operations still in the ring.
+	size_t			m_inRing;
+	//! True from Execute until the operations have completed.
+	bool			m_running;
+	//! Where to post the event once done, may be NULL.
+	wxEvtHandler*		m_handler;
+};
+
+
+DECLARE_LOCAL_EVENT_TYPE(MULE_EVT_FILEIO_BATCH, -1)
+
+/**
+ * This event is sent when all operations of a batch have completed.
+ */
+class CFileIOBatchEvent : public wxEvent
+{
+public:
+	CFileIOBatchEvent(CFileIOBatch* batch)
+		: wxEvent(-1, MULE_EVT_FILEIO_BATCH),
+		  m_batch(batch)
+	{}
+
+	/** Returns the completed batch. */
+	CFileIOBatch* GetBatch() const	{ return m_batch; }
+
+	/** @see wxEvent::Clone */
+	virtual wxEvent* Clone() const	{ return new CFileIOBatchEvent(m_batch); }
+
+private:
+	CFileIOBatch*	m_batch;
+};
+
+typedef void (wxEvtHandler::*MuleFileIOBatchEventFunction)(CFileIOBatchEvent&);
+
+//! Event-handler for completed batches.
+#define EVT_MULE_FILEIO_BATCH(func) \
+	DECLARE_EVENT_TABLE_ENTRY(MULE_EVT_FILEIO_BATCH, -1, -1, \
+	(wxObjectEventFunction) (wxEventFunction) \
+	wxStaticCastEvent(MuleFileIOBatchEventFunction, &func), (wxObject*) NULL),
+
+#endif // FILEIOBATCH_H
+// File_checked_for_headers
@@ -57,7 +57,8 @@
 #include "FileAutoClose.h"	// Needed for CFileAutoClose
 #include "Server.h"			// Needed for CServer
 
-#include "CryptoPP_Inc.h"       // Needed for MD4
+#include "PartHashing.h"	// Needed for CreatePartHashes
+#include "GetTickCount.h"	// Needed for GetTickCount
 
 #include <common/Format.h>
 
@@ -431,7 +432,11 @@ void CKnownFile::SetFileSize(uint64 nFileSize)
 
 void CKnownFile::AddUploadingClient(CUpDownClient* client)
 {
-	m_ClientUploadList.insert(CCLIENTREF(client, wxT("CKnownFile::AddUploadingClient m_ClientUploadList")));
+	if (m_ClientUploadList.insert(CCLIENTREF(client, wxT("CKnownFile::AddUploadingClient m_ClientUploadList"))).second) {
+#ifndef CLIENT_GUI
+		m_upSXCache.Invalidate();
+#endif
+	}
 
 	SourceItemType type = UNAVAILABLE_SOURCE;
 	switch (client->GetUploadState()) {
@@ -453,6 +458,9 @@ void CKnownFile::AddUploadingClient(CUpDownClient* client)
 void CKnownFile::RemoveUploadingClient(CUpDownClient* client)
 {
 	if (m_ClientUploadList.erase(CCLIENTREF(client, wxEmptyString))) {
+#ifndef CLIENT_GUI
+		m_upSXCache.Invalidate();
+#endif
 		Notify_SharedCtrlRemoveClient(client->ECID(), this);
 		UpdateAutoUpPriority();
 	}
@@ -817,78 +825,21 @@ void CKnownFile::CreateHashFromInput(const uint8_t* input, uint32 Length, CMD4Ha
 	{ wxCHECK_RET(input, wxT("No input to hash from in CreateHashFromInput")); }
 	wxASSERT(Length <= PARTSIZE); // We never hash more than one PARTSIZE
 
-	CMemFile data(input, Length);
-
-	uint32 Required = Length;
-	uint8  X[64*128];
-
-	uint32	posCurrentEMBlock = 0;
-	uint32	nIACHPos = 0;
-	CScopedPtr<CAICHHashAlgo> pHashAlg(CAICHHashSet::GetNewHashAlgo());
-
-	// This is all AICH.
-	while (Required >= 64) {
-		uint32 len = Required / 64;
-		if (len > sizeof(X)/(64 * sizeof(X[0]))) {
-			len = sizeof(X)/(64 * sizeof(X[0]));
-		}
-
-		data.Read(&X, len * 64);
-
-		// SHA hash needs 180KB blocks
-		if (pShaHashOut) {
-			if (nIACHPos + len*64 >= EMBLOCKSIZE) {
-				uint32 nToComplete = EMBLOCKSIZE - nIACHPos;
-				pHashAlg->Add(X, nToComplete);
-				wxASSERT( nIACHPos + nToComplete == EMBLOCKSIZE );
-				pShaHashOut->SetBlockHash(EMBLOCKSIZE, posCurrentEMBlock, pHashAlg.get());
-				posCurrentEMBlock += EMBLOCKSIZE;
-				pHashAlg->Reset();
-				pHashAlg->Add(X+nToComplete,(len*64) - nToComplete);
-				nIACHPos = (len*64) - nToComplete;
-			}
-			else{
-				pHashAlg->Add(X, len*64);
-				nIACHPos += len*64;
-			}
-		}
+	// MD4 and the AICH block hashes are created in a single pass over the data.
+	std::vector<CAICHHash> blockHashes;
+	CreatePartHashes(input, Length, Output, pShaHashOut ? &blockHashes : NULL);
 
-		Required -= len*64;
-	}
-	// bytes to read
-	Required = Length % 64;
-	if (Required != 0){
-		data.Read(&X,Required);
-
-		if (pShaHashOut != NULL){
-			if (nIACHPos + Required >= EMBLOCKSIZE){
-				uint32 nToComplete = EMBLOCKSIZE - nIACHPos;
-				pHashAlg->Add(X, nToComplete);
-				wxASSERT( nIACHPos + nToComplete == EMBLOCKSIZE );
-				pShaHashOut->SetBlockHash(EMBLOCKSIZE, posCurrentEMBlock, pHashAlg.get());
-				posCurrentEMBlock += EMBLOCKSIZE;
-				pHashAlg->Reset();
-				pHashAlg->Add(X+nToComplete, Required - nToComplete);
-				nIACHPos = Required - nToComplete;
-			}
-			else{
-				pHashAlg->Add(X, Required);
-				nIACHPos += Required;
-			}
-		}
-	}
-	if (pShaHashOut != NULL){
-		if(nIACHPos > 0){
-			pShaHashOut->SetBlockHash(nIACHPos, posCurrentEMBlock, pHashAlg.get());
-			posCurrentEMBlock += nIACHPos;
+	if (pShaHashOut != NULL) {
+		uint32 posCurrentEMBlock = 0;
+		for (size_t i = 0; i < blockHashes.size(); ++i) {
+			const uint32 nBlockSize = std::min<uint32>(EMBLOCKSIZE, Length - posCurrentEMBlock);
+			pShaHashOut->SetBlockHash(nBlockSize, posCurrentEMBlock, blockHashes[i]);
+			posCurrentEMBlock += nBlockSize;
 		}
 		wxASSERT( posCurrentEMBlock == Length );
-		wxCHECK2( pShaHashOut->ReCalculateHash(pHashAlg.get(), false), );
-	}
 
-	if (Output != NULL){
-		CryptoPP::Weak::MD4 md4_hasher;
-		md4_hasher.CalculateDigest(Output->GetHash(), input, Length);
+		CScopedPtr<CAICHHashAlgo> pHashAlg(CAICHHashSet::GetNewHashAlgo());
+		wxCHECK2( pShaHashOut->ReCalculateHash(pHashAlg.get(), false), );
 	}
 }
 
@@ -932,8 +883,6 @@ CPacket* CKnownFile::CreateSrcInfoPacket(const CUpDownClient* forClient, uint8 b
 		return NULL;
 	}
 
-	CMemFile data(1024);
-
 	uint8 byUsedVersion;
 	bool bIsSX2Packet;
 	if (forClient->SupportsSourceExchange2() && byRequestedVersion > 0){
@@ -941,7 +890,6 @@ CPacket* CKnownFile::CreateSrcInfoPacket(const CUpDownClient* forClient, uint8 b
 		// and we send the highest version we know, but of course not higher than his request
 		byUsedVersion = std::min(byRequestedVersion, (uint8)SOURCEEXCHANGE2_VERSION);
 		bIsSX2Packet = true;
-		data.WriteUInt8(byUsedVersion);
 
 		// we don't support any special SX2 options yet, reserved for later use
 		if (nRequestedOptions != 0) {
@@ -955,10 +903,23 @@ CPacket* CKnownFile::CreateSrcInfoPacket(const CUpDownClient* forClient, uint8 b
 		}
 	}
 
-	uint16 nCount = 0;
+	CSourceExchangeCache::Key key;
+	key.version = byUsedVersion;
+	key.options = nRequestedOptions;
+	key.sx2 = bIsSX2Packet;
+	key.hybridIDs = byUsedVersion >= 3;
+	key.SetParts(rcvstatus);
 
-	data.WriteHash(forClient->GetUploadFileID());
-	data.WriteUInt16(nCount);
+	const uint32 now = ::GetTickCount();
+	CSourceExchangeCache::Answer* answer = m_upSXCache.Find(key, now);
+	if (answer) {
+		return GetSrcInfoPacket(key, *answer, forClient);
+	}
+
+	// The answer is shared by all clients having the same parts, so the
+	// requester itself is only left out when the packet is created.
+	CSourceExchangeCache::Answer newAnswer;
+	CMemFile data(1024);
 	uint32 cDbgNoSrc = 0;
 
 	SourceSet::iterator it = m_ClientUploadList.begin();
@@ -966,7 +927,6 @@ CPacket* CKnownFile::CreateSrcInfoPacket(const CUpDownClient* forClient, uint8 b
 		const CUpDownClient *cur_src = it->GetClient();
 
 		if (	cur_src->HasLowID() ||
-			cur_src == forClient ||
 			!(	cur_src->GetUploadState() == US_UPLOADING ||
 				cur_src->GetUploadState() == US_ONUPLOADQUEUE)) {
 			continue;
@@ -981,16 +941,9 @@ CPacket* CKnownFile::CreateSrcInfoPacket(const CUpDownClient* forClient, uint8 b
 				if (srcstatus.size() != GetPartCount()) {
 					continue;
 				}
-				if ( cur_src->GetUpPartCount() == forClient->GetUpPartCount() ) {
-					for (int x = 0; x < GetPartCount(); x++ ) {
-						if ( srcstatus.get(x) && !rcvstatus.get(x) ) {
-							// We know the receiving client needs
-							// a chunk from this client.
-							bNeeded = true;
-							break;
-						}
-					}
-				}
+				// Only if the receiving client needs
+				// a chunk from this client.
+				bNeeded = srcstatus.HasAnyNotIn(rcvstatus);
 			} else {
 				cDbgNoSrc++;
 				// This client doesn't support upload chunk status.
@@ -1010,13 +963,8 @@ CPacket* CKnownFile::CreateSrcInfoPacket(const CUpDownClient* forClient, uint8 b
 				if (srcstatus.size() != GetPartCount()) {
 					continue;
 				}
-				for (int x = 0; x < GetPartCount(); x++ ) {
-					if ( srcstatus.get(x) ) {
-						// this client has at least one chunk
-						bNeeded = true;
-						break;
-					}
-				}
+				// this client has at least one chunk
+				bNeeded = srcstatus.Any();
 			} else {
 				// This client doesn't support upload chunk status.
 				// So just send it and hope for the best.
@@ -1025,7 +973,7 @@ CPacket* CKnownFile::CreateSrcInfoPacket(const CUpDownClient* forClient, uint8 b
 		}
 
 		if ( bNeeded ) {
-			nCount++;
+			newAnswer.sources.push_back(cur_src);
 			uint32 dwID;
 			if(byUsedVersion >= 3) {
 				dwID = cur_src->GetUserIDHybrid();
@@ -1054,25 +1002,59 @@ CPacket* CKnownFile::CreateSrcInfoPacket(const CUpDownClient* forClient, uint8 b
 				data.WriteUInt8(byCryptOptions);
 			}
 
-			if (nCount > 500) {
+			if (newAnswer.sources.size() > 500) {
 				break;
 			}
 		}
 	}
 
+	newAnswer.records.assign(data.GetRawBuffer(), data.GetRawBuffer() + data.GetLength());
+	answer = m_upSXCache.Add(key, std::move(newAnswer), now);
+
+	return GetSrcInfoPacket(key, *answer, forClient);
+}
+
+
+CPacket* CKnownFile::GetSrcInfoPacket(const CSourceExchangeCache::Key& key, CSourceExchangeCache::Answer& answer, const CUpDownClient* exclude)
+{
+	const size_t recordSize = answer.GetRecordSize();
+	const size_t excluded = std::find(answer.sources.begin(), answer.sources.end(), exclude) - answer.sources.begin();
+	const uint16 nCount = answer.sources.size() - (excluded < answer.sources.size() ? 1 : 0);
 	if (!nCount) {
-		return 0;
+		return NULL;
 	}
 
-	data.Seek(bIsSX2Packet ? 17 : 16, wxFromStart);
+	if (excluded == answer.sources.size() && answer.packet) {
+		// Built and compressed already
+		return new CPacket(*answer.packet);
+	}
+
+	CMemFile data(1024);
+	if (key.sx2) {
+		data.WriteUInt8(key.version);
+	}
+	data.WriteHash(GetFileHash());
 	data.WriteUInt16(nCount);
+	const uint8* records = answer.records.data();
+	if (excluded < answer.sources.size()) {
+		data.Write(records, excluded * recordSize);
+		data.Write(records + (excluded + 1) * recordSize, (answer.sources.size() - excluded - 1) * recordSize);
+	} else {
+		data.Write(records, answer.records.size());
+	}
 
-	CPacket* result = new CPacket(data, OP_EMULEPROT, bIsSX2Packet ? OP_ANSWERSOURCES2 : OP_ANSWERSOURCES);
+	CPacket* result = new CPacket(data, OP_EMULEPROT, key.sx2 ? OP_ANSWERSOURCES2 : OP_ANSWERSOURCES);
 
+	// 16+2+501*(4+2+4+2+16) = 14046 bytes max.
 	if ( result->GetPacketSize() > 354 ) {
 		result->PackPacket();
 	}
 
+	if (excluded == answer.sources.size()) {
+		// Sent to every client asking for it until the answer expires
+		answer.packet.reset(new CPacket(*result));
+	}
+
 	return result;
 }
 
@@ -1337,9 +1319,12 @@ void CKnownFile::UpdatePartsInfo()
 	if ( m_AvailPartFrequency.size() != GetPartCount() ) {
 		m_AvailPartFrequency.clear();
 		m_AvailPartFrequency.insert(m_AvailPartFrequency.begin(), GetPartCount(), 0);
+		m_upAvailability.Recount(m_AvailPartFrequency);
 	}
 
 	if (flag) {
+		CheckUpPartsFrequency();
+
 		ArrayOfUInts16 count;
 		count.reserve(m_ClientUploadList.size());
 
@@ -1351,16 +1336,8 @@ void CKnownFile::UpdatePartsInfo()
 			}
 		}
 
-		m_nCompleteSourcesCount = m_nCompleteSourcesCountLo = m_nCompleteSourcesCountHi = 0;
-
-		if( partcount > 0) {
-			m_nCompleteSourcesCount = m_AvailPartFrequency[0];
-		}
-		for (uint16 i = 1; i < partcount; ++i) {
-			if( m_nCompleteSourcesCount > m_AvailPartFrequency[i]) {
-				m_nCompleteSourcesCount = m_AvailPartFrequency[i];
-			}
-		}
+		m_nCompleteSourcesCountLo = m_nCompleteSourcesCountHi = 0;
+		m_nCompleteSourcesCount = m_upAvailability.GetMinFrequency();
 		count.push_back(m_nCompleteSourcesCount);
 
 		int32 n = count.size();
@@ -1428,30 +1405,33 @@ void CKnownFile::UpdateUpPartsFrequency( CUpDownClient* client, bool increment )
 	if ( m_AvailPartFrequency.size() != GetPartCount() ) {
 		m_AvailPartFrequency.clear();
 		m_AvailPartFrequency.insert(m_AvailPartFrequency.begin(), GetPartCount(), 0);
+		m_upAvailability.Recount(m_AvailPartFrequency);
 		if ( !increment ) {
 			return;
 		}
 	}
 
-	const BitVector& freq = client->GetUpPartStatus();
-	unsigned int size = freq.size();
-	if ( size != m_AvailPartFrequency.size() ) {
-		return;
-	}
+	m_upAvailability.Update(m_AvailPartFrequency, client->GetUpPartStatus(), increment);
+}
 
-	if ( increment ) {
-		for ( unsigned int i = 0; i < size; ++i ) {
-			if ( freq.get(i) ) {
-				m_AvailPartFrequency[i]++;
-			}
-		}
-	} else {
-		for ( unsigned int i = 0; i < size; ++i ) {
-			if ( freq.get(i) ) {
-				m_AvailPartFrequency[i]--;
-			}
+
+void CKnownFile::CheckUpPartsFrequency()
+{
+	ArrayOfUInts16 frequencies(GetPartCount(), 0);
+
+	SourceSet::iterator it = m_ClientUploadList.begin();
+	for ( ; it != m_ClientUploadList.end(); ++it ) {
+		const CUpDownClient* client = it->GetClient();
+		if ( client->GetUploadFile() == this ) {
+			CPartAvailability::AddStatus(frequencies, client->GetUpPartStatus());
 		}
 	}
+
+	if ( frequencies != m_AvailPartFrequency ) {
+		AddDebugLogLineN(logKnownFiles, wxT("Frequency of uploading parts was off, counted again: ") + GetFileName().GetPrintable());
+		m_AvailPartFrequency.swap(frequencies);
+		m_upAvailability.Recount(m_AvailPartFrequency);
+	}
 }
 
 void CKnownFile::ClearPriority() {
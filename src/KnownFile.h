@@ -45,6 +45,8 @@
 
 #include "Constants.h"		// Needed for PS_*, PR_*
 #include "ClientRef.h"		// Needed for CClientRef
+#include "PartAvailability.h"	// Needed for CPartAvailability
+#include "SourceExchangeCache.h"	// Needed for CSourceExchangeCache
 
 class CFileDataIO;
 class CPacket;
@@ -324,6 +326,26 @@ protected:
 
 protected:
 	CAICHHashSet*	m_pAICHHashSet;
+
+	//! Counts the parts in m_AvailPartFrequency.
+	CPartAvailability	m_upAvailability;
+
+	/**
+	 * Counts the frequency of uploading parts from all clients, fixing
+	 * the incremental counts if they are off.
+	 */
+	void	CheckUpPartsFrequency();
+
+	//! Answers to source exchange requests, from the uploading clients.
+	CSourceExchangeCache	m_upSXCache;
+
+	/**
+	 * Returns the packet of a cached source exchange answer, or NULL if it
+	 * has no sources.
+	 *
+	 * @param exclude A client which is not to be sent, if it is one of the sources.
+	 */
+	CPacket*	GetSrcInfoPacket(const CSourceExchangeCache::Key& key, CSourceExchangeCache::Answer& answer, const CUpDownClient* exclude);
 #endif
 
 	bool	LoadTagsFromFile(const CFileDataIO* file);
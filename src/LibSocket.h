@@ -29,8 +29,28 @@
 
 #include "config.h"		// Needed for ASIO_SOCKETS
 #include "Types.h"
+
+#include <memory>
+#include <utility>
+#include <vector>
+
 class amuleIPV4Address;
 
+//! Buffers written back to back by CLibSocket::WriteV.
+typedef std::vector<std::pair<const void*, uint32> > CSocketIOVector;
+
+//! Part of a file written by CLibSocket::WriteFile.
+struct CSocketFileRegion
+{
+	CSocketFileRegion() : fd(-1), offset(0), length(0) {}
+
+	//! Keeps the descriptor valid until the region has been sent.
+	std::shared_ptr<const void> owner;
+	int	fd;
+	uint64	offset;
+	uint32	length;
+};
+
 #ifdef ASIO_SOCKETS
 
 // Socket flags (unused in ASIO implementation, just provide the names)
@@ -81,6 +101,15 @@ public:
 	void	SetLocal(const amuleIPV4Address& local);
 	uint32	Read(void * buffer, uint32 nbytes);
 	uint32	Write(const void * buffer, uint32 nbytes);
+	// Write several buffers like a single one (the data is queued in one piece)
+	uint32	WriteV(const CSocketIOVector& buffers);
+	// Write a buffer followed by a region of a file, which is sent by the kernel
+	// without being copied (only if CanWriteFile() is true)
+	uint32	WriteFile(const void * head, uint32 headLength, const CSocketFileRegion& region);
+	bool	CanWriteFile() const;
+	// Smoothed round-trip time of the connection in microseconds, as seen
+	// by the kernel (false if not known)
+	bool	GetRoundTripTime(uint32& rtt) const;
 	void	Close();
 	void	Destroy();
 
@@ -299,6 +328,29 @@ public:
 		return wxSocketClient::LastCount();
 	}
 
+	// A short write of a later buffer couldn't be reported, so they are joined
+	uint32 WriteV(const CSocketIOVector& buffers)
+	{
+		std::vector<uint8_t> joined;
+		for (CSocketIOVector::const_iterator it = buffers.begin(); it != buffers.end(); ++it) {
+			const uint8_t* data = static_cast<const uint8_t*>(it->first);
+			joined.insert(joined.end(), data, data + it->second);
+		}
+
+		return joined.empty() ? 0 : Write(&joined[0], joined.size());
+	}
+
+	// Files are only written by the asio sockets
+	uint32 WriteFile(const void *, uint32, const CSocketFileRegion&)
+	{
+		wxFAIL;
+		return 0;
+	}
+
+	bool CanWriteFile() const	{ return false; }
+
+	bool GetRoundTripTime(uint32&) const	{ return false; }
+
 	void	Destroy()
 	{
 		if (!m_isDestroying) {
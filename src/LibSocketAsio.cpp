@@ -48,6 +48,19 @@
 #include <boost/version.hpp>
 #include <boost/asio/executor_work_guard.hpp>
 
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+#	include <sys/sendfile.h>	// Needed for sendfile
+#	include <errno.h>
+#	define ASIO_SENDFILE
+#endif
+
+#ifdef HAVE_NETINET_TCP_H
+#	include <netinet/tcp.h>	// Needed for TCP_INFO
+#	ifdef TCP_INFO
+#		define ASIO_TCP_INFO
+#	endif
+#endif
+
 //
 // Do away with building Boost.System, adding lib paths...
 // Just include the single file and be done.
@@ -284,6 +297,108 @@ public:
 	}
 
 
+	// Like Write, but the buffers are gathered into the copy sent in background
+	uint32 WriteV(const CSocketIOVector& buffers)
+	{
+		if (buffers.size() == 1) {
+			return Write(buffers[0].first, buffers[0].second);
+		}
+
+		uint32 nbytes = 0;
+		for (CSocketIOVector::const_iterator it = buffers.begin(); it != buffers.end(); ++it) {
+			nbytes += it->second;
+		}
+
+		if (m_sync) {
+			std::vector<char> joined;
+			joined.reserve(nbytes);
+			for (CSocketIOVector::const_iterator it = buffers.begin(); it != buffers.end(); ++it) {
+				const char* data = static_cast<const char*>(it->first);
+				joined.insert(joined.end(), data, data + it->second);
+			}
+			return nbytes ? WriteSync(&joined[0], nbytes) : 0;
+		}
+
+		if (m_sendBuffer) {
+			m_blocksWrite = true;
+			AddDebugLogLineF(logAsio, CFormat(wxT("WriteV blocks %d %p %s")) % nbytes % m_sendBuffer % m_IP);
+			return 0;
+		}
+		AddDebugLogLineF(logAsio, CFormat(wxT("WriteV %d %s")) % nbytes % m_IP);
+
+		if (nbytes > 0) {
+			network_perf::g_network_perf_monitor.record_sent(nbytes);
+		}
+
+		m_sendBuffer = new char[nbytes];
+		char* pos = m_sendBuffer;
+		for (CSocketIOVector::const_iterator it = buffers.begin(); it != buffers.end(); ++it) {
+			memcpy(pos, it->first, it->second);
+			pos += it->second;
+		}
+		m_strand.dispatch(boost::bind(& CAsioSocketImpl::DispatchWrite, this, nbytes), boost::asio::get_associated_allocator(boost::bind(& CAsioSocketImpl::DispatchWrite, this, nbytes)));
+		m_ErrorCode = 0;
+		return nbytes;
+	}
+
+
+	// Like Write, but after the head the region of the file is sent straight
+	// from the page cache, which the background send keeps open meanwhile
+	uint32 WriteFile(const void * head, uint32 headLength, const CSocketFileRegion& region)
+	{
+#ifdef ASIO_SENDFILE
+		wxASSERT(!m_sync && region.length > 0);
+		const uint32 nbytes = headLength + region.length;
+
+		if (m_sendBuffer) {
+			m_blocksWrite = true;
+			AddDebugLogLineF(logAsio, CFormat(wxT("WriteFile blocks %d %p %s")) % nbytes % m_sendBuffer % m_IP);
+			return 0;
+		}
+		AddDebugLogLineF(logAsio, CFormat(wxT("WriteFile %d %s")) % nbytes % m_IP);
+
+		network_perf::g_network_perf_monitor.record_sent(nbytes);
+
+		// Also marks the send as pending if there is no head
+		m_sendBuffer = new char[headLength + 1];
+		memcpy(m_sendBuffer, head, headLength);
+		m_sendFile = region;
+		m_strand.dispatch(boost::bind(& CAsioSocketImpl::DispatchWriteFile, this, headLength), boost::asio::get_associated_allocator(boost::bind(& CAsioSocketImpl::DispatchWriteFile, this, headLength)));
+		m_ErrorCode = 0;
+		return nbytes;
+#else
+		wxFAIL;
+		return 0;
+#endif
+	}
+
+
+	bool CanWriteFile() const
+	{
+#ifdef ASIO_SENDFILE
+		return !m_sync;
+#else
+		return false;
+#endif
+	}
+
+
+	bool GetRoundTripTime(uint32& rtt) const
+	{
+#ifdef ASIO_TCP_INFO
+		if (m_socket->is_open()) {
+			struct tcp_info info;
+			socklen_t length = sizeof(info);
+			if (getsockopt(m_socket->native_handle(), IPPROTO_TCP, TCP_INFO, &info, &length) == 0 && info.tcpi_rtt) {
+				rtt = info.tcpi_rtt;
+				return true;
+			}
+		}
+#endif
+		return false;
+	}
+
+
 	void Close()
 	{
 		if (!m_closed) {
@@ -445,6 +560,70 @@ private:
 			m_strand.wrap(boost::bind(& CAsioSocketImpl::HandleSend, this, placeholders::error, placeholders::bytes_transferred)));
 	}
 
+#ifdef ASIO_SENDFILE
+	void DispatchWriteFile(uint32 headLength)
+	{
+		if (headLength) {
+			async_write(*m_socket, buffer(m_sendBuffer, headLength),
+				m_strand.wrap(boost::bind(& CAsioSocketImpl::HandleSendFileHead, this, placeholders::error)));
+		} else {
+			SendFileRegion();
+		}
+	}
+
+	// Sends as much of m_sendFile as the socket takes, then waits until it
+	// takes more (on the strand, like the other handlers)
+	void SendFileRegion()
+	{
+		error_code ec;
+		m_socket->native_non_blocking(true, ec);
+
+		while (!ec && m_sendFile.length > 0) {
+			off_t offset = m_sendFile.offset;
+			ssize_t sent = sendfile(m_socket->native_handle(), m_sendFile.fd, &offset, m_sendFile.length);
+			if (sent > 0) {
+				m_sendFile.offset += sent;
+				m_sendFile.length -= sent;
+			} else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				m_socket->async_wait(socket_base::wait_write,
+					m_strand.wrap(boost::bind(& CAsioSocketImpl::HandleSendFileWritable, this, placeholders::error)));
+				return;
+			} else if (sent < 0 && errno == EINTR) {
+				continue;
+			} else {
+				// Nothing sent means the file is shorter than it should be
+				ec = error_code(sent < 0 ? errno : EIO, boost::system::system_category());
+			}
+		}
+
+		if (ec) {
+			AddDebugLogLineN(logAsio, CFormat(wxT("SendFileRegion Error %s %s")) % ec.message() % m_IP);
+		}
+		m_sendFile = CSocketFileRegion();
+		HandleSend(ec, 0);
+	}
+
+	void HandleSendFileHead(const error_code& err)
+	{
+		if (err) {
+			m_sendFile = CSocketFileRegion();
+			HandleSend(err, 0);
+		} else {
+			SendFileRegion();
+		}
+	}
+
+	void HandleSendFileWritable(const error_code& err)
+	{
+		if (err || m_isDestroying) {
+			m_sendFile = CSocketFileRegion();
+			HandleSend(err, 0);
+		} else {
+			SendFileRegion();
+		}
+	}
+#endif
+
 	//
 	// Completion handlers for async requests
 	//
@@ -629,6 +808,7 @@ private:
 	uint32			m_readBufferContent;
 	bool			m_eventPending;
 	char *			m_sendBuffer;
+	CSocketFileRegion	m_sendFile;		// sent after m_sendBuffer by WriteFile
 	io_context::strand	m_strand;		// handle synchronisation in io_context thread pool
 	deadline_timer	m_timer;
 	bool			m_connected;
@@ -717,6 +897,30 @@ uint32 CLibSocket::Write(const void * buffer, uint32 nbytes)
 }
 
 
+uint32 CLibSocket::WriteV(const CSocketIOVector& buffers)
+{
+	return m_aSocket->WriteV(buffers);
+}
+
+
+uint32 CLibSocket::WriteFile(const void * head, uint32 headLength, const CSocketFileRegion& region)
+{
+	return m_aSocket->WriteFile(head, headLength, region);
+}
+
+
+bool CLibSocket::CanWriteFile() const
+{
+	return m_aSocket->CanWriteFile();
+}
+
+
+bool CLibSocket::GetRoundTripTime(uint32& rtt) const
+{
+	return m_aSocket->GetRoundTripTime(rtt);
+}
+
+
 void CLibSocket::Close()
 {
 	m_aSocket->Close();
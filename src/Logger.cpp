@@ -78,7 +78,8 @@ CDebugCategory g_debugcats[] = {
 	CDebugCategory( logKadEntryTracking,	wxT("Kademlia Entry Tracking") ),
 	CDebugCategory( logEC,			wxT("External Connect") ),
 	CDebugCategory( logHTTP,		wxT("HTTP") ),
-	CDebugCategory( logAsio,		wxT("Asio Sockets") )
+	CDebugCategory( logAsio,		wxT("Asio Sockets") ),
+	CDebugCategory( logUploadQueue,	wxT("Upload Queue") )
 };
 
 
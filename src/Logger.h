@@ -113,7 +113,9 @@ enum DebugType
 	//! Warnings/Errors related to HTTP traffic
 	logHTTP,
 	//! Warnings/Errors related to Boost Asio networking
-	logAsio
+	logAsio,
+	//! Decisions about the upload slots.
+	logUploadQueue
 	// IMPORTANT NOTE: when you add values to this enum, update the g_debugcats
 	// array in Logger.cpp!
 };
@@ -273,5 +273,18 @@ private:
 };
 
 
+/**
+ * Hash function for using CMD4Hash as key of unordered containers.
+ *
+ * MD4 hashes are evenly distributed already, so part of one will do.
+ */
+struct CMD4HashHasher
+{
+	size_t operator()(const CMD4Hash& hash) const {
+		return (size_t)RawPeekUInt64(hash.GetHash());
+	}
+};
+
+
 #endif
 // File_checked_for_headers
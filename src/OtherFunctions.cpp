@@ -38,7 +38,6 @@
 #include <common/MD5Sum.h>
 #include <common/Path.h>
 #include "Logger.h"
-#include "BitVector.h"				// Needed for BitVector
 
 #include "OtherFunctions.h"			// Interface declarations
 
@@ -1184,10 +1183,6 @@ CMD4Hash GetPassword(bool allowEmptyPassword)
 }
 
 
-const uint8 BitVector::s_posMask[] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80};
-const uint8 BitVector::s_negMask[] = {0xFE, 0xFD, 0xFB, 0xF7, 0xEF, 0xDF, 0xBF, 0x7F};
-
-
 /**
  * Checks if a library is available at runtime
  * 
@@ -114,25 +114,6 @@ struct TransferredData {
 };
 
 
-//Kry import of 0.30d
-// Maella -Enhanced Chunk Selection- (based on jicxicmic)
-#if defined(_MSC_VER) || defined(__SUNPRO_CC)
-#pragma pack(1)
-#endif
-struct Chunk {
-	uint16 part;      // Index of the chunk
-		union {
-			uint16 frequency; // Availability of the chunk
-			uint16 rank;      // Download priority factor (highest = 0, lowest = 0xffff)
-	};
-}
-#if defined(_MSC_VER) || defined(__SUNPRO_CC)
-;
-#pragma pack()
-#else
-__attribute__((__packed__));
-#endif
-
 struct Category_Struct
 {
 	CPath		path;
@@ -46,19 +46,26 @@ CPacket::CPacket(CPacket &p)
 	m_bFromPF	= p.m_bFromPF;
 	memcpy(head, p.head, sizeof head);
 	tempbuffer	= NULL;
+	m_payload	= p.m_payload;
+	m_payloadOffset	= p.m_payloadOffset;
+	m_payloadLength	= p.m_payloadLength;
+	m_file		= p.m_file;
+	m_fileOffset	= p.m_fileOffset;
+	// A referenced payload or file is shared, only the rest of the data is copied
+	const uint32 bufferSize = size - m_payloadLength;
 	if (p.completebuffer) {
-		completebuffer	= new uint8_t[size + 10];;
+		completebuffer	= new uint8_t[bufferSize + 10];;
 		pBuffer	= completebuffer + sizeof(Header_Struct);
 	} else {
 		completebuffer	= NULL;
 		if (p.pBuffer) {
-			pBuffer = new uint8_t[size];
+			pBuffer = new uint8_t[bufferSize];
 		} else {
 			pBuffer = NULL;
 		}
 	}
 	if (pBuffer)
-		memcpy( pBuffer, p.pBuffer, size );
+		memcpy( pBuffer, p.pBuffer, bufferSize );
 }
 
 CPacket::CPacket(uint8 protocol)
@@ -74,6 +81,9 @@ CPacket::CPacket(uint8 protocol)
 	tempbuffer	= NULL;
 	completebuffer	= NULL;
 	pBuffer	= NULL;
+	m_payloadOffset	= 0;
+	m_payloadLength	= 0;
+	m_fileOffset	= 0;
 }
 
 // only used for receiving packets
@@ -91,6 +101,9 @@ CPacket::CPacket(uint8_t* rawHeader, uint8_t *buf)
 	tempbuffer	= NULL;
 	completebuffer	= NULL;
 	pBuffer	= buf;
+	m_payloadOffset	= 0;
+	m_payloadLength	= 0;
+	m_fileOffset	= 0;
 }
 
 CPacket::CPacket(const CMemFile& datafile, uint8 protocol, uint8 ucOpcode)
@@ -112,6 +125,63 @@ CPacket::CPacket(const CMemFile& datafile, uint8 protocol, uint8 ucOpcode)
 	datafile.Seek(0, wxFromStart);
 	datafile.Read(pBuffer, size);
 	datafile.Seek(position, wxFromStart);
+	m_payloadOffset	= 0;
+	m_payloadLength	= 0;
+	m_fileOffset	= 0;
+}
+
+CPacket::CPacket(const CMemFile& datafile, const CSharedPacketData& payload, uint32 offset, uint32 length, uint8 protocol, uint8 ucOpcode)
+{
+	wxASSERT(payload && offset + length <= payload->size());
+
+	const uint32 datafileSize = datafile.GetLength();
+	size		= datafileSize + length;
+	opcode		= ucOpcode;
+	prot		= protocol;
+	m_bSplitted	= false;
+	m_bLastSplitted = false;
+	m_bPacked	= false;
+	m_bFromPF	= false;
+	memset(head, 0, sizeof head);
+	tempbuffer = NULL;
+	completebuffer = new uint8_t[datafileSize + sizeof(Header_Struct)];
+	pBuffer = completebuffer + sizeof(Header_Struct);
+	m_payload	= payload;
+	m_payloadOffset	= offset;
+	m_payloadLength	= length;
+	m_fileOffset	= 0;
+
+	off_t position = datafile.GetPosition();
+	datafile.Seek(0, wxFromStart);
+	datafile.Read(pBuffer, datafileSize);
+	datafile.Seek(position, wxFromStart);
+}
+
+CPacket::CPacket(const CMemFile& datafile, const CSharedPacketFile& file, uint64 offset, uint32 length, uint8 protocol, uint8 ucOpcode)
+{
+	wxASSERT(file);
+
+	const uint32 datafileSize = datafile.GetLength();
+	size		= datafileSize + length;
+	opcode		= ucOpcode;
+	prot		= protocol;
+	m_bSplitted	= false;
+	m_bLastSplitted = false;
+	m_bPacked	= false;
+	m_bFromPF	= false;
+	memset(head, 0, sizeof head);
+	tempbuffer = NULL;
+	completebuffer = new uint8_t[datafileSize + sizeof(Header_Struct)];
+	pBuffer = completebuffer + sizeof(Header_Struct);
+	m_payloadOffset	= 0;
+	m_payloadLength	= length;
+	m_file		= file;
+	m_fileOffset	= offset;
+
+	off_t position = datafile.GetPosition();
+	datafile.Seek(0, wxFromStart);
+	datafile.Read(pBuffer, datafileSize);
+	datafile.Seek(position, wxFromStart);
 }
 
 CPacket::CPacket(int8 in_opcode, uint32 in_size, uint8 protocol, bool bFromPF)
@@ -133,6 +203,9 @@ CPacket::CPacket(int8 in_opcode, uint32 in_size, uint8 protocol, bool bFromPF)
 		completebuffer = NULL;
 		pBuffer = NULL;
 	}
+	m_payloadOffset	= 0;
+	m_payloadLength	= 0;
+	m_fileOffset	= 0;
 }
 
 // only used for splitted packets!
@@ -149,6 +222,9 @@ CPacket::CPacket(uint8_t* pPacketPart, uint32 nSize, bool bLast, bool bFromPF)
 	tempbuffer	= NULL;
 	completebuffer	= pPacketPart;
 	pBuffer		= NULL;
+	m_payloadOffset	= 0;
+	m_payloadLength	= 0;
+	m_fileOffset	= 0;
 }
 
 CPacket::~CPacket()
@@ -182,6 +258,7 @@ void CPacket::CopyToDataBuffer(unsigned int offset, const uint8_t* data, unsigne
 }
 
 uint8_t* CPacket::GetPacket() {
+	MergePayload();
 	if (completebuffer) {
 		if (!m_bSplitted) {
 			memcpy(completebuffer, GetHeader(), sizeof(Header_Struct));
@@ -200,6 +277,7 @@ uint8_t* CPacket::GetPacket() {
 }
 
 uint8_t* CPacket::DetachPacket() {
+	MergePayload();
 	if (completebuffer) {
 		if (!m_bSplitted) {
 			memcpy(completebuffer, GetHeader(), sizeof(Header_Struct));
@@ -221,6 +299,79 @@ uint8_t* CPacket::DetachPacket() {
 	}
 }
 
+uint8_t* CPacket::DetachPacketHead(uint32& headSize, CSharedPacketData& payload, uint32& offset)
+{
+	if (!m_payload) {
+		headSize = GetRealPacketSize();
+		payload.reset();
+		offset = 0;
+		return DetachPacket();
+	}
+
+	wxASSERT(completebuffer && !m_bSplitted);
+	memcpy(completebuffer, GetHeader(), sizeof(Header_Struct));
+	headSize = GetRealPacketSize() - m_payloadLength;
+	payload = m_payload;
+	offset = m_payloadOffset;
+
+	uint8_t* result = completebuffer;
+	completebuffer = pBuffer = NULL;
+	m_payload.reset();
+	m_payloadLength = 0;
+	return result;
+}
+
+uint8_t* CPacket::DetachPacketHead(uint32& headSize, CSharedPacketFile& file, uint64& offset)
+{
+	if (!m_file) {
+		headSize = GetRealPacketSize();
+		file.reset();
+		offset = 0;
+		return DetachPacket();
+	}
+
+	wxASSERT(completebuffer && !m_bSplitted);
+	memcpy(completebuffer, GetHeader(), sizeof(Header_Struct));
+	headSize = GetRealPacketSize() - m_payloadLength;
+	file = m_file;
+	offset = m_fileOffset;
+
+	uint8_t* result = completebuffer;
+	completebuffer = pBuffer = NULL;
+	m_file.reset();
+	m_payloadLength = 0;
+	return result;
+}
+
+void CPacket::MergePayload()
+{
+	if (!m_payload && !m_file) {
+		return;
+	}
+
+	// The data of a packet referencing a payload is always in completebuffer
+	const uint32 bufferSize = size - m_payloadLength;
+	uint8_t* buffer = new uint8_t[size + sizeof(Header_Struct)];
+	memcpy(buffer + sizeof(Header_Struct), pBuffer, bufferSize);
+	if (m_file) {
+		try {
+			m_file->ReadAt(buffer + sizeof(Header_Struct) + bufferSize, m_fileOffset, m_payloadLength);
+		} catch (...) {
+			delete [] buffer;
+			throw;
+		}
+	} else {
+		memcpy(buffer + sizeof(Header_Struct) + bufferSize, &(*m_payload)[m_payloadOffset], m_payloadLength);
+	}
+
+	delete [] completebuffer;
+	completebuffer = buffer;
+	pBuffer = completebuffer + sizeof(Header_Struct);
+	m_payload.reset();
+	m_file.reset();
+	m_payloadLength = 0;
+}
+
 uint8_t* CPacket::GetHeader() {
 	wxASSERT( !m_bSplitted );
 
@@ -247,6 +398,7 @@ uint8_t* CPacket::GetUDPHeader() {
 void CPacket::PackPacket()
 {
 	wxASSERT(!m_bSplitted);
+	MergePayload();
 
 	uLongf newsize = size + 300;
 	uint8_t* output = new uint8_t[newsize];
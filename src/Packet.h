@@ -29,9 +29,33 @@
 
 #include "Types.h"		// Needed for int8, int32, uint8 and uint32
 
+#include <memory>		// Needed for std::shared_ptr
+#include <vector>
+
 class CMemFile;
 class wxString;
 
+//! Data referenced by several packets, e.g. a block read for uploading.
+typedef std::shared_ptr<const std::vector<uint8_t> > CSharedPacketData;
+
+/**
+ * A file packets may reference instead of holding its data, so that the
+ * data can be sent straight from the file (see CEMSocket).
+ */
+class CPacketFile
+{
+public:
+	virtual ~CPacketFile() {}
+
+	/** Returns the descriptor of the file, valid as long as the object exists. */
+	virtual int GetFD() const = 0;
+
+	/** Reads data of the file, for when it has to be copied after all. */
+	virtual void ReadAt(void* buffer, uint64 offset, uint32 count) const = 0;
+};
+
+typedef std::shared_ptr<const CPacketFile> CSharedPacketFile;
+
 //			CLIENT TO SERVER
 
 //			PACKET CLASS
@@ -43,6 +67,19 @@ public:
 	CPacket(uint8 protocol);
 	CPacket(uint8_t* header, uint8_t *buf); // only used for receiving packets
 	CPacket(const CMemFile& datafile, uint8 protocol, uint8 ucOpcode);
+	/**
+	 * Creates a packet whose data is the contents of 'datafile' followed by
+	 * 'length' bytes of 'payload', starting at 'offset'.
+	 *
+	 * The payload is referenced rather than copied, so that the packets
+	 * sending a block don't need copies of it (see DetachPacketHead).
+	 */
+	CPacket(const CMemFile& datafile, const CSharedPacketData& payload, uint32 offset, uint32 length, uint8 protocol, uint8 ucOpcode);
+	/**
+	 * Like the above, but the payload is 'length' bytes of 'file', starting
+	 * at 'offset', which are only read if the packet has to be merged.
+	 */
+	CPacket(const CMemFile& datafile, const CSharedPacketFile& file, uint64 offset, uint32 length, uint8 protocol, uint8 ucOpcode);
 	CPacket(int8 in_opcode, uint32 in_size, uint8 protocol, bool bFromPF = true);
 	CPacket(uint8_t* pPacketPart, uint32 nSize, bool bLast, bool bFromPF = true); // only used for splitted packets!
 
@@ -52,6 +89,24 @@ public:
 	uint8_t*		GetUDPHeader();
 	uint8_t*		GetPacket();
 	uint8_t*		DetachPacket();
+	/**
+	 * Like DetachPacket, but leaves out a referenced payload.
+	 *
+	 * @param headSize Set to the size of the returned buffer.
+	 * @param payload Set to the payload, if any.
+	 * @param offset Set to the start of the packet data within the payload.
+	 * @return The header and the data preceding the payload, the rest of
+	 *         the GetRealPacketSize() bytes being in the payload.
+	 */
+	uint8_t*		DetachPacketHead(uint32& headSize, CSharedPacketData& payload, uint32& offset);
+	/**
+	 * Like the above, for packets referencing a file.
+	 *
+	 * @param offset Set to the position of the payload within the file.
+	 */
+	uint8_t*		DetachPacketHead(uint32& headSize, CSharedPacketFile& file, uint64& offset);
+	bool			HasSharedPayload() const	{ return (bool)m_payload; }
+	bool			HasFilePayload() const		{ return (bool)m_file; }
 	uint32			GetRealPacketSize() const	{ return size + 6; }
 	static uint32		GetPacketSizeFromHeader(const uint8_t* rawHeader);
 	bool			IsSplitted()		{ return m_bSplitted; }
@@ -75,6 +130,9 @@ private:
 	//! CPacket is not assignable.
 	CPacket& operator=(const CPacket&);
 
+	//! Copies a referenced payload into the packet buffer.
+	void			MergePayload();
+
 	uint32		size;
 	uint8		opcode;
 	uint8		prot;
@@ -86,6 +144,13 @@ private:
 	uint8_t*	tempbuffer;
 	uint8_t*	completebuffer;
 	uint8_t*	pBuffer;
+	//! Referenced data following the contents of pBuffer, if any.
+	CSharedPacketData	m_payload;
+	uint32		m_payloadOffset;
+	uint32		m_payloadLength;
+	//! Referenced file following the contents of pBuffer, if any (see m_payloadLength).
+	CSharedPacketFile	m_file;
+	uint64		m_fileOffset;
 };
 
 #endif // PACKET_H
@@ -0,0 +1,121 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+
+
+#include "PartAvailability.h"	// Interface declarations
+
+#include "BitVector.h"		// Needed for BitVector
+
+
+CPartAvailability::CPartAvailability()
+	: m_histogram(1, 0),
+	  m_partCount(0),
+	  m_minFrequency(0)
+{
+}
+
+
+void CPartAvailability::Update(ArrayOfUInts16& frequencies, const BitVector& status, bool increment)
+{
+	if (status.size() != frequencies.size()) {
+		return;
+	}
+	if (m_partCount != frequencies.size()) {
+		Recount(frequencies);
+	}
+
+	if (increment) {
+		status.ForEachSet([&](uint32 part) {
+			if (frequencies[part] != 0xffff) {
+				Increment(frequencies[part]++);
+			}
+		});
+	} else {
+		status.ForEachSet([&](uint32 part) {
+			if (frequencies[part] != 0) {
+				Decrement(frequencies[part]--);
+			}
+		});
+	}
+}
+
+
+void CPartAvailability::Recount(const ArrayOfUInts16& frequencies)
+{
+	m_partCount = frequencies.size();
+	m_histogram.assign(1, 0);
+	m_minFrequency = frequencies.empty() ? 0 : 0xffff;
+
+	for (ArrayOfUInts16::const_iterator it = frequencies.begin(); it != frequencies.end(); ++it) {
+		if (*it >= m_histogram.size()) {
+			m_histogram.resize(*it + 1, 0);
+		}
+		++m_histogram[*it];
+		if (*it < m_minFrequency) {
+			m_minFrequency = *it;
+		}
+	}
+}
+
+
+void CPartAvailability::AddStatus(ArrayOfUInts16& frequencies, const BitVector& status)
+{
+	if (status.size() != frequencies.size()) {
+		return;
+	}
+
+	status.ForEachSet([&](uint32 part) {
+		if (frequencies[part] != 0xffff) {
+			++frequencies[part];
+		}
+	});
+}
+
+
+void CPartAvailability::Increment(uint16 frequency)
+{
+	if (frequency + 1u >= m_histogram.size()) {
+		m_histogram.resize(frequency + 2, 0);
+	}
+	--m_histogram[frequency];
+	++m_histogram[frequency + 1];
+
+	// The parts at the lowest frequency all moved one up
+	if (frequency == m_minFrequency && m_histogram[frequency] == 0) {
+		++m_minFrequency;
+	}
+}
+
+
+void CPartAvailability::Decrement(uint16 frequency)
+{
+	--m_histogram[frequency];
+	++m_histogram[frequency - 1];
+
+	if (frequency - 1 < m_minFrequency) {
+		m_minFrequency = frequency - 1;
+	}
+}
+// File_checked_for_headers
@@ -0,0 +1,81 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+
+
+#ifndef PARTAVAILABILITY_H
+#define PARTAVAILABILITY_H
+
+#include "Types.h"		// Needed for ArrayOfUInts16
+
+class BitVector;
+
+
+/**
+ * Keeps count of how the parts of a file are spread over its sources.
+ *
+ * The frequency of each part (the number of sources having it) is kept in
+ * a list owned by the file, which is updated here from the part status of
+ * each source that comes, goes or changes. Along with it, the number of
+ * parts per frequency is kept, so the number of available parts and the
+ * number of complete sources are known at any time without going over
+ * all parts or sources.
+ */
+class CPartAvailability
+{
+public:
+	CPartAvailability();
+
+	/**
+	 * Adds the parts a source has to the frequencies, or removes them.
+	 *
+	 * A status of another size than the frequency list is ignored.
+	 */
+	void Update(ArrayOfUInts16& frequencies, const BitVector& status, bool increment);
+
+	/** Counts the parts again, after the frequency list was set otherwise. */
+	void Recount(const ArrayOfUInts16& frequencies);
+
+	/** Returns the number of parts at least one source has. */
+	uint16 GetAvailableParts() const	{ return m_partCount - m_histogram[0]; }
+
+	/** Returns the lowest frequency of any part, 0 if there are no parts. */
+	uint16 GetMinFrequency() const		{ return m_minFrequency; }
+
+	/** Adds the parts of a status to the frequencies, for a full count. */
+	static void AddStatus(ArrayOfUInts16& frequencies, const BitVector& status);
+
+private:
+	void Increment(uint16 frequency);
+	void Decrement(uint16 frequency);
+
+	//! The number of parts per frequency.
+	std::vector<uint32>	m_histogram;
+	//! The number of parts the counts are for.
+	uint32	m_partCount;
+	uint16	m_minFrequency;
+};
+
+#endif // PARTAVAILABILITY_H
+// File_checked_for_headers
@@ -67,11 +67,16 @@
 #include <common/Format.h>	// Needed for CFormat
 #include <common/FileFunctions.h>	// Needed for GetLastModificationTime
 #include "ThreadTasks.h"	// Needed for CHashingTask/CCompletionTask/CAllocateFileTask
+#include "PartFileWriteThread.h"	// Needed for CPartFileWriteThread
 #include "GuiEvents.h"		// Needed for Notify_*
 #include "DataToText.h"		// Needed for OriginToText()
 #include "PlatformSpecific.h"	// Needed for CreateSparseFile()
 #include "FileArea.h"		// Needed for CFileArea
-#include "ScopedPtr.h"		// Needed for CScopedArray
+#include "FileIOBatch.h"		// Needed for CFileIOBatch
+#include "DownloadBufferPool.h"	// Needed for CDownloadBufferPool
+#include "UploadBlockCache.h"	// Needed for CUploadBlockCache
+#include "ScopedPtr.h"		// Needed for CScopedArray and CScopedPtr
+#include "PartFileJournal.h"	// Needed for CPartFileJournal
 #include "CorruptionBlackBox.h"
 
 #include "kademlia/kademlia/Kademlia.h"
@@ -115,28 +120,13 @@ SFileRating::~SFileRating()
 }
 
 
-class PartFileBufferedData
-{
-public:
-	CFileArea area;				// File area to be written
-	uint64 start;					// This is the start offset of the data
-	uint64 end;						// This is the end offset of the data
-	Requested_Block_Struct *block;	// This is the requested block that this data relates to
-
-	PartFileBufferedData(CFileAutoClose& file, uint8_t * data, uint64 _start, uint64 _end, Requested_Block_Struct *_block)
-		: start(_start), end(_end), block(_block)
-	{
-		area.StartWriteAt(file, start, end-start+1);
-		memcpy(area.GetBuffer(), data, end-start+1);
-	}
-};
-
-
-typedef std::list<Chunk> ChunkList;
-
-
 #ifndef CLIENT_GUI
 
+//! The journal of a .part.met is compacted once it is larger than this and the .part.met.
+static const uint64 PARTMET_JOURNAL_COMPACTION_SIZE = 64 * 1024;
+//! Set in journal records that contain the hashset.
+static const uint8 PARTMET_JOURNAL_HASHSET = 0x01;
+
 CPartFile::CPartFile()
 {
 	Init();
@@ -262,7 +252,8 @@ CPartFile::~CPartFile()
 		SavePartFile();
 	}
 
-	DeleteContents(m_BufferedData_list);
+	WaitForFlush(false);
+	m_BufferedData->Clear();
 	// unique_ptr automatically deletes m_CorruptionBlackBox
 
 	wxASSERT(m_SrcList.empty());
@@ -350,6 +341,8 @@ uint8 CPartFile::LoadPartFile(const CPath& in_directory, const CPath& filename,
 			return false;
 		}
 
+		m_partMetLength = metFile.GetLength();
+
 		version = metFile.ReadUInt8();
 		if (version != PARTFILE_VERSION && version != PARTFILE_SPLITTEDVERSION && version != PARTFILE_VERSION_LARGEFILE){
 			metFile.Close();
@@ -399,172 +392,7 @@ uint8 CPartFile::LoadPartFile(const CPath& in_directory, const CPath& filename,
 				(getsizeonly &&
 					(newtag.GetNameID() == FT_FILESIZE ||
 					 newtag.GetNameID() == FT_FILENAME))) {
-				switch(newtag.GetNameID()) {
-					case FT_FILENAME: {
-						if (!GetFileName().IsOk()) {
-							// If it's not empty, we already loaded the unicoded one
-							SetFileName(CPath(newtag.GetStr()));
-						}
-						break;
-					}
-					case FT_LASTSEENCOMPLETE: {
-						lastseencomplete = newtag.GetInt();
-						break;
-					}
-					case FT_FILESIZE: {
-						SetFileSize(newtag.GetInt());
-						break;
-					}
-					case FT_TRANSFERRED: {
-						transferred = newtag.GetInt();
-						break;
-					}
-					case FT_FILETYPE:{
-						//#warning needs setfiletype string
-						//SetFileType(newtag.GetStr());
-						break;
-					}
-					case FT_CATEGORY: {
-						m_category = newtag.GetInt();
-						if (m_category > theApp->glob_prefs->GetCatCount() - 1 ) {
-							m_category = 0;
-						}
-						break;
-					}
-					case FT_OLDDLPRIORITY:
-					case FT_DLPRIORITY: {
-						if (!isnewstyle){
-							m_iDownPriority = newtag.GetInt();
-							if( m_iDownPriority == PR_AUTO ){
-								m_iDownPriority = PR_HIGH;
-								SetAutoDownPriority(true);
-							}
-							else{
-								if (	m_iDownPriority != PR_LOW &&
-									m_iDownPriority != PR_NORMAL &&
-									m_iDownPriority != PR_HIGH)
-									m_iDownPriority = PR_NORMAL;
-								SetAutoDownPriority(false);
-							}
-						}
-						break;
-					}
-					case FT_STATUS: {
-						m_paused = (newtag.GetInt() == 1);
-						m_stopped = m_paused;
-						break;
-					}
-					case FT_OLDULPRIORITY:
-					case FT_ULPRIORITY: {
-						if (!isnewstyle){
-							SetUpPriority(newtag.GetInt(), false);
-							if( GetUpPriority() == PR_AUTO ){
-								SetUpPriority(PR_HIGH, false);
-								SetAutoUpPriority(true);
-							} else {
-								SetAutoUpPriority(false);
-							}
-						}
-						break;
-					}
-					case FT_KADLASTPUBLISHSRC:{
-						SetLastPublishTimeKadSrc(newtag.GetInt(), 0);
-						if(GetLastPublishTimeKadSrc() > (uint32)time(NULL)+KADEMLIAREPUBLISHTIMES) {
-							//There may be a possibility of an older client that saved a random number here.. This will check for that..
-							SetLastPublishTimeKadSrc(0,0);
-						}
-						break;
-					}
-					case FT_KADLASTPUBLISHNOTES:{
-						SetLastPublishTimeKadNotes(newtag.GetInt());
-						break;
-					}
-					// old tags: as long as they are not needed, take the chance to purge them
-					case FT_PERMISSIONS:
-					case FT_KADLASTPUBLISHKEY:
-					case FT_PARTFILENAME:
-						break;
-					case FT_DL_ACTIVE_TIME:
-						if (newtag.IsInt()) {
-							m_nDlActiveTime = newtag.GetInt();
-						}
-						break;
-					case FT_CORRUPTEDPARTS: {
-						wxASSERT(m_corrupted_list.empty());
-						wxString strCorruptedParts(newtag.GetStr());
-						wxStringTokenizer tokenizer(strCorruptedParts, wxT(","));
-						while ( tokenizer.HasMoreTokens() ) {
-							wxString token = tokenizer.GetNextToken();
-							unsigned long uPart;
-							if (token.ToULong(&uPart)) {
-								if (uPart < GetPartCount() && !IsCorruptedPart(uPart)) {
-									m_corrupted_list.push_back(uPart);
-								}
-							}
-						}
-						break;
-					}
-					case FT_AICH_HASH:{
-						CAICHHash hash;
-						bool hashSizeOk =
-							hash.DecodeBase32(newtag.GetStr()) == CAICHHash::GetHashSize();
-						wxASSERT(hashSizeOk);
-						if (hashSizeOk) {
-							m_pAICHHashSet->SetMasterHash(hash, AICH_VERIFIED);
-						}
-						break;
-					}
-					case FT_ATTRANSFERRED:{
-						statistic.SetAllTimeTransferred(statistic.GetAllTimeTransferred() + (uint64)newtag.GetInt());
-						break;
-					}
-					case FT_ATTRANSFERREDHI:{
-						statistic.SetAllTimeTransferred(statistic.GetAllTimeTransferred() + (((uint64)newtag.GetInt()) << 32));
-						break;
-					}
-					case FT_ATREQUESTED:{
-						statistic.SetAllTimeRequests(newtag.GetInt());
-						break;
-					}
-					case FT_ATACCEPTED:{
-						statistic.SetAllTimeAccepts(newtag.GetInt());
-						break;
-					}
-					default: {
-						// Start Changes by Slugfiller for better exception handling
-
-						wxCharBuffer tag_ansi_name = newtag.GetName().ToAscii();
-						char gap_mark = tag_ansi_name.data() ? tag_ansi_name[0u] : 0;
-						if ( newtag.IsInt() && (newtag.GetName().Length() > 1) &&
-							((gap_mark == FT_GAPSTART) ||
-							 (gap_mark == FT_GAPEND))) {
-							Gap_Struct *gap = NULL;
-							unsigned long int gapkey;
-							if (newtag.GetName().Mid(1).ToULong(&gapkey)) {
-								if ( gap_map.find( gapkey ) == gap_map.end() ) {
-									gap = new Gap_Struct;
-									gap_map[gapkey] = gap;
-									gap->start = (uint64)-1;
-									gap->end = (uint64)-1;
-								} else {
-									gap = gap_map[ gapkey ];
-								}
-								if (gap_mark == FT_GAPSTART) {
-									gap->start = newtag.GetInt();
-								}
-								if (gap_mark == FT_GAPEND) {
-									gap->end = newtag.GetInt()-1;
-								}
-							} else {
-								AddDebugLogLineN(logPartFile, wxT("Wrong gap map key while reading met file!"));
-								wxFAIL;
-							}
-							// End Changes by Slugfiller for better exception handling
-						} else {
-							m_taglist.push_back(newtag);
-						}
-					}
-				}
+				LoadPartMetTag(newtag, isnewstyle, gap_map);
 			} else {
 				// Nothing. Else, nothing.
 			}
@@ -658,6 +486,11 @@ uint8 CPartFile::LoadPartFile(const CPath& in_directory, const CPath& filename,
 		m_fullname = m_fullname.RemoveExt();
 	}
 
+	// Apply the changes saved since the .part.met was last written.
+	LoadJournal();
+	GetGaps(m_journaledGaps);
+	m_journaledHashes = m_hashlist;
+
 	// open permanent handle
 	if ( !m_hpartfile.Open(m_PartPath, CFile::read_write)) {
 		AddLogLineN(CFormat( _("Failed to open %s (%s)") )
@@ -733,6 +566,177 @@ uint8 CPartFile::LoadPartFile(const CPath& in_directory, const CPath& filename,
 }
 
 
+void CPartFile::LoadPartMetTag(const CTag& newtag, bool isnewstyle, std::map<uint16, Gap_Struct*>& gap_map)
+{
+	switch(newtag.GetNameID()) {
+		case FT_FILENAME: {
+			if (!GetFileName().IsOk()) {
+				// If it's not empty, we already loaded the unicoded one
+				SetFileName(CPath(newtag.GetStr()));
+			}
+			break;
+		}
+		case FT_LASTSEENCOMPLETE: {
+			lastseencomplete = newtag.GetInt();
+			break;
+		}
+		case FT_FILESIZE: {
+			SetFileSize(newtag.GetInt());
+			break;
+		}
+		case FT_TRANSFERRED: {
+			transferred = newtag.GetInt();
+			break;
+		}
+		case FT_FILETYPE:{
+			//#warning needs setfiletype string
+			//SetFileType(newtag.GetStr());
+			break;
+		}
+		case FT_CATEGORY: {
+			m_category = newtag.GetInt();
+			if (m_category > theApp->glob_prefs->GetCatCount() - 1 ) {
+				m_category = 0;
+			}
+			break;
+		}
+		case FT_OLDDLPRIORITY:
+		case FT_DLPRIORITY: {
+			if (!isnewstyle){
+				m_iDownPriority = newtag.GetInt();
+				if( m_iDownPriority == PR_AUTO ){
+					m_iDownPriority = PR_HIGH;
+					SetAutoDownPriority(true);
+				}
+				else{
+					if (	m_iDownPriority != PR_LOW &&
+						m_iDownPriority != PR_NORMAL &&
+						m_iDownPriority != PR_HIGH)
+						m_iDownPriority = PR_NORMAL;
+					SetAutoDownPriority(false);
+				}
+			}
+			break;
+		}
+		case FT_STATUS: {
+			m_paused = (newtag.GetInt() == 1);
+			m_stopped = m_paused;
+			break;
+		}
+		case FT_OLDULPRIORITY:
+		case FT_ULPRIORITY: {
+			if (!isnewstyle){
+				SetUpPriority(newtag.GetInt(), false);
+				if( GetUpPriority() == PR_AUTO ){
+					SetUpPriority(PR_HIGH, false);
+					SetAutoUpPriority(true);
+				} else {
+					SetAutoUpPriority(false);
+				}
+			}
+			break;
+		}
+		case FT_KADLASTPUBLISHSRC:{
+			SetLastPublishTimeKadSrc(newtag.GetInt(), 0);
+			if(GetLastPublishTimeKadSrc() > (uint32)time(NULL)+KADEMLIAREPUBLISHTIMES) {
+				//There may be a possibility of an older client that saved a random number here.. This will check for that..
+				SetLastPublishTimeKadSrc(0,0);
+			}
+			break;
+		}
+		case FT_KADLASTPUBLISHNOTES:{
+			SetLastPublishTimeKadNotes(newtag.GetInt());
+			break;
+		}
+		// old tags: as long as they are not needed, take the chance to purge them
+		case FT_PERMISSIONS:
+		case FT_KADLASTPUBLISHKEY:
+		case FT_PARTFILENAME:
+			break;
+		case FT_DL_ACTIVE_TIME:
+			if (newtag.IsInt()) {
+				m_nDlActiveTime = newtag.GetInt();
+			}
+			break;
+		case FT_CORRUPTEDPARTS: {
+			wxASSERT(m_corrupted_list.empty());
+			wxString strCorruptedParts(newtag.GetStr());
+			wxStringTokenizer tokenizer(strCorruptedParts, wxT(","));
+			while ( tokenizer.HasMoreTokens() ) {
+				wxString token = tokenizer.GetNextToken();
+				unsigned long uPart;
+				if (token.ToULong(&uPart)) {
+					if (uPart < GetPartCount() && !IsCorruptedPart(uPart)) {
+						m_corrupted_list.push_back(uPart);
+					}
+				}
+			}
+			break;
+		}
+		case FT_AICH_HASH:{
+			CAICHHash hash;
+			bool hashSizeOk =
+				hash.DecodeBase32(newtag.GetStr()) == CAICHHash::GetHashSize();
+			wxASSERT(hashSizeOk);
+			if (hashSizeOk) {
+				m_pAICHHashSet->SetMasterHash(hash, AICH_VERIFIED);
+			}
+			break;
+		}
+		case FT_ATTRANSFERRED:{
+			statistic.SetAllTimeTransferred(statistic.GetAllTimeTransferred() + (uint64)newtag.GetInt());
+			break;
+		}
+		case FT_ATTRANSFERREDHI:{
+			statistic.SetAllTimeTransferred(statistic.GetAllTimeTransferred() + (((uint64)newtag.GetInt()) << 32));
+			break;
+		}
+		case FT_ATREQUESTED:{
+			statistic.SetAllTimeRequests(newtag.GetInt());
+			break;
+		}
+		case FT_ATACCEPTED:{
+			statistic.SetAllTimeAccepts(newtag.GetInt());
+			break;
+		}
+		default: {
+			// Start Changes by Slugfiller for better exception handling
+
+			wxCharBuffer tag_ansi_name = newtag.GetName().ToAscii();
+			char gap_mark = tag_ansi_name.data() ? tag_ansi_name[0u] : 0;
+			if ( newtag.IsInt() && (newtag.GetName().Length() > 1) &&
+				((gap_mark == FT_GAPSTART) ||
+				 (gap_mark == FT_GAPEND))) {
+				Gap_Struct *gap = NULL;
+				unsigned long int gapkey;
+				if (newtag.GetName().Mid(1).ToULong(&gapkey)) {
+					if ( gap_map.find( gapkey ) == gap_map.end() ) {
+						gap = new Gap_Struct;
+						gap_map[gapkey] = gap;
+						gap->start = (uint64)-1;
+						gap->end = (uint64)-1;
+					} else {
+						gap = gap_map[ gapkey ];
+					}
+					if (gap_mark == FT_GAPSTART) {
+						gap->start = newtag.GetInt();
+					}
+					if (gap_mark == FT_GAPEND) {
+						gap->end = newtag.GetInt()-1;
+					}
+				} else {
+					AddDebugLogLineN(logPartFile, wxT("Wrong gap map key while reading met file!"));
+					wxFAIL;
+				}
+				// End Changes by Slugfiller for better exception handling
+			} else {
+				m_taglist.push_back(newtag);
+			}
+		}
+	}
+}
+
+
 bool CPartFile::SavePartFile(bool Initial)
 {
 	switch (status) {
@@ -748,149 +752,31 @@ bool CPartFile::SavePartFile(bool Initial)
 		return false;
 	}
 
-	CFile file;
 	try {
 		if (!m_PartPath.FileExists()) {
 			throw wxString(wxT(".part file not found"));
 		}
 
-		uint32 lsc = lastseencomplete;
-
 		if (!Initial) {
-			CPath::BackupFile(m_fullname, wxT(".backup"));
-			CPath::RemoveFile(m_fullname);
-		}
-
-		file.Open(m_fullname, CFile::write);
-		if (!file.IsOpened()) {
-			throw wxString(wxT("Failed to open part.met file"));
-		}
-
-		// version
-		file.WriteUInt8(IsLargeFile() ? PARTFILE_VERSION_LARGEFILE : PARTFILE_VERSION);
-
-		file.WriteUInt32(CPath::GetModificationTime(m_PartPath));
-		// hash
-		file.WriteHash(m_abyFileHash);
-		uint16 parts = m_hashlist.size();
-		file.WriteUInt16(parts);
-		for (int x = 0; x < parts; ++x) {
-			file.WriteHash(m_hashlist[x]);
-		}
-		// tags
-		#define FIXED_TAGS 15
-		uint32 tagcount = m_taglist.size() + FIXED_TAGS + (m_gaplist.size()*2);
-		if (!m_corrupted_list.empty()) {
-			++tagcount;
-		}
-
-		if (m_pAICHHashSet->HasValidMasterHash() && (m_pAICHHashSet->GetStatus() == AICH_VERIFIED)){
-			++tagcount;
-		}
+			// Only the changes since the last save are written, the
+			// .part.met is rewritten once the journal has grown enough.
+			AppendToJournal();
 
-		if (GetLastPublishTimeKadSrc()){
-			++tagcount;
-		}
-
-		if (GetLastPublishTimeKadNotes()){
-			++tagcount;
-		}
-
-		if (GetDlActiveTime()){
-			++tagcount;
-		}
-
-		file.WriteUInt32(tagcount);
-
-		//#warning Kry - Where are lost by corruption and gained by compression?
-
-		// 0 (unicoded part file name)
-		// We write it with BOM to keep eMule compatibility. Note that the 'printable' filename is saved,
-		// as presently the filename does not represent an actual file.
-		CTagString(	FT_FILENAME,	GetFileName().GetPrintable()).WriteTagToFile( &file, utf8strOptBOM );
-		CTagString(	FT_FILENAME,	GetFileName().GetPrintable()).WriteTagToFile( &file );                         // 1
-
-		CTagIntSized(	FT_FILESIZE,	GetFileSize(), IsLargeFile() ? 64 : 32).WriteTagToFile( &file );// 2
-		CTagIntSized(	FT_TRANSFERRED,	transferred, IsLargeFile() ? 64 : 32).WriteTagToFile( &file );   // 3
-		CTagInt32(	FT_STATUS,	(m_paused?1:0)).WriteTagToFile( &file );                        // 4
-
-		if ( IsAutoDownPriority() ) {
-			CTagInt32( FT_DLPRIORITY,	(uint8)PR_AUTO	).WriteTagToFile( &file );	// 5
-			CTagInt32( FT_OLDDLPRIORITY,	(uint8)PR_AUTO	).WriteTagToFile( &file );	// 6
-		} else {
-			CTagInt32( FT_DLPRIORITY,	m_iDownPriority	).WriteTagToFile( &file );	// 5
-			CTagInt32( FT_OLDDLPRIORITY,	m_iDownPriority	).WriteTagToFile( &file );	// 6
-		}
-
-		CTagInt32( FT_LASTSEENCOMPLETE,	lsc			).WriteTagToFile( &file );	// 7
-
-		if ( IsAutoUpPriority() ) {
-			CTagInt32( FT_ULPRIORITY,	(uint8)PR_AUTO	).WriteTagToFile( &file );	// 8
-			CTagInt32( FT_OLDULPRIORITY,	(uint8)PR_AUTO	).WriteTagToFile( &file );	// 9
-		} else {
-			CTagInt32( FT_ULPRIORITY,	GetUpPriority() ).WriteTagToFile( &file );	// 8
-			CTagInt32( FT_OLDULPRIORITY,	GetUpPriority() ).WriteTagToFile( &file );	// 9
-		}
-
-		CTagInt32(FT_CATEGORY,       m_category).WriteTagToFile( &file );                       // 10
-		CTagInt32(FT_ATTRANSFERRED,   statistic.GetAllTimeTransferred() & 0xFFFFFFFF).WriteTagToFile( &file );// 11
-		CTagInt32(FT_ATTRANSFERREDHI, statistic.GetAllTimeTransferred() >>32).WriteTagToFile( &file );// 12
-		CTagInt32(FT_ATREQUESTED,    statistic.GetAllTimeRequests()).WriteTagToFile( &file );	// 13
-		CTagInt32(FT_ATACCEPTED,     statistic.GetAllTimeAccepts()).WriteTagToFile( &file );	// 14
-
-		// corrupt part infos
-		if (!m_corrupted_list.empty()) {
-			wxString strCorruptedParts;
-			std::list<uint16>::iterator it = m_corrupted_list.begin();
-			for (; it != m_corrupted_list.end(); ++it) {
-				uint16 uCorruptedPart = *it;
-				if (!strCorruptedParts.IsEmpty()) {
-					strCorruptedParts += wxT(",");
-				}
-				strCorruptedParts += CFormat(wxT("%u")) % uCorruptedPart;
+			if (m_journalLength > std::max(PARTMET_JOURNAL_COMPACTION_SIZE, m_partMetLength) && status != PS_COMPLETING) {
+				CompactPartMet();
 			}
-			wxASSERT( !strCorruptedParts.IsEmpty() );
-
-			CTagString( FT_CORRUPTEDPARTS, strCorruptedParts ).WriteTagToFile( &file); // 11?
-		}
 
-		//AICH Filehash
-		if (m_pAICHHashSet->HasValidMasterHash() && (m_pAICHHashSet->GetStatus() == AICH_VERIFIED)){
-			CTagString aichtag(FT_AICH_HASH, m_pAICHHashSet->GetMasterHash().GetString() );
-			aichtag.WriteTagToFile(&file); // 12?
-		}
-
-		if (GetLastPublishTimeKadSrc()){
-			CTagInt32(FT_KADLASTPUBLISHSRC, GetLastPublishTimeKadSrc()).WriteTagToFile(&file); // 15?
-		}
-
-		if (GetLastPublishTimeKadNotes()){
-			CTagInt32(FT_KADLASTPUBLISHNOTES, GetLastPublishTimeKadNotes()).WriteTagToFile(&file); // 16?
-		}
-
-		if (GetDlActiveTime()){
-			CTagInt32(FT_DL_ACTIVE_TIME, GetDlActiveTime()).WriteTagToFile(&file); // 17
+			return true;
 		}
 
-		for (uint32 j = 0; j < (uint32)m_taglist.size();++j) {
-			m_taglist[j].WriteTagToFile(&file);
+		CFile file;
+		file.Open(m_fullname, CFile::write);
+		if (!file.IsOpened()) {
+			throw wxString(wxT("Failed to open part.met file"));
 		}
 
-		// gaps
-		unsigned i_pos = 0;
-		for (CGapList::const_iterator it = m_gaplist.begin(); it != m_gaplist.end(); ++it) {
-			wxString tagName = CFormat(wxT(" %u")) % i_pos;
-
-			// gap start = first missing byte but gap ends = first non-missing byte
-			// in edonkey but I think its easier to user the real limits
-			tagName[0] = FT_GAPSTART;
-			CTagIntSized(tagName, it.start(),	IsLargeFile() ? 64 : 32).WriteTagToFile( &file );
-
-			tagName[0] = FT_GAPEND;
-			CTagIntSized(tagName, it.end() + 1, IsLargeFile() ? 64 : 32).WriteTagToFile( &file );
-
-			++i_pos;
-		}
+		WritePartMet(&file);
+		m_partMetLength = file.GetLength();
 	} catch (const wxString& error) {
 		AddLogLineNS(CFormat( _("ERROR while saving partfile: %s (%s ==> %s)") )
 			% error
@@ -904,12 +790,23 @@ bool CPartFile::SavePartFile(bool Initial)
 		return false;
 	}
 
-	file.Close();
+	// Journals left behind by an earlier download with the same number
+	// would otherwise be replayed on top of this one.
+	const CPath journals[2] = {
+		CPartFileJournal::GetPath(m_fullname),
+		CPartFileJournal::GetOldPath(m_fullname)
+	};
 
-	if (!Initial) {
-		CPath::RemoveFile(m_fullname.AppendExt(wxT(".backup")));
+	for (int i = 0; i < 2; ++i) {
+		if (journals[i].FileExists()) {
+			CPath::RemoveFile(journals[i]);
+		}
 	}
 
+	m_journalLength = 0;
+	GetGaps(m_journaledGaps);
+	m_journaledHashes = m_hashlist;
+
 	sint64 metLength = m_fullname.GetFileSize();
 	if (metLength == wxInvalidOffset) {
 		theApp->ShowAlert( CFormat( _("Could not retrieve length of '%s' - using %s file.") )
@@ -931,7 +828,311 @@ bool CPartFile::SavePartFile(bool Initial)
 		CPath::BackupFile(m_fullname, PARTMET_BAK_EXT);
 	}
 
-	return true;
+	return true;
+}
+
+
+void CPartFile::WritePartMet(CFileDataIO* file)
+{
+	// version
+	file->WriteUInt8(IsLargeFile() ? PARTFILE_VERSION_LARGEFILE : PARTFILE_VERSION);
+
+	file->WriteUInt32(CPath::GetModificationTime(m_PartPath));
+	// hash
+	file->WriteHash(m_abyFileHash);
+	uint16 parts = m_hashlist.size();
+	file->WriteUInt16(parts);
+	for (int x = 0; x < parts; ++x) {
+		file->WriteHash(m_hashlist[x]);
+	}
+
+	// tags, which are counted while being written
+	CMemFile tags;
+	uint32 tagcount = WriteStateTags(&tags);
+
+	for (uint32 j = 0; j < (uint32)m_taglist.size();++j) {
+		m_taglist[j].WriteTagToFile(&tags);
+	}
+	tagcount += m_taglist.size();
+
+	// gaps
+	unsigned i_pos = 0;
+	for (CGapList::const_iterator it = m_gaplist.begin(); it != m_gaplist.end(); ++it) {
+		wxString tagName = CFormat(wxT(" %u")) % i_pos;
+
+		// gap start = first missing byte but gap ends = first non-missing byte
+		// in edonkey but I think its easier to user the real limits
+		tagName[0] = FT_GAPSTART;
+		CTagIntSized(tagName, it.start(),	IsLargeFile() ? 64 : 32).WriteTagToFile( &tags );
+
+		tagName[0] = FT_GAPEND;
+		CTagIntSized(tagName, it.end() + 1, IsLargeFile() ? 64 : 32).WriteTagToFile( &tags );
+
+		++i_pos;
+	}
+	tagcount += m_gaplist.size() * 2;
+
+	file->WriteUInt32(tagcount);
+	file->Write(tags.GetRawBuffer(), tags.GetLength());
+}
+
+
+uint32 CPartFile::WriteStateTags(CFileDataIO* file)
+{
+	#define FIXED_TAGS 15
+	uint32 tagcount = FIXED_TAGS;
+
+	//#warning Kry - Where are lost by corruption and gained by compression?
+
+	// 0 (unicoded part file name)
+	// We write it with BOM to keep eMule compatibility. Note that the 'printable' filename is saved,
+	// as presently the filename does not represent an actual file.
+	CTagString(	FT_FILENAME,	GetFileName().GetPrintable()).WriteTagToFile( file, utf8strOptBOM );
+	CTagString(	FT_FILENAME,	GetFileName().GetPrintable()).WriteTagToFile( file );                         // 1
+
+	CTagIntSized(	FT_FILESIZE,	GetFileSize(), IsLargeFile() ? 64 : 32).WriteTagToFile( file );// 2
+	CTagIntSized(	FT_TRANSFERRED,	transferred, IsLargeFile() ? 64 : 32).WriteTagToFile( file );   // 3
+	CTagInt32(	FT_STATUS,	(m_paused?1:0)).WriteTagToFile( file );                        // 4
+
+	if ( IsAutoDownPriority() ) {
+		CTagInt32( FT_DLPRIORITY,	(uint8)PR_AUTO	).WriteTagToFile( file );	// 5
+		CTagInt32( FT_OLDDLPRIORITY,	(uint8)PR_AUTO	).WriteTagToFile( file );	// 6
+	} else {
+		CTagInt32( FT_DLPRIORITY,	m_iDownPriority	).WriteTagToFile( file );	// 5
+		CTagInt32( FT_OLDDLPRIORITY,	m_iDownPriority	).WriteTagToFile( file );	// 6
+	}
+
+	CTagInt32( FT_LASTSEENCOMPLETE,	lastseencomplete	).WriteTagToFile( file );	// 7
+
+	if ( IsAutoUpPriority() ) {
+		CTagInt32( FT_ULPRIORITY,	(uint8)PR_AUTO	).WriteTagToFile( file );	// 8
+		CTagInt32( FT_OLDULPRIORITY,	(uint8)PR_AUTO	).WriteTagToFile( file );	// 9
+	} else {
+		CTagInt32( FT_ULPRIORITY,	GetUpPriority() ).WriteTagToFile( file );	// 8
+		CTagInt32( FT_OLDULPRIORITY,	GetUpPriority() ).WriteTagToFile( file );	// 9
+	}
+
+	CTagInt32(FT_CATEGORY,       m_category).WriteTagToFile( file );                       // 10
+	CTagInt32(FT_ATTRANSFERRED,   statistic.GetAllTimeTransferred() & 0xFFFFFFFF).WriteTagToFile( file );// 11
+	CTagInt32(FT_ATTRANSFERREDHI, statistic.GetAllTimeTransferred() >>32).WriteTagToFile( file );// 12
+	CTagInt32(FT_ATREQUESTED,    statistic.GetAllTimeRequests()).WriteTagToFile( file );	// 13
+	CTagInt32(FT_ATACCEPTED,     statistic.GetAllTimeAccepts()).WriteTagToFile( file );	// 14
+
+	// corrupt part infos
+	if (!m_corrupted_list.empty()) {
+		wxString strCorruptedParts;
+		std::list<uint16>::iterator it = m_corrupted_list.begin();
+		for (; it != m_corrupted_list.end(); ++it) {
+			uint16 uCorruptedPart = *it;
+			if (!strCorruptedParts.IsEmpty()) {
+				strCorruptedParts += wxT(",");
+			}
+			strCorruptedParts += CFormat(wxT("%u")) % uCorruptedPart;
+		}
+		wxASSERT( !strCorruptedParts.IsEmpty() );
+
+		CTagString( FT_CORRUPTEDPARTS, strCorruptedParts ).WriteTagToFile(file); // 11?
+		++tagcount;
+	}
+
+	//AICH Filehash
+	if (m_pAICHHashSet->HasValidMasterHash() && (m_pAICHHashSet->GetStatus() == AICH_VERIFIED)){
+		CTagString aichtag(FT_AICH_HASH, m_pAICHHashSet->GetMasterHash().GetString() );
+		aichtag.WriteTagToFile(file); // 12?
+		++tagcount;
+	}
+
+	if (GetLastPublishTimeKadSrc()){
+		CTagInt32(FT_KADLASTPUBLISHSRC, GetLastPublishTimeKadSrc()).WriteTagToFile(file); // 15?
+		++tagcount;
+	}
+
+	if (GetLastPublishTimeKadNotes()){
+		CTagInt32(FT_KADLASTPUBLISHNOTES, GetLastPublishTimeKadNotes()).WriteTagToFile(file); // 16?
+		++tagcount;
+	}
+
+	if (GetDlActiveTime()){
+		CTagInt32(FT_DL_ACTIVE_TIME, GetDlActiveTime()).WriteTagToFile(file); // 17
+		++tagcount;
+	}
+
+	return tagcount;
+}
+
+
+void CPartFile::GetGaps(CPartFileJournal::GapVector& gaps) const
+{
+	gaps.clear();
+	gaps.reserve(m_gaplist.size());
+	for (CGapList::const_iterator it = m_gaplist.begin(); it != m_gaplist.end(); ++it) {
+		gaps.push_back(std::make_pair(it.start(), it.end()));
+	}
+}
+
+
+void CPartFile::AppendToJournal()
+{
+	CPartFileJournal::GapVector gaps;
+	GetGaps(gaps);
+	CPartFileJournal::GapChanges changes;
+	CPartFileJournal::DiffGaps(m_journaledGaps, gaps, changes);
+
+	// The hashset only changes when it is received, so it is only
+	// recorded then.
+	const bool hashesChanged = (m_hashlist != m_journaledHashes);
+
+	CMemFile record;
+	record.WriteUInt8(hashesChanged ? PARTMET_JOURNAL_HASHSET : 0);
+	record.WriteUInt32(CPath::GetModificationTime(m_PartPath));
+
+	CMemFile tags;
+	record.WriteUInt32(WriteStateTags(&tags));
+	record.Write(tags.GetRawBuffer(), tags.GetLength());
+
+	record.WriteUInt32(changes.size());
+	for (CPartFileJournal::GapChanges::const_iterator it = changes.begin(); it != changes.end(); ++it) {
+		record.WriteUInt64(it->start);
+		record.WriteUInt64(it->end);
+		record.WriteUInt8(it->isGap ? 1 : 0);
+	}
+
+	if (hashesChanged) {
+		record.WriteUInt16(m_hashlist.size());
+		for (size_t i = 0; i < m_hashlist.size(); ++i) {
+			record.WriteHash(m_hashlist[i]);
+		}
+	}
+
+	m_journalLength = CPartFileJournal::Append(CPartFileJournal::GetPath(m_fullname), record);
+	m_journaledGaps.swap(gaps);
+	if (hashesChanged) {
+		m_journaledHashes = m_hashlist;
+	}
+}
+
+
+void CPartFile::CompactPartMet()
+{
+	// The journal is left to grow until the running compaction is done.
+	if (CPartMetCompactionTask::IsPending(m_fullname)) {
+		return;
+	}
+
+	CScopedPtr<CMemFile> data;
+	WritePartMet(data.get());
+
+	// Records added from now on are kept in a new journal, which is not
+	// touched by the compaction.
+	CPartFileJournal::Rotate(m_fullname);
+	m_journalLength = 0;
+	m_partMetLength = data->GetLength();
+
+	CThreadScheduler::AddTask(new CPartMetCompactionTask(m_fullname, data.release()));
+}
+
+
+void CPartFile::LoadJournal()
+{
+	CPartFileJournal::RecordList records;
+	try {
+		// Records of a compaction that didn't finish come first.
+		bool complete = CPartFileJournal::Read(CPartFileJournal::GetOldPath(m_fullname), records);
+		complete &= CPartFileJournal::Read(CPartFileJournal::GetPath(m_fullname), records);
+
+		if (!complete) {
+			AddLogLineN(CFormat(_("WARNING: Discarded incomplete changes of %s (%s)"))
+				% m_partmetfilename
+				% GetFileName());
+		}
+
+		const sint64 journalLength = CPartFileJournal::GetPath(m_fullname).GetFileSize();
+		m_journalLength = (journalLength == wxInvalidOffset) ? 0 : journalLength;
+	} catch (const CIOFailureException& e) {
+		// Without the journal, the .part file is newer than the .part.met
+		// and will be rehashed.
+		AddDebugLogLineC(logPartFile, CFormat( wxT("IO failure while loading journal of '%s': %s") )
+			% m_partmetfilename
+			% e.what() );
+		return;
+	}
+
+	std::map<uint16, Gap_Struct*> unusedGaps;
+	for (CPartFileJournal::RecordList::const_iterator it = records.begin(); it != records.end(); ++it) {
+		try {
+			CMemFile record(&(*it)[0], it->size());
+
+			const uint8 flags = record.ReadUInt8();
+			m_lastDateChanged = record.ReadUInt32();
+
+			// Tags that are only written if set must be reset first, and
+			// the all-time statistics are accumulated by LoadPartMetTag.
+			m_corrupted_list.clear();
+			statistic.SetAllTimeTransferred(0);
+			SetLastPublishTimeKadSrc(0, 0);
+			SetLastPublishTimeKadNotes(0);
+			m_nDlActiveTime = 0;
+
+			bool nameLoaded = false;
+			const uint32 tagcount = record.ReadUInt32();
+			for (uint32 i = 0; i < tagcount; ++i) {
+				CTag tag(record, true);
+				if (tag.GetNameID() == FT_FILENAME) {
+					// The unicoded name comes first.
+					if (!nameLoaded) {
+						SetFileName(CPath(tag.GetStr()));
+						nameLoaded = true;
+					}
+				} else {
+					LoadPartMetTag(tag, false, unusedGaps);
+				}
+			}
+
+			const uint32 gapcount = record.ReadUInt32();
+			for (uint32 i = 0; i < gapcount; ++i) {
+				const uint64 start = record.ReadUInt64();
+				const uint64 end = record.ReadUInt64();
+				const bool isGap = (record.ReadUInt8() != 0);
+
+				if (start <= end && end < GetFileSize()) {
+					if (isGap) {
+						m_gaplist.AddGap(start, end);
+					} else {
+						m_gaplist.FillGap(start, end);
+					}
+				}
+			}
+
+			if (flags & PARTMET_JOURNAL_HASHSET) {
+				m_hashlist.clear();
+				const uint16 parts = record.ReadUInt16();
+				for (uint16 i = 0; i < parts; ++i) {
+					m_hashlist.push_back(record.ReadHash());
+				}
+
+				CMD4Hash checkhash;
+				if (!m_hashlist.empty()) {
+					CreateHashFromHashlist(m_hashlist, &checkhash);
+				}
+				if (m_abyFileHash != checkhash) {
+					m_hashlist.clear();
+				}
+			}
+		} catch (const CSafeIOException& e) {
+			// Records are checksummed, so this should never happen.
+			AddDebugLogLineC(logPartFile, CFormat( wxT("Invalid journal record in '%s': %s") )
+				% m_partmetfilename
+				% e.what() );
+			break;
+		} catch (const CInvalidPacket& e) {
+			AddDebugLogLineC(logPartFile, CFormat( wxT("Invalid journal record in '%s': %s") )
+				% m_partmetfilename
+				% e.what() );
+			break;
+		}
+	}
+
+	wxASSERT(unusedGaps.empty());
 }
 
 
@@ -1165,6 +1366,10 @@ void CPartFile::PartFileHashFinished(CKnownFile* result)
 						% GetPartHash(i).Encode() );
 
 					AddGap(i);
+					// Let ICH and AICH recovery know about the part.
+					if (!IsCorruptedPart(i)) {
+						m_corrupted_list.push_back(i);
+					}
 					errorfound = true;
 				}
 			} else {
@@ -1220,12 +1425,21 @@ void CPartFile::PartFileHashFinished(CKnownFile* result)
 void CPartFile::AddGap(uint64 start, uint64 end)
 {
 	m_gaplist.AddGap(start, end);
+	// Data will be downloaded again, so any partial hash is useless now
+	m_hashStates->Reset(start, end);
+	CUploadBlockCache::Invalidate(GetFileHash(), start, end + 1);
+	InvalidateChunks(start, end);
+	UpdateCompleteParts(start / PARTSIZE, end / PARTSIZE);
 	UpdateDisplayedInfo();
 }
 
 void CPartFile::AddGap(uint16 part)
 {
 	m_gaplist.AddGap(part);
+	m_hashStates->Reset(PARTSIZE * part, PARTSIZE * part);
+	CUploadBlockCache::Invalidate(GetFileHash(), PARTSIZE * part, PARTSIZE * (part + 1));
+	m_chunkSelector.Invalidate(part);
+	UpdateCompleteParts(part, part);
 	UpdateDisplayedInfo();
 }
 
@@ -1313,6 +1527,8 @@ bool CPartFile::GetNextEmptyBlockInPart(uint16 partNumber, Requested_Block_Struc
 void CPartFile::FillGap(uint64 start, uint64 end)
 {
 	m_gaplist.FillGap(start, end);
+	InvalidateChunks(start, end);
+	UpdateCompleteParts(start / PARTSIZE, end / PARTSIZE);
 	UpdateCompletedInfos();
 	UpdateDisplayedInfo();
 }
@@ -1320,11 +1536,38 @@ void CPartFile::FillGap(uint64 start, uint64 end)
 void CPartFile::FillGap(uint16 part)
 {
 	m_gaplist.FillGap(part);
+	m_chunkSelector.Invalidate(part);
+	UpdateCompleteParts(part, part);
 	UpdateCompletedInfos();
 	UpdateDisplayedInfo();
 }
 
 
+void CPartFile::InvalidateChunks(uint64 start, uint64 end)
+{
+	m_chunkSelector.Invalidate((uint16)(start / PARTSIZE), (uint16)(end / PARTSIZE));
+}
+
+
+const BitVector& CPartFile::GetCompleteParts()
+{
+	// Set up on first use, then kept up to date by AddGap and FillGap
+	if (m_completeParts.size() != GetPartCount()) {
+		m_completeParts.setsize(GetPartCount(), false);
+		UpdateCompleteParts(0, GetPartCount() - 1);
+	}
+	return m_completeParts;
+}
+
+
+void CPartFile::UpdateCompleteParts(uint16 first, uint16 last)
+{
+	for (uint32 part = first; part <= last && part < m_completeParts.size(); ++part) {
+		m_completeParts.set(part, m_gaplist.IsComplete((uint16)part));
+	}
+}
+
+
 void CPartFile::UpdateCompletedInfos()
 {
 	uint64 allgaps = m_gaplist.GetGapSize();
@@ -1367,7 +1610,17 @@ uint32 CPartFile::Process(uint32 reducedownload/*in percent*/,uint8 m_icounter)
 	// If buffer size exceeds limit, or if not written within time limit, flush data
 	if (	(m_nTotalBufferData > thePrefs::GetFileBufferSize()) ||
 		(dwCurTick > (m_nLastBufferFlushTime + BUFFER_TIME_LIMIT))) {
-		FlushBuffer();
+		FlushBufferInBackground();
+	}
+
+	// Sources that stopped requesting blocks while the download buffers
+	// were full continue once the buffers have drained.
+	if (!m_deferredSources.empty() && !CDownloadBufferPool::IsThrottling()) {
+		CClientRefList deferred;
+		deferred.swap(m_deferredSources);
+		for (CClientRefList::iterator it = deferred.begin(); it != deferred.end(); ++it) {
+			it->GetClient()->ResumeBlockRequests();
+		}
 	}
 
 
@@ -1713,15 +1966,17 @@ void CPartFile::UpdatePartsInfo()
 	if ( m_SrcpartFrequency.size() != GetPartCount() ) {
 		m_SrcpartFrequency.clear();
 		m_SrcpartFrequency.insert(m_SrcpartFrequency.begin(), GetPartCount(), 0);
+		m_srcAvailability.Recount(m_SrcpartFrequency);
+		m_chunkSelector.InvalidateAll();
 	}
 
-	// Find number of available parts
-	uint16 availablecounter = 0;
-	for ( uint16 i = 0; i < partcount; ++i ) {
-		if ( m_SrcpartFrequency[i] )
-			++availablecounter;
+	if ( flag ) {
+		CheckPartsFrequency();
 	}
 
+	// Find number of available parts
+	uint16 availablecounter = m_srcAvailability.GetAvailableParts();
+
 	if ( ( availablecounter == partcount ) && ( m_availablePartsCount < partcount ) ) {
 		lastseencomplete = time(NULL);
 	}
@@ -1740,16 +1995,8 @@ void CPartFile::UpdatePartsInfo()
 			}
 		}
 
-		m_nCompleteSourcesCount = m_nCompleteSourcesCountLo = m_nCompleteSourcesCountHi = 0;
-
-		for (uint16 i = 0; i < partcount; ++i)	{
-			if( !i )	{
-				m_nCompleteSourcesCount = m_SrcpartFrequency[i];
-			}
-			else if( m_nCompleteSourcesCount > m_SrcpartFrequency[i]) {
-				m_nCompleteSourcesCount = m_SrcpartFrequency[i];
-			}
-		}
+		m_nCompleteSourcesCountLo = m_nCompleteSourcesCountHi = 0;
+		m_nCompleteSourcesCount = m_srcAvailability.GetMinFrequency();
 		count.push_back(m_nCompleteSourcesCount);
 
 		int32 n = count.size();
@@ -1875,9 +2122,39 @@ bool CPartFile::GetNextRequestedBlock(CUpDownClient* sender,
 	if ( sender->GetPartStatus().empty() ) {
 		return false;
 	}
-	// Define and create the list of the chunks to download
 	const uint16 partCount = GetPartCount();
-	ChunkList chunksList;
+
+	// Define the bounds of the three zones (very rare, rare)
+	// more depending on available sources
+	uint8 modif=10;
+	if (GetSourceCount()>800) {
+		modif=2;
+	} else if (GetSourceCount()>200) {
+		modif=5;
+	}
+	uint16 limit= modif*GetSourceCount()/ 100;
+	if (limit==0) {
+		limit=1;
+	}
+	const uint16 veryRareBound = limit;
+	const uint16 rareBound = 2*limit;
+
+	// Cache Preview state (Criterion 2)
+	FileType type = GetFiletype(GetFileName());
+	const bool isPreviewEnable =
+		thePrefs::GetPreviewPrio() &&
+		(type == ftArchive || type == ftVideo);
+
+	// Only the chunks whose state changed since the last call are ranked again
+	m_chunkSelector.SetPartCount(partCount);
+	m_chunkSelector.SetBounds(veryRareBound, rareBound);
+	if (isPreviewEnable != m_chunkPreview) {
+		m_chunkPreview = isPreviewEnable;
+		m_chunkSelector.InvalidateAll();
+	}
+
+	// Chunks selected during this call are not selected again
+	std::vector<uint16> selectedParts;
 
 	// Main loop
 	uint16 newBlockCount = 0;
@@ -1888,6 +2165,8 @@ bool CPartFile::GetNextRequestedBlock(CUpDownClient* sender,
 			if(GetNextEmptyBlockInPart(sender->GetLastPartAsked(), pBlock) == true) {
 				// Keep a track of all pending requested blocks
 				m_requestedblocks_list.push_back(pBlock);
+				m_requestedblocks_index.insert(pBlock);
+				m_chunkSelector.Invalidate(sender->GetLastPartAsked());
 				// Update list of blocks to return
 				toadd.push_back(pBlock);
 				newBlockCount++;
@@ -1903,159 +2182,75 @@ bool CPartFile::GetNextRequestedBlock(CUpDownClient* sender,
 
 		// Check if a new chunk must be selected (e.g. download starting, previous chunk complete)
 		if(sender->GetLastPartAsked() == 0xffff) {
-			// Quantify all chunks (create list of chunks to download)
-			// This is done only one time and only if it is necessary (=> CPU load)
-			if(chunksList.empty()) {
-				// Identify the locally missing part(s) that this source has
-				for(uint16 i=0; i < partCount; ++i) {
-					if(sender->IsPartAvailable(i) == true && GetNextEmptyBlockInPart(i, NULL) == true) {
-						// Create a new entry for this chunk and add it to the list
-						Chunk newEntry;
-						newEntry.part = i;
-						newEntry.frequency = m_SrcpartFrequency[i];
-						chunksList.push_back(newEntry);
-					}
-				}
-
-				// Check if any blocks(s) could be downloaded
-				if(chunksList.empty()) {
-					break; // Exit main loop while()
-				}
-
-				// Define the bounds of the three zones (very rare, rare)
-				// more depending on available sources
-				uint8 modif=10;
-				if (GetSourceCount()>800) {
-					modif=2;
-				} else if (GetSourceCount()>200) {
-					modif=5;
-				}
-				uint16 limit= modif*GetSourceCount()/ 100;
-				if (limit==0) {
-					limit=1;
+			// Quantify the chunks whose state changed
+			m_chunkSelector.Refresh([&](uint16 part, CChunkSelector::ChunkInfo& info) {
+				// Only the locally missing parts
+				if (!GetNextEmptyBlockInPart(part, NULL)) {
+					return false;
 				}
-				const uint16 veryRareBound = limit;
-				const uint16 rareBound = 2*limit;
-
-				// Cache Preview state (Criterion 2)
-				FileType type = GetFiletype(GetFileName());
-				const bool isPreviewEnable =
-					thePrefs::GetPreviewPrio() &&
-					(type == ftArchive || type == ftVideo);
-
-				// Collect and calculate criteria for all chunks
-				for (ChunkList::iterator it = chunksList.begin(); it != chunksList.end(); ++it) {
-					Chunk& cur_chunk = *it;
-
-					// Offsets of chunk
-					const uint64 uStart = cur_chunk.part * PARTSIZE;
-					const uint64 uEnd   = uStart + GetPartSize(cur_chunk.part) - 1;
-					// Criterion 2. Parts used for preview
-					// Remark: - We need to download the first part and the last part(s).
-					//        - When the last part is very small, it's necessary to
-					//          download the two last parts.
-					bool critPreview = false;
-					if(isPreviewEnable == true) {
-						if(cur_chunk.part == 0) {
-							critPreview = true; // First chunk
-						} else if(cur_chunk.part == partCount-1) {
-							critPreview = true; // Last chunk
-						} else if(cur_chunk.part == partCount-2) {
-							// Last chunk - 1 (only if last chunk is too small)
-							const uint32 sizeOfLastChunk = GetFileSize() - uEnd;
-							if(sizeOfLastChunk < PARTSIZE/3) {
-								critPreview = true; // Last chunk - 1
-							}
-						}
-					}
 
-					// Criterion 3. Request state (downloading in process from other source(s))
-					// => CPU load
-					const bool critRequested =
-						cur_chunk.frequency > veryRareBound &&
-						IsAlreadyRequested(uStart, uEnd);
-
-					// Criterion 4. Completion
-					// PARTSIZE instead of GetPartSize() favours the last chunk - but that may be intentional
-					uint32 partSize = PARTSIZE - m_gaplist.GetGapSize(cur_chunk.part);
-					const uint16 critCompletion = (uint16)(partSize/(PARTSIZE/100)); // in [%]
-
-					// Calculate priority with all criteria
-					if(cur_chunk.frequency <= veryRareBound) {
-						// 0..xxxx unrequested + requested very rare chunks
-						cur_chunk.rank = (25 * cur_chunk.frequency) + // Criterion 1
-						((critPreview == true) ? 0 : 1) + // Criterion 2
-						(100 - critCompletion); // Criterion 4
-					} else if(critPreview == true) {
-						// 10000..10100  unrequested preview chunks
-						// 30000..30100  requested preview chunks
-						cur_chunk.rank = ((critRequested == false) ? 10000 : 30000) + // Criterion 3
-						(100 - critCompletion); // Criterion 4
-					} else if(cur_chunk.frequency <= rareBound) {
-						// 10101..1xxxx  unrequested rare chunks
-						// 30101..3xxxx  requested rare chunks
-						cur_chunk.rank = (25 * cur_chunk.frequency) +                 // Criterion 1
-						((critRequested == false) ? 10101 : 30101) + // Criterion 3
-						(100 - critCompletion); // Criterion 4
-					} else {
-						// common chunk
-						if(critRequested == false) { // Criterion 3
-							// 20000..2xxxx  unrequested common chunks
-							cur_chunk.rank = 20000 + // Criterion 3
-							(100 - critCompletion); // Criterion 4
-						} else {
-							// 40000..4xxxx  requested common chunks
-							// Remark: The weight of the completion criterion is inversed
-							//         to spead the requests over the completing chunks.
-							//         Without this, the chunk closest to completion will
-							//         received every new sources.
-							cur_chunk.rank = 40000 + // Criterion 3
-							(critCompletion); // Criterion 4
+				// Offsets of chunk
+				const uint64 uStart = part * PARTSIZE;
+				const uint64 uEnd   = uStart + GetPartSize(part) - 1;
+
+				info.frequency = m_SrcpartFrequency[part];
+				// Criterion 2. Parts used for preview
+				// Remark: - We need to download the first part and the last part(s).
+				//        - When the last part is very small, it's necessary to
+				//          download the two last parts.
+				info.preview = false;
+				if(isPreviewEnable == true) {
+					if(part == 0) {
+						info.preview = true; // First chunk
+					} else if(part == partCount-1) {
+						info.preview = true; // Last chunk
+					} else if(part == partCount-2) {
+						// Last chunk - 1 (only if last chunk is too small)
+						const uint32 sizeOfLastChunk = GetFileSize() - uEnd;
+						if(sizeOfLastChunk < PARTSIZE/3) {
+							info.preview = true; // Last chunk - 1
 						}
 					}
 				}
-			}
 
-			// Select the next chunk to download
-			if(!chunksList.empty()) {
-				// Find and count the chunk(s) with the highest priority
-				uint16 chunkCount = 0; // Number of found chunks with same priority
-				uint16 rank = 0xffff; // Highest priority found
-
-				// Collect and calculate criteria for all chunks
-				for (ChunkList::iterator it = chunksList.begin(); it != chunksList.end(); ++it) {
-					const Chunk& cur_chunk = *it;
-					if(cur_chunk.rank < rank) {
-						chunkCount = 1;
-						rank = cur_chunk.rank;
-					} else if(cur_chunk.rank == rank) {
-						++chunkCount;
-					}
-				}
+				// Criterion 3. Request state (downloading in process from other source(s))
+				// => CPU load, only needed outside the very rare zone
+				info.requested =
+					info.frequency > veryRareBound &&
+					IsAlreadyRequested(uStart, uEnd);
 
-				// Use a random access to avoid that everybody tries to download the
-				// same chunks at the same time (=> spread the selected chunk among clients)
-				uint16 randomness = 1 + (int) (((float)(chunkCount-1))*rand()/(RAND_MAX+1.0));
-
-				for (ChunkList::iterator it = chunksList.begin(); it != chunksList.end(); ++it) {
-					const Chunk& cur_chunk = *it;
-					if(cur_chunk.rank == rank) {
-						randomness--;
-						if(randomness == 0) {
-							// Selection process is over
-							sender->SetLastPartAsked(cur_chunk.part);
-							// Remark: this list might be reused up to *count times
-							chunksList.erase(it);
-							break; // exit loop for()
-						}
-					}
-				}
-			} else {
+				// Criterion 4. Completion
+				// PARTSIZE instead of GetPartSize() favours the last chunk - but that may be intentional
+				uint32 partSize = PARTSIZE - m_gaplist.GetGapSize(part);
+				info.completion = (uint16)(partSize/(PARTSIZE/100)); // in [%]
+
+				return true;
+			});
+
+			// Select the next chunk to download among those this source has.
+			// Use a random access to avoid that everybody tries to download the
+			// same chunks at the same time (=> spread the selected chunk among clients)
+			const uint16 part = m_chunkSelector.Select([&](uint16 i) {
+				return sender->IsPartAvailable(i) &&
+					std::find(selectedParts.begin(), selectedParts.end(), i) == selectedParts.end();
+			}, rand());
+
+			if (part == CChunkSelector::NONE) {
 				// There is no remaining chunk to download
 				break; // Exit main loop while()
 			}
+			// Selection process is over
+			sender->SetLastPartAsked(part);
+			selectedParts.push_back(part);
 		}
 	}
+
+	// All missing blocks this source has are requested already. Near the
+	// end of the download, ask it for some of them too rather than waiting
+	// for the sources they were requested from.
+	if (newBlockCount == 0 && IsEndGame()) {
+		newBlockCount = GetEndGameBlocks(sender, toadd, count);
+	}
 	// Return the number of the blocks
 	count = newBlockCount;
 	// Return
@@ -2071,15 +2266,139 @@ void  CPartFile::RemoveBlockFromList(uint64 start,uint64 end)
 		std::list<Requested_Block_Struct*>::iterator it2 = it++;
 
 		if ((*it2)->StartOffset <= start && (*it2)->EndOffset >= end) {
+			InvalidateChunks((*it2)->StartOffset, (*it2)->EndOffset);
+			m_requestedblocks_index.erase(*it2);
+			m_duplicateBlocks.Remove(*it2);
 			m_requestedblocks_list.erase(it2);
 		}
 	}
 }
 
 
+void CPartFile::RemoveBlockFromList(const Requested_Block_Struct* block)
+{
+	std::list<Requested_Block_Struct*>::iterator it =
+		std::find(m_requestedblocks_list.begin(), m_requestedblocks_list.end(), block);
+	if (it != m_requestedblocks_list.end()) {
+		InvalidateChunks(block->StartOffset, block->EndOffset);
+		m_requestedblocks_index.erase(*it);
+		m_duplicateBlocks.Remove(block);
+		m_requestedblocks_list.erase(it);
+	}
+}
+
+
 void CPartFile::RemoveAllRequestedBlocks(void)
 {
 	m_requestedblocks_list.clear();
+	m_requestedblocks_index.clear();
+	m_duplicateBlocks.Clear();
+	m_chunkSelector.InvalidateAll();
+}
+
+
+bool CPartFile::IsEndGame()
+{
+	return thePrefs::IsEndGameMode() &&
+		m_gaplist.GetGapSize() <= (uint64)thePrefs::GetEndGameBlocks() * BLOCKSIZE;
+}
+
+
+uint16 CPartFile::GetEndGameBlocks(CUpDownClient* sender, std::vector<Requested_Block_Struct*>& toadd, uint16 count)
+{
+	// A source whose request lost against another one already is unlikely
+	// to be faster than the sources of the remaining blocks.
+	if (sender->HasCancelledBlocks()) {
+		return 0;
+	}
+
+	// Collect the incomplete blocks this source has and wasn't asked for
+	std::vector<CEndGame::Candidate> candidates;
+	for (CReqBlockPtrList::iterator it = m_requestedblocks_list.begin(); it != m_requestedblocks_list.end(); ++it) {
+		const Requested_Block_Struct* block = *it;
+		if (!sender->IsPartAvailable(block->StartOffset / PARTSIZE) ||
+			IsComplete(block->StartOffset, block->EndOffset) ||
+			sender->FindBlockRequest(block->StartOffset, block->EndOffset)) {
+			continue;
+		}
+
+		std::vector<CEndGame::Candidate>::iterator candidate = candidates.begin();
+		while (candidate != candidates.end() && candidate->start != block->StartOffset) {
+			++candidate;
+		}
+		if (candidate == candidates.end()) {
+			CEndGame::Candidate added = { block->StartOffset, block->EndOffset, 1, block->transferred };
+			candidates.push_back(added);
+		} else {
+			++candidate->requests;
+			candidate->transferred = std::max(candidate->transferred, block->transferred);
+		}
+	}
+
+	CEndGame::SelectBlocks(candidates, count);
+
+	for (std::vector<CEndGame::Candidate>::iterator it = candidates.begin(); it != candidates.end(); ++it) {
+		Requested_Block_Struct* block = new Requested_Block_Struct;
+		block->StartOffset = it->start;
+		block->EndOffset = it->end;
+		md4cpy(block->FileID, GetFileHash().GetHash());
+		block->transferred = 0;
+
+		m_requestedblocks_list.push_back(block);
+		m_requestedblocks_index.insert(block);
+		m_duplicateBlocks.Add(block);
+		m_chunkSelector.Invalidate(block->StartOffset / PARTSIZE);
+		toadd.push_back(block);
+	}
+
+	if (!candidates.empty()) {
+		CEndGame::AddDuplicated(candidates.size());
+		AddDebugLogLineN(logPartFile, CFormat(wxT("End-game: requesting %u blocks of %s once more from %s"))
+			% (uint32)candidates.size() % GetFileName() % sender->GetFullIP());
+	}
+
+	return candidates.size();
+}
+
+
+void CPartFile::CancelDuplicateBlocks(const Requested_Block_Struct* block, const CUpDownClient* winner)
+{
+	// Only blocks requested several times have requests to cancel
+	bool duplicated = false;
+	for (CReqBlockPtrList::iterator it = m_requestedblocks_list.begin(); it != m_requestedblocks_list.end(); ++it) {
+		if (*it != block && (*it)->StartOffset == block->StartOffset && (*it)->EndOffset == block->EndOffset) {
+			duplicated = true;
+			break;
+		}
+	}
+	if (!duplicated) {
+		return;
+	}
+
+	// Collect the requests of the block by the other sources
+	const uint64 size = block->EndOffset - block->StartOffset + 1;
+	std::vector<CEndGameRequests::Request> requests;
+	std::vector<CUpDownClient*> sources;
+
+	CClientRefList::iterator it = m_downloadingSourcesList.begin();
+	for ( ; it != m_downloadingSourcesList.end(); ++it) {
+		CUpDownClient* cur_src = it->GetClient();
+		if (cur_src == winner) {
+			continue;
+		}
+
+		const Requested_Block_Struct* request = cur_src->FindBlockRequest(block->StartOffset, block->EndOffset);
+		if (request != NULL) {
+			CEndGameRequests::Request entry = { request, size - std::min<uint64>(request->transferred, size), (uint64)(cur_src->GetKBpsDown() * 1024) };
+			requests.push_back(entry);
+			sources.push_back(cur_src);
+		}
+	}
+
+	const std::vector<size_t> cancelled = m_duplicateBlocks.Complete(block, requests);
+	for (std::vector<size_t>::const_iterator it2 = cancelled.begin(); it2 != cancelled.end(); ++it2) {
+		sources[*it2]->CancelBlockRequest(static_cast<const Requested_Block_Struct*>(requests[*it2].request));
+	}
 }
 
 
@@ -2190,6 +2509,9 @@ void CPartFile::PerformFileComplete()
 		m_hpartfile.Close();
 	}
 
+	// The completion removes the .part.met and its journals
+	CPartMetCompactionTask::Cancel(m_fullname);
+
 	// Schedule task for completion of the file
 	CThreadScheduler::AddTask(new CCompletionTask(this));
 }
@@ -2240,6 +2562,7 @@ void CPartFile::Delete()
 		theApp->uploadqueue->SuspendUpload(GetFileHash(), true);
 	AddDebugLogLineN(logPartFile, CFormat(wxT("\tSuspended upload to %d clients")) % removed);
 	theApp->sharedfiles->RemoveFile(this);
+	CUploadBlockCache::Invalidate(GetFileHash());
 	AddDebugLogLineN(logPartFile, wxT("\tRemoved from shared"));
 	theApp->downloadqueue->RemoveFile(this);
 	AddDebugLogLineN(logPartFile, wxT("\tRemoved from download queue"));
@@ -2251,12 +2574,18 @@ void CPartFile::Delete()
 	AddDebugLogLineN(logPartFile, wxT("\tAdded to canceled file list"));
 	theApp->searchlist->UpdateSearchFileByHash(GetFileHash());	// Update file in the search dialog if it's still open
 
+	// The write thread must be done with the file before it is removed
+	WaitForFlush(false);
+
 	if (m_hpartfile.IsOpened()) {
 		m_hpartfile.Close();
 	}
 
 	AddDebugLogLineN(logPartFile, wxT("\tClosed"));
 
+	// A compaction must not recreate the .part.met
+	CPartMetCompactionTask::Cancel(m_fullname);
+
 	// cppcheck-suppress duplicateBranch
 	if (!CPath::RemoveFile(m_fullname)) {
 		AddDebugLogLineC(logPartFile, CFormat(wxT("\tFailed to delete '%s'")) % m_fullname);
@@ -2279,6 +2608,18 @@ void CPartFile::Delete()
 		AddDebugLogLineN(logPartFile, wxT("\tRemoved .bak"));
 	}
 
+	CPath journalNames[2] = { CPartFileJournal::GetPath(m_fullname), CPartFileJournal::GetOldPath(m_fullname) };
+	for (int i = 0; i < 2; ++i) {
+		if (journalNames[i].FileExists()) {
+			// cppcheck-suppress duplicateBranch
+			if (CPath::RemoveFile(journalNames[i])) {
+				AddDebugLogLineN(logPartFile, wxT("\tRemoved journal"));
+			} else {
+				AddDebugLogLineC(logPartFile, CFormat(wxT("Failed to delete '%s'")) % journalNames[i]);
+			}
+		}
+	}
+
 	CPath SEEDSName = m_fullname.AppendExt(wxT(".seeds"));
 	if (SEEDSName.FileExists()) {
 		// cppcheck-suppress duplicateBranch
@@ -2295,7 +2636,7 @@ void CPartFile::Delete()
 }
 
 
-bool CPartFile::HashSinglePart(uint16 partnumber)
+bool CPartFile::HashSinglePart(uint16 partnumber, const CPartFileWriteJob* job)
 {
 	if ((GetHashCount() <= partnumber) && (GetPartCount() > 1)) {
 		AddLogLineC(CFormat( _("WARNING: Unable to hash downloaded part - hashset incomplete for '%s'") )
@@ -2310,16 +2651,28 @@ bool CPartFile::HashSinglePart(uint16 partnumber)
 		CMD4Hash hashresult;
 		uint64 offset = PARTSIZE * partnumber;
 		uint32 length = GetPartSize(partnumber);
-		try {
-			CreateHashFromFile(m_hpartfile, offset, length, &hashresult, NULL);
-		} catch (const CIOFailureException& e) {
-			AddLogLineC(CFormat( _("EOF while hashing downloaded part %u with length %u (max %u) of partfile '%s' with length %u: %s"))
-				% partnumber % length % (offset+length) % GetFileName() % GetFileSize() % e.what());
-			SetStatus(PS_ERROR);
-			return false;
-		} catch (const CEOFException& e) {
+		wxString error;
+
+		// Use the hash created by the write thread, if any
+		const CPartFileWriteJob::PartHash* precomputed = job ? job->GetPartHash(partnumber) : NULL;
+		if (precomputed) {
+			hashresult = precomputed->hash;
+			error = precomputed->error;
+		} else {
+			// The incremental hash doesn't cover data verified this way
+			m_hashStates->Reset(offset, offset + length - 1);
+			try {
+				CreateHashFromFile(m_hpartfile, offset, length, &hashresult, NULL);
+			} catch (const CIOFailureException& e) {
+				error = e.what();
+			} catch (const CEOFException& e) {
+				error = e.what();
+			}
+		}
+
+		if (!error.IsEmpty()) {
 			AddLogLineC(CFormat( _("EOF while hashing downloaded part %u with length %u (max %u) of partfile '%s' with length %u: %s"))
-				% partnumber % length % (offset+length) % GetFileName() % GetFileSize() % e.what());
+				% partnumber % length % (offset+length) % GetFileName() % GetFileSize() % error);
 			SetStatus(PS_ERROR);
 			return false;
 		}
@@ -2400,6 +2753,8 @@ void CPartFile::StopPausedFile()
 				kBpsDown = 0.0;
 		}
 	}
+	// sources of inactive files don't resume requesting blocks
+	m_deferredSources.clear();
 	// release file handle if unused for some time
 	m_hpartfile.Release();
 }
@@ -2562,8 +2917,6 @@ CPacket *CPartFile::CreateSrcInfoPacket(const CUpDownClient* forClient, uint8 by
 		return NULL;
 	}
 
-	CMemFile data(1024);
-
 	uint8 byUsedVersion;
 	bool bIsSX2Packet;
 	if (forClient->SupportsSourceExchange2() && byRequestedVersion > 0){
@@ -2571,7 +2924,6 @@ CPacket *CPartFile::CreateSrcInfoPacket(const CUpDownClient* forClient, uint8 by
 		// and we send the highest version we know, but of course not higher than his request
 		byUsedVersion = std::min(byRequestedVersion, (uint8)SOURCEEXCHANGE2_VERSION);
 		bIsSX2Packet = true;
-		data.WriteUInt8(byUsedVersion);
 
 		// we don't support any special SX2 options yet, reserved for later use
 		if (nRequestedOptions != 0) {
@@ -2585,10 +2937,21 @@ CPacket *CPartFile::CreateSrcInfoPacket(const CUpDownClient* forClient, uint8 by
 		}
 	}
 
-	uint16 nCount = 0;
+	CSourceExchangeCache::Key key;
+	key.version = byUsedVersion;
+	key.options = nRequestedOptions;
+	key.sx2 = bIsSX2Packet;
+	key.hybridIDs = forClient->GetSourceExchange1Version() > 2;
+	key.SetParts(reqstatus);
+
+	const uint32 now = ::GetTickCount();
+	CSourceExchangeCache::Answer* answer = m_srcSXCache.Find(key, now);
+	if (answer) {
+		return GetSrcInfoPacket(key, *answer, NULL);
+	}
 
-	data.WriteHash(m_abyFileHash);
-	data.WriteUInt16(nCount);
+	CSourceExchangeCache::Answer newAnswer;
+	CMemFile data(1024);
 	bool bNeeded;
 	for (SourceSet::iterator it = m_SrcList.begin(); it != m_SrcList.end(); ++it ) {
 		bNeeded = false;
@@ -2610,12 +2973,7 @@ CPacket *CPartFile::CreateSrcInfoPacket(const CUpDownClient* forClient, uint8 by
 			}
 			if ( KnowNeededParts ) {
 				// only send sources which have needed parts for this client
-				for (int x = 0; x < GetPartCount(); ++x) {
-					if (srcstatus.get(x) && !reqstatus.get(x)) {
-						bNeeded = true;
-						break;
-					}
-				}
+				bNeeded = srcstatus.HasAnyNotIn(reqstatus);
 			} else {
 				// if we don't know the need parts for this client,
 				// return any source currently a client sends it's
@@ -2623,18 +2981,13 @@ CPacket *CPartFile::CreateSrcInfoPacket(const CUpDownClient* forClient, uint8 by
 				if (srcstatus.size() != GetPartCount()) {
 					continue;
 				}
-				for (int x = 0; x < GetPartCount(); ++x){
-					if (srcstatus.get(x)) {
-						bNeeded = true;
-						break;
-					}
-				}
+				bNeeded = srcstatus.Any();
 			}
 		}
 		if(bNeeded) {
-			++nCount;
+			newAnswer.sources.push_back(cur_src);
 			uint32 dwID;
-			if(forClient->GetSourceExchange1Version() > 2) {
+			if (key.hybridIDs) {
 				dwID = cur_src->GetUserIDHybrid();
 			} else {
 				dwID = wxUINT32_SWAP_ALWAYS(cur_src->GetUserIDHybrid());
@@ -2661,25 +3014,16 @@ CPacket *CPartFile::CreateSrcInfoPacket(const CUpDownClient* forClient, uint8 by
 				data.WriteUInt8(byCryptOptions);
 			}
 
-			if (nCount > 500) {
+			if (newAnswer.sources.size() > 500) {
 				break;
 			}
 		}
 	}
-	if (!nCount) {
-		return 0;
-	}
-	data.Seek(bIsSX2Packet ? 17 : 16, wxFromStart);
-	data.WriteUInt16(nCount);
 
-	CPacket* result = new CPacket(data, OP_EMULEPROT, bIsSX2Packet ? OP_ANSWERSOURCES2 : OP_ANSWERSOURCES);
+	newAnswer.records.assign(data.GetRawBuffer(), data.GetRawBuffer() + data.GetLength());
+	answer = m_srcSXCache.Add(key, std::move(newAnswer), now);
 
-	// 16+2+501*(4+2+4+2+16) = 14046 bytes max.
-	if (result->GetPacketSize() > 354) {
-		result->PackPacket();
-	}
-
-	return result;
+	return GetSrcInfoPacket(key, *answer, NULL);
 }
 
 void CPartFile::AddClientSources(CMemFile* sources, unsigned nSourceFrom, uint8 uClientSXVersion, bool bSourceExchange2, const CUpDownClient* /*pClient*/)
@@ -2888,8 +3232,9 @@ uint32 CPartFile::WriteToBuffer(uint32 transize, uint8_t* data, uint64 start, ui
 		m_iGainDueToCompression += lenData-transize;
 	}
 
-	// Occasionally packets are duplicated, no point writing it twice
-	if (IsComplete(start, end)) {
+	// Occasionally packets are duplicated, no point writing it twice.
+	// In end-game mode, another copy of the block may have arrived first.
+	if (!m_duplicateBlocks.Receive(IsComplete(start, end), transize)) {
 		AddDebugLogLineN(logPartFile,
 			CFormat(wxT("File '%s' has already been written from %u to %u"))
 				% GetFileName() % start % end);
@@ -2914,30 +3259,9 @@ uint32 CPartFile::WriteToBuffer(uint32 transize, uint8_t* data, uint64 start, ui
 	// log transferinformation in our "blackbox"
 	m_CorruptionBlackBox->TransferredData(start, end, client->GetIP());
 
-	// Create a new buffered queue entry
+	// Create a new buffered queue entry, kept ordered by offset
 	PartFileBufferedData *item = new PartFileBufferedData(m_hpartfile, data, start, end, block);
-
-	// Add to the queue in the correct position (most likely the end)
-	bool added = false;
-
-	std::list<PartFileBufferedData*>::iterator it = m_BufferedData_list.begin();
-	for (; it != m_BufferedData_list.end(); ++it) {
-		PartFileBufferedData* queueItem = *it;
-
-		if (item->end <= queueItem->end) {
-			if (it != m_BufferedData_list.begin()) {
-				added = true;
-
-				m_BufferedData_list.insert(--it, item);
-			}
-
-			break;
-		}
-	}
-
-	if (!added) {
-		m_BufferedData_list.push_front(item);
-	}
+	m_BufferedData->Add(item);
 
 	// Increment buffer size marker
 	m_nTotalBufferData += lenData;
@@ -2946,17 +3270,18 @@ uint32 CPartFile::WriteToBuffer(uint32 transize, uint8_t* data, uint64 start, ui
 	FillGap(item->start, item->end);
 
 	// Update the flushed mark on the requested block
-	// The loop here is unfortunate but necessary to detect deleted blocks.
+	// The lookup is necessary to detect deleted blocks.
+	if (m_requestedblocks_index.count(item->block)) {
+		item->block->transferred += lenData;
 
-	std::list<Requested_Block_Struct*>::iterator it2 = m_requestedblocks_list.begin();
-	for (; it2 != m_requestedblocks_list.end(); ++it2) {
-		if (*it2 == item->block) {
-			item->block->transferred += lenData;
+		// The other copies of a finished block are of no use anymore
+		if (m_duplicateBlocks.IsActive() && IsComplete(item->block->StartOffset, item->block->EndOffset)) {
+			CancelDuplicateBlocks(item->block, client);
 		}
 	}
 
 	if (m_gaplist.IsComplete()) {
-		FlushBuffer();
+		FlushBufferInBackground();
 	}
 
 	// Return the length of data written to the buffer
@@ -2965,16 +3290,45 @@ uint32 CPartFile::WriteToBuffer(uint32 transize, uint8_t* data, uint64 start, ui
 
 void CPartFile::FlushBuffer(bool fromAICHRecoveryDataAvailable)
 {
-	m_nLastBufferFlushTime = GetTickCount();
+	// Results of a flush still in the write thread have to be applied first.
+	WaitForFlush();
+
+	CPartFileWriteJob* job = PrepareFlush(fromAICHRecoveryDataAvailable);
+	if (job) {
+		m_flushJob = job;
+		job->Run();
+		FlushDone(job);
+	}
+}
+
 
-	if (m_BufferedData_list.empty()) {
+void CPartFile::FlushBufferInBackground()
+{
+	// Only one flush per file at a time, the data keeps piling up in the
+	// buffer meanwhile and is written by the next flush.
+	if (m_flushJob) {
 		return;
 	}
 
+	CPartFileWriteJob* job = PrepareFlush(false);
+	if (job) {
+		m_flushJob = job;
+		if (!CPartFileWriteThread::AddJob(job)) {
+			// Write thread not running (startup or shutdown)
+			job->Run();
+			FlushDone(job);
+		}
+	}
+}
+
 
-	uint32 partCount = GetPartCount();
-	// Remember which parts need to be checked at the end of the flush
-	std::vector<bool> changedPart(partCount, false);
+CPartFileWriteJob* CPartFile::PrepareFlush(bool fromAICHRecoveryDataAvailable)
+{
+	m_nLastBufferFlushTime = GetTickCount();
+
+	if (m_BufferedData->empty()) {
+		return NULL;
+	}
 
 	// Ensure file is big enough to write data to (the last item will be the furthest from the start)
 	if (!CheckFreeDiskSpace(m_nTotalBufferData)) {
@@ -2982,63 +3336,116 @@ void CPartFile::FlushBuffer(bool fromAICHRecoveryDataAvailable)
 		AddLogLineC(CFormat( _("WARNING: Not enough free disk-space! Pausing file: %s") ) % GetFileName());
 
 		PauseFile( true );
-		return;
+		return NULL;
 	}
 
-	// Loop through queue
-	while ( !m_BufferedData_list.empty() ) {
-		// Get top item and remove it from the queue
-		CScopedPtr<PartFileBufferedData> item(m_BufferedData_list.front());
-		m_BufferedData_list.pop_front();
-
-		// This is needed a few times
-		wxASSERT((item->end - item->start) < 0xFFFFFFFF);
-		uint32 lenData = (uint32)(item->end - item->start + 1);
+	uint32 partCount = GetPartCount();
+	CPartFileWriteJob* job = new CPartFileWriteJob(this, m_hpartfile, GetFileSize(), *m_hashStates, fromAICHRecoveryDataAvailable);
+	// Remember which parts need to be checked at the end of the flush
+	job->m_changedParts.resize(partCount, false);
+	job->m_buffers.Swap(*m_BufferedData);
+	job->m_dataSize = m_nTotalBufferData;
+	m_nTotalBufferData = 0;
 
+	// Bytes of each part written by the job
+	std::vector<uint64> flushedSizes(partCount, 0);
+	CBufferedDataMap::iterator it = job->m_buffers.begin();
+	for (; it != job->m_buffers.end(); ++it) {
 		// SLUGFILLER: SafeHash - could be more than one part
-		for (uint32 curpart = (item->start/PARTSIZE); curpart <= (item->end/PARTSIZE); ++curpart) {
+		for (uint32 curpart = (it->second->start/PARTSIZE); curpart <= (it->second->end/PARTSIZE); ++curpart) {
 			wxASSERT(curpart < partCount);
-			changedPart[curpart] = true;
+			job->m_changedParts[curpart] = true;
+			flushedSizes[curpart] += std::min(it->second->end, PARTSIZE * (curpart + 1) - 1)
+				- std::max(it->second->start, PARTSIZE * curpart) + 1;
 		}
 		// SLUGFILLER: SafeHash
+	}
 
-		// Go to the correct position in file and write block of data
-		try {
-			item->area.FlushAt(m_hpartfile, item->start, lenData);
-			// Decrease buffer size
-			m_nTotalBufferData -= lenData;
-		} catch (const CIOFailureException& e) {
-			AddDebugLogLineC(logPartFile, wxT("Error while saving part-file: ") + e.what());
-			SetStatus(PS_ERROR);
-			// No need to bang your head against it again and again if it has already failed.
-			DeleteContents(m_BufferedData_list);
-			m_nTotalBufferData = 0;
-			return;
+	// Parts with no data on disk yet may be hashed as the data is written,
+	// in whatever order it arrived
+	for (uint16 partNumber = 0; partNumber < partCount; ++partNumber) {
+		if (flushedSizes[partNumber] && flushedSizes[partNumber] == GetPartSize(partNumber) - m_gaplist.GetGapSize(partNumber)) {
+			m_hashStates->Begin(partNumber);
+		}
+	}
+
+	// Let the write thread hash the parts FlushDone is going to check
+	for (uint16 partNumber = 0; partNumber < partCount; ++partNumber) {
+		if (job->m_changedParts[partNumber]
+			&& (IsComplete(partNumber)
+				|| (IsCorruptedPart(partNumber) && (thePrefs::IsICHEnabled() || fromAICHRecoveryDataAvailable)))) {
+			job->AddPartToHash(partNumber, GetPartSize(partNumber));
 		}
 	}
 
+	return job;
+}
+
+
+void CPartFile::WaitForFlush(bool applyResults)
+{
+	CPartFileWriteJob* job = m_flushJob;
+	if (job == NULL) {
+		return;
+	}
+
+	CPartFileWriteThread::WaitForJob(job);
+
+	if (applyResults) {
+		FlushDone(job);
+	} else {
+		m_flushJob = NULL;
+		delete job;
+	}
+}
+
+
+bool CPartFile::IsBeingWritten(uint64 start, uint64 end) const
+{
+	if (m_flushJob && m_flushJob->Overlaps(start, end)) {
+		return true;
+	}
+
+	return m_BufferedData->Overlaps(start, end);
+}
+
+
+void CPartFile::FlushDone(CPartFileWriteJob* job)
+{
+	wxCHECK_RET(job == m_flushJob, wxT("FlushDone called for a foreign write job"));
+	CScopedPtr<CPartFileWriteJob> jobPtr(job);
+	m_flushJob = NULL;
+
+	bool fromAICHRecoveryDataAvailable = job->m_fromAICHRecoveryDataAvailable;
+
+	if (!job->m_writeError.IsEmpty()) {
+		AddDebugLogLineC(logPartFile, wxT("Error while saving part-file: ") + job->m_writeError);
+		SetStatus(PS_ERROR);
+		return;
+	}
 
 	// Update last-changed date
 	m_lastDateChanged = wxDateTime::GetTimeNow();
 
-	try {
-		// Partfile should never be too large
-		if (m_hpartfile.GetLength() > GetFileSize()) {
-			// it's "last chance" correction. the real bugfix has to be applied 'somewhere' else
-			m_hpartfile.SetLength(GetFileSize());
-		}
-	} catch (const CIOFailureException& e) {
+	if (!job->m_truncateError.IsEmpty()) {
 		AddDebugLogLineC(logPartFile,
 			CFormat(wxT("Error while truncating part-file (%s): %s"))
-				% m_PartPath % e.what());
+				% m_PartPath % job->m_truncateError);
 		SetStatus(PS_ERROR);
 	}
 
-
+	uint32 partCount = GetPartCount();
 
 	// Check each part of the file
 	for (uint16 partNumber = 0; partNumber < partCount; ++partNumber) {
-		if (changedPart[partNumber] == false) {
+		if (job->m_changedParts[partNumber] == false) {
+			continue;
+		}
+
+		// Only check the parts PrepareFlush had hashed. A part completed
+		// since then by data still buffered is checked by the next flush,
+		// as that data isn't on disk yet.
+		if (job->GetPartHash(partNumber) == NULL) {
 			continue;
 		}
 
@@ -3047,7 +3454,7 @@ void CPartFile::FlushBuffer(bool fromAICHRecoveryDataAvailable)
 		// Is this 9MB part complete
 		if (IsComplete(partNumber)) {
 			// Is part corrupt
-			if (!HashSinglePart(partNumber)) {
+			if (!HashSinglePart(partNumber, job)) {
 				AddLogLineC(CFormat(
 					_("Downloaded part %i is corrupt in file: %s") ) % partNumber % GetFileName() );
 				AddGap(partNumber);
@@ -3088,7 +3495,7 @@ void CPartFile::FlushBuffer(bool fromAICHRecoveryDataAvailable)
 					(thePrefs::IsICHEnabled()			// old ICH:  rehash whenever we have new data hoping it will be good now
 					|| fromAICHRecoveryDataAvailable)) {// new AICH: one rehash right before performing it (maybe it's already good)
 			// Try to recover with minimal loss
-			if (HashSinglePart(partNumber)) {
+			if (HashSinglePart(partNumber, job)) {
 				++m_iTotalPacketsSavedDueToICH;
 
 				uint64 uMissingInPart = m_gaplist.GetGapSize(partNumber);
@@ -3124,14 +3531,20 @@ void CPartFile::FlushBuffer(bool fromAICHRecoveryDataAvailable)
 	if (theApp->IsRunning()) { // may be called during shutdown!
 		// Is this file finished ?
 		if (m_gaplist.IsComplete()) {
-			CompleteFile(false);
+			if (m_BufferedData->empty()) {
+				CompleteFile(false);
+			} else {
+				// Data arrived while this flush was running. The file
+				// is completed once that has been written, too.
+				FlushBufferInBackground();
+			}
 		}
 	}
 }
 
 
 // read data for upload, return false on error
-bool CPartFile::ReadData(CFileArea & area, uint64 offset, uint32 toread)
+bool CPartFile::ReadData(CFileArea & area, uint64 offset, uint32 toread, CFileIOBatch* batch)
 {
 	// Sanity check
 	if (offset + toread > GetFileSize()) {
@@ -3141,7 +3554,23 @@ bool CPartFile::ReadData(CFileArea & area, uint64 offset, uint32 toread)
 		return false;
 	}
 
-	area.ReadAt(m_hpartfile, offset, toread);
+	// Data which has not reached the disk yet must be written first,
+	// otherwise stale data would be read.
+	if (IsBeingWritten(offset, offset + toread - 1)) {
+		AddDebugLogLineN(logPartFile, CFormat(wxT("Flushing buffered data of %s for reading %u bytes at %u"))
+			% GetFileName() % toread % offset);
+		// Reads queued before would have to be done while the file is
+		// surely open, the caller leaves the block for the next batch
+		wxASSERT(!batch || !batch->GetCount());
+		FlushBuffer();
+
+		// The flush may have found the data corrupt or completed the file
+		if (!IsComplete(offset, offset + toread - 1) || !m_hpartfile.IsOpened()) {
+			return false;
+		}
+	}
+
+	area.ReadAt(m_hpartfile, offset, toread, batch);
 	// if it fails it throws (which the caller should catch)
 	return true;
 }
@@ -3221,6 +3650,12 @@ void CPartFile::AddDownloadingSource(CUpDownClient* client)
 }
 
 
+void CPartFile::AddDeferredSource(CUpDownClient* client)
+{
+	m_deferredSources.push_back(CCLIENTREF(client, wxT("CPartFile::AddDeferredSource")));
+}
+
+
 void CPartFile::RemoveDownloadingSource(CUpDownClient* client)
 {
 	CClientRefList::iterator it =
@@ -3499,6 +3934,8 @@ void CPartFile::ClientStateChanged( int oldState, int newState )
 bool CPartFile::AddSource( CUpDownClient* client )
 {
 	if (m_SrcList.insert(CCLIENTREF(client, wxT("CPartFile::AddSource"))).second) {
+		theApp->downloadqueue->AddSourceToIndex(client);
+		m_srcSXCache.Invalidate();
 		theStats::AddFoundSource();
 		theStats::AddSourceOrigin(client->GetSourceFrom());
 		return true;
@@ -3511,6 +3948,8 @@ bool CPartFile::AddSource( CUpDownClient* client )
 bool CPartFile::DelSource( CUpDownClient* client )
 {
 	if (m_SrcList.erase(CCLIENTREF(client, wxEmptyString))) {
+		theApp->downloadqueue->RemoveSourceFromIndex(client);
+		m_srcSXCache.Invalidate();
 		theStats::RemoveSourceOrigin(client->GetSourceFrom());
 		theStats::RemoveFoundSource();
 		return true;
@@ -3527,30 +3966,46 @@ void CPartFile::UpdatePartsFrequency( CUpDownClient* client, bool increment )
 	if ( m_SrcpartFrequency.size() != GetPartCount() ) {
 		m_SrcpartFrequency.clear();
 		m_SrcpartFrequency.insert(m_SrcpartFrequency.begin(), GetPartCount(), 0);
+		m_srcAvailability.Recount(m_SrcpartFrequency);
+		m_chunkSelector.InvalidateAll();
 
 		if ( !increment ) {
 			return;
 		}
 	}
 
-	unsigned int size = freq.size();
-	if ( size != m_SrcpartFrequency.size() ) {
+	if ( freq.size() != m_SrcpartFrequency.size() ) {
 		return;
 	}
 
-	if ( increment ) {
-		for ( unsigned int i = 0; i < size; i++ ) {
-			if ( freq.get(i) ) {
-				m_SrcpartFrequency[i]++;
-			}
-		}
+	m_srcAvailability.Update(m_SrcpartFrequency, freq, increment);
+
+	// The chunks of a complete source all change
+	if ( freq.AllTrue() ) {
+		m_chunkSelector.InvalidateAll();
 	} else {
-		for ( unsigned int i = 0; i < size; i++ ) {
-			if ( freq.get(i) ) {
-				m_SrcpartFrequency[i]--;
-			}
+		freq.ForEachSet([this](uint32 part) { m_chunkSelector.Invalidate(part); });
+	}
+}
+
+
+void CPartFile::CheckPartsFrequency()
+{
+	ArrayOfUInts16 frequencies(GetPartCount(), 0);
+
+	for ( SourceSet::iterator it = m_SrcList.begin(); it != m_SrcList.end(); ++it ) {
+		const CUpDownClient* client = it->GetClient();
+		if ( client->GetRequestFile() == this ) {
+			CPartAvailability::AddStatus(frequencies, client->GetPartStatus());
 		}
 	}
+
+	if ( frequencies != m_SrcpartFrequency ) {
+		AddDebugLogLineN(logPartFile, wxT("Frequency of parts was off, counted again: ") + GetFileName().GetPrintable());
+		m_SrcpartFrequency.swap(frequencies);
+		m_srcAvailability.Recount(m_SrcpartFrequency);
+		m_chunkSelector.InvalidateAll();
+	}
 }
 
 void CPartFile::GetRatingAndComments(FileRatingList & list) const
@@ -3695,6 +4150,12 @@ void CPartFile::Init()
 
 #ifndef CLIENT_GUI
 	m_CorruptionBlackBox = std::make_unique<CCorruptionBlackBox>();
+	m_flushJob = NULL;
+	m_hashStates = std::make_unique<CPartHashStates>();
+	m_BufferedData = std::make_unique<CBufferedDataMap>();
+	m_journalLength = 0;
+	m_partMetLength = 0;
+	m_chunkPreview = false;
 #endif
 }
 
@@ -34,12 +34,19 @@
 #include "OtherStructs.h"	// Needed for Requested_Block_Struct
 #include "DeadSourceList.h"	// Needed for CDeadSourceList
 #include "GapList.h"
+#include "PartFileJournal.h"	// Needed for CPartFileJournal
+#include "ChunkSelector.h"	// Needed for CChunkSelector
+#include "EndGame.h"		// Needed for CEndGameRequests
+#include "BitVector.h"		// Needed for BitVector
 
 class CSearchFile;
 class CMemFile;
 class CFileDataIO;
 class CED2KFileLink;
 class CCorruptionBlackBox;
+class CPartHashStates;
+class CBufferedDataMap;
+class CTag;
 
 //#define BUFFER_SIZE_LIMIT	500000 // Max bytes before forcing a flush
 #define BUFFER_TIME_LIMIT	60000   // Max milliseconds before forcing a flush
@@ -114,12 +121,16 @@ public:
 	uint8	LoadPartFile(const CPath& in_directory, const CPath& filename, bool from_backup = false, bool getsizeonly = false);
 	bool	SavePartFile(bool Initial = false);
 	void	PartFileHashFinished(CKnownFile* result);
-	bool	HashSinglePart(uint16 partnumber); // true = ok , false = corrupted
+	bool	HashSinglePart(uint16 partnumber, const class CPartFileWriteJob* job = NULL); // true = ok , false = corrupted
 
 	bool    CheckShowItemInGivenCat(int inCategory);
 
 	bool	IsComplete(uint64 start, uint64 end)	{ return m_gaplist.IsComplete(start, end); }
 	bool	IsComplete(uint16 part)			{ return m_gaplist.IsComplete(part); }
+#ifndef CLIENT_GUI
+	//! Returns the parts that are complete, one bit per part.
+	const BitVector& GetCompleteParts();
+#endif
 
 	void	UpdateCompletedInfos();
 
@@ -166,11 +177,25 @@ public:
 	// Barry - Added as replacement for BlockReceived to buffer data before writing to disk
 	uint32	WriteToBuffer(uint32 transize, uint8_t *data, uint64 start, uint64 end, Requested_Block_Struct *block, const CUpDownClient* client);
 	void	FlushBuffer(bool fromAICHRecoveryDataAvailable = false);
+	// Hands the buffered data to the CPartFileWriteThread, see FlushDone
+	void	FlushBufferInBackground();
+	// Returns the amount of data waiting to be handed to the write thread
+	uint32	GetBufferedDataSize() const	{ return m_nTotalBufferData; }
+	// Remembers a source that deferred its block requests, see CDownloadBufferPool
+	void	AddDeferredSource(CUpDownClient* client);
+	// Applies the results of a flush, called on the main thread
+	void	FlushDone(class CPartFileWriteJob* job);
 
 	// Barry - Added to prevent list containing deleted blocks on shutdown
 	void	RemoveAllRequestedBlocks(void);
 
 	void	RemoveBlockFromList(uint64 start,uint64 end);
+	//! Removes one request, leaving other requests of the same block alone.
+	void	RemoveBlockFromList(const Requested_Block_Struct* block);
+#ifndef CLIENT_GUI
+	//! Returns true if the last blocks are to be requested from several sources.
+	bool	IsEndGame();
+#endif
 	void	RemoveAllSources(bool bTryToSwap);
 	void	Delete();
 	void	StopFile(bool bCancel = false);
@@ -297,6 +322,44 @@ private:
 
 	// CorruptionBlackBox ownership managed by unique_ptr for automatic cleanup
 	std::unique_ptr<CCorruptionBlackBox> m_CorruptionBlackBox;
+
+	//! The chunks ordered by download priority.
+	CChunkSelector	m_chunkSelector;
+	//! The preview state the chunks were ranked with.
+	bool	m_chunkPreview;
+
+	//! Counts the parts in m_SrcpartFrequency.
+	CPartAvailability	m_srcAvailability;
+
+	//! See GetCompleteParts, empty until first used.
+	BitVector	m_completeParts;
+	//! Updates m_completeParts after the gaps of the parts changed.
+	void	UpdateCompleteParts(uint16 first, uint16 last);
+
+	/**
+	 * Counts the frequency of parts from all sources, fixing the
+	 * incremental counts if they are off.
+	 */
+	void	CheckPartsFrequency();
+
+	//! Answers to source exchange requests, from the download sources.
+	CSourceExchangeCache	m_srcSXCache;
+
+	/**
+	 * Requests blocks from 'sender' which are requested from other
+	 * sources already, for the end-game mode.
+	 *
+	 * @return The number of blocks added to 'toadd', at most 'count'.
+	 */
+	uint16	GetEndGameBlocks(CUpDownClient* sender, std::vector<Requested_Block_Struct*>& toadd, uint16 count);
+
+	/**
+	 * Cancels the other requests of a block once it is complete.
+	 *
+	 * @param block The request which completed it.
+	 * @param winner The source of that request.
+	 */
+	void	CancelDuplicateBlocks(const Requested_Block_Struct* block, const CUpDownClient* winner);
 #endif
 
 	uint16	m_notCurrentSources;
@@ -307,6 +370,8 @@ private:
 	void	AddGap(uint16 part);
 	void	FillGap(uint64 start, uint64 end);
 	void	FillGap(uint16 part);
+	//! Marks the chunks overlapping the range to be ranked again.
+	void	InvalidateChunks(uint64 start, uint64 end);
 	bool	GetNextEmptyBlockInPart(uint16 partnumber,Requested_Block_Struct* result);
 	bool	IsAlreadyRequested(uint64 start, uint64 end);
 	void	CompleteFile(bool hashingdone);
@@ -340,6 +405,10 @@ private:
 	uint32	m_LastNoNeededCheck;
 	CGapList m_gaplist;
 	CReqBlockPtrList m_requestedblocks_list;
+	// Index of m_requestedblocks_list, to detect deleted blocks
+	std::set<Requested_Block_Struct*> m_requestedblocks_index;
+	// Requests of m_requestedblocks_list which were requested already, see GetEndGameBlocks
+	CEndGameRequests m_duplicateBlocks;
 	double	percentcompleted;
 	std::list<uint16> m_corrupted_list;
 	uint16	m_availablePartsCount;
@@ -350,12 +419,42 @@ private:
 
 	uint32		m_lastRefreshedDLDisplay;
 
+#ifndef CLIENT_GUI
 	// Buffered data to be written
-	std::list<class PartFileBufferedData*> m_BufferedData_list;
+	std::unique_ptr<CBufferedDataMap> m_BufferedData;
+#endif
 
 	uint32 m_nTotalBufferData;
 	uint32 m_nLastBufferFlushTime;
 
+#ifndef CLIENT_GUI
+	// Flush currently handed to the write thread (at most one per file)
+	class CPartFileWriteJob* m_flushJob;
+	// Incremental MD4 hashes of the parts receiving data
+	std::unique_ptr<CPartHashStates> m_hashStates;
+	// Sources waiting for the download buffers to drain
+	CClientRefList m_deferredSources;
+
+	class CPartFileWriteJob* PrepareFlush(bool fromAICHRecoveryDataAvailable);
+	void	WaitForFlush(bool applyResults = true);
+
+	// Gaps and hashset as of the last .part.met journal record
+	CPartFileJournal::GapVector m_journaledGaps;
+	std::vector<CMD4Hash> m_journaledHashes;
+	// Length of the .part.met journal
+	uint64	m_journalLength;
+	// Length of the .part.met as last written
+	uint64	m_partMetLength;
+
+	void	LoadPartMetTag(const CTag& newtag, bool isnewstyle, std::map<uint16, Gap_Struct*>& gap_map);
+	void	WritePartMet(CFileDataIO* file);
+	uint32	WriteStateTags(CFileDataIO* file);
+	void	GetGaps(CPartFileJournal::GapVector& gaps) const;
+	void	AppendToJournal();
+	void	CompactPartMet();
+	void	LoadJournal();
+#endif
+
 	uint8	m_category;
 	uint32	m_nDlActiveTime;
 	time_t  m_tActivated;
@@ -427,8 +526,11 @@ public:
 	// Dropping slow sources
 	CUpDownClient* GetSlowerDownloadingClient(uint32 speed, CUpDownClient* caller);
 
-  // Read data for sharing
-	bool ReadData(class CFileArea & area, uint64 offset, uint32 toread);
+  // Read data for sharing, queued to the batch if given (see CFileArea::ReadAt).
+  // Data not yet written is flushed first, which the batch must be empty for.
+	bool ReadData(class CFileArea & area, uint64 offset, uint32 toread, class CFileIOBatch* batch = NULL);
+	// True if data of the range is buffered or being written to disk
+	bool IsBeingWritten(uint64 start, uint64 end) const;
 
 private:
 	/* downloading sources list */
@@ -0,0 +1,243 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+
+#include "PartFileJournal.h"		// Interface declarations
+
+#include <algorithm>			// Needed for std::min
+
+#include <common/MuleDebug.h>		// Needed for MULE_VALIDATE_PARAMS
+
+#include "CFile.h"			// Needed for CFile
+#include "MemFile.h"			// Needed for CMemFile
+
+
+//! Size of the header of a record (length and checksum).
+static const uint32 RECORD_HEADER_SIZE = 8;
+//! Records larger than this are considered corrupt.
+static const uint32 MAX_RECORD_SIZE = 64 * 1024 * 1024;
+
+
+//! Lookup table of the CRC-32 (as used by zlib).
+struct CChecksumTable
+{
+	CChecksumTable()
+	{
+		for (uint32 i = 0; i < 256; ++i) {
+			uint32 value = i;
+			for (int bit = 0; bit < 8; ++bit) {
+				value = (value & 1) ? (0xEDB88320u ^ (value >> 1)) : (value >> 1);
+			}
+			values[i] = value;
+		}
+	}
+
+	uint32 values[256];
+};
+
+
+/** Returns the CRC-32 of the given data. */
+static uint32 GetChecksum(const uint8_t* data, size_t length)
+{
+	static const CChecksumTable table;
+
+	uint32 crc = 0xFFFFFFFFu;
+	for (size_t i = 0; i < length; ++i) {
+		crc = table.values[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	}
+
+	return crc ^ 0xFFFFFFFFu;
+}
+
+
+CPath CPartFileJournal::GetPath(const CPath& metFile)
+{
+	return metFile.AppendExt(PARTMET_JOURNAL_EXT);
+}
+
+
+CPath CPartFileJournal::GetOldPath(const CPath& metFile)
+{
+	return metFile.AppendExt(PARTMET_OLD_JOURNAL_EXT);
+}
+
+
+uint64 CPartFileJournal::Append(const CPath& path, const CMemFile& record)
+{
+	const uint32 length = record.GetLength();
+	MULE_VALIDATE_PARAMS(length && length <= MAX_RECORD_SIZE, wxT("Invalid journal record size."));
+
+	// Header and contents are written at once, to keep torn records rare.
+	CMemFile buffer(RECORD_HEADER_SIZE + length);
+	buffer.WriteUInt32(length);
+	buffer.WriteUInt32(GetChecksum(record.GetRawBuffer(), length));
+	buffer.Write(record.GetRawBuffer(), length);
+
+	CFile file;
+	if (!file.Open(path, CFile::write_append)) {
+		throw CIOFailureException(wxT("Failed to open journal for appending"));
+	}
+
+	file.Write(buffer.GetRawBuffer(), buffer.GetLength());
+
+	return file.GetLength();
+}
+
+
+bool CPartFileJournal::Read(const CPath& path, RecordList& records)
+{
+	if (!path.FileExists()) {
+		return true;
+	}
+
+	CFile file;
+	if (!file.Open(path, CFile::read)) {
+		throw CIOFailureException(wxT("Failed to open journal for reading"));
+	}
+
+	const uint64 fileLength = file.GetLength();
+	uint64 validLength = 0;
+	while (fileLength - validLength >= RECORD_HEADER_SIZE) {
+		const uint32 length = file.ReadUInt32();
+		const uint32 checksum = file.ReadUInt32();
+		if (length == 0 || length > MAX_RECORD_SIZE || length > fileLength - validLength - RECORD_HEADER_SIZE) {
+			break;
+		}
+
+		std::vector<uint8_t> record(length);
+		file.Read(&record[0], length);
+		if (GetChecksum(&record[0], length) != checksum) {
+			break;
+		}
+
+		records.push_back(std::vector<uint8_t>());
+		records.back().swap(record);
+		validLength += RECORD_HEADER_SIZE + length;
+	}
+
+	if (validLength == fileLength) {
+		return true;
+	}
+
+	file.Close();
+	file.Reopen(CFile::read_write);
+	if (!file.SetLength(validLength)) {
+		throw CIOFailureException(wxT("Failed to truncate journal"));
+	}
+
+	return false;
+}
+
+
+void CPartFileJournal::Rotate(const CPath& metFile)
+{
+	const CPath journal = GetPath(metFile);
+	const CPath oldJournal = GetOldPath(metFile);
+
+	if (!journal.FileExists()) {
+		return;
+	} else if (!oldJournal.FileExists()) {
+		if (!CPath::RenameFile(journal, oldJournal)) {
+			throw CIOFailureException(wxT("Failed to rename journal"));
+		}
+
+		return;
+	}
+
+	// Reading the old journal cuts off any torn record, which would
+	// otherwise hide the records appended after it.
+	RecordList unused;
+	Read(oldJournal, unused);
+
+	RecordList records;
+	Read(journal, records);
+	for (RecordList::const_iterator it = records.begin(); it != records.end(); ++it) {
+		Append(oldJournal, CMemFile(&(*it)[0], it->size()));
+	}
+
+	if (!CPath::RemoveFile(journal)) {
+		throw CIOFailureException(wxT("Failed to remove journal"));
+	}
+}
+
+
+void CPartFileJournal::DiffGaps(const GapVector& before, const GapVector& after, GapChanges& changes)
+{
+	// Both sets of gaps are swept at once. Each gap toggles the state
+	// of its set at its start and again right after its end.
+	std::vector<uint64> beforeToggles;
+	beforeToggles.reserve(before.size() * 2);
+	for (GapVector::const_iterator it = before.begin(); it != before.end(); ++it) {
+		beforeToggles.push_back(it->first);
+		beforeToggles.push_back(it->second + 1);
+	}
+
+	std::vector<uint64> afterToggles;
+	afterToggles.reserve(after.size() * 2);
+	for (GapVector::const_iterator it = after.begin(); it != after.end(); ++it) {
+		afterToggles.push_back(it->first);
+		afterToggles.push_back(it->second + 1);
+	}
+
+	changes.clear();
+
+	size_t i = 0, j = 0;
+	bool inBefore = false, inAfter = false;
+	bool open = false;
+	GapChange current = { 0, 0, false };
+	while (i < beforeToggles.size() || j < afterToggles.size()) {
+		uint64 pos;
+		if (i == beforeToggles.size()) {
+			pos = afterToggles[j];
+		} else if (j == afterToggles.size()) {
+			pos = beforeToggles[i];
+		} else {
+			pos = std::min(beforeToggles[i], afterToggles[j]);
+		}
+
+		// Adjacent gaps toggle twice at the same position.
+		for (; i < beforeToggles.size() && beforeToggles[i] == pos; ++i) {
+			inBefore = !inBefore;
+		}
+		for (; j < afterToggles.size() && afterToggles[j] == pos; ++j) {
+			inAfter = !inAfter;
+		}
+
+		const bool differs = (inBefore != inAfter);
+		if (open && (!differs || inAfter != current.isGap)) {
+			current.end = pos - 1;
+			changes.push_back(current);
+			open = false;
+		}
+
+		if (differs && !open) {
+			current.start = pos;
+			current.isGap = inAfter;
+			open = true;
+		}
+	}
+
+	wxASSERT(!open);
+}
+// File_checked_for_headers
@@ -0,0 +1,130 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+
+#ifndef PARTFILEJOURNAL_H
+#define PARTFILEJOURNAL_H
+
+#include <vector>
+
+#include "Types.h"
+#include <common/Path.h>	// Needed for CPath
+
+class CMemFile;
+
+
+//! Extension of the journal of a .part.met file.
+#define PARTMET_JOURNAL_EXT wxT(".journal")
+//! Extension of a journal that is being compacted.
+#define PARTMET_OLD_JOURNAL_EXT wxT(".journal.old")
+
+
+/**
+ * Append-only journal of the changes to a .part.met file.
+ *
+ * Instead of rewriting the whole .part.met every time a part-file is
+ * saved, the changes since the last save are appended to the journal
+ * "<name>.part.met.journal". Every record describes the absolute state of
+ * what it covers, so replaying records that are already contained in the
+ * .part.met is harmless, as long as they are replayed in order.
+ *
+ * Compaction moves the journal aside to "<name>.part.met.journal.old",
+ * writes a new .part.met and only then removes the old journal. A crash
+ * at any point thus leaves a .part.met and the journals needed to restore
+ * the latest state.
+ *
+ * Each record is stored as its length, the CRC-32 of its contents and the
+ * contents. A record torn by a crash fails the check and ends the journal.
+ */
+class CPartFileJournal
+{
+public:
+	//! The gaps of a file as (start, end) pairs, sorted and inclusive.
+	typedef std::vector<std::pair<uint64, uint64> > GapVector;
+
+	//! A range of a file that became a gap or complete.
+	struct GapChange
+	{
+		uint64	start;
+		uint64	end;
+		bool	isGap;
+	};
+
+	typedef std::vector<GapChange> GapChanges;
+
+	//! The contents of the records of a journal.
+	typedef std::vector<std::vector<uint8_t> > RecordList;
+
+	/** Returns the path of the journal of the given .part.met file. */
+	static CPath GetPath(const CPath& metFile);
+
+	/** Returns the path of the journal being compacted. */
+	static CPath GetOldPath(const CPath& metFile);
+
+	/**
+	 * Appends a record to a journal, creating the journal as needed.
+	 *
+	 * @param path The journal.
+	 * @param record The contents of the record.
+	 * @return The length of the journal afterwards.
+	 *
+	 * Throws CIOFailureException on failure.
+	 */
+	static uint64 Append(const CPath& path, const CMemFile& record);
+
+	/**
+	 * Reads all records of a journal.
+	 *
+	 * @param path The journal.
+	 * @param records Receives the contents of the records, in order.
+	 * @return False if invalid data was found after the last valid record.
+	 *
+	 * Invalid data, typically a record torn by a crash, is cut off, so that
+	 * records appended later can be read again. A missing journal is empty.
+	 * Throws CIOFailureException on failure.
+	 */
+	static bool Read(const CPath& path, RecordList& records);
+
+	/**
+	 * Moves a journal aside before compaction.
+	 *
+	 * If an old journal is left from a failed compaction, the journal is
+	 * appended to it instead, so that no records are lost.
+	 *
+	 * Throws CIOFailureException on failure.
+	 */
+	static void Rotate(const CPath& metFile);
+
+	/**
+	 * Lists the ranges whose state differs between two sets of gaps.
+	 *
+	 * @param before The gaps as last recorded.
+	 * @param after The current gaps.
+	 * @param changes Receives the ranges that became gaps or complete.
+	 */
+	static void DiffGaps(const GapVector& before, const GapVector& after, GapChanges& changes);
+};
+
+#endif // PARTFILEJOURNAL_H
+// File_checked_for_headers
@@ -0,0 +1,447 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+#include "PartFileWriteThread.h"	// Interface declarations
+
+#include <algorithm>			// Needed for std::find
+#include <deque>
+#include <list>
+
+#include <wx/app.h>			// Needed for wxTheApp
+
+#include <protocol/ed2k/Constants.h>	// Needed for PARTSIZE
+#include "FileAutoClose.h"		// Needed for CFileAutoClose
+#include "FileIOBatch.h"		// Needed for CFileIOBatch
+#include "KnownFile.h"			// Needed for CKnownFile::CreateHashFromFile
+#include "PartFile.h"			// Needed for CPartFile::FlushDone
+#include "Logger.h"			// Needed for AddDebugLogLine{C,N}
+#include <common/Format.h>		// Needed for CFormat
+
+
+////////////////////////////////////////////////////////////
+// PartFileBufferedData
+
+PartFileBufferedData::PartFileBufferedData(CFileAutoClose& file, uint8_t * data, uint64 _start, uint64 _end, Requested_Block_Struct *_block)
+	: start(_start), end(_end), block(_block)
+{
+	area.StartWriteAt(file, start, end-start+1);
+	memcpy(area.GetBuffer(), data, end-start+1);
+}
+
+
+////////////////////////////////////////////////////////////
+// CBufferedDataMap
+
+void CBufferedDataMap::Add(PartFileBufferedData* item)
+{
+	m_maxLength = std::max(m_maxLength, item->end - item->start + 1);
+	m_items.insert(ItemMap::value_type(item->start, item));
+}
+
+
+bool CBufferedDataMap::Overlaps(uint64 start, uint64 end) const
+{
+	// No item starting before this can reach 'start'
+	uint64 first = (start > m_maxLength) ? start - m_maxLength : 0;
+
+	const_iterator it = m_items.lower_bound(first);
+	for (; it != m_items.end() && it->first <= end; ++it) {
+		if (it->second->end >= start) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+void CBufferedDataMap::Swap(CBufferedDataMap& other)
+{
+	m_items.swap(other.m_items);
+	std::swap(m_maxLength, other.m_maxLength);
+}
+
+
+void CBufferedDataMap::Clear()
+{
+	for (iterator it = m_items.begin(); it != m_items.end(); ++it) {
+		delete it->second;
+	}
+
+	m_items.clear();
+	m_maxLength = 0;
+}
+
+
+////////////////////////////////////////////////////////////
+// CPartFileWriteJob
+
+CPartFileWriteJob::CPartFileWriteJob(CPartFile* owner, CFileAutoClose& file, uint64 fileSize, CPartHashStates& hashStates, bool fromAICHRecoveryDataAvailable)
+	: m_owner(owner),
+	  m_dataSize(0),
+	  m_fromAICHRecoveryDataAvailable(fromAICHRecoveryDataAvailable),
+	  m_file(file),
+	  m_fileSize(fileSize),
+	  m_hashStates(hashStates)
+{
+}
+
+
+void CPartFileWriteJob::AddPartToHash(uint16 part, uint32 length)
+{
+	PartHash entry;
+	entry.part = part;
+	entry.length = length;
+
+	m_hashes.push_back(entry);
+}
+
+
+const CPartFileWriteJob::PartHash* CPartFileWriteJob::GetPartHash(uint16 part) const
+{
+	for (std::vector<PartHash>::const_iterator it = m_hashes.begin(); it != m_hashes.end(); ++it) {
+		if (it->part == part) {
+			return &(*it);
+		}
+	}
+
+	return NULL;
+}
+
+
+bool CPartFileWriteJob::Overlaps(uint64 start, uint64 end) const
+{
+	return m_buffers.Overlaps(start, end);
+}
+
+
+void CPartFileWriteJob::Run()
+{
+	// Where supported, all runs are handed to the kernel at once.
+	CFileIOBatch batch;
+	CFile* pinned = NULL;
+	std::vector<PartFileBufferedData*> batched;
+	uint64 batchedEnd = 0;
+
+	if (CFileIOBatch::IsBatched()) {
+		try {
+			pinned = &m_file.Pin();
+		} catch (const CIOFailureException& e) {
+			m_writeError = e.what();
+			return;
+		}
+	}
+
+	// The container itself is left untouched, since the main thread may
+	// check it for overlaps (see Overlaps) while the job is being executed.
+	CBufferedDataMap::iterator it = m_buffers.begin();
+	while (it != m_buffers.end()) {
+		// Adjacent buffers are collected and written with a single call.
+		// Mapped buffers are part of the file already and only need syncing.
+		std::vector<PartFileBufferedData*> run;
+		CFile::IOVector buffers;
+
+		do {
+			PartFileBufferedData* item = it->second;
+
+			wxASSERT((item->end - item->start) < 0xFFFFFFFF);
+			uint32 lenData = (uint32)(item->end - item->start + 1);
+
+			if (!run.empty() && (item->area.IsMapped() || item->start != run.back()->end + 1)) {
+				break;
+			}
+
+			// Must be done before flushing, which releases the buffer
+			m_hashStates.Feed(item->start, item->area.GetBuffer(), lenData);
+
+			run.push_back(item);
+			buffers.push_back(CFile::IOVector::value_type(item->area.GetBuffer(), lenData));
+			++it;
+		} while (it != m_buffers.end() && !run.back()->area.IsMapped());
+
+		if (pinned && !run.front()->area.IsMapped()) {
+			// The kernel may reorder the writes of a batch, so newer data
+			// overlapping data already queued has to wait for it.
+			if (!batched.empty() && run.front()->start <= batchedEnd) {
+				batch.Execute();
+				batch.Wait();
+			}
+
+			if (run.size() == 1) {
+				run.front()->area.FlushAt(m_file, run.front()->start, buffers.front().second, &batch);
+			} else {
+				batch.AddWrite(*pinned, buffers, run.front()->start);
+			}
+			batched.insert(batched.end(), run.begin(), run.end());
+			batchedEnd = std::max(batchedEnd, run.back()->end);
+			continue;
+		}
+
+		try {
+			if (run.size() == 1) {
+				PartFileBufferedData* item = run.front();
+				item->area.FlushAt(m_file, item->start, buffers.front().second);
+			} else {
+				m_file.WriteAtV(buffers, run.front()->start);
+				for (std::vector<PartFileBufferedData*>::iterator item = run.begin(); item != run.end(); ++item) {
+					(*item)->area.Close();
+				}
+			}
+		} catch (const CIOFailureException& e) {
+			// No need to bang your head against it again and again if it has already failed.
+			m_writeError = e.what();
+			break;
+		}
+	}
+
+	if (pinned) {
+		// This thread has nothing else to do in the meantime
+		if (m_writeError.IsEmpty()) {
+			batch.Execute();
+			batch.Wait();
+		}
+		m_file.Unlock();
+
+		for (size_t i = 0; i < batch.GetCount() && m_writeError.IsEmpty(); ++i) {
+			try {
+				batch.CheckResult(i);
+			} catch (const CIOFailureException& e) {
+				m_writeError = e.what();
+			}
+		}
+
+		for (std::vector<PartFileBufferedData*>::iterator item = batched.begin(); item != batched.end(); ++item) {
+			(*item)->area.Close();
+		}
+	}
+
+	if (!m_writeError.IsEmpty()) {
+		return;
+	}
+
+	try {
+		// Partfile should never be too large
+		if (m_file.GetLength() > m_fileSize) {
+			// it's "last chance" correction. the real bugfix has to be applied 'somewhere' else
+			m_file.SetLength(m_fileSize);
+		}
+	} catch (const CIOFailureException& e) {
+		m_truncateError = e.what();
+	}
+
+	for (std::vector<PartHash>::iterator it = m_hashes.begin(); it != m_hashes.end(); ++it) {
+		if (m_hashStates.GetHash(it->part, it->length, it->hash)) {
+			continue;
+		}
+
+		AddDebugLogLineN(logPartFile, CFormat(wxT("Part %u of '%s' was not hashed incrementally, reading it from disk"))
+			% it->part % m_file.GetFilePath());
+
+		try {
+			CKnownFile::CreateHashFromFile(m_file, PARTSIZE * it->part, it->length, &it->hash, NULL);
+		} catch (const CIOFailureException& e) {
+			it->error = e.what();
+		} catch (const CEOFException& e) {
+			it->error = e.what();
+		}
+	}
+}
+
+
+////////////////////////////////////////////////////////////
+// CPartFileWriteThread
+
+typedef std::deque<CPartFileWriteJob*> CWriteJobQueue;
+typedef std::list<CPartFileWriteJob*> CWriteJobList;
+
+//! Global lock for the write thread and its queues.
+static wxMutex s_lock;
+//! Signaled when new jobs are queued or the thread is terminated.
+static wxCondition s_jobAdded(s_lock);
+//! Signaled when a job has been executed.
+static wxCondition s_jobDone(s_lock);
+//! Jobs waiting to be executed.
+static CWriteJobQueue s_queue;
+//! The job currently being executed.
+static CPartFileWriteJob* s_currentJob = NULL;
+//! Executed jobs waiting to be collected by their owners.
+static CWriteJobList s_finished;
+//! The global write thread, NULL if not running.
+static CPartFileWriteThread* s_thread = NULL;
+//! Specifies if the thread should exit once the queue is empty.
+static bool s_terminating = false;
+
+
+CPartFileWriteThread::CPartFileWriteThread()
+	: CMuleThread(wxTHREAD_JOINABLE)
+{
+}
+
+
+void CPartFileWriteThread::Start()
+{
+	wxMutexLocker lock(s_lock);
+
+	if (s_thread) {
+		return;
+	}
+
+	s_terminating = false;
+	s_thread = new CPartFileWriteThread();
+	if (s_thread->Create() == wxTHREAD_NO_ERROR && s_thread->Run() == wxTHREAD_NO_ERROR) {
+		AddDebugLogLineN(logPartFile, wxT("Part-file write thread started"));
+	} else {
+		AddDebugLogLineC(logPartFile, wxT("Error while starting part-file write thread, writing synchronously"));
+		delete s_thread;
+		s_thread = NULL;
+	}
+}
+
+
+void CPartFileWriteThread::Terminate()
+{
+	CPartFileWriteThread* thread = NULL;
+
+	{
+		wxMutexLocker lock(s_lock);
+
+		thread = s_thread;
+		s_thread = NULL;
+		s_terminating = true;
+		s_jobAdded.Broadcast();
+	}
+
+	if (thread) {
+		AddDebugLogLineN(logPartFile, wxT("Terminating part-file write thread"));
+		// Wait rather than Stop, since pending jobs must still reach the disk.
+		thread->Wait();
+		delete thread;
+		AddDebugLogLineN(logPartFile, wxT("Part-file write thread terminated"));
+	}
+}
+
+
+bool CPartFileWriteThread::AddJob(CPartFileWriteJob* job)
+{
+	wxMutexLocker lock(s_lock);
+
+	if (s_thread == NULL) {
+		return false;
+	}
+
+	s_queue.push_back(job);
+	s_jobAdded.Signal();
+
+	return true;
+}
+
+
+void CPartFileWriteThread::WaitForJob(CPartFileWriteJob* job)
+{
+	wxMutexLocker lock(s_lock);
+
+	for (;;) {
+		CWriteJobList::iterator it = std::find(s_finished.begin(), s_finished.end(), job);
+		if (it != s_finished.end()) {
+			s_finished.erase(it);
+			return;
+		}
+
+		wxCHECK_RET(job == s_currentJob || std::find(s_queue.begin(), s_queue.end(), job) != s_queue.end(),
+			wxT("Waiting for a job unknown to the part-file write thread"));
+
+		s_jobDone.Wait();
+	}
+}
+
+
+void CPartFileWriteThread::ProcessFinishedJobs()
+{
+	for (;;) {
+		CPartFileWriteJob* job = NULL;
+
+		{
+			wxMutexLocker lock(s_lock);
+			if (s_finished.empty()) {
+				return;
+			}
+
+			job = s_finished.front();
+			s_finished.pop_front();
+		}
+
+		// May delete the job, and may queue a new one for the same file.
+		job->m_owner->FlushDone(job);
+	}
+}
+
+
+uint32 CPartFileWriteThread::GetQueueLength()
+{
+	wxMutexLocker lock(s_lock);
+
+	return s_queue.size() + (s_currentJob ? 1 : 0);
+}
+
+
+void* CPartFileWriteThread::Entry()
+{
+	AddDebugLogLineN(logPartFile, wxT("Entering part-file write thread"));
+
+	for (;;) {
+		{
+			wxMutexLocker lock(s_lock);
+
+			s_currentJob = NULL;
+			while (s_queue.empty()) {
+				if (s_terminating) {
+					AddDebugLogLineN(logPartFile, wxT("Leaving part-file write thread"));
+					return NULL;
+				}
+
+				s_jobAdded.Wait();
+			}
+
+			s_currentJob = s_queue.front();
+			s_queue.pop_front();
+		}
+
+		s_currentJob->Run();
+
+		{
+			wxMutexLocker lock(s_lock);
+
+			s_finished.push_back(s_currentJob);
+			s_jobDone.Broadcast();
+		}
+
+		CPartFileFlushedEvent evt;
+		wxPostEvent(wxTheApp, evt);
+	}
+}
+
+
+DEFINE_LOCAL_EVENT_TYPE(MULE_EVT_PARTFILE_FLUSHED)
+
+// File_checked_for_headers
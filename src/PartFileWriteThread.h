@@ -0,0 +1,272 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+#ifndef PARTFILEWRITETHREAD_H
+#define PARTFILEWRITETHREAD_H
+
+#include <map>
+#include <vector>
+
+#include <wx/event.h>
+#include <wx/thread.h>		// Needed for wxMutex
+
+#include "Types.h"
+#include "MD4Hash.h"		// Needed for CMD4Hash
+#include "FileArea.h"		// Needed for CFileArea
+#include "MuleThread.h"		// Needed for CMuleThread
+#include "PartHashStates.h"	// Needed for CPartHashStates
+
+class CPartFile;
+class CFileAutoClose;
+struct Requested_Block_Struct;
+
+
+/**
+ * A block of downloaded data waiting to be written to a part-file.
+ */
+class PartFileBufferedData
+{
+public:
+	CFileArea area;				// File area to be written
+	uint64 start;					// This is the start offset of the data
+	uint64 end;						// This is the end offset of the data
+	Requested_Block_Struct *block;	// This is the requested block that this data relates to
+
+	PartFileBufferedData(CFileAutoClose& file, uint8_t * data, uint64 _start, uint64 _end, Requested_Block_Struct *_block);
+};
+
+
+/**
+ * Buffered data of a part-file, ordered by offset.
+ *
+ * Items with the same start offset are kept in the order they were added,
+ * so that newer data is written last. The container owns the items.
+ */
+class CBufferedDataMap
+{
+public:
+	typedef std::multimap<uint64, PartFileBufferedData*> ItemMap;
+	typedef ItemMap::iterator iterator;
+	typedef ItemMap::const_iterator const_iterator;
+
+	CBufferedDataMap()
+		: m_maxLength(0)
+	{}
+
+	/** Deletes all items. */
+	~CBufferedDataMap()		{ Clear(); }
+
+	/** Adds an item, taking ownership of it. */
+	void Add(PartFileBufferedData* item);
+
+	/** Returns true if any item overlaps the range [start, end]. */
+	bool Overlaps(uint64 start, uint64 end) const;
+
+	/** Exchanges the contents of two containers. */
+	void Swap(CBufferedDataMap& other);
+
+	/** Deletes all items. */
+	void Clear();
+
+	bool empty() const		{ return m_items.empty(); }
+	iterator begin()		{ return m_items.begin(); }
+	iterator end()			{ return m_items.end(); }
+	const_iterator begin() const	{ return m_items.begin(); }
+	const_iterator end() const	{ return m_items.end(); }
+
+private:
+	//! A CBufferedDataMap is neither copyable nor assignable.
+	//@{
+	CBufferedDataMap(const CBufferedDataMap&);
+	CBufferedDataMap& operator=(const CBufferedDataMap&);
+	//@}
+
+	//! The items, keyed by start offset.
+	ItemMap		m_items;
+	//! Length of the largest item added since the last Clear.
+	uint64		m_maxLength;
+};
+
+
+/**
+ * A single flush of a part-file, as handed to the write thread.
+ *
+ * The job owns the buffered data taken from the part-file. The write
+ * thread writes it to disk and creates the MD4 hashes of the parts that
+ * have to be verified. Everything that touches the state of the part-file
+ * (gap list, corrupted parts, status, .part.met) is left to
+ * CPartFile::FlushDone(), which is called on the main thread.
+ */
+class CPartFileWriteJob
+{
+public:
+	//! The MD4 hash of a part, as created by the write thread.
+	struct PartHash
+	{
+		uint16		part;
+		uint32		length;
+		CMD4Hash	hash;
+		//! Error message if hashing failed, empty otherwise.
+		wxString	error;
+	};
+
+	/**
+	 * @param owner The part-file being flushed.
+	 * @param file The handle of the .part file.
+	 * @param fileSize The size the .part file must not exceed.
+	 * @param hashStates The incremental part hashes of the part-file.
+	 * @param fromAICHRecoveryDataAvailable See CPartFile::FlushBuffer.
+	 */
+	CPartFileWriteJob(CPartFile* owner, CFileAutoClose& file, uint64 fileSize, CPartHashStates& hashStates, bool fromAICHRecoveryDataAvailable);
+
+	/**
+	 * Writes the buffered data and hashes the requested parts, using
+	 * the incremental part hashes where possible.
+	 *
+	 * This function only touches the data owned by the job and the
+	 * file handle, so it may be called from any thread.
+	 */
+	void Run();
+
+	/** Schedules a part to be hashed once all data has been written. */
+	void AddPartToHash(uint16 part, uint32 length);
+
+	/**
+	 * Returns the hash result of the given part, or NULL if the part
+	 * was not hashed by this job.
+	 */
+	const PartHash* GetPartHash(uint16 part) const;
+
+	/** Returns true if the range [start, end] overlaps data owned by the job. */
+	bool Overlaps(uint64 start, uint64 end) const;
+
+	//! The part-file this job belongs to.
+	CPartFile*		m_owner;
+	//! The data to be written.
+	CBufferedDataMap	m_buffers;
+	//! Total number of bytes in m_buffers.
+	uint32			m_dataSize;
+	//! Parts touched by the buffered data.
+	std::vector<bool>	m_changedParts;
+	//! Set if the flush was triggered by AICH recovery.
+	bool			m_fromAICHRecoveryDataAvailable;
+	//! Error message of a failed write, empty on success.
+	wxString		m_writeError;
+	//! Error message of a failed truncation, empty on success.
+	wxString		m_truncateError;
+
+private:
+	//! The .part file.
+	CFileAutoClose&	m_file;
+	//! Size of the complete file.
+	uint64			m_fileSize;
+	//! Incremental part hashes of the owner.
+	CPartHashStates&	m_hashStates;
+	//! The parts to hash and their results.
+	std::vector<PartHash>	m_hashes;
+};
+
+
+/**
+ * This thread writes buffered download data to disk.
+ *
+ * Part-files hand their buffers to the thread as a CPartFileWriteJob, at
+ * most one job per file at a time. Once a job has been executed, it is
+ * queued as finished and a MULE_EVT_PARTFILE_FLUSHED event is sent to the
+ * application, which then calls ProcessFinishedJobs() to apply the results
+ * on the main thread.
+ *
+ * If the thread is not running (before Start() and after Terminate()),
+ * jobs are rejected and the caller is expected to run them itself.
+ */
+class CPartFileWriteThread : public CMuleThread
+{
+public:
+	/** Starts the write thread. */
+	static void Start();
+
+	/**
+	 * Stops the write thread after all queued jobs have been executed.
+	 *
+	 * Finished jobs are kept until they are collected by their owners.
+	 */
+	static void Terminate();
+
+	/**
+	 * Queues a job for execution, returning false if the thread isn't running.
+	 *
+	 * On failure, ownership of the job remains with the caller.
+	 */
+	static bool AddJob(CPartFileWriteJob* job);
+
+	/**
+	 * Blocks until the given job has been executed, then removes it from
+	 * the list of finished jobs. The job is not deleted.
+	 */
+	static void WaitForJob(CPartFileWriteJob* job);
+
+	/**
+	 * Hands all finished jobs back to their owners (see CPartFile::FlushDone).
+	 *
+	 * Must be called from the main thread.
+	 */
+	static void ProcessFinishedJobs();
+
+	/** Returns the number of jobs waiting to be written. */
+	static uint32 GetQueueLength();
+
+protected:
+	CPartFileWriteThread();
+
+	/** @see wxThread::Entry */
+	virtual void* Entry();
+};
+
+
+DECLARE_LOCAL_EVENT_TYPE(MULE_EVT_PARTFILE_FLUSHED, -1)
+
+/**
+ * This event is sent when the write thread has finished one or more jobs.
+ */
+class CPartFileFlushedEvent : public wxEvent
+{
+public:
+	CPartFileFlushedEvent()
+		: wxEvent(-1, MULE_EVT_PARTFILE_FLUSHED)
+	{}
+
+	/** @see wxEvent::Clone */
+	virtual wxEvent* Clone() const	{ return new CPartFileFlushedEvent(); }
+};
+
+typedef void (wxEvtHandler::*MulePartFileFlushedEventFunction)(CPartFileFlushedEvent&);
+
+//! Event-handler for finished part-file flushes.
+#define EVT_MULE_PARTFILE_FLUSHED(func) \
+	DECLARE_EVENT_TABLE_ENTRY(MULE_EVT_PARTFILE_FLUSHED, -1, -1, \
+	(wxObjectEventFunction) (wxEventFunction) \
+	wxStaticCastEvent(MulePartFileFlushedEventFunction, &func), (wxObject*) NULL),
+
+#endif // PARTFILEWRITETHREAD_H
+// File_checked_for_headers
@@ -0,0 +1,220 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+
+#include "PartHashStates.h"		// Interface declarations
+
+#include <algorithm>		// Needed for std::min
+#include <vector>
+
+#include <protocol/ed2k/Constants.h>	// Needed for PARTSIZE
+#include "DownloadBufferPool.h"		// Needed for CDownloadBufferPool
+#include "MD4Hash.h"			// Needed for CMD4Hash
+#include "CryptoPP_Inc.h"		// Needed for MD4
+
+
+//! Upper limit of data parked for a single part.
+static const uint32 MAX_PARKED_PER_PART = PARTSIZE / 2;
+
+/**
+ * The incremental hash of a single part.
+ */
+struct CPartHashState
+{
+	CPartHashState()
+		: hashed(0), parkedSize(0), failed(false)
+	{}
+
+	~CPartHashState()
+	{
+		Unpark();
+	}
+
+	/** Drops the parked data. */
+	void Unpark()
+	{
+		CDownloadBufferPool::ReleaseParked(parkedSize);
+		parked.clear();
+		parkedSize = 0;
+	}
+
+	//! MD4 of the data [0, hashed) of the part.
+	CryptoPP::Weak::MD4	md4;
+	//! Number of bytes hashed so far.
+	uint32			hashed;
+	//! Data that doesn't continue the hashed range yet, by offset in the part.
+	std::map<uint32, std::vector<uint8_t> > parked;
+	//! Number of bytes in 'parked'.
+	uint32			parkedSize;
+	//! Set if the part can't be hashed incrementally.
+	bool			failed;
+};
+
+
+CPartHashStates::CPartHashStates()
+{
+}
+
+
+CPartHashStates::~CPartHashStates()
+{
+	Clear();
+}
+
+
+void CPartHashStates::Begin(uint16 part)
+{
+	wxMutexLocker lock(m_lock);
+
+	CPartHashState*& state = m_states[part];
+	if (state == NULL) {
+		state = new CPartHashState();
+	}
+}
+
+
+void CPartHashStates::Feed(uint64 offset, const uint8_t* data, uint32 length)
+{
+	wxMutexLocker lock(m_lock);
+
+	// Blocks may cross part boundaries
+	while (length) {
+		uint16 part = offset / PARTSIZE;
+		uint32 partOffset = offset % PARTSIZE;
+		uint32 toFeed = std::min<uint64>(length, PARTSIZE - partOffset);
+
+		FeedPart(part, partOffset, data, toFeed);
+
+		offset += toFeed;
+		data += toFeed;
+		length -= toFeed;
+	}
+}
+
+
+void CPartHashStates::FeedPart(uint16 part, uint32 offset, const uint8_t* data, uint32 length)
+{
+	CPartHashState*& state = m_states[part];
+	if (state == NULL) {
+		// Unless Begin was called, data before this may be on disk already
+		state = new CPartHashState();
+		state->failed = (offset != 0);
+	}
+
+	if (state->failed) {
+		return;
+	}
+
+	bool overlaps = offset < state->hashed;
+	if (!overlaps && !state->parked.empty()) {
+		// Check the parked data around the new data
+		std::map<uint32, std::vector<uint8_t> >::iterator it = state->parked.lower_bound(offset);
+		if (it != state->parked.end() && it->first < offset + length) {
+			overlaps = true;
+		} else if (it != state->parked.begin()) {
+			--it;
+			overlaps = it->first + it->second.size() > offset;
+		}
+	}
+
+	const bool park = offset > state->hashed;
+	if (overlaps || (park && (state->parkedSize + length > MAX_PARKED_PER_PART
+			|| !CDownloadBufferPool::ReserveParked(length)))) {
+		// Data is rewritten or arrives too scattered, hash the part from disk
+		state->Unpark();
+		state->failed = true;
+		return;
+	}
+
+	if (park) {
+		state->parked[offset].assign(data, data + length);
+		state->parkedSize += length;
+		return;
+	}
+
+	state->md4.Update(data, length);
+	state->hashed += length;
+
+	// Feed the parked data which has become contiguous
+	while (!state->parked.empty() && state->parked.begin()->first == state->hashed) {
+		std::vector<uint8_t>& parked = state->parked.begin()->second;
+		uint32 parkedLength = parked.size();
+
+		state->md4.Update(&parked[0], parkedLength);
+		state->hashed += parkedLength;
+		state->parkedSize -= parkedLength;
+		state->parked.erase(state->parked.begin());
+		CDownloadBufferPool::ReleaseParked(parkedLength);
+	}
+}
+
+
+bool CPartHashStates::GetHash(uint16 part, uint32 length, CMD4Hash& hash)
+{
+	wxMutexLocker lock(m_lock);
+
+	StateMap::iterator it = m_states.find(part);
+	if (it == m_states.end()) {
+		return false;
+	}
+
+	CPartHashState* state = it->second;
+	bool complete = !state->failed && state->hashed == length;
+	if (complete) {
+		state->md4.Final(hash.GetHash());
+	}
+
+	delete state;
+	m_states.erase(it);
+
+	return complete;
+}
+
+
+void CPartHashStates::Reset(uint64 start, uint64 end)
+{
+	wxMutexLocker lock(m_lock);
+
+	uint16 first = start / PARTSIZE;
+	uint16 last = end / PARTSIZE;
+
+	StateMap::iterator it = m_states.lower_bound(first);
+	while (it != m_states.end() && it->first <= last) {
+		delete it->second;
+		m_states.erase(it++);
+	}
+}
+
+
+void CPartHashStates::Clear()
+{
+	wxMutexLocker lock(m_lock);
+
+	for (StateMap::iterator it = m_states.begin(); it != m_states.end(); ++it) {
+		delete it->second;
+	}
+
+	m_states.clear();
+}
+// File_checked_for_headers
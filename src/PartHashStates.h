@@ -0,0 +1,109 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+
+#ifndef PARTHASHSTATES_H
+#define PARTHASHSTATES_H
+
+#include <map>
+
+#include <wx/thread.h>		// Needed for wxMutex
+
+#include "Types.h"
+
+class CMD4Hash;
+
+
+/**
+ * Incremental MD4 hashing of the parts of a part-file.
+ *
+ * Data is fed into the hash of its part as it is written to disk. Data
+ * that doesn't continue the hashed range of its part is parked in memory
+ * until the data before it has been fed. Once a part has been completed,
+ * its hash is therefore available without reading the part back from disk.
+ *
+ * Hashing a part starts with data fed at its start, or with any data once
+ * Begin has been called for it, i.e. if none of its data is on disk yet.
+ * Otherwise it would only park data until giving up, as the data on disk
+ * is never fed.
+ *
+ * A part falls back to hashing from disk if its data could not be
+ * hashed in order, for instance because it was downloaded in a previous
+ * session, data overlapping already hashed data was written, or too much
+ * data had to be parked. Parked data is accounted in CDownloadBufferPool,
+ * which also limits the parked data of all part-files.
+ *
+ * The states are protected by an internal lock, so that the write thread
+ * may feed data while the main thread resets parts.
+ */
+class CPartHashStates
+{
+public:
+	CPartHashStates();
+	~CPartHashStates();
+
+	/**
+	 * Allows hashing a part to start with data anywhere in the part. Must
+	 * only be called if none of its data is on disk yet.
+	 */
+	void Begin(uint16 part);
+
+	/** Feeds data that is about to be written at the given offset of the file. */
+	void Feed(uint64 offset, const uint8_t* data, uint32 length);
+
+	/**
+	 * Retrieves the MD4 hash of a part and discards its state.
+	 *
+	 * @param part The part to retrieve the hash of.
+	 * @param length The size of the part.
+	 * @param hash Set to the hash of the part on success.
+	 * @return False if the part has not been hashed completely.
+	 */
+	bool GetHash(uint16 part, uint32 length, CMD4Hash& hash);
+
+	/** Discards the states of all parts touching the given range. */
+	void Reset(uint64 start, uint64 end);
+
+	/** Discards all states. */
+	void Clear();
+
+private:
+	//! A CPartHashStates is neither copyable nor assignable.
+	//@{
+	CPartHashStates(const CPartHashStates&);
+	CPartHashStates& operator=(const CPartHashStates&);
+	//@}
+
+	void FeedPart(uint16 part, uint32 offset, const uint8_t* data, uint32 length);
+
+	typedef std::map<uint16, struct CPartHashState*> StateMap;
+
+	//! The states of the parts currently receiving data.
+	StateMap		m_states;
+	//! Protects the states.
+	wxMutex			m_lock;
+};
+
+#endif // PARTHASHSTATES_H
+// File_checked_for_headers
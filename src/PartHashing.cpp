@@ -0,0 +1,86 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+
+#include "PartHashing.h"		// Interface declarations
+
+#include <algorithm>			// Needed for std::min
+
+#include <protocol/ed2k/Constants.h>	// Needed for PARTSIZE and EMBLOCKSIZE
+#include <wx/debug.h>			// Needed for wxCHECK_RET
+
+#include "CryptoPP_Inc.h"		// Needed for MD4 and SHA1
+#include "MD4Hash.h"			// Needed for CMD4Hash
+#include "SHAHashSet.h"			// Needed for CAICHHash
+
+
+//! Number of bytes hashed at a time, small enough to stay in the L1 cache.
+static const uint32 HASH_WINDOW_SIZE = 16 * 1024;
+
+
+void CreatePartHashes(const uint8_t* input, uint32 length, CMD4Hash* md4, std::vector<CAICHHash>* blockHashes)
+{
+	wxCHECK_RET(input || !length, wxT("No input to hash from in CreatePartHashes"));
+	wxASSERT(length <= PARTSIZE);
+
+	CryptoPP::Weak::MD4 md4Hasher;
+	CryptoPP::SHA1 shaHasher;
+
+	if (blockHashes) {
+		blockHashes->clear();
+		blockHashes->reserve((length + EMBLOCKSIZE - 1) / EMBLOCKSIZE);
+	}
+
+	uint32 blockPos = 0;
+	for (uint32 pos = 0; pos < length; ) {
+		uint32 window = std::min(HASH_WINDOW_SIZE, length - pos);
+		if (blockHashes) {
+			// Windows never cross the end of an AICH block.
+			window = std::min(window, EMBLOCKSIZE - blockPos);
+		}
+
+		if (md4) {
+			md4Hasher.Update(input + pos, window);
+		}
+
+		if (blockHashes) {
+			shaHasher.Update(input + pos, window);
+			blockPos += window;
+
+			if ((blockPos == EMBLOCKSIZE) || (pos + window == length)) {
+				CAICHHash hash;
+				shaHasher.Final(hash.GetRawHash());
+				blockHashes->push_back(hash);
+				blockPos = 0;
+			}
+		}
+
+		pos += window;
+	}
+
+	if (md4) {
+		md4Hasher.Final(md4->GetHash());
+	}
+}
+// File_checked_for_headers
@@ -0,0 +1,52 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+
+#ifndef PARTHASHING_H
+#define PARTHASHING_H
+
+#include <vector>
+
+#include "Types.h"
+
+class CMD4Hash;
+class CAICHHash;
+
+
+/**
+ * Creates the MD4 hash and the AICH block hashes of a part in a single pass.
+ *
+ * The input is processed in small windows, each of which is fed to both
+ * the MD4 and the SHA-1 hash while it is still in the CPU cache. The data
+ * is hashed in place, without intermediate copies.
+ *
+ * @param input The data of the part, at most PARTSIZE bytes.
+ * @param length The length of the part.
+ * @param md4 Set to the MD4 hash of the part, may be NULL.
+ * @param blockHashes Set to the SHA-1 hashes of the EMBLOCKSIZE blocks of the part, may be NULL.
+ */
+void CreatePartHashes(const uint8_t* input, uint32 length, CMD4Hash* md4, std::vector<CAICHHash>* blockHashes);
+
+#endif // PARTHASHING_H
+// File_checked_for_headers
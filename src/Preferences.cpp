@@ -215,6 +215,14 @@ bool		CPreferences::s_ConnectToKad;
 bool		CPreferences::s_ConnectToED2K;
 unsigned	CPreferences::s_maxClientVersions;
 bool		CPreferences::s_DropSlowSources;
+uint32		CPreferences::s_downloadBufferPoolSize;
+uint32		CPreferences::s_uploadBlockCacheSize;
+uint32		CPreferences::s_sharedFileHandleCacheSize;
+bool		CPreferences::s_delayBasedUpload;
+uint32		CPreferences::s_uploadTargetDelay;
+bool		CPreferences::s_adaptiveUploadSlots;
+bool		CPreferences::s_endGameMode;
+uint32		CPreferences::s_endGameBlocks;
 bool		CPreferences::s_IsClientCryptLayerSupported;
 bool		CPreferences::s_bCryptLayerRequested;
 bool		CPreferences::s_IsClientCryptLayerRequired;
@@ -1244,6 +1252,14 @@ void CPreferences::BuildItemList( const wxString& appdir )
 	s_MiscList.push_back( MkCfg_Int( wxT("/eMule/SmartIdState"), s_smartidstate, 0 ) );
 
 	s_MiscList.push_back( new Cfg_Bool( wxT("/eMule/DropSlowSources"),		s_DropSlowSources, false ) );
+	s_MiscList.push_back(    MkCfg_Int( wxT("/eMule/DownloadBufferPoolSize"),	s_downloadBufferPoolSize, 64 ) );
+	s_MiscList.push_back(    MkCfg_Int( wxT("/eMule/UploadBlockCacheSize"),	s_uploadBlockCacheSize, 32 ) );
+	s_MiscList.push_back(    MkCfg_Int( wxT("/eMule/SharedFileHandleCacheSize"),	s_sharedFileHandleCacheSize, 32 ) );
+	s_MiscList.push_back( new Cfg_Bool( wxT("/eMule/DelayBasedUpload"),		s_delayBasedUpload, false ) );
+	s_MiscList.push_back(    MkCfg_Int( wxT("/eMule/UploadTargetDelay"),		s_uploadTargetDelay, 50 ) );
+	s_MiscList.push_back( new Cfg_Bool( wxT("/eMule/AdaptiveUploadSlots"),		s_adaptiveUploadSlots, true ) );
+	s_MiscList.push_back( new Cfg_Bool( wxT("/eMule/EndGameMode"),			s_endGameMode, false ) );
+	s_MiscList.push_back(    MkCfg_Int( wxT("/eMule/EndGameBlocks"),		s_endGameBlocks, 8 ) );
 
 	s_MiscList.push_back( new Cfg_Str(  wxT("/eMule/KadNodesUrl"),			s_KadURL, wxT("http://upd.emule-security.org/nodes.dat") ) );
 	s_MiscList.push_back( new Cfg_Str(	wxT("/eMule/Ed2kServersUrl"),		s_Ed2kURL, wxT("http://upd.emule-security.org/server.met") ) );
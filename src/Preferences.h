@@ -542,6 +542,23 @@ public:
 	// Dropping slow sources
 	static bool GetDropSlowSources()					{ return s_DropSlowSources; }
 
+	// Memory for buffered download data of all files, 0 = unlimited
+	static uint64 GetDownloadBufferPoolSize()	{ return (uint64)s_downloadBufferPoolSize * 1024 * 1024; }
+	// Memory for blocks cached for uploading, 0 = disabled
+	static uint64 GetUploadBlockCacheSize()		{ return (uint64)s_uploadBlockCacheSize * 1024 * 1024; }
+	// Complete shared files kept open for uploading, 0 = none
+	static uint32 GetSharedFileHandleCacheSize()	{ return s_sharedFileHandleCacheSize; }
+	// Adjust the upload rate to the queueing delay measured on the uplink
+	static bool IsDelayBasedUpload()		{ return s_delayBasedUpload; }
+	// Queueing delay the delay-based upload aims for, in ms
+	static uint32 GetUploadTargetDelay()		{ return s_uploadTargetDelay; }
+	// Adjust the number of upload slots to the measured throughput
+	static bool IsAdaptiveUploadSlots()		{ return s_adaptiveUploadSlots; }
+	// Request the last blocks of a download from several sources at once
+	static bool IsEndGameMode()			{ return s_endGameMode; }
+	// Missing data of a download below which it enters end-game mode, in blocks
+	static uint32 GetEndGameBlocks()		{ return s_endGameBlocks; }
+
 	// server.met and nodes.dat urls
 	static const wxString& GetKadNodesUrl() { return s_KadURL; }
 	static void SetKadNodesUrl(const wxString& url) { s_KadURL = url; }
@@ -796,6 +813,21 @@ protected:
 	// Drop slow sources if needed
 	static bool s_DropSlowSources;
 
+	// Download buffer pool size in MB
+	static uint32 s_downloadBufferPoolSize;
+	// Upload block cache size in MB
+	static uint32 s_uploadBlockCacheSize;
+	// Number of cached shared file handles
+	static uint32 s_sharedFileHandleCacheSize;
+	// Delay-based upload rate and its target delay in ms
+	static bool s_delayBasedUpload;
+	static uint32 s_uploadTargetDelay;
+	// Adaptive number of upload slots
+	static bool s_adaptiveUploadSlots;
+	// End-game mode of downloads and its threshold in blocks
+	static bool s_endGameMode;
+	static uint32 s_endGameBlocks;
+
 	static wxString s_Ed2kURL;
 	static wxString s_KadURL;
 
@@ -1333,6 +1333,18 @@ uint32 CSocketClientProxy::Write(const void *buffer, wxUint32 nbytes)
 	return CProxySocket::Write(buffer, nbytes);
 }
 
+uint32 CSocketClientProxy::WriteV(const CSocketIOVector& buffers)
+{
+	wxMutexLocker lock(m_socketLocker);
+	return CProxySocket::WriteV(buffers);
+}
+
+uint32 CSocketClientProxy::WriteFile(const void *head, uint32 headLength, const CSocketFileRegion& region)
+{
+	wxMutexLocker lock(m_socketLocker);
+	return CProxySocket::WriteFile(head, headLength, region);
+}
+
 //------------------------------------------------------------------------------
 // CSocketServerProxy
 //------------------------------------------------------------------------------
@@ -512,6 +512,8 @@ public:
 	bool Connect(amuleIPV4Address &address, bool wait);
 	uint32 Read(void *buffer, wxUint32 nbytes);
 	uint32 Write(const void *buffer, wxUint32 nbytes);
+	uint32 WriteV(const CSocketIOVector& buffers);
+	uint32 WriteFile(const void *head, uint32 headLength, const CSocketFileRegion& region);
 
 private:
 	wxMutex			m_socketLocker;
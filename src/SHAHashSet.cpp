@@ -46,6 +46,7 @@
 #define	MINPERCENTAGE_TOTRUST		92  // how many percentage of clients have to send the same hash to make it trustworthy
 
 CAICHRequestedDataList CAICHHashSet::m_liRequestedData;
+wxMutex CAICHHashSet::m_metFileLock;
 
 /////////////////////////////////////////////////////////////////////////////////////////
 ///CAICHHash
@@ -248,6 +249,14 @@ bool CAICHHashTree::VerifyHashTree(CAICHHashAlgo* hashalg, bool bDeleteBadTrees)
 
 
 void CAICHHashTree::SetBlockHash(uint64 nSize, uint64 nStartPos, CAICHHashAlgo* pHashAlg)
+{
+	CAICHHash Hash;
+	pHashAlg->Finish(Hash);
+	SetBlockHash(nSize, nStartPos, Hash);
+}
+
+
+void CAICHHashTree::SetBlockHash(uint64 nSize, uint64 nStartPos, const CAICHHash& Hash)
 {
 	wxASSERT ( nSize <= EMBLOCKSIZE );
 	CAICHHashTree* pToInsert = FindHash(nStartPos, nSize);
@@ -264,7 +273,7 @@ void CAICHHashTree::SetBlockHash(uint64 nSize, uint64 nStartPos, CAICHHashAlgo*
 		return;
 	}
 
-	pHashAlg->Finish(pToInsert->m_Hash);
+	pToInsert->m_Hash = Hash;
 	pToInsert->m_bHashValid = true;
 }
 
@@ -634,6 +643,8 @@ bool CAICHHashSet::SaveHashSet()
 	}
 
 
+	wxMutexLocker lock(m_metFileLock);
+
 	try {
 		const wxString fullpath = thePrefs::GetConfigDir() + KNOWN2_MET_FILENAME;
 		const bool exists = wxFile::Exists(fullpath);
@@ -715,6 +726,8 @@ bool CAICHHashSet::LoadHashSet()
 		wxFAIL;
 		return false;
 	}
+	wxMutexLocker lock(m_metFileLock);
+
 	wxString fullpath = thePrefs::GetConfigDir() + KNOWN2_MET_FILENAME;
 	CFile file(fullpath, CFile::read);
 	if (!file.IsOpened()) {
@@ -75,6 +75,8 @@ Version 2 of AICH also supports 32bit identifiers to support large files, check
 #include <deque>
 #include <set>
 
+#include <wx/thread.h>		// Needed for wxMutex
+
 #include "Types.h"
 #include "ClientRef.h"
 
@@ -168,6 +170,7 @@ public:
 	bool GetHashValid() const		{ return m_bHashValid; }
 
 	void SetBlockHash(uint64 nSize, uint64 nStartPos, CAICHHashAlgo* pHashAlg);
+	void SetBlockHash(uint64 nSize, uint64 nStartPos, const CAICHHash& Hash);
 	bool ReCalculateHash(CAICHHashAlgo* hashalg, bool bDontReplace );
 	bool VerifyHashTree(CAICHHashAlgo* hashalg, bool bDeleteBadTrees);
 	CAICHHashTree* FindHash(uint64 nStartPos, uint64 nSize)
@@ -240,6 +243,8 @@ private:
 
 public:
 	static CAICHRequestedDataList m_liRequestedData;
+	// Serializes access to known2_64.met, which hashing tasks may use concurrently
+	static wxMutex m_metFileLock;
 	CAICHHashTree m_pHashTree;
 
 	CAICHHashSet(CKnownFile* pOwner);
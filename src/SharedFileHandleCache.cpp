@@ -0,0 +1,145 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+
+#include "SharedFileHandleCache.h"	// Interface declarations
+
+#include <list>
+#include <map>
+
+#include "FileAutoClose.h"	// Needed for CFileAutoClose
+#include "GetTickCount.h"	// Needed for TheTime
+
+
+//! Seconds after which a cached handle is checked against its path again.
+static const uint32 VALIDATE_INTERVAL = 10;
+
+
+//! A cached handle.
+struct CCachedHandle
+{
+	CCachedHandle(const CMD4Hash& h, const CSharedFileHandleCache::Handle& f)
+		: hash(h), file(f), lastCheck(TheTime)
+	{}
+
+	CMD4Hash hash;
+	CSharedFileHandleCache::Handle file;
+	//! When the file was last known to exist at its path.
+	uint32 lastCheck;
+};
+
+typedef std::list<CCachedHandle> HandleList;
+typedef std::map<CMD4Hash, HandleList::iterator> HandleMap;
+
+
+//! The cached handles, most recently used first.
+static HandleList s_handles;
+//! Index of the cached handles.
+static HandleMap s_handleMap;
+//! Maximum number of cached handles.
+static size_t s_limit = 0;
+
+
+/** Closes the least recently used handles until the given number is left. */
+static void Shrink(size_t count)
+{
+	while (s_handles.size() > count) {
+		s_handleMap.erase(s_handles.back().hash);
+		s_handles.pop_back();
+	}
+}
+
+
+CSharedFileHandleCache::Handle CSharedFileHandleCache::Get(const CMD4Hash& hash)
+{
+	HandleMap::iterator it = s_handleMap.find(hash);
+	if (it == s_handleMap.end()) {
+		return Handle();
+	}
+
+	CCachedHandle& entry = *it->second;
+	if (TheTime - entry.lastCheck >= VALIDATE_INTERVAL) {
+		if (!entry.file->GetFilePath().FileExists()) {
+			s_handles.erase(it->second);
+			s_handleMap.erase(it);
+			return Handle();
+		}
+
+		entry.lastCheck = TheTime;
+	}
+
+	s_handles.splice(s_handles.begin(), s_handles, it->second);
+
+	return entry.file;
+}
+
+
+CSharedFileHandleCache::Handle CSharedFileHandleCache::Open(const CMD4Hash& hash, const CPath& path)
+{
+	Handle file(new CFileAutoClose());
+	if (!file->Open(path, CFile::read)) {
+		return Handle();
+	}
+
+	if (s_limit) {
+		Remove(hash);
+		Shrink(s_limit - 1);
+
+		s_handles.push_front(CCachedHandle(hash, file));
+		s_handleMap.insert(std::make_pair(hash, s_handles.begin()));
+	}
+
+	return file;
+}
+
+
+void CSharedFileHandleCache::Remove(const CMD4Hash& hash)
+{
+	HandleMap::iterator it = s_handleMap.find(hash);
+	if (it != s_handleMap.end()) {
+		s_handles.erase(it->second);
+		s_handleMap.erase(it);
+	}
+}
+
+
+void CSharedFileHandleCache::SetLimit(size_t limit)
+{
+	s_limit = limit;
+	Shrink(limit);
+}
+
+
+size_t CSharedFileHandleCache::GetCount()
+{
+	return s_handles.size();
+}
+
+
+void CSharedFileHandleCache::Clear()
+{
+	s_handleMap.clear();
+	s_handles.clear();
+}
+// File_checked_for_headers
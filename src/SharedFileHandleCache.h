@@ -0,0 +1,87 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+
+#ifndef SHAREDFILEHANDLECACHE_H
+#define SHAREDFILEHANDLECACHE_H
+
+#include "MD4Hash.h"		// Needed for CMD4Hash
+
+#include <memory>		// Needed for std::shared_ptr
+
+class CFileAutoClose;
+class CPath;
+
+
+/**
+ * Keeps the handles of complete shared files open between uploaded blocks.
+ *
+ * Without it, every block requested from a complete file costs opening
+ * and closing the file. Handles are identified by the hash of the file,
+ * and closed in least-recently-used order once more than the limit are
+ * open.
+ *
+ * As an open handle keeps working after the file was moved or deleted,
+ * cached handles are checked against their path every few seconds. A
+ * handle whose file is gone is dropped, so that the following Open fails
+ * just like it does without the cache.
+ *
+ * Must only be used from the main thread.
+ */
+class CSharedFileHandleCache
+{
+public:
+	//! An open file, which stays usable after being dropped from the cache.
+	typedef std::shared_ptr<CFileAutoClose> Handle;
+
+	/**
+	 * Returns the cached handle of a file, or an empty one if there is none
+	 * (or the file is gone).
+	 */
+	static Handle Get(const CMD4Hash& hash);
+
+	/**
+	 * Opens a file for reading and caches its handle.
+	 *
+	 * @param hash The hash of the file.
+	 * @param path The full path of the file.
+	 * @return The handle, or an empty one if the file couldn't be opened.
+	 */
+	static Handle Open(const CMD4Hash& hash, const CPath& path);
+
+	/** Drops the handle of a file, which must be done when it is renamed or unshared. */
+	static void Remove(const CMD4Hash& hash);
+
+	/** Sets the maximum number of open handles, 0 disabling the cache. */
+	static void SetLimit(size_t limit);
+
+	/** Returns the number of cached handles. */
+	static size_t GetCount();
+
+	/** Drops all cached handles. */
+	static void Clear();
+};
+
+#endif // SHAREDFILEHANDLECACHE_H
+// File_checked_for_headers
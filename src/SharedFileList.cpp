@@ -47,6 +47,7 @@
 #include <common/FileFunctions.h>
 #include "GuiEvents.h"		// Needed for Notify_*
 #include "SHAHashSet.h"		// Needed for CAICHHash
+#include "SharedFileHandleCache.h"	// Needed for CSharedFileHandleCache
 
 
 #include "kademlia/kademlia/Kademlia.h"
@@ -323,6 +324,8 @@ void CSharedFileList::FindSharedFiles()
 		wxMutexLocker lock(list_mut);
 		m_Files_map.clear();
 	}
+	// Files may have been moved or replaced since they were opened.
+	CSharedFileHandleCache::Clear();
 
 	// All part files are automatically shared.
 	for ( uint32 i = 0; i < theApp->downloadqueue->GetFileCount(); ++i ) {
@@ -525,6 +528,7 @@ void CSharedFileList::RemoveFile(CKnownFile* toremove){
 	if (m_Files_map.erase(toremove->GetFileHash()) > 0) {
 		theStats::RemoveSharedFile(toremove->GetFileSize());
 	}
+	CSharedFileHandleCache::Remove(toremove->GetFileHash());
 	/* This file keywords must not be published to kad anymore */
 	m_keywords->RemoveKeywords(toremove);
 }
@@ -912,6 +916,7 @@ bool CSharedFileList::RenameFile(CKnownFile* file, const CPath& newName)
 		CPath newPath = file->GetFilePath().JoinPaths(newName);
 
 		if (CPath::RenameFile(oldPath, newPath)) {
+			CSharedFileHandleCache::Remove(file->GetFileHash());
 			// Must create a copy of the word list because:
 			// 1) it will be reset on SetFileName()
 			// 2) we will want to edit it
@@ -0,0 +1,96 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+
+
+#include "SourceExchangeCache.h"	// Interface declarations
+
+#include "BitVector.h"		// Needed for BitVector
+
+
+//! The time an answer is kept.
+static const uint32 ANSWER_LIFETIME = 10000;
+//! The most answers kept for a file.
+static const size_t MAX_ANSWERS = 8;
+
+static CSourceExchangeCache::Stats s_stats = { 0, 0 };
+
+
+void CSourceExchangeCache::Key::SetParts(const BitVector& status)
+{
+	parts.clear();
+	if (!status.Any()) {
+		return;
+	}
+
+	const uint8* buffer = static_cast<const uint8*>(status.GetBuffer());
+	parts.assign(buffer, buffer + status.SizeBuffer());
+	// The bits past the size may be set
+	if (status.size() & 7) {
+		parts.back() &= (1 << (status.size() & 7)) - 1;
+	}
+}
+
+
+CSourceExchangeCache::Answer* CSourceExchangeCache::Find(const Key& key, uint32 now)
+{
+	for (AnswerList::iterator it = m_answers.begin(); it != m_answers.end(); ++it) {
+		if (now - it->added >= ANSWER_LIFETIME) {
+			// The answers are ordered by age, so the rest expired too
+			m_answers.erase(it, m_answers.end());
+			break;
+		}
+		if (it->key == key) {
+			++s_stats.hits;
+			return &it->answer;
+		}
+	}
+
+	++s_stats.misses;
+	return NULL;
+}
+
+
+CSourceExchangeCache::Answer* CSourceExchangeCache::Add(const Key& key, Answer&& answer, uint32 now)
+{
+	for (AnswerList::iterator it = m_answers.begin(); it != m_answers.end(); ++it) {
+		if (it->key == key) {
+			m_answers.erase(it);
+			break;
+		}
+	}
+	if (m_answers.size() >= MAX_ANSWERS) {
+		m_answers.pop_back();
+	}
+
+	m_answers.push_front(CachedAnswer{key, std::move(answer), now});
+	return &m_answers.front().answer;
+}
+
+
+void CSourceExchangeCache::GetStats(Stats& stats)
+{
+	stats = s_stats;
+}
+// File_checked_for_headers
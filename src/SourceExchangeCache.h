@@ -0,0 +1,142 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+
+
+#ifndef SOURCEEXCHANGECACHE_H
+#define SOURCEEXCHANGECACHE_H
+
+#include "Types.h"
+
+#include <list>
+#include <memory>		// Needed for std::shared_ptr
+#include <vector>
+
+class BitVector;
+class CPacket;
+
+
+/**
+ * Answers to source exchange requests for one file, kept for a short time
+ * so that popular files don't gather their sources and compress the answer
+ * again for every client asking.
+ *
+ * Only sources having parts the requester needs are sent, so an answer
+ * depends on the parts the requester has, besides the version and options
+ * of the request. Requesters having the same parts get the same answer.
+ *
+ * The answers must be invalidated whenever the sources of the file change,
+ * and expire after a few seconds anyway, as the states of the sources
+ * change too.
+ *
+ * Times are given in milliseconds.
+ */
+class CSourceExchangeCache
+{
+public:
+	//! Statistics of the caches of all files.
+	struct Stats
+	{
+		//! Number of requests answered from a cache.
+		uint64	hits;
+		//! Number of requests whose answer had to be gathered.
+		uint64	misses;
+	};
+
+	//! What an answer depends on, besides the sources.
+	struct Key
+	{
+		//! The source exchange version of the answer.
+		uint8	version;
+		//! The options requested.
+		uint16	options;
+		//! True for an SX2 answer.
+		bool	sx2;
+		//! True if the sources are identified by their hybrid IDs.
+		bool	hybridIDs;
+		//! The parts the requester has, see SetParts.
+		std::vector<uint8>	parts;
+
+		/**
+		 * Sets the parts the requester has.
+		 *
+		 * Requesters having no part are sent all sources having any part,
+		 * same as those whose parts are unknown, so neither have any parts
+		 * set here.
+		 */
+		void SetParts(const BitVector& status);
+
+		bool operator==(const Key& other) const = default;
+	};
+
+	//! An answer, which is valid until the next call to Add or Invalidate.
+	struct Answer
+	{
+		//! The sources sent, in the order of their records.
+		std::vector<const void*>	sources;
+		//! The serialized sources, all of the same size.
+		std::vector<uint8>	records;
+		//! The answer packet for all of the sources, empty until first used.
+		std::shared_ptr<CPacket>	packet;
+
+		/** Returns the size of the record of a source. */
+		size_t GetRecordSize() const	{ return sources.empty() ? 0 : records.size() / sources.size(); }
+	};
+
+	/** Returns the answer for a request, or NULL if it isn't cached or expired. */
+	Answer* Find(const Key& key, uint32 now);
+
+	/**
+	 * Stores the answer to a request, replacing the oldest answer if the
+	 * cache is full.
+	 *
+	 * @return The stored answer.
+	 */
+	Answer* Add(const Key& key, Answer&& answer, uint32 now);
+
+	/** Drops all answers, which must be done whenever the sources change. */
+	void Invalidate()		{ m_answers.clear(); }
+
+	/** Returns the number of answers held. */
+	size_t GetCount() const		{ return m_answers.size(); }
+
+	/** Retrieves the statistics of the caches of all files. */
+	static void GetStats(Stats& stats);
+
+private:
+	struct CachedAnswer
+	{
+		Key	key;
+		Answer	answer;
+		//! The time the answer was added.
+		uint32	added;
+	};
+
+	typedef std::list<CachedAnswer> AnswerList;
+	//! The answers, most recently added first.
+	AnswerList	m_answers;
+};
+
+#endif // SOURCEEXCHANGECACHE_H
+// File_checked_for_headers
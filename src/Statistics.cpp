@@ -42,6 +42,13 @@
 	#include "ServerList.h"		// Needed for CServerList (tree)
 	#include <cmath>		// Needed for std::floor
 	#include "updownclient.h"	// Needed for CUpDownClient
+	#include "DownloadBufferPool.h"	// Needed for CDownloadBufferPool (tree)
+	#include "EndGame.h"		// Needed for CEndGame (tree)
+	#include "UploadBlockCache.h"	// Needed for CUploadBlockCache (tree)
+	#include "UploadQueue.h"		// Needed for CUploadQueue (tree)
+	#include "UploadCompressor.h"	// Needed for CUploadCompressor (tree)
+	#include "ThreadScheduler.h"	// Needed for CThreadScheduler (tree)
+	#include "SourceExchangeCache.h"	// Needed for CSourceExchangeCache (tree)
 #else
 	#include "GetTickCount.h"	// Needed for GetTickCount64()
 	#include <ec/cpp/RemoteConnect.h>		// Needed for CRemoteConnect
@@ -171,6 +178,36 @@ CStatTreeItemCounter*		CStatistics::s_totalSuccUploads;
 CStatTreeItemCounter*		CStatistics::s_totalFailedUploads;
 CStatTreeItemCounter*		CStatistics::s_totalUploadTime;
 
+// Upload block cache
+CStatTreeItemSimple*		CStatistics::s_blockCacheData;
+CStatTreeItemSimple*		CStatistics::s_blockCacheLimit;
+CStatTreeItemSimple*		CStatistics::s_blockCacheHits;
+CStatTreeItemSimple*		CStatistics::s_blockCacheMisses;
+CStatTreeItemSimple*		CStatistics::s_blockCacheHitRate;
+CStatTreeItemSimple*		CStatistics::s_blockCacheEvicted;
+
+// Upload slots
+CStatTreeItemSimple*		CStatistics::s_slotLimit;
+CStatTreeItemSimple*		CStatistics::s_slotUtilisation;
+CStatTreeItemSimple*		CStatistics::s_slotsOpened;
+CStatTreeItemSimple*		CStatistics::s_slotsClosed;
+CStatTreeItemSimple*		CStatistics::s_slowSlotsDropped;
+
+// Upload compression
+CStatTreeItemSimple*		CStatistics::s_compressedBlocks;
+CStatTreeItemSimple*		CStatistics::s_uncompressibleBlocks;
+CStatTreeItemSimple*		CStatistics::s_skippedCompressions;
+CStatTreeItemSimple*		CStatistics::s_compressedData;
+CStatTreeItemSimple*		CStatistics::s_compressionSaved;
+CStatTreeItemSimple*		CStatistics::s_compressionTime;
+CStatTreeItemSimple*		CStatistics::s_compressionSavedPerSecond;
+CStatTreeItemSimple*		CStatistics::s_compressionLevel;
+
+// Source exchange answers
+CStatTreeItemSimple*		CStatistics::s_sxCacheHits;
+CStatTreeItemSimple*		CStatistics::s_sxCacheMisses;
+CStatTreeItemSimple*		CStatistics::s_sxCacheHitRate;
+
 // Download
 CStatTreeItemUlDlCounter*	CStatistics::s_sessionDownload;
 CStatTreeItemPacketTotals*	CStatistics::s_totalDownOverhead;
@@ -182,6 +219,23 @@ CStatTreeItemCounter*		CStatistics::s_cryptDownOverhead;
 CStatTreeItemCounter*		CStatistics::s_foundSources;
 CStatTreeItemNativeCounter*	CStatistics::s_activeDownloads;
 
+// Download buffers
+CStatTreeItemSimple*		CStatistics::s_bufferedData;
+CStatTreeItemSimple*		CStatistics::s_peakBufferedData;
+CStatTreeItemSimple*		CStatistics::s_bufferLimit;
+CStatTreeItemSimple*		CStatistics::s_cachedBuffers;
+CStatTreeItemSimple*		CStatistics::s_parkedData;
+CStatTreeItemSimple*		CStatistics::s_bufferAllocations;
+CStatTreeItemSimple*		CStatistics::s_reusedBuffers;
+CStatTreeItemSimple*		CStatistics::s_bufferThrottled;
+CStatTreeItemSimple*		CStatistics::s_deferredRequests;
+
+// End-game mode
+CStatTreeItemSimple*		CStatistics::s_endGameDuplicated;
+CStatTreeItemSimple*		CStatistics::s_endGameWon;
+CStatTreeItemSimple*		CStatistics::s_endGameWasted;
+CStatTreeItemSimple*		CStatistics::s_endGameSaved;
+
 // Connection
 CStatTreeItemReconnects*	CStatistics::s_reconnects;
 CStatTreeItemTimer*		CStatistics::s_sinceFirstTransfer;
@@ -217,6 +271,12 @@ CStatTreeItemSimple*		CStatistics::s_serverOccupation;
 CStatTreeItemCounter*		CStatistics::s_numberOfShared;
 CStatTreeItemCounter*		CStatistics::s_sizeOfShare;
 
+// Background tasks
+CStatTreeItemSimple*		CStatistics::s_taskLanes;
+CStatTreeItemSimple*		CStatistics::s_queuedTasks;
+CStatTreeItemSimple*		CStatistics::s_runningTasks;
+CStatTreeItemSimple*		CStatistics::s_completedTasks;
+
 // Kad
 uint64_t			CStatistics::s_kadNodesTotal;
 uint16_t			CStatistics::s_kadNodesCur;
@@ -754,6 +814,40 @@ void CStatistics::InitStatsTree()
 	s_totalUploadTime = new CStatTreeItemCounter(wxEmptyString);
 	tmpRoot2->AddChild(new CStatTreeItemAverage(wxTRANSLATE("Average upload time: %s"), s_totalUploadTime, s_totalSuccUploads, dmTime));
 
+	CStatTreeItemBase* blockCache = tmpRoot2->AddChild(new CStatTreeItemBase(wxTRANSLATE("Block Cache")));
+	s_blockCacheData = static_cast<CStatTreeItemSimple*>(blockCache->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Cached Data: %s"), stNone, dmBytes)));
+	s_blockCacheLimit = static_cast<CStatTreeItemSimple*>(blockCache->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Limit: %s"), stHideIfZero, dmBytes)));
+	s_blockCacheHits = static_cast<CStatTreeItemSimple*>(blockCache->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Hits: %llu"))));
+	s_blockCacheMisses = static_cast<CStatTreeItemSimple*>(blockCache->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Misses: %llu"))));
+	s_blockCacheHitRate = static_cast<CStatTreeItemSimple*>(blockCache->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Hit Rate: %.1f%%"))));
+	s_blockCacheHitRate->SetValue(0.0);
+	s_blockCacheEvicted = static_cast<CStatTreeItemSimple*>(blockCache->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Evicted Blocks: %llu"))));
+
+	CStatTreeItemBase* uploadSlots = tmpRoot2->AddChild(new CStatTreeItemBase(wxTRANSLATE("Upload Slots")));
+	s_slotLimit = static_cast<CStatTreeItemSimple*>(uploadSlots->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Slot Limit: %llu"))));
+	s_slotUtilisation = static_cast<CStatTreeItemSimple*>(uploadSlots->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Uplink Utilisation: %.1f%%"))));
+	s_slotUtilisation->SetValue(0.0);
+	s_slotsOpened = static_cast<CStatTreeItemSimple*>(uploadSlots->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Slots Opened: %llu"))));
+	s_slotsClosed = static_cast<CStatTreeItemSimple*>(uploadSlots->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Slots Closed: %llu"))));
+	s_slowSlotsDropped = static_cast<CStatTreeItemSimple*>(uploadSlots->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Slow Slots Dropped: %llu"))));
+
+	CStatTreeItemBase* compression = tmpRoot2->AddChild(new CStatTreeItemBase(wxTRANSLATE("Compression")));
+	s_compressedBlocks = static_cast<CStatTreeItemSimple*>(compression->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Compressed Blocks: %llu"))));
+	s_uncompressibleBlocks = static_cast<CStatTreeItemSimple*>(compression->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Uncompressible Blocks: %llu"))));
+	s_skippedCompressions = static_cast<CStatTreeItemSimple*>(compression->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Blocks Skipped While Busy: %llu"))));
+	s_compressedData = static_cast<CStatTreeItemSimple*>(compression->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Compressed Data: %s"), stNone, dmBytes)));
+	s_compressionSaved = static_cast<CStatTreeItemSimple*>(compression->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Saved Data: %s"), stNone, dmBytes)));
+	s_compressionTime = static_cast<CStatTreeItemSimple*>(compression->AddChild(new CStatTreeItemSimple(wxTRANSLATE("CPU Time: %.1f s"))));
+	s_compressionTime->SetValue(0.0);
+	s_compressionSavedPerSecond = static_cast<CStatTreeItemSimple*>(compression->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Saved per CPU Second: %s"), stNone, dmBytes)));
+	s_compressionLevel = static_cast<CStatTreeItemSimple*>(compression->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Current Level: %llu"))));
+
+	CStatTreeItemBase* sxCache = tmpRoot2->AddChild(new CStatTreeItemBase(wxTRANSLATE("Source Exchange Answers")));
+	s_sxCacheHits = static_cast<CStatTreeItemSimple*>(sxCache->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Hits: %llu"))));
+	s_sxCacheMisses = static_cast<CStatTreeItemSimple*>(sxCache->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Misses: %llu"))));
+	s_sxCacheHitRate = static_cast<CStatTreeItemSimple*>(sxCache->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Hit Rate: %.1f%%"))));
+	s_sxCacheHitRate->SetValue(0.0);
+
 	tmpRoot2 = tmpRoot1->AddChild(new CStatTreeItemBase(wxTRANSLATE("Downloads")), 1);
 	s_sessionDownload = static_cast<CStatTreeItemUlDlCounter*>(tmpRoot2->AddChild(new CStatTreeItemUlDlCounter(wxTRANSLATE("Downloaded Data (Session (Total)): %s"), theStats::GetTotalReceivedBytes, stSortChildren | stSortByValue)));
 	// Children will be added on-the-fly
@@ -771,6 +865,24 @@ void CStatistics::InitStatsTree()
 	s_foundSources = static_cast<CStatTreeItemCounter*>(tmpRoot2->AddChild(new CStatTreeItemCounter(wxTRANSLATE("Found Sources: %s"), stSortChildren | stSortByValue)));
 	s_activeDownloads = static_cast<CStatTreeItemNativeCounter*>(tmpRoot2->AddChild(new CStatTreeItemNativeCounter(wxTRANSLATE("Active Downloads (chunks): %s"))));
 
+	CStatTreeItemBase* buffers = tmpRoot2->AddChild(new CStatTreeItemBase(wxTRANSLATE("Download Buffers")));
+	s_bufferedData = static_cast<CStatTreeItemSimple*>(buffers->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Buffered Data: %s"), stNone, dmBytes)));
+	s_peakBufferedData = static_cast<CStatTreeItemSimple*>(buffers->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Peak Buffered Data: %s"), stNone, dmBytes)));
+	s_bufferLimit = static_cast<CStatTreeItemSimple*>(buffers->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Limit: %s"), stHideIfZero, dmBytes)));
+	s_cachedBuffers = static_cast<CStatTreeItemSimple*>(buffers->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Cached Buffers: %s"), stNone, dmBytes)));
+	s_parkedData = static_cast<CStatTreeItemSimple*>(buffers->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Held for Hashing: %s"), stNone, dmBytes)));
+	s_bufferAllocations = static_cast<CStatTreeItemSimple*>(buffers->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Allocations: %llu"))));
+	s_reusedBuffers = static_cast<CStatTreeItemSimple*>(buffers->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Reused Buffers: %llu"))));
+	s_bufferThrottled = static_cast<CStatTreeItemSimple*>(buffers->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Times Limit Reached: %llu"))));
+	s_deferredRequests = static_cast<CStatTreeItemSimple*>(buffers->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Deferred Block Requests: %llu"))));
+
+	CStatTreeItemBase* endGame = tmpRoot2->AddChild(new CStatTreeItemBase(wxTRANSLATE("End Game")));
+	s_endGameDuplicated = static_cast<CStatTreeItemSimple*>(endGame->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Duplicate Block Requests: %llu"))));
+	s_endGameWon = static_cast<CStatTreeItemSimple*>(endGame->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Blocks Won by Duplicates: %llu"))));
+	s_endGameWasted = static_cast<CStatTreeItemSimple*>(endGame->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Duplicate Data: %s"), stNone, dmBytes)));
+	s_endGameSaved = static_cast<CStatTreeItemSimple*>(endGame->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Time Saved (estimate): %.1f s"))));
+	s_endGameSaved->SetValue(0.0);
+
 	tmpRoot1->AddChild(new CStatTreeItemRatio(wxTRANSLATE("Session UL:DL Ratio (Total): %s"), s_sessionUpload, s_sessionDownload, theStats::GetTotalSentBytes, theStats::GetTotalReceivedBytes), 3);
 
 	tmpRoot1 = s_statTree->AddChild(new CStatTreeItemBase(wxTRANSLATE("Connection")));
@@ -817,6 +929,12 @@ void CStatistics::InitStatsTree()
 	s_sizeOfShare = static_cast<CStatTreeItemCounter*>(tmpRoot1->AddChild(new CStatTreeItemCounter(wxTRANSLATE("Total size of Shared Files: %s"))));
 	s_sizeOfShare->SetDisplayMode(dmBytes);
 	tmpRoot1->AddChild(new CStatTreeItemAverage(wxTRANSLATE("Average file size: %s"), s_sizeOfShare, s_numberOfShared, dmBytes));
+
+	tmpRoot1 = s_statTree->AddChild(new CStatTreeItemBase(wxTRANSLATE("Background Tasks")));
+	s_taskLanes = static_cast<CStatTreeItemSimple*>(tmpRoot1->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Lanes: %llu"))));
+	s_queuedTasks = static_cast<CStatTreeItemSimple*>(tmpRoot1->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Queued Tasks: %llu"))));
+	s_runningTasks = static_cast<CStatTreeItemSimple*>(tmpRoot1->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Running Tasks: %llu"))));
+	s_completedTasks = static_cast<CStatTreeItemSimple*>(tmpRoot1->AddChild(new CStatTreeItemSimple(wxTRANSLATE("Completed Tasks: %llu"))));
 }
 
 
@@ -831,6 +949,75 @@ void CStatistics::UpdateStatsTree()
 
 	s_avgConnections->SetValue(theApp->listensocket->GetAverageConnections());
 
+	CDownloadBufferPool::Stats bufferStats;
+	CDownloadBufferPool::GetStats(bufferStats);
+	s_bufferedData->SetValue(bufferStats.used);
+	s_peakBufferedData->SetValue(bufferStats.peak);
+	s_bufferLimit->SetValue(bufferStats.limit);
+	s_cachedBuffers->SetValue(bufferStats.cached);
+	s_parkedData->SetValue(bufferStats.parked);
+	s_bufferAllocations->SetValue(bufferStats.allocations);
+	s_reusedBuffers->SetValue(bufferStats.reused);
+	s_bufferThrottled->SetValue(bufferStats.throttled);
+	s_deferredRequests->SetValue(bufferStats.deferredRequests);
+
+	CEndGame::Stats endGameStats;
+	CEndGame::GetStats(endGameStats);
+	s_endGameDuplicated->SetValue(endGameStats.duplicated);
+	s_endGameWon->SetValue(endGameStats.won);
+	s_endGameWasted->SetValue(endGameStats.wasted);
+	s_endGameSaved->SetValue(endGameStats.saved / 1000.0);
+
+	CUploadBlockCache::Stats cacheStats;
+	CUploadBlockCache::GetStats(cacheStats);
+	const uint64 lookups = cacheStats.hits + cacheStats.misses;
+	s_blockCacheData->SetValue(cacheStats.cached);
+	s_blockCacheLimit->SetValue(cacheStats.limit);
+	s_blockCacheHits->SetValue(cacheStats.hits);
+	s_blockCacheMisses->SetValue(cacheStats.misses);
+	s_blockCacheHitRate->SetValue(lookups ? 100.0 * cacheStats.hits / lookups : 0.0);
+	s_blockCacheEvicted->SetValue(cacheStats.evicted);
+
+	const CUploadSlotController& slotController = theApp->uploadqueue->GetSlotController();
+	s_slotLimit->SetValue((uint64)theApp->uploadqueue->GetMaxSlots());
+	s_slotUtilisation->SetValue(theApp->uploadqueue->IsAdaptingSlots() ? slotController.GetUtilisation() : 0.0);
+	s_slotsOpened->SetValue(slotController.GetOpened());
+	s_slotsClosed->SetValue(slotController.GetClosed());
+	s_slowSlotsDropped->SetValue(slotController.GetDropped());
+
+	CUploadCompressor::Stats compressionStats;
+	CUploadCompressor::GetStats(compressionStats);
+	s_compressedBlocks->SetValue(compressionStats.compressed);
+	s_uncompressibleBlocks->SetValue(compressionStats.uncompressible);
+	s_skippedCompressions->SetValue(compressionStats.skipped);
+	s_compressedData->SetValue(compressionStats.input);
+	s_compressionSaved->SetValue(compressionStats.saved);
+	s_compressionTime->SetValue(compressionStats.time / 1000000.0);
+	s_compressionSavedPerSecond->SetValue(compressionStats.time ? compressionStats.saved * 1000000 / compressionStats.time : 0);
+	s_compressionLevel->SetValue((uint64)compressionStats.level);
+
+	CSourceExchangeCache::Stats sxStats;
+	CSourceExchangeCache::GetStats(sxStats);
+	const uint64 sxRequests = sxStats.hits + sxStats.misses;
+	s_sxCacheHits->SetValue(sxStats.hits);
+	s_sxCacheMisses->SetValue(sxStats.misses);
+	s_sxCacheHitRate->SetValue(sxRequests ? 100.0 * sxStats.hits / sxRequests : 0.0);
+
+	std::vector<CSchedulerLaneStats> laneStats;
+	CThreadScheduler::GetStats(laneStats);
+	uint64 queuedTasks = 0;
+	uint64 runningTasks = 0;
+	uint64 completedTasks = 0;
+	for (std::vector<CSchedulerLaneStats>::const_iterator it = laneStats.begin(); it != laneStats.end(); ++it) {
+		queuedTasks += it->queued;
+		runningTasks += it->running;
+		completedTasks += it->completed;
+	}
+	s_taskLanes->SetValue((uint64)laneStats.size());
+	s_queuedTasks->SetValue(queuedTasks);
+	s_runningTasks->SetValue(runningTasks);
+	s_completedTasks->SetValue(completedTasks);
+
 	// get serverstats
 	// TODO: make these realtime, too
 	uint32 servfail;
@@ -421,6 +421,36 @@ class CStatistics {
 	static	CStatTreeItemCounter*		s_totalFailedUploads;
 	static	CStatTreeItemCounter*		s_totalUploadTime;
 
+	// Upload block cache
+	static	CStatTreeItemSimple*		s_blockCacheData;
+	static	CStatTreeItemSimple*		s_blockCacheLimit;
+	static	CStatTreeItemSimple*		s_blockCacheHits;
+	static	CStatTreeItemSimple*		s_blockCacheMisses;
+	static	CStatTreeItemSimple*		s_blockCacheHitRate;
+	static	CStatTreeItemSimple*		s_blockCacheEvicted;
+
+	// Upload slots
+	static	CStatTreeItemSimple*		s_slotLimit;
+	static	CStatTreeItemSimple*		s_slotUtilisation;
+	static	CStatTreeItemSimple*		s_slotsOpened;
+	static	CStatTreeItemSimple*		s_slotsClosed;
+	static	CStatTreeItemSimple*		s_slowSlotsDropped;
+
+	// Upload compression
+	static	CStatTreeItemSimple*		s_compressedBlocks;
+	static	CStatTreeItemSimple*		s_uncompressibleBlocks;
+	static	CStatTreeItemSimple*		s_skippedCompressions;
+	static	CStatTreeItemSimple*		s_compressedData;
+	static	CStatTreeItemSimple*		s_compressionSaved;
+	static	CStatTreeItemSimple*		s_compressionTime;
+	static	CStatTreeItemSimple*		s_compressionSavedPerSecond;
+	static	CStatTreeItemSimple*		s_compressionLevel;
+
+	// Source exchange answers
+	static	CStatTreeItemSimple*		s_sxCacheHits;
+	static	CStatTreeItemSimple*		s_sxCacheMisses;
+	static	CStatTreeItemSimple*		s_sxCacheHitRate;
+
 	// Download
 	static	CStatTreeItemUlDlCounter*	s_sessionDownload;
 	static	CStatTreeItemPacketTotals*	s_totalDownOverhead;
@@ -432,6 +462,23 @@ class CStatistics {
 	static	CStatTreeItemCounter*		s_foundSources;
 	static	CStatTreeItemNativeCounter*	s_activeDownloads;
 
+	// Download buffers
+	static	CStatTreeItemSimple*		s_bufferedData;
+	static	CStatTreeItemSimple*		s_peakBufferedData;
+	static	CStatTreeItemSimple*		s_bufferLimit;
+	static	CStatTreeItemSimple*		s_cachedBuffers;
+	static	CStatTreeItemSimple*		s_parkedData;
+	static	CStatTreeItemSimple*		s_bufferAllocations;
+	static	CStatTreeItemSimple*		s_reusedBuffers;
+	static	CStatTreeItemSimple*		s_bufferThrottled;
+	static	CStatTreeItemSimple*		s_deferredRequests;
+
+	// End-game mode
+	static	CStatTreeItemSimple*		s_endGameDuplicated;
+	static	CStatTreeItemSimple*		s_endGameWon;
+	static	CStatTreeItemSimple*		s_endGameWasted;
+	static	CStatTreeItemSimple*		s_endGameSaved;
+
 	// Connection
 	static	CStatTreeItemReconnects*	s_reconnects;
 	static	CStatTreeItemTimer*		s_sinceFirstTransfer;
@@ -467,6 +514,12 @@ class CStatistics {
 	static	CStatTreeItemCounter*		s_numberOfShared;
 	static	CStatTreeItemCounter*		s_sizeOfShare;
 
+	// Background tasks
+	static	CStatTreeItemSimple*		s_taskLanes;
+	static	CStatTreeItemSimple*		s_queuedTasks;
+	static	CStatTreeItemSimple*		s_runningTasks;
+	static	CStatTreeItemSimple*		s_completedTasks;
+
 	// Kad nodes
 	static	uint64_t	s_kadNodesTotal;
 	static	uint16_t	s_kadNodesCur;
@@ -740,6 +740,10 @@ void CamulecmdApp::Process_Answer_v2(const CECPacket *response)
 			if ((tmpTag = response->GetTagByName(EC_TAG_STATS_UL_SPEED)) != 0) {
 				s <<	CFormat(_("\nUpload:\t%s")) % CastItoSpeed(tmpTag->GetInt());
 			}
+			if ((tmpTag = response->GetTagByName(EC_TAG_STATS_UL_TARGET_RATE)) != 0) {
+				const CECTag *delayTag = response->GetTagByName(EC_TAG_STATS_UL_QUEUEING_DELAY);
+				s <<	CFormat(_("\nUpload target:\t%s (queueing delay: %u ms)")) % CastItoSpeed(tmpTag->GetInt()) % (delayTag ? delayTag->GetInt() : 0);
+			}
 			if ((tmpTag = response->GetTagByName(EC_TAG_STATS_UL_QUEUE_LEN)) != 0) {
 				s <<	CFormat(_("\nClients in queue:\t%d\n")) % tmpTag->GetInt();
 			}
@@ -29,7 +29,7 @@
 
 #include <algorithm>			// Needed for std::sort		// Do_not_auto_remove (mingw-gcc-3.4.5)
 
-//! Global lock the scheduler and its thread.
+//! Global lock the scheduler and its threads.
 static wxMutex s_lock;
 //! Pointer to the global scheduler instance (automatically instantiated).
 static CThreadScheduler* s_scheduler = NULL;
@@ -37,6 +37,8 @@ static CThreadScheduler* s_scheduler = NULL;
 static bool	s_running = false;
 //! Specifies if the global scheduler has been terminated.
 static bool s_terminated = false;
+//! Lane limits by task type, see CThreadScheduler::SetLaneLimit.
+static std::map<wxString, uint32> s_laneLimits;
 
 /**
  * This class is used in a custom implementation of wxThreadHelper.
@@ -58,7 +60,7 @@ public:
 
 	//! For simplicity's sake, all code is placed in CThreadScheduler::Entry
 	void* Entry() {
-		return m_owner->Entry();
+		return m_owner->Entry(this);
 	}
 
 private:
@@ -74,10 +76,10 @@ void CThreadScheduler::Start()
 	s_running = true;
 	s_terminated = false;
 
-	// Ensures that a thread is started if tasks are already waiting.
+	// Ensures that threads are started if tasks are already waiting.
 	if (s_scheduler) {
 		AddDebugLogLineN(logThreads, wxT("Starting scheduler"));
-		s_scheduler->CreateSchedulerThread();
+		s_scheduler->CreateSchedulerThreads();
 	}
 }
 
@@ -104,6 +106,14 @@ void CThreadScheduler::Terminate()
 
 bool CThreadScheduler::AddTask(CThreadTask* task, bool overwrite)
 {
+	// The device is looked up before locking, since it may take a while.
+	if (task->m_ioPath.IsOk()) {
+		const sint64 device = CPath::GetDeviceAt(task->m_ioPath);
+		if (device != wxInvalidOffset) {
+			task->m_lane = CFormat(wxT("%s (device %i)")) % task->GetType() % device;
+		}
+	}
+
 	wxMutexLocker lock(s_lock);
 
 	// When terminated (on shutdown), all tasks are ignored.
@@ -120,6 +130,51 @@ bool CThreadScheduler::AddTask(CThreadTask* task, bool overwrite)
 }
 
 
+void CThreadScheduler::SetLaneLimit(const wxString& type, uint32 limit)
+{
+	wxCHECK_RET(limit > 0, wxT("Lanes must allow at least one task"));
+
+	wxMutexLocker lock(s_lock);
+
+	s_laneLimits[type] = limit;
+
+	if (s_scheduler) {
+		CLaneMap::iterator it = s_scheduler->m_lanes.begin();
+		for (; it != s_scheduler->m_lanes.end(); ++it) {
+			if (it->second.type == type) {
+				it->second.limit = limit;
+			}
+		}
+
+		if (s_running) {
+			s_scheduler->CreateSchedulerThreads();
+		}
+	}
+}
+
+
+void CThreadScheduler::GetStats(std::vector<CSchedulerLaneStats>& stats)
+{
+	stats.clear();
+
+	wxMutexLocker lock(s_lock);
+
+	if (s_scheduler) {
+		CLaneMap::const_iterator it = s_scheduler->m_lanes.begin();
+		for (; it != s_scheduler->m_lanes.end(); ++it) {
+			CSchedulerLaneStats entry;
+			entry.name = it->first;
+			entry.limit = it->second.limit;
+			entry.queued = it->second.tasks.size();
+			entry.running = it->second.running;
+			entry.completed = it->second.completed;
+
+			stats.push_back(entry);
+		}
+	}
+}
+
+
 /** Returns string representation of error code. */
 static wxString GetErrMsg(wxThreadError err)
 {
@@ -136,41 +191,71 @@ static wxString GetErrMsg(wxThreadError err)
 }
 
 
-void CThreadScheduler::CreateSchedulerThread()
+/**
+ * Returns the maximum number of scheduler threads.
+ *
+ * At least two threads are allowed, since tasks mostly wait for the
+ * disk and lanes usually work on different devices.
+ */
+static uint32 GetMaxThreads()
 {
-	if ((m_thread && m_thread->IsAlive()) || m_tasks.empty()) {
-		return;
-	}
+	return std::max(wxThread::GetCPUCount(), 2);
+}
+
 
-	// A thread can only be run once, so the old one must be safely disposed of
-	if (m_thread) {
-		AddDebugLogLineN(logThreads, wxT("CreateSchedulerThread: Disposing of old thread."));
-		m_thread->Stop();
-		delete m_thread;
+void CThreadScheduler::CreateSchedulerThreads()
+{
+	// A thread can only be run once, so old ones must be safely disposed of
+	std::list<CTaskThread*>::iterator it = m_threads.begin();
+	while (it != m_threads.end()) {
+		if ((*it)->IsAlive()) {
+			++it;
+		} else {
+			AddDebugLogLineN(logThreads, wxT("CreateSchedulerThreads: Disposing of old thread."));
+			(*it)->Stop();
+			delete *it;
+			it = m_threads.erase(it);
+		}
 	}
 
-	m_thread = new CTaskThread(this);
+	// Count the tasks that could be started right away.
+	uint32 runnable = 0;
+	CLaneMap::const_iterator lane = m_lanes.begin();
+	for (; lane != m_lanes.end(); ++lane) {
+		if (lane->second.running < lane->second.limit) {
+			runnable += std::min<uint32>(lane->second.tasks.size(), lane->second.limit - lane->second.running);
+		}
+	}
 
-	wxThreadError err = m_thread->Create();
-	if (err == wxTHREAD_NO_ERROR) {
-		// Try to avoid reducing the latency of the main thread
-		m_thread->SetPriority(WXTHREAD_MIN_PRIORITY);
+	// Threads that are not running a task are about to select one.
+	uint32 idle = m_activeThreads - m_runningTasks.size();
+	while ((runnable > idle) && (m_activeThreads < GetMaxThreads())) {
+		CTaskThread* thread = new CTaskThread(this);
 
-		err = m_thread->Run();
+		wxThreadError err = thread->Create();
 		if (err == wxTHREAD_NO_ERROR) {
-			AddDebugLogLineN(logThreads, wxT("Scheduler thread started"));
-			return;
+			// Try to avoid reducing the latency of the main thread
+			thread->SetPriority(WXTHREAD_MIN_PRIORITY);
+
+			err = thread->Run();
+			if (err == wxTHREAD_NO_ERROR) {
+				AddDebugLogLineN(logThreads, wxT("Scheduler thread started"));
+				m_threads.push_back(thread);
+				++m_activeThreads;
+				++idle;
+				continue;
+			} else {
+				AddDebugLogLineC(logThreads, wxT("Error while starting scheduler thread: ") + GetErrMsg(err));
+			}
 		} else {
-			AddDebugLogLineC(logThreads, wxT("Error while starting scheduler thread: ") + GetErrMsg(err));
+			AddDebugLogLineC(logThreads, wxT("Error while creating scheduler thread: ") + GetErrMsg(err));
 		}
-	} else {
-		AddDebugLogLineC(logThreads, wxT("Error while creating scheduler thread: ") + GetErrMsg(err));
-	}
 
-	// Creation or running failed.
-	m_thread->Stop();
-	delete m_thread;
-	m_thread = NULL;
+		// Creation or running failed.
+		thread->Stop();
+		delete thread;
+		break;
+	}
 }
 
 
@@ -190,9 +275,7 @@ struct CTaskSorter
 
 
 CThreadScheduler::CThreadScheduler()
-	: m_tasksDirty(false),
-	  m_thread(NULL),
-	  m_currentTask(NULL)
+	: m_activeThreads(0)
 {
 
 }
@@ -200,18 +283,51 @@ CThreadScheduler::CThreadScheduler()
 
 CThreadScheduler::~CThreadScheduler()
 {
-	if (m_thread) {
-		m_thread->Stop();
-		delete m_thread;
+	std::list<CTaskThread*>::iterator it = m_threads.begin();
+	for (; it != m_threads.end(); ++it) {
+		(*it)->Stop();
+		delete *it;
+	}
+
+	// Tasks which were never started are owned by the scheduler.
+	CLaneMap::iterator lane = m_lanes.begin();
+	for (; lane != m_lanes.end(); ++lane) {
+		CTaskQueue& tasks = lane->second.tasks;
+		for (CTaskQueue::iterator task = tasks.begin(); task != tasks.end(); ++task) {
+			delete task->first;
+		}
 	}
 }
 
 
 size_t CThreadScheduler::GetTaskCount() const
 {
-	wxMutexLocker lock(s_lock);
+	size_t count = 0;
+	CLaneMap::const_iterator it = m_lanes.begin();
+	for (; it != m_lanes.end(); ++it) {
+		count += it->second.tasks.size();
+	}
+
+	return count;
+}
+
+
+CThreadScheduler::CLane& CThreadScheduler::GetLane(const CThreadTask* task)
+{
+	CLaneMap::iterator it = m_lanes.find(task->GetLane());
+	if (it == m_lanes.end()) {
+		AddDebugLogLineN(logThreads, wxT("Creating lane: ") + task->GetLane());
+
+		it = m_lanes.insert(CLaneMap::value_type(task->GetLane(), CLane())).first;
+		it->second.type = task->GetType();
+
+		std::map<wxString, uint32>::const_iterator limit = s_laneLimits.find(task->GetType());
+		if (limit != s_laneLimits.end()) {
+			it->second.limit = limit->second;
+		}
+	}
 
-	return m_tasks.size();
+	return it->second;
 }
 
 
@@ -227,67 +343,107 @@ bool CThreadScheduler::DoAddTask(CThreadTask* task, bool overwrite)
 	CDescMap::value_type entry(task->GetDesc(), task);
 	if (map.insert(entry).second) {
 		AddDebugLogLineN(logThreads, wxT("Task scheduled: ") + task->GetType() + wxT(" - ") + task->GetDesc());
-		m_tasks.push_back(CEntryPair(task, taskAge++));
-		m_tasksDirty = true;
 	} else if (overwrite) {
 		AddDebugLogLineN(logThreads, wxT("Task overwritten: ") + task->GetType() + wxT(" - ") + task->GetDesc());
 
 		CThreadTask* existingTask = map[task->GetDesc()];
-		if (m_currentTask == existingTask) {
+		if (m_runningTasks.count(existingTask)) {
 			// The duplicate is already being executed, abort it.
-			m_currentTask->m_abort = true;
+			existingTask->m_abort = true;
 		} else {
 			// Task not yet started, simply remove and delete.
-			wxCHECK2(map.erase(existingTask->GetDesc()), /* Do nothing. */);
+			CTaskQueue& tasks = GetLane(existingTask).tasks;
+			for (CTaskQueue::iterator it = tasks.begin(); it != tasks.end(); ++it) {
+				if (it->first == existingTask) {
+					tasks.erase(it);
+					break;
+				}
+			}
+
 			delete existingTask;
 		}
 
-		m_tasks.push_back(CEntryPair(task, taskAge++));
 		map[task->GetDesc()] = task;
-		m_tasksDirty = true;
 	} else {
 		AddDebugLogLineN(logThreads, wxT("Duplicate task, discarding: ") + task->GetType() + wxT(" - ") + task->GetDesc());
 		delete task;
 		return false;
 	}
 
+	CLane& lane = GetLane(task);
+	lane.tasks.push_back(CEntryPair(task, taskAge++));
+	lane.dirty = true;
+
 	if (s_running) {
-		CreateSchedulerThread();
+		CreateSchedulerThreads();
 	}
 
 	return true;
 }
 
 
-void* CThreadScheduler::Entry()
+CThreadTask* CThreadScheduler::SelectTask()
+{
+	CLane* best = NULL;
+
+	CLaneMap::iterator it = m_lanes.begin();
+	for (; it != m_lanes.end(); ++it) {
+		CLane& lane = it->second;
+		if (lane.tasks.empty() || (lane.running >= lane.limit)) {
+			continue;
+		}
+
+		// Resort tasks by priority/age if the lane has been modified.
+		if (lane.dirty) {
+			AddDebugLogLineN(logThreads, wxT("Resorting tasks of lane: ") + it->first);
+			std::sort(lane.tasks.begin(), lane.tasks.end(), CTaskSorter());
+			lane.dirty = false;
+		}
+
+		if ((best == NULL) || CTaskSorter()(lane.tasks.front(), best->tasks.front())) {
+			best = &lane;
+		}
+	}
+
+	if (best == NULL) {
+		return NULL;
+	}
+
+	CThreadTask* task = best->tasks.front().first;
+	best->tasks.pop_front();
+	best->running++;
+	m_runningTasks.insert(task);
+
+	return task;
+}
+
+
+void* CThreadScheduler::Entry(CTaskThread* thread)
 {
 	AddDebugLogLineN(logThreads, wxT("Entering scheduling loop"));
 
-	while (!m_thread->TestDestroy()) {
+	while (true) {
 		CScopedPtr<CThreadTask> task(NULL);
 
 		{
 			wxMutexLocker lock(s_lock);
 
-			// Resort tasks by priority/age if list has been modified.
-			if (m_tasksDirty) {
-				AddDebugLogLineN(logThreads, wxT("Resorting tasks"));
-				std::sort(m_tasks.begin(), m_tasks.end(), CTaskSorter());
-				m_tasksDirty = false;
-			} else if (m_tasks.empty()) {
-				AddDebugLogLineN(logThreads, wxT("No more tasks, stopping"));
-				break;
+			if (!thread->TestDestroy()) {
+				task.reset(SelectTask());
 			}
 
-			// Select the next task
-			task.reset(m_tasks.front().first);
-			m_tasks.pop_front();
-			m_currentTask = task.get();
+			// The thread must be accounted for while the lock is
+			// held, or newly added tasks could be left waiting.
+			if (task.get() == NULL) {
+				AddDebugLogLineN(logThreads, wxT("No more runnable tasks, stopping"));
+				m_activeThreads--;
+				break;
+			}
 		}
 
 		AddDebugLogLineN(logThreads, wxT("Current task: ") + task->GetType() + wxT(" - ") + task->GetDesc());
 		// Execute the task
-		task->m_owner = m_thread;
+		task->m_owner = thread;
 		task->Entry();
 		task->OnExit();
 
@@ -297,6 +453,11 @@ void* CThreadScheduler::Entry()
 		{
 			wxMutexLocker lock(s_lock);
 
+			CLane& lane = GetLane(task.get());
+			lane.running--;
+			lane.completed++;
+			m_runningTasks.erase(task.get());
+
 			// If the task has been aborted, the entry now refers to
 			// a different task, so dont remove it. That also means
 			// that it can't be the last task of this type.
@@ -305,7 +466,7 @@ void* CThreadScheduler::Entry()
 					CFormat(wxT("Completed task '%s%s', %u tasks remaining."))
 						% task->GetType()
 						% (task->GetDesc().IsEmpty() ? wxString() : (wxT(" - ") + task->GetDesc()))
-						% m_tasks.size() );
+						% GetTaskCount() );
 
 				CDescMap& map = m_taskDescs[task->GetType()];
 				if (!map.erase(task->GetDesc())) {
@@ -315,8 +476,6 @@ void* CThreadScheduler::Entry()
 					isLastTask = true;
 				}
 			}
-
-			m_currentTask = NULL;
 		}
 
 		if (isLastTask) {
@@ -337,6 +496,7 @@ CThreadTask::CThreadTask(const wxString& type, const wxString& desc, ETaskPriori
 	: m_type(type),
 	  m_desc(desc),
 	  m_priority(priority),
+	  m_lane(type),
 	  m_owner(NULL),
 	  m_abort(false)
 {
@@ -386,4 +546,16 @@ ETaskPriority CThreadTask::GetPriority() const
 }
 
 
+const wxString& CThreadTask::GetLane() const
+{
+	return m_lane;
+}
+
+
+void CThreadTask::SetIOPath(const CPath& path)
+{
+	m_ioPath = path;
+}
+
+
 // File_checked_for_headers
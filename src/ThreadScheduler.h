@@ -29,12 +29,17 @@
 
 #include <deque>
 #include <map>
+#include <set>
+#include <list>
+#include <vector>
 
 #include "Types.h"
 #include "MuleThread.h"
+#include <common/Path.h>
 
 
 class CThreadTask;
+class CTaskThread;
 
 
 //! The priority values of tasks.
@@ -48,14 +53,40 @@ enum ETaskPriority
 };
 
 
+//! Statistics of a single lane of the scheduler, see CThreadScheduler::GetStats.
+struct CSchedulerLaneStats
+{
+	//! The name of the lane (task type and device).
+	wxString	name;
+	//! The maximum number of tasks run at the same time in this lane.
+	uint32		limit;
+	//! The number of tasks waiting to be run.
+	uint32		queued;
+	//! The number of tasks currently being run.
+	uint32		running;
+	//! The number of tasks completed since the lane was created.
+	uint32		completed;
+};
+
+
 /**
  * This class mananges scheduling of background tasks.
  *
- * Currently it is assumed that all tasks are IO intensive,
- * so that only a single task is allowed to proceed at any
- * one time. All threads are run in lowest priority mode.
+ * Tasks are executed in lanes. A lane is made up of the
+ * tasks of one type (see CThreadTask::GetType) that work on
+ * files on the same device (see CThreadTask::SetIOPath),
+ * or simply of all tasks of one type if they don't work on
+ * files. Since tasks are assumed to be IO intensive, each
+ * lane by default only allows a single task to proceed at
+ * any one time, but different lanes run in parallel, using
+ * at most one thread per CPU. For instance, hashing of new
+ * shared files doesn't hold up the completion of downloads,
+ * and hashing files on two disks proceeds on both of them.
+ * All threads are run in lowest priority mode.
  *
- * Tasks are sorted by priority (see ETaskPriority) and age.
+ * Tasks are sorted by priority (see ETaskPriority) and age,
+ * and the oldest task of the highest priority whose lane has
+ * room for another task is executed next.
  *
  * Note that the scheduler starts in suspended mode, in
  * which tasks are queued but not executed. Call Start()
@@ -93,40 +124,80 @@ public:
 	 */
 	static bool AddTask(CThreadTask* task, bool overwrite = false);
 
+	/**
+	 * Sets the number of tasks of the given type that may run at the
+	 * same time in a single lane (i.e. on the same device). The default
+	 * is one.
+	 */
+	static void SetLaneLimit(const wxString& type, uint32 limit);
+
+	/** Retrieves the statistics of all lanes in use. */
+	static void GetStats(std::vector<CSchedulerLaneStats>& stats);
+
 private:
 	CThreadScheduler();
 	~CThreadScheduler();
 
-	/** Returns the number of tasks on the queue. */
+	//! Contains a task and its age.
+	typedef std::pair<CThreadTask*, uint32> CEntryPair;
+	//! List of scheduled tasks.
+	typedef std::deque<CEntryPair> CTaskQueue;
+
+	//! A single lane of tasks.
+	struct CLane
+	{
+		CLane()
+			: dirty(false), limit(1), running(0), completed(0)
+		{}
+
+		//! The type of the tasks in this lane.
+		wxString	type;
+		//! The tasks waiting to be run.
+		CTaskQueue	tasks;
+		//! Specifies if tasks should be resorted by priority.
+		bool		dirty;
+		//! The maximum number of tasks to run at the same time.
+		uint32		limit;
+		//! The number of tasks currently being run.
+		uint32		running;
+		//! The number of tasks completed so far.
+		uint32		completed;
+	};
+
+	typedef std::map<wxString, CLane> CLaneMap;
+
+	/** Returns the number of tasks waiting in all lanes. The lock must be held. */
 	size_t GetTaskCount() const;
 
+	/** Returns the lane of the given task, creating it as needed. */
+	CLane& GetLane(const CThreadTask* task);
+
 	/** Tries to add the given task to the queue, returning true on success. */
 	bool DoAddTask(CThreadTask* task, bool overwrite);
 
-	/** Creates the actual scheduler thread if none exist. */
-	void CreateSchedulerThread();
+	/** Creates scheduler threads for the tasks that may be run right away. */
+	void CreateSchedulerThreads();
 
-	/** Entry function called via internal thread-object. */
-	void* Entry();
+	/** Selects the next task to be run, or returns NULL if no task may be run. */
+	CThreadTask* SelectTask();
 
-	//! Contains a task and its age.
-	typedef std::pair<CThreadTask*, uint32> CEntryPair;
-
-	//! List of currently scheduled tasks.
-	std::deque<CEntryPair> m_tasks;
+	/** Entry function called via internal thread-object. */
+	void* Entry(CTaskThread* thread);
 
-	//! Specifies if tasks should be resorted by priority.
-	bool	m_tasksDirty;
+	//! The lanes of the scheduler, by name.
+	CLaneMap m_lanes;
 
 	typedef std::map<wxString, CThreadTask*> CDescMap;
 	typedef std::map<wxString, CDescMap> CTypeMap;
 	//! Map of current task by type -> desc. Used to avoid duplicate tasks.
 	CTypeMap m_taskDescs;
 
-	//! The actual worker thread.
-	CMuleThread* m_thread;
-	//! The currently running task, if any.
-	CThreadTask* m_currentTask;
+	//! The worker threads.
+	std::list<CTaskThread*> m_threads;
+	//! The number of worker threads which have not yet left their loop.
+	uint32 m_activeThreads;
+	//! The tasks currently being run.
+	std::set<CThreadTask*> m_runningTasks;
 
 	friend class CTaskThread;
 	friend struct CTaskSorter;
@@ -168,7 +239,18 @@ public:
 	/** Returns the priority of the task. Used when selecting the next task. */
 	ETaskPriority GetPriority() const;
 
+	/** Returns the lane the task is run in, see CThreadScheduler. */
+	const wxString& GetLane() const;
+
 protected:
+	/**
+	 * Specifies the file or directory the task works on.
+	 *
+	 * The task is run in the lane of its type for the device containing
+	 * the path. Must be called from the constructor of the task.
+	 */
+	void SetIOPath(const CPath& path);
+
 	//! @see wxThread::Entry
 	virtual void Entry() = 0;
 
@@ -185,8 +267,12 @@ private:
 	wxString m_type;
 	wxString m_desc;
 	ETaskPriority m_priority;
+	//! The file or directory the task works on, if any.
+	CPath m_ioPath;
+	//! The lane of the task, set when the task is added to the scheduler.
+	wxString m_lane;
 
-	//! The owner (scheduler), used when calling TestDestroy.
+	//! The thread running the task, used when calling TestDestroy.
 	CMuleThread* m_owner;
 	//! Specifies if the specific task should be aborted.
 	bool m_abort;
@@ -36,14 +36,112 @@
 #include "Preferences.h"		// Needed for thePrefs
 #include "ScopedPtr.h"			// Needed for CScopedPtr and CScopedArray
 #include "PlatformSpecific.h"		// Needed for CanFSHandleSpecialChars
+#include "PartHashing.h"		// Needed for CreatePartHashes
+#include "FileArea.h"			// Needed for CFileArea
+#include "MuleThread.h"			// Needed for CMuleThread
+#include "PartFileJournal.h"		// Needed for CPartFileJournal
+#include "MemFile.h"			// Needed for CMemFile
 #include "config.h"
 
+#include <algorithm>			// Needed for std::min and std::max
+
 //! This hash represents the value for an empty MD4 hashing
 const uint8_t g_emptyMD4Hash[16] = {
 	0x31, 0xD6, 0xCF, 0xE0, 0xD1, 0x6A, 0xE9, 0x31,
 	0xB7, 0x3C, 0x59, 0xD7, 0xE0, 0xC0, 0x89, 0xC0 };
 
 
+////////////////////////////////////////////////////////////
+// CPartHashingState
+
+/**
+ * The parts of a file being hashed by a CHashingTask and its helpers.
+ *
+ * Each worker takes the next part to be hashed and stores the results in
+ * the slots of that part, so that every part is hashed exactly once.
+ */
+struct CPartHashingState
+{
+	CPartHashingState(const CPath& _path, uint64 _fileLength, uint16 _partCount, bool md4, bool aich)
+		: path(_path),
+		  fileLength(_fileLength),
+		  partCount(_partCount),
+		  nextPart(0),
+		  hashedParts(0),
+		  aborted(false)
+	{
+		if (md4) {
+			md4Hashes.resize(partCount);
+		}
+
+		if (aich) {
+			aichHashes.resize(partCount);
+		}
+	}
+
+	//! The full path of the file.
+	const CPath	path;
+	//! The size of the file.
+	const uint64	fileLength;
+	//! The number of parts to hash.
+	const uint16	partCount;
+
+	//! Protects the members below.
+	wxMutex		lock;
+	//! The next part to be hashed.
+	uint16		nextPart;
+	//! The number of parts hashed so far.
+	uint16		hashedParts;
+	//! Set if the workers should stop.
+	bool		aborted;
+	//! Error message of the first failed read, empty otherwise.
+	wxString	error;
+
+	//! The MD4 hash of each part, empty if not requested.
+	std::vector<CMD4Hash>	md4Hashes;
+	//! The AICH block hashes of each part, empty if not requested.
+	std::vector< std::vector<CAICHHash> >	aichHashes;
+};
+
+
+////////////////////////////////////////////////////////////
+// CPartHashingThread
+
+/**
+ * Helps a CHashingTask to hash the parts of a file.
+ *
+ * The thread reads through its own handle of the file, and stops when no
+ * parts are left or the task has been aborted.
+ */
+class CPartHashingThread : public CMuleThread
+{
+public:
+	CPartHashingThread(CHashingTask& task, CPartHashingState& state)
+		: CMuleThread(wxTHREAD_JOINABLE),
+		  m_task(task),
+		  m_state(state)
+	{}
+
+protected:
+	/** @see wxThread::Entry */
+	virtual void* Entry()
+	{
+		CFileAutoClose file;
+		// If the file cannot be opened, the parts are left to the others.
+		if (file.Open(m_state.path, CFile::read)) {
+			file.Advise(0, 0, CFile::hint_sequential);
+			m_task.HashParts(file, m_state, false);
+		}
+
+		return NULL;
+	}
+
+private:
+	CHashingTask&		m_task;
+	CPartHashingState&	m_state;
+};
+
+
 ////////////////////////////////////////////////////////////
 // CHashingTask
 
@@ -63,6 +161,8 @@ CHashingTask::CHashingTask(const CPath& path, const CPath& filename, const CPart
 	if (part && !part->GetGapList().empty()) {
 		m_toHash = EH_MD4;
 	}
+
+	SetIOPath(path);
 }
 
 
@@ -74,6 +174,21 @@ CHashingTask::CHashingTask(const CKnownFile* toAICHHash)
 	  m_toHash(EH_AICH),
 	  m_owner(toAICHHash)
 {
+	SetIOPath(m_path);
+}
+
+
+void CHashingTask::SetupLanes()
+{
+	// Each file is read ahead while it is being hashed (see Entry), so a
+	// few files per device keep several cores busy without the disk
+	// seeking back and forth too much. Each task holds a single part in
+	// memory, which bounds the memory used for hashing.
+	const int maxFiles = 4;
+	const uint32 files = std::min(std::max(wxThread::GetCPUCount(), 1), maxFiles);
+
+	CThreadScheduler::SetLaneLimit(wxT("Hashing"), files);
+	CThreadScheduler::SetLaneLimit(wxT("AICH Hashing"), files);
 }
 
 
@@ -141,26 +256,76 @@ void CHashingTask::Entry()
 			% m_filename).GetString());
 	}
 
-	// This loops creates the part-hashes, loop-de-loop.
-	try {
-		for (uint16 part = 0; part < knownfile->GetPartCount() && !TestDestroy(); part++) {
-			SetHashingProgress(part + 1);
-			if (CreateNextPartHash(file, part, knownfile.get(), m_toHash) == false) {
-				AddDebugLogLineC(logHasher,
-					CFormat(wxT("Error while hashing file, skipping: %s"))
-						% m_filename);
-
-				SetHashingProgress(0);
-				return;
+	// The parts are hashed by the task thread, which for part-files is
+	// joined by a few helper threads, since verifying a completed download
+	// would otherwise take minutes for very large files.
+	CPartHashingState state(fullPath, fileLength, knownfile->GetPartCount(),
+		(m_toHash & EH_MD4) != 0, (m_toHash & EH_AICH) != 0);
+
+	std::vector<CPartHashingThread*> helpers;
+	if (m_owner && m_owner->IsPartFile()) {
+		const int maxThreads = 4;
+		const int threads = std::min(std::max(wxThread::GetCPUCount(), 1), maxThreads);
+
+		for (int i = 1; i < threads && i < knownfile->GetPartCount(); ++i) {
+			CPartHashingThread* helper = new CPartHashingThread(*this, state);
+			if (helper->Create() == wxTHREAD_NO_ERROR && helper->Run() == wxTHREAD_NO_ERROR) {
+				helpers.push_back(helper);
+			} else {
+				delete helper;
 			}
 		}
-	} catch (const CSafeIOException& e) {
-		AddDebugLogLineC(logHasher, wxT("IO exception while hashing file: ") + e.what());
-		SetHashingProgress(0);
-		return;
 	}
+
+	// Parts are handed out front to back, so the file is still read
+	// mostly sequentially, and the next part is read ahead. Parts already
+	// hashed are dropped from the page cache, since hashing large libraries
+	// would otherwise evict everything else.
+	file.Advise(0, 0, CFile::hint_sequential);
+	HashParts(file, state, true);
+
+	for (size_t i = 0; i < helpers.size(); ++i) {
+		helpers[i]->Wait();
+		delete helpers[i];
+	}
+
 	SetHashingProgress(0);
 
+	if (!state.error.IsEmpty()) {
+		AddDebugLogLineC(logHasher, wxT("IO exception while hashing file: ") + state.error);
+		return;
+	} else if (state.aborted) {
+		return;
+	}
+
+	if (m_toHash & EH_MD4) {
+		knownfile->m_hashlist = state.md4Hashes;
+
+		// This is because of the ed2k implementation for parts. A 2 * PARTSIZE
+		// file i.e. will have 3 parts (see CKnownFile::SetFileSize for comments).
+		// So we have to create the hash for the 0-size data, which will be the default
+		// md4 hash for null data: 31D6CFE0D16AE931B73C59D7E0C089C0
+		if ((fileLength % PARTSIZE) == 0) {
+			knownfile->m_hashlist.push_back(CMD4Hash(g_emptyMD4Hash));
+		}
+	}
+
+	if (m_toHash & EH_AICH) {
+		// The hash tree is not thread-safe, so the block hashes are only
+		// inserted once all parts have been hashed.
+		CAICHHashTree& tree = knownfile->GetAICHHashset()->m_pHashTree;
+		for (uint16 part = 0; part < state.partCount; ++part) {
+			const uint64 partStart = part * PARTSIZE;
+			const uint32 partLength = knownfile->GetPartSize(part);
+			const std::vector<CAICHHash>& blocks = state.aichHashes[part];
+
+			for (size_t i = 0; i < blocks.size(); ++i) {
+				const uint32 blockStart = i * EMBLOCKSIZE;
+				tree.SetBlockHash(std::min<uint32>(EMBLOCKSIZE, partLength - blockStart), partStart + blockStart, blocks[i]);
+			}
+		}
+	}
+
 	if ((m_toHash & EH_MD4) && !TestDestroy()) {
 		// If the file is < PARTSIZE, then the filehash is that one hash,
 		// otherwise, the filehash is the hash of the parthashes
@@ -214,39 +379,56 @@ void CHashingTask::SetHashingProgress(uint16 part)
 }
 
 
-bool CHashingTask::CreateNextPartHash(CFileAutoClose& file, uint16 part, CKnownFile* owner, EHashes toHash)
+void CHashingTask::HashParts(CFileAutoClose& file, CPartHashingState& state, bool isTaskThread)
 {
-	wxCHECK_MSG(!file.Eof(), false, wxT("Unexpected EOF in CreateNextPartHash"));
+	while (true) {
+		uint16 part = 0;
+		uint16 nextPart = 0;
+		{
+			wxMutexLocker lock(state.lock);
+			if (state.aborted || state.nextPart >= state.partCount) {
+				return;
+			} else if (isTaskThread && TestDestroy()) {
+				state.aborted = true;
+				return;
+			}
 
-	const uint64 offset = part * PARTSIZE;
-	// We'll read at most PARTSIZE bytes per cycle
-	const uint64 partLength = owner->GetPartSize(part);
+			part = state.nextPart++;
+			nextPart = state.nextPart;
+		}
 
-	CMD4Hash hash;
-	CMD4Hash* md4Hash = ((toHash & EH_MD4) ? &hash : NULL);
-	CAICHHashTree* aichHash = NULL;
+		// While this part is being hashed, the kernel is asked to read
+		// ahead the part that is handed out next.
+		if (nextPart < state.partCount) {
+			const uint64 nextOffset = nextPart * PARTSIZE;
+			file.Advise(nextOffset, std::min<uint64>(PARTSIZE, state.fileLength - nextOffset), CFile::hint_willneed);
+		}
 
-	// Setup for AICH hashing
-	if (toHash & EH_AICH) {
-		aichHash = owner->GetAICHHashset()->m_pHashTree.FindHash(offset, partLength);
-	}
+		const uint64 offset = part * PARTSIZE;
+		const uint32 length = std::min<uint64>(PARTSIZE, state.fileLength - offset);
 
-	owner->CreateHashFromFile(file, offset, partLength, md4Hash, aichHash);
+		try {
+			CFileArea area;
+			area.ReadAt(file, offset, length);
+
+			CreatePartHashes(area.GetBuffer(), length,
+				state.md4Hashes.empty() ? NULL : &state.md4Hashes[part],
+				state.aichHashes.empty() ? NULL : &state.aichHashes[part]);
+			area.CheckError();
+		} catch (const CSafeIOException& e) {
+			wxMutexLocker lock(state.lock);
+			if (state.error.IsEmpty()) {
+				state.error = e.what();
+			}
+			state.aborted = true;
+			return;
+		}
 
-	if (toHash & EH_MD4) {
-		// Store the md4 hash
-		owner->m_hashlist.push_back(hash);
+		file.Advise(offset, length, CFile::hint_dontneed);
 
-		// This is because of the ed2k implementation for parts. A 2 * PARTSIZE
-		// file i.e. will have 3 parts (see CKnownFile::SetFileSize for comments).
-		// So we have to create the hash for the 0-size data, which will be the default
-		// md4 hash for null data: 31D6CFE0D16AE931B73C59D7E0C089C0
-		if ((partLength == PARTSIZE) && file.Eof()) {
-			owner->m_hashlist.push_back(CMD4Hash(g_emptyMD4Hash));
-		}
+		wxMutexLocker lock(state.lock);
+		SetHashingProgress(++state.hashedParts);
 	}
-
-	return true;
 }
 
 
@@ -274,64 +456,70 @@ CAICHSyncTask::CAICHSyncTask()
 
 void CAICHSyncTask::Entry()
 {
-	ConvertToKnown2ToKnown264();
-
-	AddDebugLogLineN( logAICHThread, wxT("Synchronization thread started.") );
-
 	// We collect all masterhashs which we find in the known2.met and store them in a list
 	std::list<CAICHHash> hashlist;
-	const CPath fullpath = CPath(thePrefs::GetConfigDir() + KNOWN2_MET_FILENAME);
 
-	CFile file;
-	if (!fullpath.FileExists()) {
-		// File does not exist. Try to create it to see if it can be created at all (and don't start hashing otherwise).
-		if (!file.Open(fullpath, CFile::write)) {
-			AddDebugLogLineC( logAICHThread, wxT("Error, failed to open 'known2_64.met' file!") );
-			return;
-		}
-		try {
-			file.WriteUInt8(KNOWN2_MET_VERSION);
-		} catch (const CIOFailureException& e) {
-			AddDebugLogLineC(logAICHThread, wxT("IO failure while creating hashlist (Aborting): ") + e.what());
-			return;
-		}
-	} else {
-		if (!file.Open(fullpath, CFile::read)) {
-			AddDebugLogLineC( logAICHThread, wxT("Error, failed to open 'known2_64.met' file!") );
-			return;
-		}
+	{
+		// Hashing tasks running in other lanes may be saving hashsets meanwhile.
+		wxMutexLocker lock(CAICHHashSet::m_metFileLock);
 
-		uint32 nLastVerifiedPos = 0;
-		try {
-			if (file.ReadUInt8() != KNOWN2_MET_VERSION) {
-				throw CEOFException(wxT("Invalid met-file header found, removing file."));
+		ConvertToKnown2ToKnown264();
+
+		AddDebugLogLineN( logAICHThread, wxT("Synchronization thread started.") );
+
+		const CPath fullpath = CPath(thePrefs::GetConfigDir() + KNOWN2_MET_FILENAME);
+
+		CFile file;
+		if (!fullpath.FileExists()) {
+			// File does not exist. Try to create it to see if it can be created at all (and don't start hashing otherwise).
+			if (!file.Open(fullpath, CFile::write)) {
+				AddDebugLogLineC( logAICHThread, wxT("Error, failed to open 'known2_64.met' file!") );
+				return;
+			}
+			try {
+				file.WriteUInt8(KNOWN2_MET_VERSION);
+			} catch (const CIOFailureException& e) {
+				AddDebugLogLineC(logAICHThread, wxT("IO failure while creating hashlist (Aborting): ") + e.what());
+				return;
+			}
+		} else {
+			if (!file.Open(fullpath, CFile::read)) {
+				AddDebugLogLineC( logAICHThread, wxT("Error, failed to open 'known2_64.met' file!") );
+				return;
 			}
 
-			uint64 nExistingSize = file.GetLength();
-			while (file.GetPosition() < nExistingSize) {
-				// Read the next hash
-				hashlist.push_back(CAICHHash(&file));
+			uint32 nLastVerifiedPos = 0;
+			try {
+				if (file.ReadUInt8() != KNOWN2_MET_VERSION) {
+					throw CEOFException(wxT("Invalid met-file header found, removing file."));
+				}
+
+				uint64 nExistingSize = file.GetLength();
+				while (file.GetPosition() < nExistingSize) {
+					// Read the next hash
+					hashlist.push_back(CAICHHash(&file));
 
-				uint32 nHashCount = file.ReadUInt32();
-				if (file.GetPosition() + nHashCount * CAICHHash::GetHashSize() > nExistingSize){
-					throw CEOFException(wxT("Hashlist ends past end of file."));
+					uint32 nHashCount = file.ReadUInt32();
+					if (file.GetPosition() + nHashCount * CAICHHash::GetHashSize() > nExistingSize){
+						throw CEOFException(wxT("Hashlist ends past end of file."));
+					}
+
+					// skip the rest of this hashset
+					nLastVerifiedPos = file.Seek(nHashCount * HASHSIZE, wxFromCurrent);
 				}
+			} catch (const CEOFException&) {
+				AddDebugLogLineC(logAICHThread, wxT("Hashlist corrupted, truncating file."));
+				file.Close();
+				file.Reopen(CFile::read_write);
+				file.SetLength(nLastVerifiedPos);
+			} catch (const CIOFailureException& e) {
+				AddDebugLogLineC(logAICHThread, wxT("IO failure while reading hashlist (Aborting): ") + e.what());
 
-				// skip the rest of this hashset
-				nLastVerifiedPos = file.Seek(nHashCount * HASHSIZE, wxFromCurrent);
+				return;
 			}
-		} catch (const CEOFException&) {
-			AddDebugLogLineC(logAICHThread, wxT("Hashlist corrupted, truncating file."));
-			file.Close();
-			file.Reopen(CFile::read_write);
-			file.SetLength(nLastVerifiedPos);
-		} catch (const CIOFailureException& e) {
-			AddDebugLogLineC(logAICHThread, wxT("IO failure while reading hashlist (Aborting): ") + e.what());
 
-			return;
+			AddDebugLogLineN( logAICHThread, wxT("Masterhashes of known files have been loaded.") );
 		}
-
-		AddDebugLogLineN( logAICHThread, wxT("Masterhashes of known files have been loaded.") );
 	}
 
 	// Now we check that all files which are in the sharedfilelist have a
@@ -420,6 +608,8 @@ CCompletionTask::CCompletionTask(const CPartFile* file)
 	wxASSERT(m_filename.IsOk());
 	wxASSERT(m_metPath.IsOk());
 	wxASSERT(m_owner);
+
+	SetIOPath(m_metPath);
 }
 
 
@@ -478,7 +668,7 @@ void CCompletionTask::Entry()
 	}
 
 	// Removes the various other data-files
-	const wxChar* otherMetExt[] = { wxT(""), PARTMET_BAK_EXT, wxT(".seeds"), NULL };
+	const wxChar* otherMetExt[] = { wxT(""), PARTMET_BAK_EXT, wxT(".seeds"), PARTMET_JOURNAL_EXT, PARTMET_OLD_JOURNAL_EXT, NULL };
 	for (size_t i = 0; otherMetExt[i]; ++i) {
 		CPath toRemove = m_metPath.AppendExt(otherMetExt[i]);
 
@@ -534,6 +724,8 @@ CAllocateFileTask::CAllocateFileTask(CPartFile *file, bool pause)
 	  m_file(file), m_pause(pause), m_result(ENOSYS)
 {
 	wxASSERT(file != NULL);
+
+	SetIOPath(file->GetFullName());
 }
 
 void CAllocateFileTask::Entry()
@@ -623,6 +815,95 @@ void CAllocateFileTask::OnExit()
 
 
 
+////////////////////////////////////////////////////////////
+// CPartMetCompactionTask
+
+//! Protects s_compactions.
+static wxMutex s_compactionLock;
+//! The .part.met files being compacted, and whether the compaction was cancelled.
+static std::map<CPath, bool> s_compactions;
+
+
+CPartMetCompactionTask::CPartMetCompactionTask(const CPath& metFile, CMemFile* data)
+	// GetPrintable is used to improve the readability of the log.
+	: CThreadTask(wxT("Compacting"), metFile.GetPrintable(), ETP_Low),
+	  m_metPath(metFile),
+	  m_data(data)
+{
+	SetIOPath(m_metPath);
+
+	wxMutexLocker lock(s_compactionLock);
+	s_compactions[m_metPath] = false;
+}
+
+
+CPartMetCompactionTask::~CPartMetCompactionTask()
+{
+	delete m_data;
+
+	wxMutexLocker lock(s_compactionLock);
+	s_compactions.erase(m_metPath);
+}
+
+
+bool CPartMetCompactionTask::IsPending(const CPath& metFile)
+{
+	wxMutexLocker lock(s_compactionLock);
+
+	return s_compactions.find(metFile) != s_compactions.end();
+}
+
+
+void CPartMetCompactionTask::Cancel(const CPath& metFile)
+{
+	// Waits for a running compaction to finish replacing the files.
+	wxMutexLocker lock(s_compactionLock);
+
+	std::map<CPath, bool>::iterator it = s_compactions.find(metFile);
+	if (it != s_compactions.end()) {
+		it->second = true;
+	}
+}
+
+
+void CPartMetCompactionTask::Entry()
+{
+	const CPath newPath = m_metPath.AppendExt(wxT(".new"));
+
+	try {
+		CFile file;
+		if (!file.Open(newPath, CFile::write)) {
+			throw CIOFailureException(wxT("Failed to open file"));
+		}
+
+		file.Write(m_data->GetRawBuffer(), m_data->GetLength());
+		// The journal is removed below, so the data must be on disk first.
+		if (!file.Flush()) {
+			throw CIOFailureException(wxT("Failed to flush file"));
+		}
+	} catch (const CIOFailureException& e) {
+		AddDebugLogLineC(logPartFile, CFormat(wxT("IO failure while compacting '%s': %s"))
+			% m_metPath % e.what());
+		CPath::RemoveFile(newPath);
+
+		// The old journal is kept, and merged into the next compaction.
+		return;
+	}
+
+	wxMutexLocker lock(s_compactionLock);
+	if (s_compactions[m_metPath]) {
+		// The part-file has been completed or deleted meanwhile.
+		CPath::RemoveFile(newPath);
+	} else if (!CPath::RenameFile(newPath, m_metPath, true)) {
+		AddDebugLogLineC(logPartFile, CFormat(wxT("Failed to replace '%s' while compacting")) % m_metPath);
+		CPath::RemoveFile(newPath);
+	} else {
+		CPath::BackupFile(m_metPath, PARTMET_BAK_EXT);
+		CPath::RemoveFile(CPartFileJournal::GetOldPath(m_metPath));
+	}
+}
+
+
 ////////////////////////////////////////////////////////////
 // CHashingEvent
 
@@ -33,6 +33,7 @@
 class CKnownFile;
 class CPartFile;
 class CFileAutoClose;
+struct CPartHashingState;
 
 
 /**
@@ -73,6 +74,14 @@ public:
 	 **/
 	CHashingTask(const CKnownFile* toAICHHash);
 
+	/**
+	 * Allows several files on the same device to be hashed at once.
+	 *
+	 * The number of files depends on the number of CPUs.
+	 * @see CThreadScheduler::SetLaneLimit
+	 */
+	static void SetupLanes();
+
 protected:
 	//! Specifies which hashes should be calculated when the task is executed.
 	enum EHashes {
@@ -87,20 +96,18 @@ protected:
 	virtual void Entry();
 
 	/**
-	 * Helper function for hashing a PARTSIZE chunk of a file.
+	 * Hashes parts of the file until none are left.
 	 *
 	 * @param file The file to read from.
-	 * @param part The number of the part to hash.
-	 * @param owner The known- (or part) file representing that file.
-	 * @bool createAICH Specifies if AICH hash-sets should be created as well.
-	 * @return Returns false on read-errors, true otherwise.
+	 * @param state The parts to hash, shared with the other workers.
+	 * @param isTaskThread Specifies if called by the thread running the task.
 	 *
-	 * This function will create a MD4 hash and, if specified, a AICH hashset for
-	 * the next part of the file. This function makes the assumption that it wont
-	 * be called for closed or EOF files.
+	 * Each part is read and its MD4 and/or AICH block hashes are stored in
+	 * the state. On read-errors, the state is marked as aborted. Only the
+	 * task thread checks if the task is being destroyed; the helpers stop
+	 * once it has marked the state as aborted.
 	 */
-	bool CreateNextPartHash(CFileAutoClose& file, uint16 part, CKnownFile* owner, EHashes toHash);
-
+	void HashParts(CFileAutoClose& file, CPartHashingState& state, bool isTaskThread);
 
 	//! The path to the file to be hashed (shared or part), without filename.
 	CPath m_path;
@@ -113,6 +120,8 @@ protected:
 
 private:
 	void SetHashingProgress(uint16 part);
+
+	friend class CPartHashingThread;
 };
 
 
@@ -200,6 +209,46 @@ class CAllocateFileTask : public CThreadTask
 };
 
 
+/**
+ * This task writes a compacted .part.met.
+ *
+ * The contents are created on the main thread, after the journal of the
+ * .part.met has been moved aside (see CPartFileJournal). The task writes
+ * them to a temporary file, which then replaces the .part.met and its
+ * backup, and finally removes the old journal.
+ */
+class CPartMetCompactionTask : public CThreadTask
+{
+public:
+	/**
+	 * @param metFile The full path to the .part.met.
+	 * @param data The new contents of the .part.met, owned by the task.
+	 */
+	CPartMetCompactionTask(const CPath& metFile, class CMemFile* data);
+	~CPartMetCompactionTask();
+
+	/** Returns true if a compaction of the given .part.met is scheduled or running. */
+	static bool IsPending(const CPath& metFile);
+
+	/**
+	 * Prevents a scheduled or running compaction from writing any files.
+	 *
+	 * Must be called before the files of a part-file are removed.
+	 */
+	static void Cancel(const CPath& metFile);
+
+protected:
+	/** See CThreadTask::Entry */
+	virtual void Entry();
+
+private:
+	//! The full path to the .part.met.
+	CPath		m_metPath;
+	//! The new contents of the .part.met.
+	class CMemFile*	m_data;
+};
+
+
 /**
  * This event is used to signal the completion of a hashing event.
  *
@@ -49,6 +49,8 @@ public:
     virtual SocketSentBytes SendFileAndControlData(uint32 maxNumberOfBytesToSend, uint32 minFragSize) = 0;
     virtual uint32 GetLastCalledSend() = 0;
     virtual uint32	GetNeededBytes() = 0;
+    // True if standard packets are waiting and the socket can take them
+    virtual bool	HasStandardData() = 0;
 };
 
 #endif
@@ -29,6 +29,7 @@
 #include <common/Macros.h>
 #include <common/Constants.h>
 
+#include <chrono>
 #include <cmath>
 #include "OtherFunctions.h"
 #include "ThrottledSocket.h"
@@ -37,6 +38,22 @@
 #include "Statistics.h"
 
 
+//! Bandwidth is handed out in portions of at least this many microseconds worth of data.
+static const uint64 PACING_INTERVAL = 250;
+//! Unused bandwidth is saved up for at most this many microseconds.
+static const uint64 MAX_BURST_TIME = 4000;
+//! Longest wait while idle, in case a wakeup got lost.
+static const uint64 MAX_IDLE_WAIT = 1000000;
+
+
+/** Returns the time in microseconds, from a monotonic clock. */
+static uint64 GetTimeMicro()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
 /////////////////////////////////////
 
 
@@ -50,6 +67,8 @@ UploadBandwidthThrottler::UploadBandwidthThrottler()
 	m_SentBytesSinceLastCallOverhead = 0;
 
 	m_doRun = true;
+	m_wakeupPending = false;
+	m_delayBased = false;
 
 	Create();
 	Run();
@@ -117,14 +136,13 @@ uint64 UploadBandwidthThrottler::GetNumberOfSentBytesOverheadSinceLastCallAndRes
 void UploadBandwidthThrottler::AddToStandardList(uint32 index, ThrottledFileSocket* socket)
 {
 	if ( socket ) {
-		wxMutexLocker lock( m_sendLocker );
+		{
+			wxMutexLocker lock( m_sendLocker );
 
-		RemoveFromStandardListNoLock(socket);
-		if (index > (uint32)m_StandardOrder_list.size()) {
-			index = m_StandardOrder_list.size();
+			m_StandardOrder_list.Add(index, socket);
 		}
 
-		m_StandardOrder_list.insert(m_StandardOrder_list.begin() + index, socket);
+		Wakeup();
 	}
 }
 
@@ -157,7 +175,7 @@ bool UploadBandwidthThrottler::RemoveFromStandardList(ThrottledFileSocket* socke
  */
 bool UploadBandwidthThrottler::RemoveFromStandardListNoLock(ThrottledFileSocket* socket)
 {
-	return (EraseFirstValue( m_StandardOrder_list, socket ) > 0);
+	return m_StandardOrder_list.Remove(socket);
 }
 
 
@@ -175,16 +193,22 @@ bool UploadBandwidthThrottler::RemoveFromStandardListNoLock(ThrottledFileSocket*
 */
 void UploadBandwidthThrottler::QueueForSendingControlPacket(ThrottledControlSocket* socket, bool hasSent)
 {
-	// Get critical section
-	wxMutexLocker lock( m_tempQueueLocker );
+	{
+		// Get critical section
+		wxMutexLocker lock( m_tempQueueLocker );
+
+		if ( !m_doRun ) {
+			return;
+		}
 
-	if ( m_doRun ) {
 		if( hasSent ) {
 			m_TempControlQueueFirst_list.push_back(socket);
 		} else {
 			m_TempControlQueue_list.push_back(socket);
 		}
 	}
+
+	Wakeup();
 }
 
 
@@ -231,6 +255,85 @@ void UploadBandwidthThrottler::RemoveFromAllQueues(ThrottledFileSocket* socket)
 }
 
 
+/**
+ * Wakes up the thread if it is waiting, or makes it check for work again
+ * right away when it is done with the current cycle.
+ */
+void UploadBandwidthThrottler::Wakeup()
+{
+	std::lock_guard<std::mutex> lock(m_wakeupLocker);
+
+	m_wakeupPending = true;
+	m_wakeupCondition.notify_one();
+}
+
+
+/**
+ * Waits for a wakeup, or until the given time (in microseconds) has passed.
+ *
+ * @param waitTime time to wait at most, 0 meaning as long as possible.
+ */
+void UploadBandwidthThrottler::WaitForWork(uint64 waitTime)
+{
+	if (waitTime == 0 || waitTime > MAX_IDLE_WAIT) {
+		waitTime = MAX_IDLE_WAIT;
+	}
+
+	std::unique_lock<std::mutex> lock(m_wakeupLocker);
+	m_wakeupCondition.wait_for(lock, std::chrono::microseconds(waitTime), [this] { return m_wakeupPending; });
+	m_wakeupPending = false;
+}
+
+
+/**
+ * Adds a sample of the queueing delay, used if the upload rate is delay-based.
+ *
+ * @param delay how much the round-trip time of a connection exceeds its lowest, in microseconds.
+ */
+void UploadBandwidthThrottler::AddDelaySample(uint32 delay)
+{
+	wxMutexLocker lock(m_delayLocker);
+
+	m_delayController.AddSample(delay);
+}
+
+
+/**
+ * Returns the rate actually sent at and the rate aimed for by the
+ * delay-based upload, as well as the queueing delay it measured.
+ */
+void UploadBandwidthThrottler::GetDelayStats(uint64& currentRate, uint64& targetRate, uint32& delay)
+{
+	wxMutexLocker lock(m_delayLocker);
+
+	currentRate = m_delayController.GetCurrentRate();
+	targetRate = m_delayController.GetTargetRate();
+	delay = m_delayController.GetQueueingDelay();
+}
+
+
+/**
+ * Returns the upload rate set from the queueing delay, which is adjusted
+ * every now and then. The configured upload limit is kept as the upper bound.
+ */
+uint32 UploadBandwidthThrottler::GetDelayBasedRate(uint64 now)
+{
+	wxMutexLocker lock(m_delayLocker);
+
+	if (!m_delayBased) {
+		// Start from what is being sent now
+		m_delayController.Reset(now, (uint64)theStats::GetUploadRate());
+		m_delayBased = true;
+	}
+
+	m_delayController.SetTarget(thePrefs::GetUploadTargetDelay() * 1000);
+	m_delayController.SetMaxRate(thePrefs::GetMaxUpload() == UNLIMITED ? 0 : thePrefs::GetMaxUpload() * 1024);
+	m_delayController.Update(now);
+
+	return (uint32)std::min<uint64>(m_delayController.GetTargetRate(), 0x7fffffff);
+}
+
+
 /**
  * Make the thread exit. This method will not return until the thread has stopped
  * looping. This guarantees that the thread will not access the CEMSockets after this
@@ -246,6 +349,7 @@ void UploadBandwidthThrottler::EndThread()
 			m_doRun = false;
 		}
 
+		Wakeup();
 		Wait();
 	}
 }
@@ -254,83 +358,62 @@ void UploadBandwidthThrottler::EndThread()
 /**
  * The thread method that handles calling send for the individual sockets.
  *
- * Control packets will always be tried to be sent first. If there is any bandwidth leftover
- * after that, send() for the upload slot sockets will be called in priority order until we have run
- * out of available bandwidth for this loop. Upload slots will not be allowed to go without having sent
- * called for more than a defined amount of time (i.e. two seconds).
+ * The upload rate is enforced with a token bucket. The thread only runs
+ * while sockets have data to send and there are tokens to spend, otherwise
+ * it waits until woken up by a socket or until enough tokens have been
+ * earned. Tokens are spent in portions of at least PACING_INTERVAL worth
+ * of data, so that packets are paced evenly even at high rates.
+ *
+ * Control packets will always be tried to be sent first. The tokens left
+ * after that are shared by the upload slots (see CUploadSlotScheduler).
+ * Upload slots will not be allowed to go without having sent called for
+ * more than a defined amount of time (i.e. one second).
  *
  * @return always returns 0.
  */
 void* UploadBandwidthThrottler::Entry()
 {
-	const uint32 TIME_BETWEEN_UPLOAD_LOOPS = 1;
-
-	uint32 lastLoopTick = GetTickCountFullRes();
-	// Bytes to spend in current cycle. If we spend more this becomes negative and causes a wait next time.
-	sint32 bytesToSpend = 0;
-	uint32 allowedDataRate;
-	uint32 rememberedSlotCounter = 0;
-	uint32 extraSleepTime = TIME_BETWEEN_UPLOAD_LOOPS;
-
-	while (m_doRun && !TestDestroy()) {
-		uint32 timeSinceLastLoop = GetTickCountFullRes() - lastLoopTick;
-
-		// Calculate data rate
-		if (thePrefs::GetMaxUpload() == UNLIMITED) {
-			// Try to increase the upload rate from UploadSpeedSense
-			allowedDataRate = (uint32)theStats::GetUploadRate() + 5 * 1024;
-		} else {
-			allowedDataRate = thePrefs::GetMaxUpload() * 1024;
-		}
-
-		uint32 minFragSize = 1300;
-		uint32 doubleSendSize = minFragSize*2; // send two packages at a time so they can share an ACK
-		if (allowedDataRate < 6*1024) {
-			minFragSize = 536;
-			doubleSendSize = minFragSize; // don't send two packages at a time at very low speeds to give them a smoother load
-		}
-
-
-		uint32 sleepTime;
-		if (bytesToSpend < 1) {
-			// We have sent more than allowed in last cycle so we have to wait now
-			// until we can send at least 1 byte.
-			sleepTime = std::max((-bytesToSpend + 1) * 1000 / allowedDataRate + 2, // add 2 ms to allow for rounding inaccuracies
-									extraSleepTime);
-		} else {
-			// We could send at once, but sleep a while to not suck up all cpu
-			sleepTime = extraSleepTime;
-		}
-
-		if (timeSinceLastLoop < sleepTime) {
-			Sleep(sleepTime-timeSinceLastLoop);
-		}
+	CTokenBucket bucket;
 
-		// Check after sleep in case the thread has been signaled to end
-		if (!m_doRun || TestDestroy()) {
-			break;
-		}
+	while (!TestDestroy()) {
+		// Time to wait for the next cycle, 0 meaning until woken up.
+		uint64 waitTime = 0;
 
-		const uint32 thisLoopTick = GetTickCountFullRes();
-		timeSinceLastLoop = thisLoopTick - lastLoopTick;
-		lastLoopTick = thisLoopTick;
+		{
+			wxMutexLocker sendLock(m_sendLocker);
 
-		if (timeSinceLastLoop > sleepTime + 2000) {
-			AddDebugLogLineN(logGeneral, CFormat(wxT("UploadBandwidthThrottler: Time since last loop too long. time: %ims wanted: %ims Max: %ims"))
-				% timeSinceLastLoop % sleepTime % (sleepTime + 2000));
+			if (!m_doRun) {
+				break;
+			}
 
-			timeSinceLastLoop = sleepTime + 2000;
-		}
+			const uint64 now = GetTimeMicro();
 
-		// Calculate how many bytes we can spend
+			// Calculate data rate
+			uint32 allowedDataRate;
+			if (thePrefs::IsDelayBasedUpload()) {
+				allowedDataRate = GetDelayBasedRate(now);
+			} else {
+				// Started over when enabled again
+				m_delayBased = false;
 
-		bytesToSpend += (sint32) (allowedDataRate / 1000.0 * timeSinceLastLoop);
+				if (thePrefs::GetMaxUpload() == UNLIMITED) {
+					// Try to increase the upload rate from UploadSpeedSense
+					allowedDataRate = (uint32)theStats::GetUploadRate() + 5 * 1024;
+				} else {
+					allowedDataRate = thePrefs::GetMaxUpload() * 1024;
+				}
+			}
 
-		if (bytesToSpend >= 1) {
-			sint32 spentBytes = 0;
-			sint32 spentOverhead = 0;
+			uint32 minFragSize = 1300;
+			uint32 doubleSendSize = minFragSize*2; // send two packages at a time so they can share an ACK
+			if (allowedDataRate < 6*1024) {
+				minFragSize = 536;
+				doubleSendSize = minFragSize; // don't send two packages at a time at very low speeds to give them a smoother load
+			}
 
-			wxMutexLocker sendLock(m_sendLocker);
+			const uint32 portion = (uint32)std::max<uint64>(doubleSendSize, allowedDataRate * PACING_INTERVAL / 1000000);
+			bucket.SetRate(allowedDataRate, std::max<uint64>(allowedDataRate * MAX_BURST_TIME / 1000000, 2 * portion));
+			bucket.Refill(now);
 
 			{
 				wxMutexLocker queueLock(m_tempQueueLocker);
@@ -348,31 +431,35 @@ void* UploadBandwidthThrottler::Entry()
 				m_TempControlQueueFirst_list.clear();
 			}
 
-			// Send any queued up control packets first
-			while (spentBytes < bytesToSpend && (!m_ControlQueueFirst_list.empty() || !m_ControlQueue_list.empty())) {
-				ThrottledControlSocket* socket = NULL;
-
-				if (!m_ControlQueueFirst_list.empty()) {
-					socket = m_ControlQueueFirst_list.front();
-					m_ControlQueueFirst_list.pop_front();
-				} else if (!m_ControlQueue_list.empty()) {
-					socket = m_ControlQueue_list.front();
-					m_ControlQueue_list.pop_front();
-				}
+			if (bucket.GetTokens() >= (sint64)portion) {
+				const uint32 bytesToSpend = (uint32)std::min<sint64>(bucket.GetTokens(), 0x7fffffff);
+				uint32 spentBytes = 0;
+				uint32 spentOverhead = 0;
+
+				// Send any queued up control packets first
+				while (spentBytes < bytesToSpend && (!m_ControlQueueFirst_list.empty() || !m_ControlQueue_list.empty())) {
+					ThrottledControlSocket* socket = NULL;
+
+					if (!m_ControlQueueFirst_list.empty()) {
+						socket = m_ControlQueueFirst_list.front();
+						m_ControlQueueFirst_list.pop_front();
+					} else if (!m_ControlQueue_list.empty()) {
+						socket = m_ControlQueue_list.front();
+						m_ControlQueue_list.pop_front();
+					}
 
-				if (socket != NULL) {
-					SocketSentBytes socketSentBytes = socket->SendControlData(bytesToSpend-spentBytes, minFragSize);
-					spentBytes += socketSentBytes.sentBytesControlPackets + socketSentBytes.sentBytesStandardPackets;
-					spentOverhead += socketSentBytes.sentBytesControlPackets;
+					if (socket != NULL) {
+						SocketSentBytes socketSentBytes = socket->SendControlData(bytesToSpend-spentBytes, minFragSize);
+						spentBytes += socketSentBytes.sentBytesControlPackets + socketSentBytes.sentBytesStandardPackets;
+						spentOverhead += socketSentBytes.sentBytesControlPackets;
+					}
 				}
-			}
 
-			// Check if any sockets haven't gotten data for a long time. Then trickle them a package.
-			uint32 slots = m_StandardOrder_list.size();
-			for (uint32 slotCounter = 0; slotCounter < slots; slotCounter++) {
-				ThrottledFileSocket* socket = m_StandardOrder_list[ slotCounter ];
+				// Check if any sockets haven't gotten data for a long time. Then trickle them a package.
+				const uint32 thisLoopTick = GetTickCountFullRes();
+				for (uint32 slotCounter = 0; slotCounter < m_StandardOrder_list.GetCount(); slotCounter++) {
+					ThrottledFileSocket* socket = m_StandardOrder_list.GetSocket(slotCounter);
 
-				if (socket != NULL) {
 					if (thisLoopTick-socket->GetLastCalledSend() > SEC2MS(1)) {
 						// trickle
 						uint32 neededBytes = socket->GetNeededBytes();
@@ -383,60 +470,32 @@ void* UploadBandwidthThrottler::Entry()
 							spentOverhead += socketSentBytes.sentBytesControlPackets;
 						}
 					}
-				} else {
-					AddDebugLogLineN(logGeneral, CFormat( wxT("There was a NULL socket in the UploadBandwidthThrottler Standard list (trickle)! Prevented usage. Index: %i Size: %i"))
-						% slotCounter % m_StandardOrder_list.size());
 				}
-			}
 
-			// Give available bandwidth to slots, starting with the one we ended with last time.
-			// There are two passes. First pass gives packets of doubleSendSize, second pass
-			// gives as much as possible.
-			// Second pass starts with the last slot of the first pass actually.
-			for (uint32 slotCounter = 0; (slotCounter < slots * 2) && spentBytes < bytesToSpend; slotCounter++) {
-				if (rememberedSlotCounter >= slots) {	// wrap around pointer
-					rememberedSlotCounter = 0;
+				// Share the rest between the slots
+				if (spentBytes < bytesToSpend) {
+					spentBytes += m_StandardOrder_list.Send(bytesToSpend - spentBytes, doubleSendSize, doubleSendSize, spentOverhead);
 				}
 
-				uint32 data = (slotCounter < slots - 1)	? doubleSendSize				// pass 1
-															: (bytesToSpend - spentBytes);	// pass 2
-
-				ThrottledFileSocket* socket = m_StandardOrder_list[ rememberedSlotCounter ];
+				bucket.Consume(spentBytes);
 
-				if (socket != NULL) {
-					SocketSentBytes socketSentBytes = socket->SendFileAndControlData(data, doubleSendSize);
-					spentBytes += socketSentBytes.sentBytesControlPackets + socketSentBytes.sentBytesStandardPackets;
-					spentOverhead += socketSentBytes.sentBytesControlPackets;
-				} else {
-					AddDebugLogLineN(logGeneral, CFormat(wxT("There was a NULL socket in the UploadBandwidthThrottler Standard list (equal-for-all)! Prevented usage. Index: %i Size: %i"))
-						% rememberedSlotCounter % m_StandardOrder_list.size());
+				if (m_delayBased) {
+					wxMutexLocker delayLock(m_delayLocker);
+					m_delayController.AddSent(spentBytes);
 				}
 
-				rememberedSlotCounter++;
+				m_SentBytesSinceLastCall += spentBytes;
+				m_SentBytesSinceLastCallOverhead += spentOverhead;
 			}
 
-			// Do some limiting of what we keep for the next loop.
-			bytesToSpend -= spentBytes;
-			sint32 minBytesToSpend = (slots + 1) * minFragSize;
-
-			if (bytesToSpend < - minBytesToSpend) {
-				bytesToSpend = - minBytesToSpend;
-			} else {
-				sint32 bandwidthSavedTolerance = slots * 512 + 1;
-				if (bytesToSpend > bandwidthSavedTolerance) {
-					bytesToSpend = bandwidthSavedTolerance;
-				}
-			}
-
-			m_SentBytesSinceLastCall += spentBytes;
-			m_SentBytesSinceLastCallOverhead += spentOverhead;
-
-			if (spentBytes == 0) {	// spentBytes includes the overhead
-				extraSleepTime = std::min<uint32>(extraSleepTime * 5, 1000); // 1s at most
-			} else {
-				extraSleepTime = TIME_BETWEEN_UPLOAD_LOOPS;
+			// Sockets which are blocked or have nothing to send wake us up when
+			// that changes, so only waiting for tokens needs a timeout.
+			if (!m_ControlQueueFirst_list.empty() || !m_ControlQueue_list.empty() || m_StandardOrder_list.HasData()) {
+				waitTime = std::max(bucket.GetWaitTime(portion), PACING_INTERVAL);
 			}
 		}
+
+		WaitForWork(waitTime);
 	}
 
 	{
@@ -447,7 +506,7 @@ void* UploadBandwidthThrottler::Entry()
 
 	wxMutexLocker sendLock(m_sendLocker);
 	m_ControlQueue_list.clear();
-	m_StandardOrder_list.clear();
+	m_StandardOrder_list.Clear();
 
 	return 0;
 }
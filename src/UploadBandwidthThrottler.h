@@ -29,9 +29,12 @@
 
 #include <wx/thread.h>
 
+#include <condition_variable>
 #include <deque>
+#include <mutex>
 
 #include "Types.h"
+#include "UploadScheduler.h"	// Needed for CUploadSlotScheduler and CUploadDelayController
 
 class ThrottledControlSocket;
 class ThrottledFileSocket;
@@ -52,15 +55,36 @@ public:
     void RemoveFromAllQueues(ThrottledControlSocket* socket);
     void RemoveFromAllQueues(ThrottledFileSocket* socket);
 
+    // Tells the thread that a socket with an upload slot has data to send
+    void Wakeup();
+
+    // Queueing delay measured on an uploading connection, in microseconds
+    void AddDelaySample(uint32 delay);
+    // State of the delay-based upload rate: rates in bytes/s, delay in microseconds
+    void GetDelayStats(uint64& currentRate, uint64& targetRate, uint32& delay);
+
     void EndThread();
 private:
     void DoRemoveFromAllQueues(ThrottledControlSocket* socket);
     bool RemoveFromStandardListNoLock(ThrottledFileSocket* socket);
+    void WaitForWork(uint64 waitTime);
+    uint32 GetDelayBasedRate(uint64 now);
 
     void* Entry();
 
     bool m_doRun;
 
+    // Wakes up the thread, which is only running while there is work. This
+    // isn't a wxCondition, which only supports timeouts in milliseconds.
+    std::mutex m_wakeupLocker;
+    std::condition_variable m_wakeupCondition;
+    bool m_wakeupPending;
+
+    // Sets the upload rate if it is delay-based
+    wxMutex m_delayLocker;
+    CUploadDelayController m_delayController;
+    bool m_delayBased;
+
 
     wxMutex m_sendLocker;
     wxMutex m_tempQueueLocker;
@@ -77,9 +101,8 @@ private:
     SocketQueue m_TempControlQueueFirst_list;
 
 
-	typedef std::deque<ThrottledFileSocket*> FileSocketQueue;
-	// sockets that have upload slots. Ordered so the most prioritized socket is first
-    FileSocketQueue m_StandardOrder_list;
+	// sockets that have upload slots
+    CUploadSlotScheduler m_StandardOrder_list;
 
     uint64 m_SentBytesSinceLastCall;
     uint64 m_SentBytesSinceLastCallOverhead;
@@ -0,0 +1,287 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+
+#include "UploadBlockCache.h"	// Interface declarations
+
+#include <algorithm>		// Needed for std::max
+#include <list>
+#include <map>
+
+
+//! Minimum number of recently missed blocks remembered for the admission.
+static const size_t MIN_GHOST_COUNT = 64;
+
+
+/** Identifies a block of a file. */
+struct CBlockKey
+{
+	CBlockKey(const CMD4Hash& h, uint64 s, uint64 e)
+		: hash(h), start(s), end(e)
+	{}
+
+	bool operator<(const CBlockKey& other) const
+	{
+		if (hash != other.hash) {
+			return hash < other.hash;
+		} else if (start != other.start) {
+			return start < other.start;
+		}
+
+		return end < other.end;
+	}
+
+	CMD4Hash hash;
+	uint64 start;
+	uint64 end;
+};
+
+
+//! A cached block.
+struct CCachedBlock
+{
+	CCachedBlock(const CBlockKey& k, const CUploadBlockCache::BlockData& d)
+		: key(k), data(d), hasPacked(false)
+	{}
+
+	/** Returns the bytes held by the block. */
+	uint64 GetSize() const	{ return data->size() + (packed ? packed->size() : 0); }
+
+	CBlockKey key;
+	CUploadBlockCache::BlockData data;
+	//! The compressed data, if known and smaller than the data.
+	CUploadBlockCache::BlockData packed;
+	//! Set once the block has been compressed.
+	bool hasPacked;
+};
+
+typedef std::list<CCachedBlock> BlockList;
+typedef std::map<CBlockKey, BlockList::iterator> BlockMap;
+typedef std::list<CBlockKey> GhostList;
+typedef std::map<CBlockKey, GhostList::iterator> GhostMap;
+
+
+//! The cached blocks, most recently used first.
+static BlockList s_blocks;
+//! Index of the cached blocks, ordered by file and offset.
+static BlockMap s_blockMap;
+//! Blocks missed recently but not admitted, most recent first.
+static GhostList s_ghosts;
+//! Index of the missed blocks.
+static GhostMap s_ghostMap;
+//! The statistics, including the limit.
+static CUploadBlockCache::Stats s_stats = { 0, 0, 0, 0, 0, 0, 0 };
+
+
+/** Removes a block from the cache. */
+static void RemoveBlock(BlockMap::iterator it)
+{
+	s_stats.cached -= it->second->GetSize();
+	--s_stats.blocks;
+	s_blocks.erase(it->second);
+	s_blockMap.erase(it);
+}
+
+
+/** Remembers a missed block, forgetting the oldest ones if needed. */
+static void AddGhost(const CBlockKey& key)
+{
+	GhostMap::iterator it = s_ghostMap.find(key);
+	if (it != s_ghostMap.end()) {
+		s_ghosts.splice(s_ghosts.begin(), s_ghosts, it->second);
+		return;
+	}
+
+	s_ghosts.push_front(key);
+	s_ghostMap.insert(std::make_pair(key, s_ghosts.begin()));
+
+	// As many misses are remembered as there are blocks in the cache, so
+	// that a block re-requested within the reuse distance of the cached
+	// blocks is admitted.
+	const size_t ghostCount = std::max<size_t>(MIN_GHOST_COUNT, s_blocks.size());
+	while (s_ghosts.size() > ghostCount) {
+		s_ghostMap.erase(s_ghosts.back());
+		s_ghosts.pop_back();
+	}
+}
+
+
+/** Forgets a missed block, returning true if it was known. */
+static bool RemoveGhost(const CBlockKey& key)
+{
+	GhostMap::iterator it = s_ghostMap.find(key);
+	if (it == s_ghostMap.end()) {
+		return false;
+	}
+
+	s_ghosts.erase(it->second);
+	s_ghostMap.erase(it);
+
+	return true;
+}
+
+
+/** Evicts the least recently used blocks until the given size fits. */
+static void MakeRoom(uint64 size)
+{
+	while (!s_blocks.empty() && s_stats.cached + size > s_stats.limit) {
+		RemoveBlock(s_blockMap.find(s_blocks.back().key));
+		++s_stats.evicted;
+	}
+}
+
+
+CUploadBlockCache::BlockData CUploadBlockCache::Lookup(const CMD4Hash& hash, uint64 start, uint64 end)
+{
+	if (s_stats.limit == 0) {
+		return BlockData();
+	}
+
+	const CBlockKey key(hash, start, end);
+	BlockMap::iterator it = s_blockMap.find(key);
+	if (it == s_blockMap.end()) {
+		++s_stats.misses;
+		return BlockData();
+	}
+
+	++s_stats.hits;
+	s_blocks.splice(s_blocks.begin(), s_blocks, it->second);
+
+	return it->second->data;
+}
+
+
+bool CUploadBlockCache::Insert(const CMD4Hash& hash, uint64 start, uint64 end, const BlockData& data)
+{
+	const uint64 size = end - start;
+	wxASSERT(data && data->size() == size);
+	if (size == 0 || size > s_stats.limit / 4) {
+		// Large blocks would evict too much at once.
+		return false;
+	}
+
+	const CBlockKey key(hash, start, end);
+	if (s_blockMap.find(key) != s_blockMap.end()) {
+		return false;
+	}
+
+	// Once the cache is full, only blocks which are requested again make
+	// it in, at the expense of the least recently used ones.
+	if (s_stats.cached + size > s_stats.limit && !RemoveGhost(key)) {
+		AddGhost(key);
+		return false;
+	}
+
+	MakeRoom(size);
+
+	s_blocks.push_front(CCachedBlock(key, data));
+	s_blockMap.insert(std::make_pair(key, s_blocks.begin()));
+	s_stats.cached += size;
+	++s_stats.blocks;
+	++s_stats.admitted;
+
+	return true;
+}
+
+
+bool CUploadBlockCache::LookupPacked(const CMD4Hash& hash, uint64 start, uint64 end, BlockData& packed)
+{
+	BlockMap::iterator it = s_blockMap.find(CBlockKey(hash, start, end));
+	if (it == s_blockMap.end() || !it->second->hasPacked) {
+		return false;
+	}
+
+	packed = it->second->packed;
+
+	return true;
+}
+
+
+void CUploadBlockCache::SetPacked(const CMD4Hash& hash, uint64 start, uint64 end, const BlockData& packed)
+{
+	BlockMap::iterator it = s_blockMap.find(CBlockKey(hash, start, end));
+	if (it == s_blockMap.end() || it->second->hasPacked) {
+		return;
+	}
+
+	CCachedBlock& block = *it->second;
+	wxASSERT(!packed || packed->size() < block.data->size());
+	if (packed && block.data->size() + packed->size() > s_stats.limit / 2) {
+		// Could evict the block itself after the limit was lowered.
+		return;
+	}
+
+	block.packed = packed;
+	block.hasPacked = true;
+
+	if (packed) {
+		// The block is moved to the front first, so it isn't evicted itself.
+		s_blocks.splice(s_blocks.begin(), s_blocks, it->second);
+		MakeRoom(packed->size());
+		s_stats.cached += packed->size();
+	}
+}
+
+
+void CUploadBlockCache::Invalidate(const CMD4Hash& hash, uint64 start, uint64 end)
+{
+	BlockMap::iterator it = s_blockMap.lower_bound(CBlockKey(hash, 0, 0));
+	while (it != s_blockMap.end() && it->first.hash == hash && it->first.start < end) {
+		if (it->first.end > start) {
+			RemoveBlock(it++);
+		} else {
+			++it;
+		}
+	}
+}
+
+
+void CUploadBlockCache::SetLimit(uint64 limit)
+{
+	s_stats.limit = limit;
+	MakeRoom(0);
+
+	if (limit == 0) {
+		s_ghosts.clear();
+		s_ghostMap.clear();
+	}
+}
+
+
+void CUploadBlockCache::GetStats(Stats& stats)
+{
+	stats = s_stats;
+}
+
+
+void CUploadBlockCache::Clear()
+{
+	s_blocks.clear();
+	s_blockMap.clear();
+	s_ghosts.clear();
+	s_ghostMap.clear();
+	s_stats.cached = 0;
+	s_stats.blocks = 0;
+}
+// File_checked_for_headers
@@ -0,0 +1,137 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+
+#ifndef UPLOADBLOCKCACHE_H
+#define UPLOADBLOCKCACHE_H
+
+#include "Types.h"
+#include "MD4Hash.h"		// Needed for CMD4Hash
+
+#include <memory>		// Needed for std::shared_ptr
+#include <vector>
+
+
+/**
+ * Cache of the blocks read for uploading, shared by all clients.
+ *
+ * Popular files are usually uploaded to several clients at once, which
+ * request the same blocks within a short time. Keeping the data of
+ * recently uploaded blocks in memory saves reading them again for every
+ * client.
+ *
+ * Blocks are identified by the hash of their file and their range, and
+ * evicted in least-recently-used order once the memory limit is reached.
+ * While the cache still has room, every block read is admitted. Once it
+ * is full, a block is only admitted if it was missed before recently,
+ * so that blocks requested a single time don't push out the ones which
+ * are actually reused.
+ *
+ * For clients receiving compressed parts, the compressed form of a block
+ * is kept along with it, so that it is compressed only once.
+ *
+ * Must only be used from the main thread.
+ */
+class CUploadBlockCache
+{
+public:
+	//! The data of a cached block, which stays valid after eviction.
+	typedef std::shared_ptr<const std::vector<uint8_t> > BlockData;
+
+	//! Snapshot of the state of the cache.
+	struct Stats
+	{
+		//! Bytes of block data held, including compressed data.
+		uint64	cached;
+		//! The limit, 0 if the cache is disabled.
+		uint64	limit;
+		//! Number of blocks held.
+		uint64	blocks;
+		//! Number of lookups which found the block.
+		uint64	hits;
+		//! Number of lookups which didn't.
+		uint64	misses;
+		//! Number of blocks added.
+		uint64	admitted;
+		//! Number of blocks evicted to make room for others.
+		uint64	evicted;
+	};
+
+	/**
+	 * Returns the data of a block, or an empty pointer if it isn't cached.
+	 *
+	 * @param hash The hash of the file.
+	 * @param start The first byte of the block.
+	 * @param end The position right behind the last byte of the block.
+	 */
+	static BlockData Lookup(const CMD4Hash& hash, uint64 start, uint64 end);
+
+	/**
+	 * Offers the data of a block read after a failed lookup.
+	 *
+	 * The data (end - start bytes) is shared with the cache if the block
+	 * is admitted, so it must not be changed afterwards.
+	 *
+	 * @return True if the block was added.
+	 */
+	static bool Insert(const CMD4Hash& hash, uint64 start, uint64 end, const BlockData& data);
+
+	/**
+	 * Retrieves the compressed form of a cached block.
+	 *
+	 * @param packed Set to the compressed data, or to an empty pointer if
+	 *               the block doesn't compress.
+	 * @return False if the block isn't cached or wasn't compressed yet.
+	 */
+	static bool LookupPacked(const CMD4Hash& hash, uint64 start, uint64 end, BlockData& packed);
+
+	/**
+	 * Stores the compressed form of a block, which is ignored if the block
+	 * itself isn't cached.
+	 *
+	 * @param packed The compressed data, or an empty pointer if the block
+	 *               doesn't compress.
+	 */
+	static void SetPacked(const CMD4Hash& hash, uint64 start, uint64 end, const BlockData& packed);
+
+	/**
+	 * Drops the blocks of a file overlapping the given range, which must
+	 * be done whenever the data of the file may change.
+	 *
+	 * @param end The position right behind the last byte of the range.
+	 */
+	static void Invalidate(const CMD4Hash& hash, uint64 start = 0, uint64 end = ULONGLONG(0xFFFFFFFFFFFFFFFF));
+
+	/** Sets the limit in bytes, 0 disabling the cache. */
+	static void SetLimit(uint64 limit);
+
+	/** Retrieves the current statistics. */
+	static void GetStats(Stats& stats);
+
+	/** Drops all cached blocks. */
+	static void Clear();
+};
+
+#endif // UPLOADBLOCKCACHE_H
+// File_checked_for_headers
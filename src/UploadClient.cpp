@@ -28,7 +28,7 @@
 #include <protocol/Protocols.h>
 #include <protocol/ed2k/Client2Client/TCP.h>
 
-#include <zlib.h>
+#include <memory>
 
 #include "ClientCredits.h"	// Needed for CClientCredits
 #include "Packet.h"		// Needed for CPacket
@@ -42,9 +42,13 @@
 #include "ClientList.h"
 #include "Statistics.h"		// Needed for theStats
 #include "Logger.h"
-#include "ScopedPtr.h"		// Needed for CScopedArray
 #include "GuiEvents.h"		// Needed for Notify_*
 #include "FileArea.h"		// Needed for CFileArea
+#include "FileAutoClose.h"	// Needed for CFileAutoClose
+#include "FileIOBatch.h"		// Needed for CFileIOBatch
+#include "UploadBlockCache.h"	// Needed for CUploadBlockCache
+#include "SharedFileHandleCache.h"	// Needed for CSharedFileHandleCache
+#include "UploadCompressor.h"	// Needed for CUploadCompressor
 
 
 //	members of CUpDownClient
@@ -187,14 +191,99 @@ bool CUpDownClient::IsDifferentPartBlock() const // [Tarod 12/22/2002]
 }
 
 
+/**
+ * A complete shared file referenced by upload packets, which is kept open
+ * until the last of them has been sent.
+ */
+class CUploadPacketFile : public CPacketFile
+{
+public:
+	CUploadPacketFile(const CSharedFileHandleCache::Handle& handle)
+		: m_handle(handle),
+		  m_fd(handle->fd())
+	{}
+
+	~CUploadPacketFile()
+	{
+		m_handle->Unlock();
+	}
+
+	int GetFD() const
+	{
+		return m_fd;
+	}
+
+	void ReadAt(void* buffer, uint64 offset, uint32 count) const
+	{
+		m_handle->ReadAt(buffer, offset, count);
+	}
+
+private:
+	CSharedFileHandleCache::Handle	m_handle;
+	int		m_fd;
+};
+
+
+/**
+ * A block being read for uploading.
+ */
+struct CUploadBlockRead
+{
+	Requested_Block_Struct*	block;
+	uint64			length;
+	//! True if the block is to be compressed.
+	bool			compress;
+	//! The data if the block was found in the cache, otherwise it is read into 'area'.
+	CUploadBlockCache::BlockData	cached;
+	//! Set instead of reading if the block can be sent straight from the file.
+	CSharedPacketFile	packetFile;
+	//! Handle of a complete file, must outlive 'area' which may pin it.
+	CSharedFileHandleCache::Handle	sharedFile;
+	CFileArea		area;
+};
+
+
+/**
+ * The blocks read for a client with one batch.
+ *
+ * While the batch is running, the client keeps it as m_blockReads. Once it
+ * has completed, the blocks are sent by CUpDownClient::OnBlocksRead, which
+ * also deletes the batch.
+ */
+struct CUploadBlockReads : public CFileIOBatch
+{
+	CUploadBlockReads(CUpDownClient* owner)
+		: client(owner)
+	{}
+
+	//! The client reading, NULL once it has stopped uploading.
+	CUpDownClient*	client;
+	//! The blocks, in the order they were requested.
+	std::list<CUploadBlockRead>	blocks;
+};
+
+
 void CUpDownClient::CreateNextBlockPackage()
 {
+	// Blocks compressed in the meantime go first
+	SendPendingBlocks();
+
+	// So do the blocks still being read, see OnBlocksRead
+	if (m_blockReads) {
+		return;
+	}
+
+	// Where supported, the blocks are read in the background with a single batch
+	std::unique_ptr<CUploadBlockReads> reads(new CUploadBlockReads(this));
+	CFileIOBatch* queue = CFileIOBatch::IsBatched() ? reads.get() : NULL;
+
 	try {
 		// Buffer new data if current buffer is less than 100 KBytes
-		while (!m_BlockRequests_queue.empty()
-			   && m_addedPayloadQueueSession - m_nCurQueueSessionPayloadUp < 100*1024) {
+		uint64 addedPayload = m_addedPayloadQueueSession;
+		for (std::list<Requested_Block_Struct*>::iterator it = m_BlockRequests_queue.begin();
+			 it != m_BlockRequests_queue.end() && addedPayload - m_nCurQueueSessionPayloadUp < 100*1024; ++it) {
 
-			Requested_Block_Struct* currentblock = m_BlockRequests_queue.front();
+			Requested_Block_Struct* currentblock = *it;
 			CKnownFile* srcfile = theApp->sharedfiles->GetFileByID(CMD4Hash(currentblock->FileID));
 
 			if (!srcfile) {
@@ -223,70 +312,216 @@ void CUpDownClient::CreateNextBlockPackage()
 									% togo % (EMBLOCKSIZE * 3));
 			}
 
-			CFileArea area;
-			if (srcPartFile) {
+			// Data not yet written is flushed before it is read, which
+			// can't be done while reads are queued (see CPartFile::ReadData)
+			if (srcPartFile && queue && queue->GetCount()
+				&& srcPartFile->IsBeingWritten(currentblock->StartOffset, currentblock->EndOffset - 1)) {
+				break;
+			}
+
+			reads->blocks.emplace_back();
+			CUploadBlockRead& read = reads->blocks.back();
+			read.block = currentblock;
+			read.length = togo;
+			// check extension to decide whether to compress or not
+			read.compress = m_byDataCompVer == 1 && GetFiletype(srcfile->GetFileName()) != ftArchive
+				&& CUploadCompressor::IsWorthCompressing(srcfile->GetFileHash());
+			read.cached = CUploadBlockCache::Lookup(srcfile->GetFileHash(), currentblock->StartOffset, currentblock->EndOffset);
+
+			if (read.cached) {
+				// Already read for another client
+			} else if (srcPartFile) {
 				if (!srcPartFile->IsComplete(currentblock->StartOffset,currentblock->EndOffset-1)) {
 					throw wxString(CFormat(wxT("Asked for incomplete block (%d - %d)"))
 									% currentblock->StartOffset % (currentblock->EndOffset-1));
 				}
-				if (!srcPartFile->ReadData(area, currentblock->StartOffset, togo)) {
+				if (!srcPartFile->ReadData(read.area, currentblock->StartOffset, togo, queue)) {
 					throw wxString(wxT("Failed to read from requested partfile"));
 				}
 			} else {
-				CFileAutoClose file;
-				CPath fullname = srcfile->GetFilePath().JoinPaths(srcfile->GetFileName());
-				if ( !file.Open(fullname, CFile::read) ) {
+				read.sharedFile = CSharedFileHandleCache::Get(srcfile->GetFileHash());
+				if (!read.sharedFile) {
+					CPath fullname = srcfile->GetFilePath().JoinPaths(srcfile->GetFileName());
+					read.sharedFile = CSharedFileHandleCache::Open(srcfile->GetFileHash(), fullname);
+				}
+				if ( !read.sharedFile ) {
 					// The file was most likely moved/deleted. So remove it from the list of shared files.
 					AddLogLineN(CFormat( _("Failed to open file (%s), removing from list of shared files.") ) % srcfile->GetFileName() );
 					theApp->sharedfiles->RemoveFile(srcfile);
 
 					throw wxString(wxT("Failed to open requested file: Removing from list of shared files!"));
 				}
-				area.ReadAt(file, currentblock->StartOffset, togo);
+				if (!read.compress && m_socket && m_socket->CanSendFiles()) {
+					// Sent by the kernel from the page cache, without reading it here
+					read.packetFile.reset(new CUploadPacketFile(read.sharedFile));
+				} else {
+					read.area.ReadAt(*read.sharedFile, currentblock->StartOffset, togo, queue);
+				}
 			}
-			area.CheckError();
 
-			SetUploadFileID(srcfile);
+			addedPayload += togo;
+		}
 
-			// check extension to decide whether to compress or not
-			if (m_byDataCompVer == 1 && GetFiletype(srcfile->GetFileName()) != ftArchive) {
-				CreatePackedPackets(area.GetBuffer(), togo, currentblock);
-			} else {
-				CreateStandardPackets(area.GetBuffer(), togo, currentblock);
-			}
+		if (queue && queue->GetCount()) {
+			// The main thread goes on while the disk is busy
+			m_blockReads = reads.release();
+			m_blockReads->Execute(theApp);
+		} else {
+			CreateBlockPackages(*reads);
+		}
+
+		return;
+	} catch (const wxString& DEBUG_ONLY(error)) {
+		AddDebugLogLineN(logClient,
+			CFormat(wxT("Client '%s' (%s) caused error while creating packet (%s) - disconnecting client"))
+				% GetUserName() % GetFullIP() % error);
+	} catch (const CIOFailureException& error) {
+		AddDebugLogLineC(logClient, wxT("IO failure while reading requested file: ") + error.what());
+	} catch (const CEOFException& WXUNUSED(error)) {
+		AddDebugLogLineN(logClient, GetClientFullInfo() + wxT(" requested file-data at an invalid position - disconnecting"));
+	}
 
-			// file statistic
-			srcfile->statistic.AddTransferred(togo);
+	// Error occurred.
+	theApp->uploadqueue->RemoveFromUploadQueue(this);
+}
+
+
+/**
+ * Sends the blocks read, in order. The packets of blocks to be compressed
+ * are created once the compression is done (see SendPendingBlocks).
+ *
+ * @throws wxString, CIOFailureException or CEOFException if a block failed.
+ */
+void CUpDownClient::CreateBlockPackages(CUploadBlockReads& reads)
+{
+	for (std::list<CUploadBlockRead>::iterator it = reads.blocks.begin(); it != reads.blocks.end(); ++it) {
+		// Looked up again, the file may have been unshared while being read
+		CKnownFile* srcfile = theApp->sharedfiles->GetFileByID(CMD4Hash(it->block->FileID));
+		if (!srcfile) {
+			throw wxString(wxT("requested file not found"));
+		}
 
-			m_addedPayloadQueueSession += togo;
+		CSharedPacketData data = it->cached;
+		if (!data && !it->packetFile) {
+			it->area.CheckError();
+			// The packets and the cache reference this single copy
+			const uint8_t* buffer = it->area.GetBuffer();
+			data.reset(new std::vector<uint8_t>(buffer, buffer + it->length));
+			CUploadBlockCache::Insert(srcfile->GetFileHash(), it->block->StartOffset, it->block->EndOffset, data);
+		}
 
-			Requested_Block_Struct* block = m_BlockRequests_queue.front();
+		SetUploadFileID(srcfile);
 
-			m_BlockRequests_queue.pop_front();
-			m_DoneBlocks_list.push_front(block);
+		if (it->compress) {
+			// Compressed in the background unless done before for another client
+			PendingBlock pending;
+			pending.block = *it->block;
+			pending.data = data;
+			if (!CUploadBlockCache::LookupPacked(srcfile->GetFileHash(), it->block->StartOffset, it->block->EndOffset, pending.packed)) {
+				pending.job = CUploadCompressor::Compress(srcfile->GetFileHash(), data);
+			}
+			m_pendingBlocks.push_back(pending);
+		} else if (!m_pendingBlocks.empty()) {
+			// Keeps the blocks in order
+			PendingBlock pending;
+			pending.block = *it->block;
+			pending.data = data;
+			pending.file = it->packetFile;
+			m_pendingBlocks.push_back(pending);
+		} else {
+			CreateStandardPackets(data, it->packetFile, it->length, it->block);
 		}
 
+		// file statistic
+		srcfile->statistic.AddTransferred(it->length);
+
+		m_addedPayloadQueueSession += it->length;
+
+		wxASSERT(m_BlockRequests_queue.front() == it->block);
+		m_BlockRequests_queue.pop_front();
+		m_DoneBlocks_list.push_front(it->block);
+	}
+
+	SendPendingBlocks();
+}
+
+
+void CUpDownClient::OnBlocksRead(CFileIOBatch* batch)
+{
+	std::unique_ptr<CUploadBlockReads> reads(static_cast<CUploadBlockReads*>(batch));
+	CUpDownClient* client = reads->client;
+
+	// The blocks are dropped if the client has stopped uploading meanwhile
+	if (client == NULL) {
+		return;
+	}
+
+	wxASSERT(client->m_blockReads == reads.get());
+	client->m_blockReads = NULL;
+
+	// Still requested, they are read again once the client can send
+	if (client->m_socket == NULL) {
+		return;
+	}
+
+	try {
+		client->CreateBlockPackages(*reads);
+
 		return;
 	} catch (const wxString& DEBUG_ONLY(error)) {
 		AddDebugLogLineN(logClient,
 			CFormat(wxT("Client '%s' (%s) caused error while creating packet (%s) - disconnecting client"))
-				% GetUserName() % GetFullIP() % error);
+				% client->GetUserName() % client->GetFullIP() % error);
 	} catch (const CIOFailureException& error) {
 		AddDebugLogLineC(logClient, wxT("IO failure while reading requested file: ") + error.what());
 	} catch (const CEOFException& WXUNUSED(error)) {
-		AddDebugLogLineN(logClient, GetClientFullInfo() + wxT(" requested file-data at an invalid position - disconnecting"));
+		AddDebugLogLineN(logClient, client->GetClientFullInfo() + wxT(" requested file-data at an invalid position - disconnecting"));
 	}
 
 	// Error occurred.
-	theApp->uploadqueue->RemoveFromUploadQueue(this);
+	theApp->uploadqueue->RemoveFromUploadQueue(client);
 }
 
 
-void CUpDownClient::CreateStandardPackets(const uint8_t* buffer, uint32 togo, Requested_Block_Struct* currentblock)
+void CUpDownClient::SendPendingBlocks()
+{
+	while (!m_pendingBlocks.empty()) {
+		PendingBlock& pending = m_pendingBlocks.front();
+		if (pending.job) {
+			if (!pending.job->IsDone()) {
+				return;
+			}
+
+			pending.packed = pending.job->GetResult();
+			// A block skipped while the compressor was busy may compress
+			// next time, so it isn't cached as uncompressible.
+			if (!pending.job->IsSkipped()) {
+				CUploadBlockCache::SetPacked(CMD4Hash(pending.block.FileID), pending.block.StartOffset, pending.block.EndOffset, pending.packed);
+			}
+			pending.job.reset();
+		}
+
+		const uint32 togo = pending.block.EndOffset - pending.block.StartOffset;
+		if (pending.packed) {
+			CreatePackedPackets(pending.packed, togo, &pending.block);
+		} else {
+			CreateStandardPackets(pending.data, pending.file, togo, &pending.block);
+		}
+
+		m_pendingBlocks.pop_front();
+	}
+}
+
+
+/**
+ * Creates the packets of a block, which reference either the data read or
+ * the file it can be sent from.
+ */
+void CUpDownClient::CreateStandardPackets(const CSharedPacketData& data, const CSharedPacketFile& file, uint32 togo, Requested_Block_Struct* currentblock)
 {
 	uint32 nPacketSize;
+	uint32 offset = 0;
 
-	CMemFile memfile(buffer, togo);
 	if (togo > 10240) {
 		nPacketSize = togo/(uint32)(togo/10240);
 	} else {
@@ -306,20 +541,22 @@ void CUpDownClient::CreateStandardPackets(const uint8_t* buffer, uint32 togo, Re
 
 		bool bLargeBlocks = (startpos > 0xFFFFFFFF) || (endpos > 0xFFFFFFFF);
 
-		CMemFile data(nPacketSize + 16 + 2 * (bLargeBlocks ? 8 :4));
-		data.WriteHash(GetUploadFileID());
+		CMemFile header(16 + 2 * (bLargeBlocks ? 8 :4));
+		header.WriteHash(CMD4Hash(currentblock->FileID));
 		if (bLargeBlocks) {
-			data.WriteUInt64(startpos);
-			data.WriteUInt64(endpos);
+			header.WriteUInt64(startpos);
+			header.WriteUInt64(endpos);
 		} else {
-			data.WriteUInt32(startpos);
-			data.WriteUInt32(endpos);
+			header.WriteUInt32(startpos);
+			header.WriteUInt32(endpos);
 		}
-		char *tempbuf = new char[nPacketSize];
-		memfile.Read(tempbuf, nPacketSize);
-		data.Write(tempbuf, nPacketSize);
-		delete [] tempbuf;
-		CPacket* packet = new CPacket(data, (bLargeBlocks ? OP_EMULEPROT : OP_EDONKEYPROT), (bLargeBlocks ? (uint8)OP_SENDINGPART_I64 : (uint8)OP_SENDINGPART));
+		// The packet references its part of the block instead of a copy
+		const uint8 protocol = bLargeBlocks ? OP_EMULEPROT : OP_EDONKEYPROT;
+		const uint8 opcode = bLargeBlocks ? (uint8)OP_SENDINGPART_I64 : (uint8)OP_SENDINGPART;
+		CPacket* packet = file
+			? new CPacket(header, file, startpos, nPacketSize, protocol, opcode)
+			: new CPacket(header, data, offset, nPacketSize, protocol, opcode);
+		offset += nPacketSize;
 		theStats::AddUpOverheadFileRequest(16 + 2 * (bLargeBlocks ? 8 :4));
 		theStats::AddUploadToSoft(GetClientSoft(), nPacketSize);
 		AddDebugLogLineN(logLocalClient,
@@ -330,18 +567,12 @@ void CUpDownClient::CreateStandardPackets(const uint8_t* buffer, uint32 togo, Re
 }
 
 
-void CUpDownClient::CreatePackedPackets(const uint8_t* buffer, uint32 togo, Requested_Block_Struct* currentblock)
+void CUpDownClient::CreatePackedPackets(const CSharedPacketData& packed, uint32 togo, Requested_Block_Struct* currentblock)
 {
-	uLongf newsize = togo+300;
-	CScopedArray<uint8_t> output(newsize);
-	uint16 result = compress2(output.get(), &newsize, buffer, togo, 9);
-	if (result != Z_OK || togo <= newsize){
-		CreateStandardPackets(buffer, togo, currentblock);
-		return;
-	}
-
-	CMemFile memfile(output.get(), newsize);
+	const uint32 newsize = packed->size();
+	wxASSERT(newsize < togo);
 
+	uint32 offset = 0;
 	uint32 totalPayloadSize = 0;
 	uint32 oldSize = togo;
 	togo = newsize;
@@ -360,19 +591,16 @@ void CUpDownClient::CreatePackedPackets(const uint8_t* buffer, uint32 togo, Requ
 
 		bool isLargeBlock = (currentblock->StartOffset > 0xFFFFFFFF) || (currentblock->EndOffset > 0xFFFFFFFF);
 
-		CMemFile data(nPacketSize + 16 + (isLargeBlock ? 12 : 8));
-		data.WriteHash(GetUploadFileID());
+		CMemFile header(16 + (isLargeBlock ? 12 : 8));
+		header.WriteHash(CMD4Hash(currentblock->FileID));
 		if (isLargeBlock) {
-			data.WriteUInt64(currentblock->StartOffset);
+			header.WriteUInt64(currentblock->StartOffset);
 		} else {
-			data.WriteUInt32(currentblock->StartOffset);
+			header.WriteUInt32(currentblock->StartOffset);
 		}
-		data.WriteUInt32(newsize);
-		char *tempbuf = new char[nPacketSize];
-		memfile.Read(tempbuf, nPacketSize);
-		data.Write(tempbuf, nPacketSize);
-		delete [] tempbuf;
-		CPacket* packet = new CPacket(data, OP_EMULEPROT, (isLargeBlock ? OP_COMPRESSEDPART_I64 : OP_COMPRESSEDPART));
+		header.WriteUInt32(newsize);
+		CPacket* packet = new CPacket(header, packed, offset, nPacketSize, OP_EMULEPROT, (isLargeBlock ? OP_COMPRESSEDPART_I64 : OP_COMPRESSEDPART));
+		offset += nPacketSize;
 
 		// approximate payload size
 		uint32 payloadSize = nPacketSize*oldSize/newsize;
@@ -715,7 +943,18 @@ void CUpDownClient::SendHashsetPacket(const CMD4Hash& forfileid)
 
 void CUpDownClient::ClearUploadBlockRequests()
 {
+	if (m_blockReads) {
+		// The files read from may be closed once the client stops
+		// uploading, so the reads are finished and released right away.
+		// The batch itself is deleted when its event arrives.
+		m_blockReads->Wait();
+		m_blockReads->client = NULL;
+		m_blockReads->blocks.clear();
+		m_blockReads = NULL;
+	}
+
 	FlushSendBlocks();
+	m_pendingBlocks.clear();
 	DeleteContents(m_BlockRequests_queue);
 	DeleteContents(m_DoneBlocks_list);
 }
@@ -0,0 +1,350 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+
+#include "UploadCompressor.h"	// Interface declarations
+
+#include <algorithm>		// Needed for std::min and std::max
+#include <deque>
+#include <map>
+#include <vector>
+
+#include <zlib.h>
+#include <wx/thread.h>		// Needed for wxMutex
+#include <wx/time.h>		// Needed for wxGetUTCTimeUSec
+
+#include <common/Format.h>	// Needed for CFormat
+
+#include "Logger.h"		// Needed for AddDebugLogLineN
+#include "MuleThread.h"		// Needed for CMuleThread
+
+
+//! Maximum number of worker threads.
+static const int MAX_THREADS = 4;
+//! Number of jobs per worker which may be queued before blocks are skipped.
+static const size_t MAX_QUEUED_PER_THREAD = 8;
+//! Size of the samples compressed to check if a block is worth compressing.
+static const size_t SAMPLE_SIZE = 4 * 1024;
+//! Number of samples taken from a block.
+static const size_t SAMPLE_COUNT = 3;
+//! Percentage of their size the samples must be compressed to.
+static const uLong SAMPLE_THRESHOLD = 95;
+//! Number of blocks of a file in a row which must not compress for the file to be skipped.
+static const uint32 FAILURES_TO_SKIP = 4;
+//! Every that many blocks of a skipped file are still checked.
+static const uint32 RESAMPLE_INTERVAL = 16;
+//! Maximum number of files for which failures are remembered.
+static const size_t MAX_FILE_HINTS = 1024;
+//! The lowest compression level used.
+static const uint32 MIN_LEVEL = Z_BEST_SPEED;
+//! The highest compression level used.
+static const uint32 MAX_LEVEL = Z_BEST_COMPRESSION;
+//! The level used at first, which is the default of zlib.
+static const uint32 INITIAL_LEVEL = 6;
+//! Interval at which the level is adjusted, in microseconds.
+static const uint64 ADJUST_INTERVAL = 1000000;
+
+
+/** A worker compressing queued blocks. */
+class CUploadCompressionThread : public CMuleThread
+{
+public:
+	CUploadCompressionThread()
+		: CMuleThread(wxTHREAD_JOINABLE)
+	{}
+
+protected:
+	/** @see wxThread::Entry */
+	virtual void* Entry();
+};
+
+
+//! Blocks of a file which didn't compress.
+struct CFileHint
+{
+	//! Number of blocks in a row which didn't compress.
+	uint32	failures;
+	//! Number of blocks skipped since the file failed too often.
+	uint32	skipped;
+};
+
+typedef std::deque<CUploadCompressor::JobPtr> JobQueue;
+typedef std::map<CMD4Hash, CFileHint> FileHintMap;
+
+
+//! Protects everything below, as well as the state of the jobs.
+static wxMutex s_lock;
+//! Signaled when jobs are queued or the workers are terminated.
+static wxCondition s_jobAdded(s_lock);
+//! Jobs waiting for a worker.
+static JobQueue s_queue;
+//! The running workers.
+static std::vector<CUploadCompressionThread*> s_threads;
+//! Specifies if the workers should exit once the queue is empty.
+static bool s_terminating = false;
+//! Files with blocks which didn't compress.
+static FileHintMap s_fileHints;
+//! Time spent compressing since the level was last adjusted, in microseconds.
+static uint64 s_busyTime = 0;
+//! When the level was last adjusted, in microseconds.
+static uint64 s_lastAdjust = 0;
+//! The statistics, including the level.
+static CUploadCompressor::Stats s_stats = { 0, 0, 0, 0, 0, 0, INITIAL_LEVEL };
+
+
+/**
+ * Returns false if a few samples of the data don't compress well, in
+ * which case compressing the whole block is not worth it.
+ */
+static bool IsCompressible(const std::vector<uint8_t>& data)
+{
+	if (data.empty()) {
+		return false;
+	} else if (data.size() < 2 * SAMPLE_COUNT * SAMPLE_SIZE) {
+		// Small blocks are cheap enough to compress right away.
+		return true;
+	}
+
+	uLong sampled = 0;
+	uLong packed = 0;
+	std::vector<Bytef> buffer(compressBound(SAMPLE_SIZE));
+	for (size_t i = 0; i < SAMPLE_COUNT; ++i) {
+		const size_t offset = (data.size() - SAMPLE_SIZE) / (SAMPLE_COUNT - 1) * i;
+		uLongf size = buffer.size();
+		if (compress2(&buffer[0], &size, &data[offset], SAMPLE_SIZE, Z_BEST_SPEED) != Z_OK) {
+			return false;
+		}
+
+		sampled += SAMPLE_SIZE;
+		packed += size;
+	}
+
+	return packed * 100 <= sampled * SAMPLE_THRESHOLD;
+}
+
+
+/**
+ * Adjusts the compression level to the load of the workers, must be
+ * called with s_lock held.
+ */
+static void AdjustLevel()
+{
+	const uint64 now = wxGetUTCTimeUSec().GetValue();
+	if (now - s_lastAdjust < ADJUST_INTERVAL) {
+		return;
+	}
+
+	const uint64 capacity = (now - s_lastAdjust) * std::max<size_t>(s_threads.size(), 1);
+	if (s_busyTime * 4 > capacity * 3 || s_queue.size() > s_threads.size()) {
+		// Falling behind, the level is lowered quickly.
+		s_stats.level = (s_stats.level > MIN_LEVEL + 2) ? (s_stats.level - 2) : MIN_LEVEL;
+	} else if (s_busyTime * 4 < capacity && s_queue.empty()) {
+		s_stats.level = std::min(MAX_LEVEL, s_stats.level + 1);
+	}
+
+	s_busyTime = 0;
+	s_lastAdjust = now;
+}
+
+
+bool CUploadCompressionJob::IsDone() const
+{
+	wxMutexLocker lock(s_lock);
+
+	return m_done;
+}
+
+
+void CUploadCompressionJob::Run()
+{
+	const wxLongLong startTime = wxGetUTCTimeUSec();
+	const std::vector<uint8_t>& input = *m_input;
+
+	CUploadBlockCache::BlockData output;
+	if (IsCompressible(input)) {
+		uLongf size = compressBound(input.size());
+		std::vector<uint8_t>* buffer = new std::vector<uint8_t>(size);
+		output.reset(buffer);
+
+		// Blocks only worth sending compressed if they actually shrink.
+		if (compress2(&(*buffer)[0], &size, &input[0], input.size(), m_level) == Z_OK && size < input.size()) {
+			buffer->resize(size);
+		} else {
+			output.reset();
+		}
+	}
+
+	const uint64 time = (wxGetUTCTimeUSec() - startTime).GetValue();
+
+	wxMutexLocker lock(s_lock);
+
+	m_output = output;
+	m_done = true;
+	s_stats.time += time;
+	s_busyTime += time;
+
+	if (output) {
+		++s_stats.compressed;
+		s_stats.input += input.size();
+		s_stats.saved += input.size() - output->size();
+		s_fileHints.erase(m_file);
+	} else {
+		++s_stats.uncompressible;
+		if (s_fileHints.size() >= MAX_FILE_HINTS && s_fileHints.find(m_file) == s_fileHints.end()) {
+			s_fileHints.clear();
+		}
+
+		CFileHint& hint = s_fileHints[m_file];
+		++hint.failures;
+		hint.skipped = 0;
+	}
+}
+
+
+void* CUploadCompressionThread::Entry()
+{
+	for (;;) {
+		CUploadCompressor::JobPtr job;
+
+		{
+			wxMutexLocker lock(s_lock);
+
+			while (s_queue.empty()) {
+				if (s_terminating) {
+					return NULL;
+				}
+
+				s_jobAdded.Wait();
+			}
+
+			job = s_queue.front();
+			s_queue.pop_front();
+		}
+
+		job->Run();
+	}
+}
+
+
+void CUploadCompressor::Start()
+{
+	wxMutexLocker lock(s_lock);
+
+	if (!s_threads.empty()) {
+		return;
+	}
+
+	// One core is left to the main thread.
+	const int threads = std::min(std::max(wxThread::GetCPUCount() - 1, 1), MAX_THREADS);
+
+	s_terminating = false;
+	for (int i = 0; i < threads; ++i) {
+		CUploadCompressionThread* thread = new CUploadCompressionThread();
+		if (thread->Create() == wxTHREAD_NO_ERROR && thread->Run() == wxTHREAD_NO_ERROR) {
+			s_threads.push_back(thread);
+		} else {
+			delete thread;
+		}
+	}
+
+	if (s_threads.empty()) {
+		AddDebugLogLineC(logZLib, wxT("Error while starting upload compression threads, compressing synchronously"));
+	} else {
+		AddDebugLogLineN(logZLib, CFormat(wxT("Started %u upload compression threads")) % s_threads.size());
+	}
+}
+
+
+void CUploadCompressor::Terminate()
+{
+	std::vector<CUploadCompressionThread*> threads;
+
+	{
+		wxMutexLocker lock(s_lock);
+
+		threads.swap(s_threads);
+		s_terminating = true;
+		s_jobAdded.Broadcast();
+	}
+
+	for (size_t i = 0; i < threads.size(); ++i) {
+		threads[i]->Wait();
+		delete threads[i];
+	}
+}
+
+
+bool CUploadCompressor::IsWorthCompressing(const CMD4Hash& file)
+{
+	wxMutexLocker lock(s_lock);
+
+	FileHintMap::iterator it = s_fileHints.find(file);
+	if (it != s_fileHints.end() && it->second.failures >= FAILURES_TO_SKIP
+		&& ++it->second.skipped % RESAMPLE_INTERVAL != 0) {
+		// The file most likely doesn't compress at all.
+		++s_stats.uncompressible;
+		return false;
+	}
+
+	return true;
+}
+
+
+CUploadCompressor::JobPtr CUploadCompressor::Compress(const CMD4Hash& file, const CUploadBlockCache::BlockData& data)
+{
+	JobPtr job(new CUploadCompressionJob(file, data, 0));
+
+	{
+		wxMutexLocker lock(s_lock);
+
+		if (!s_threads.empty() && s_queue.size() >= MAX_QUEUED_PER_THREAD * s_threads.size()) {
+			++s_stats.skipped;
+			job->m_skipped = true;
+			job->m_done = true;
+			return job;
+		}
+
+		AdjustLevel();
+		job->m_level = s_stats.level;
+
+		if (!s_threads.empty()) {
+			s_queue.push_back(job);
+			s_jobAdded.Signal();
+			return job;
+		}
+	}
+
+	job->Run();
+
+	return job;
+}
+
+
+void CUploadCompressor::GetStats(Stats& stats)
+{
+	wxMutexLocker lock(s_lock);
+
+	stats = s_stats;
+}
+// File_checked_for_headers
@@ -0,0 +1,152 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+
+#ifndef UPLOADCOMPRESSOR_H
+#define UPLOADCOMPRESSOR_H
+
+#include "Types.h"
+#include "MD4Hash.h"		// Needed for CMD4Hash
+#include "UploadBlockCache.h"	// Needed for CUploadBlockCache::BlockData
+
+#include <memory>		// Needed for std::shared_ptr
+
+
+/**
+ * The compression of a block for uploading, see CUploadCompressor.
+ */
+class CUploadCompressionJob
+{
+public:
+	/** Returns true once the block has been compressed. */
+	bool IsDone() const;
+
+	/**
+	 * Returns the compressed data, or an empty pointer if the block
+	 * doesn't compress. Must only be called once the job is done.
+	 */
+	const CUploadBlockCache::BlockData& GetResult() const	{ return m_output; }
+
+	/**
+	 * Returns true if the block wasn't compressed because the workers
+	 * were busy, so nothing is known about how it compresses. Must only
+	 * be called once the job is done.
+	 */
+	bool IsSkipped() const	{ return m_skipped; }
+
+private:
+	friend class CUploadCompressor;
+	friend class CUploadCompressionThread;
+
+	CUploadCompressionJob(const CMD4Hash& file, const CUploadBlockCache::BlockData& input, int level)
+		: m_file(file), m_input(input), m_level(level), m_done(false), m_skipped(false)
+	{}
+
+	/** Compresses the block, may be called from any thread. */
+	void Run();
+
+	//! The hash of the file the block belongs to.
+	CMD4Hash	m_file;
+	//! The data to compress.
+	CUploadBlockCache::BlockData	m_input;
+	//! The result, see GetResult.
+	CUploadBlockCache::BlockData	m_output;
+	//! The zlib compression level to use.
+	int		m_level;
+	//! Set once the job has been run, protected by the lock of the compressor.
+	bool		m_done;
+	//! Set if the job was given up without being run.
+	bool		m_skipped;
+};
+
+
+/**
+ * Compresses uploaded blocks for clients supporting compressed parts.
+ *
+ * Blocks are compressed by a small pool of worker threads, so that the
+ * main thread isn't stalled by zlib. Before compressing a block, a few
+ * samples of it are compressed quickly; blocks whose samples don't shrink
+ * are sent uncompressed without further work. Files which keep failing
+ * that check (usually media) are only sampled now and then, and their
+ * other blocks are sent as they are without being queued at all.
+ *
+ * The compression level follows the load of the workers: it is raised
+ * while they are mostly idle and lowered when they fall behind. If too
+ * many blocks are queued, further blocks are not compressed at all, so
+ * that uploads never wait on the CPU.
+ *
+ * Without running workers (before Start and after Terminate), blocks are
+ * compressed by the calling thread.
+ */
+class CUploadCompressor
+{
+public:
+	typedef std::shared_ptr<CUploadCompressionJob> JobPtr;
+
+	//! Snapshot of the state of the compressor.
+	struct Stats
+	{
+		//! Number of blocks compressed.
+		uint64	compressed;
+		//! Number of blocks found not to compress.
+		uint64	uncompressible;
+		//! Number of blocks not compressed because the workers were busy.
+		uint64	skipped;
+		//! Size of the blocks compressed.
+		uint64	input;
+		//! Bytes saved by compression.
+		uint64	saved;
+		//! Time spent compressing, in microseconds.
+		uint64	time;
+		//! The current compression level.
+		uint32	level;
+	};
+
+	/** Starts the worker threads. */
+	static void Start();
+
+	/** Stops the worker threads after the queued blocks have been compressed. */
+	static void Terminate();
+
+	/**
+	 * Returns false if a block of the file should be sent uncompressed
+	 * without trying (see above), counting it as uncompressible.
+	 */
+	static bool IsWorthCompressing(const CMD4Hash& file);
+
+	/**
+	 * Queues a block for compression.
+	 *
+	 * @param file The hash of the file the block belongs to.
+	 * @param data The data of the block, which must not change.
+	 * @return The job, which may already be done.
+	 */
+	static JobPtr Compress(const CMD4Hash& file, const CUploadBlockCache::BlockData& data);
+
+	/** Retrieves the current statistics. */
+	static void GetStats(Stats& stats);
+};
+
+#endif // UPLOADCOMPRESSOR_H
+// File_checked_for_headers
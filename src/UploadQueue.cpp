@@ -59,6 +59,7 @@
 #include "ListenSocket.h"
 #include "DownloadQueue.h"
 #include "PartFile.h"
+#include "OtherFunctions.h"	// Needed for CastItoSpeed
 
 
 //TODO rewrite the whole networkcode, use overlapped sockets
@@ -69,13 +70,67 @@ CUploadQueue::CUploadQueue()
 	m_lastSort = 0;
 	lastupslotHighID = true;
 	m_allowKicking = true;
+	m_adaptiveSlots = false;
 	m_allUploadingKnownFile = new CKnownFile;
 }
 
 
+//! How long slots are given by the order of the last sort of the waiting queue.
+//! It changes only slowly, as the scores grow with the time waited.
+static const uint32 WAITING_SORT_INTERVAL = SEC2MS(10);
+
+
+/** Orders clients by descending score. */
+static bool CompareScore(const CClientRef& a, const CClientRef& b)
+{
+	return a.GetClient()->GetScore() > b.GetClient()->GetScore();
+}
+
+
 void CUploadQueue::SortGetBestClient(CClientRef * bestClient)
 {
 	uint32 tick = GetTickCount();
+	if (!bestClient || tick - m_lastSort >= WAITING_SORT_INTERVAL) {
+		SortWaitingQueue(tick);
+	}
+
+	if (!bestClient) {
+		return;
+	}
+
+	// Find the best high id client, marking all better low id clients as enabled for upload
+	for (CClientRefList::iterator it = m_waitinglist.begin(); it != m_waitinglist.end(); ++it) {
+		CUpDownClient* cur_client = it->GetClient();
+		if (cur_client->IsBanned() || IsSuspended(cur_client->GetUploadFileID())
+			|| !theApp->sharedfiles->GetFileByID(cur_client->GetUploadFileID())) {
+			// Changed since the last sort, which takes care of it
+			continue;
+		} else if (cur_client->HasLowID() && !cur_client->IsConnected()) {
+			// No better high id client, so start upload to this one once it connects
+			cur_client->m_bAddNextConnect = true;
+		} else {
+			// We found a high id client (or a currently connected low id client)
+			cur_client->m_bAddNextConnect = false;
+			bestClient->Link(cur_client CLIENT_DEBUGSTRING("CUploadQueue::SortGetBestClient"));
+			const uint16 rank = cur_client->GetUploadQueueWaitingPosition();
+			CClientRefList::iterator next = it;
+			++next;
+			RemoveFromWaitingQueue(it);
+			SetWaitingRanks(next, rank);
+			lastupslotHighID = true; // VQB LowID alternate
+
+			// Clients added since the last sort may have moved ahead of marked ones
+			for (; next != m_waitinglist.end() && next->GetClient()->m_bAddNextConnect; ++next) {
+				next->GetClient()->m_bAddNextConnect = false;
+			}
+			break;
+		}
+	}
+}
+
+
+void CUploadQueue::SortWaitingQueue(uint32 tick)
+{
 	m_lastSort = tick;
 	CClientRefList::iterator it = m_waitinglist.begin();
 	for (; it != m_waitinglist.end(); ) {
@@ -98,55 +153,32 @@ void CUploadQueue::SortGetBestClient(CClientRef * bestClient)
 
 		if (cur_client->IsBanned() || IsSuspended(cur_client->GetUploadFileID())) { // Banned client or suspended upload ?
 			cur_client->ClearScore();
-			continue;
-		}
-		// finished clearing
-
-		// Calculate score of current client
-		uint32 cur_score = cur_client->CalculateScore();
-		// Check if it's better than that of a previous one, and move it up then.
-		CClientRefList::iterator it1 = it2;
-		while (it1 != m_waitinglist.begin()) {
-			--it1;
-			if (cur_score > it1->GetClient()->GetScore()) {
-				// swap them
-				std::swap(*it2, *it1);
-				--it2;
-			} else {
-				// no need to check further since list is already sorted
-				break;
-			}
+		} else {
+			cur_client->CalculateScore();
 		}
 	}
 
+	// Nodes are relinked, so the index stays valid
+	m_waitinglist.sort(CompareScore);
+
 	// Second Pass:
 	// - calculate queue rank
-	// - find best high id client
-	// - mark all better low id clients as enabled for upload
+	// - mark all low id clients better than the best high id client as enabled for upload
 	uint16 rank = 1;
 	bool bestClientFound = false;
-	for (it = m_waitinglist.begin(); it != m_waitinglist.end(); ) {
-		CClientRefList::iterator it2 = it++;
-		CUpDownClient* cur_client = it2->GetClient();
+	for (it = m_waitinglist.begin(); it != m_waitinglist.end(); ++it) {
+		CUpDownClient* cur_client = it->GetClient();
 		cur_client->SetUploadQueueWaitingPosition(rank++);
 		if (bestClientFound) {
 			// There's a better high id client
 			cur_client->m_bAddNextConnect = false;
+		} else if (cur_client->HasLowID() && !cur_client->IsConnected()) {
+			// No better high id client, so start upload to this one once it connects
+			cur_client->m_bAddNextConnect = true;
 		} else {
-			if (cur_client->HasLowID() && !cur_client->IsConnected()) {
-				// No better high id client, so start upload to this one once it connects
-				cur_client->m_bAddNextConnect = true;
-			} else {
-				// We found a high id client (or a currently connected low id client)
-				bestClientFound = true;
-				cur_client->m_bAddNextConnect = false;
-				if (bestClient) {
-					bestClient->Link(cur_client CLIENT_DEBUGSTRING("CUploadQueue::SortGetBestClient"));
-					RemoveFromWaitingQueue(it2);
-					rank--;
-					lastupslotHighID = true; // VQB LowID alternate
-				}
-			}
+			// We found a high id client (or a currently connected low id client)
+			bestClientFound = true;
+			cur_client->m_bAddNextConnect = false;
 		}
 	}
 
@@ -287,6 +319,8 @@ void CUploadQueue::Process()
 		theStats::AddSentBytes(sentBytes);
 	}
 
+	UpdateSlots(tick);
+
 	// Periodically resort queue if it doesn't happen anyway
 	if ((sint32) (tick - m_lastSort) > MIN2MS(2)) {
 		SortGetBestClient();
@@ -296,6 +330,10 @@ void CUploadQueue::Process()
 
 uint16 CUploadQueue::GetMaxSlots() const
 {
+	if (m_adaptiveSlots) {
+		return m_slotController.GetSlots();
+	}
+
 	uint16 nMaxSlots = 0;
 	float kBpsUpPerClient = (float)thePrefs::GetSlotAllocation();
 	if (thePrefs::GetMaxUpload() == UNLIMITED) {
@@ -319,6 +357,81 @@ uint16 CUploadQueue::GetMaxSlots() const
 }
 
 
+/**
+ * Returns the rate the uplink may be used at, or 0 if it isn't known
+ * because uploads are unlimited.
+ */
+uint64 CUploadQueue::GetUploadCapacity() const
+{
+	if (thePrefs::IsDelayBasedUpload()) {
+		uint64 currentRate, targetRate;
+		uint32 delay;
+		theApp->uploadBandwidthThrottler->GetDelayStats(currentRate, targetRate, delay);
+		return targetRate;
+	}
+
+	return thePrefs::GetMaxUpload() == UNLIMITED ? 0 : (uint64)thePrefs::GetMaxUpload() * 1024;
+}
+
+
+/**
+ * Lets the slot controller adjust the number of slots to the throughput
+ * measured on them, if the capacity of the uplink is known. Otherwise the
+ * number of slots follows from the preferences.
+ */
+void CUploadQueue::UpdateSlots(uint32 tick)
+{
+	const uint64 capacity = thePrefs::IsAdaptiveUploadSlots() ? GetUploadCapacity() : 0;
+	if (!capacity) {
+		m_adaptiveSlots = false;
+		return;
+	}
+
+	if (!m_adaptiveSlots) {
+		// Start from the number of slots set by the preferences
+		m_slotController.SetLimits(MIN_UP_CLIENTS_ALLOWED, MAX_UP_CLIENTS_ALLOWED);
+		m_slotController.Reset(tick, GetMaxSlots());
+		m_adaptiveSlots = true;
+		AddDebugLogLineN(logUploadQueue, CFormat(wxT("Adapting upload slots to their throughput, starting with %u slots"))
+			% m_slotController.GetSlots());
+		return;
+	}
+
+	if (!m_slotController.IsDue(tick)) {
+		return;
+	}
+
+	std::vector<CUploadSlotController::SlotInfo> slots;
+	slots.reserve(m_uploadinglist.size());
+	for (CClientRefList::iterator it = m_uploadinglist.begin(); it != m_uploadinglist.end(); ++it) {
+		CUpDownClient* client = it->GetClient();
+		// Friends and release uploads keep their slots
+		const CKnownFile* file = client->GetUploadFile();
+		CUploadSlotController::SlotInfo slot = { client, client->GetSessionUp(), client->GetUpStartTimeDelay(),
+			!client->GetFriendSlot() && file && file->GetUpPriority() != PR_POWERSHARE };
+		slots.push_back(slot);
+	}
+
+	m_slotController.SetMinSlotRate((uint64)thePrefs::GetSlotAllocation() * 1024);
+	switch (m_slotController.Update(tick, capacity, slots)) {
+		case CUploadSlotController::SlotOpened:
+			AddDebugLogLineN(logUploadQueue, CFormat(wxT("Opened upload slot %u, uplink used at %.1f%% (%s)"))
+				% m_slotController.GetSlots() % m_slotController.GetUtilisation() % CastItoSpeed(m_slotController.GetRate()));
+			break;
+		case CUploadSlotController::SlotClosed:
+			AddDebugLogLineN(logUploadQueue, CFormat(wxT("Closed an upload slot, %u left, uplink saturated at %s per slot"))
+				% m_slotController.GetSlots() % CastItoSpeed(m_slotController.GetRate() / slots.size()));
+			break;
+		case CUploadSlotController::SlowSlotFound:
+			AddDebugLogLineN(logUploadQueue, CFormat(wxT("Uplink saturated at %.1f%%, dropping the slowest upload slot (%s)"))
+				% m_slotController.GetUtilisation() % CastItoSpeed(m_slotController.GetSlotRate(m_slotController.GetSlotToDrop())));
+			break;
+		default:
+			break;
+	}
+}
+
+
 CUploadQueue::~CUploadQueue()
 {
 	wxASSERT(m_waitinglist.empty());
@@ -329,12 +442,7 @@ CUploadQueue::~CUploadQueue()
 
 bool CUploadQueue::IsOnUploadQueue(const CUpDownClient* client) const
 {
-	for (CClientRefList::const_iterator it = m_waitinglist.begin(); it != m_waitinglist.end(); ++it) {
-		if (it->GetClient() == client) {
-			return true;
-		}
-	}
-	return false;
+	return m_waitingClients.find(client) != m_waitingClients.end();
 }
 
 
@@ -355,9 +463,9 @@ CUpDownClient* CUploadQueue::GetWaitingClientByIP_UDP(uint32 dwIP, uint16 nUDPPo
 
 	int cMatches = 0;
 
-	CClientRefList::iterator it = m_waitinglist.begin();
-	for (; it != m_waitinglist.end(); ++it) {
-		CUpDownClient* cur_client = it->GetClient();
+	std::pair<WaitingIPMap::iterator, WaitingIPMap::iterator> range = m_waitingIPs.equal_range(dwIP);
+	for (WaitingIPMap::iterator it = range.first; it != range.second; ++it) {
+		CUpDownClient* cur_client = it->second;
 
 		if ((dwIP == cur_client->GetIP()) && (nUDPPort == cur_client->GetUDPPort())) {
 			return cur_client;
@@ -379,6 +487,23 @@ CUpDownClient* CUploadQueue::GetWaitingClientByIP_UDP(uint32 dwIP, uint16 nUDPPo
 }
 
 
+void CUploadQueue::UpdateWaitingClientIP(CUpDownClient* client, uint32 newIP)
+{
+	if (!IsOnUploadQueue(client) || client->GetIP() == newIP) {
+		return;
+	}
+
+	std::pair<WaitingIPMap::iterator, WaitingIPMap::iterator> range = m_waitingIPs.equal_range(client->GetIP());
+	for (WaitingIPMap::iterator it = range.first; it != range.second; ++it) {
+		if (it->second == client) {
+			m_waitingIPs.erase(it);
+			break;
+		}
+	}
+	m_waitingIPs.insert(WaitingIPMap::value_type(newIP, client));
+}
+
+
 void CUploadQueue::AddClientToQueue(CUpDownClient* client)
 {
 	if (theApp->serverconnect->IsConnected() && theApp->serverconnect->IsLowID() && !theApp->serverconnect->IsLocalServer(client->GetServerIP(),client->GetServerPort()) && client->GetDownloadState() == DS_NONE && !client->IsFriend() && theStats::GetWaitingUserCount() > 50) {
@@ -507,9 +632,7 @@ void CUploadQueue::AddClientToQueue(CUpDownClient* client)
 		m_nLastStartUpload = tick;
 	} else {
 		// add to waiting queue
-		m_waitinglist.push_back(CCLIENTREF(client, wxT("CUploadQueue::AddClientToQueue m_waitinglist.push_back")));
-		// and sort it to update queue ranks
-		SortGetBestClient();
+		AddToWaitingQueue(client);
 		theStats::AddWaitingClient();
 		client->ClearAskedCount();
 		client->SetUploadState(US_ONUPLOADQUEUE);
@@ -529,6 +652,7 @@ bool CUploadQueue::RemoveFromUploadQueue(CUpDownClient* client)
 
 	if (it != m_uploadinglist.end()) {
 		m_uploadinglist.erase(it);
+		m_slotController.RemoveSlot(client);
 		m_allUploadingKnownFile->RemoveUploadingClient(client);
 		theStats::RemoveUploadingClient();
 		if( client->GetTransferredUp() ) {
@@ -573,6 +697,15 @@ bool CUploadQueue::CheckForTimeOver(CUpDownClient* client)
 		// Otherwise normal rules apply.
 	}
 
+	// The slowest slot while the uplink is saturated, so a faster client gets it
+	if (m_adaptiveSlots && client == m_slotController.GetSlotToDrop()) {
+		AddDebugLogLineN(logUploadQueue, CFormat(wxT("Dropped slow upload slot of %s (%s)"))
+			% client->GetUserName() % CastItoSpeed(m_slotController.GetSlotRate(client)));
+		m_slotController.SlotDropped(GetTickCount());
+		m_allowKicking = false;		// kick max one client per cycle
+		return true;
+	}
+
 	// Ordinary slots
 	// "Transfer full chunks": drop client after 10 MB upload, or after an hour.
 	// (so average UL speed should at least be 2.84 kB/s)
@@ -630,7 +763,7 @@ uint16 CUploadQueue::SuspendUpload(const CMD4Hash& filehash, bool terminate)
 			if (terminate) {
 				potential->SetUploadState(US_NONE);
 			} else {
-				m_waitinglist.push_back(CCLIENTREF(potential, wxT("CUploadQueue::SuspendUpload")));
+				AddToWaitingQueue(potential);
 				theStats::AddWaitingClient();
 				potential->SetUploadState(US_ONUPLOADQUEUE);
 				potential->SendRankingInfo();
@@ -642,31 +775,77 @@ uint16 CUploadQueue::SuspendUpload(const CMD4Hash& filehash, bool terminate)
 	return removed;
 }
 
-bool CUploadQueue::RemoveFromWaitingQueue(CUpDownClient* client)
+/**
+ * Adds a client to the waiting queue, at the place of its current score.
+ * Only the ranks of the clients behind it change, which are usually none,
+ * as new clients haven't waited yet.
+ */
+void CUploadQueue::AddToWaitingQueue(CUpDownClient* client)
 {
-	CClientRefList::iterator it = m_waitinglist.begin();
+	if (client->IsBanned() || IsSuspended(client->GetUploadFileID())) {
+		client->ClearScore();
+	} else {
+		client->CalculateScore();
+	}
 
-	uint16 rank = 1;
-	while (it != m_waitinglist.end()) {
-		CClientRefList::iterator it1 = it++;
-		if (it1->GetClient() == client) {
-			RemoveFromWaitingQueue(it1);
-			// update ranks of remaining queue
-			while (it != m_waitinglist.end()) {
-				it->GetClient()->SetUploadQueueWaitingPosition(rank++);
-				++it;
-			}
-			return true;
+	CClientRefList::iterator pos = m_waitinglist.end();
+	uint16 rank = m_waitinglist.size() + 1;
+	while (pos != m_waitinglist.begin()) {
+		CClientRefList::iterator prev = pos;
+		if ((--prev)->GetClient()->GetScore() >= client->GetScore()) {
+			break;
 		}
-		rank++;
+		pos = prev;
+		rank--;
 	}
-	return false;
+
+	pos = m_waitinglist.insert(pos, CCLIENTREF(client, wxT("CUploadQueue::AddToWaitingQueue")));
+	m_waitingClients[client] = pos;
+	m_waitingIPs.insert(WaitingIPMap::value_type(client->GetIP(), client));
+	SetWaitingRanks(pos, rank);
+}
+
+
+/**
+ * Numbers the waiting clients from the given one on, which has the given rank.
+ */
+void CUploadQueue::SetWaitingRanks(CClientRefList::iterator pos, uint16 rank)
+{
+	for (; pos != m_waitinglist.end(); ++pos) {
+		pos->GetClient()->SetUploadQueueWaitingPosition(rank++);
+	}
+}
+
+
+bool CUploadQueue::RemoveFromWaitingQueue(CUpDownClient* client)
+{
+	WaitingClientMap::iterator found = m_waitingClients.find(client);
+	if (found == m_waitingClients.end()) {
+		return false;
+	}
+
+	// update ranks of remaining queue
+	const uint16 rank = client->GetUploadQueueWaitingPosition();
+	CClientRefList::iterator next = found->second;
+	++next;
+	RemoveFromWaitingQueue(found->second);
+	SetWaitingRanks(next, rank);
+
+	return true;
 }
 
 
 void CUploadQueue::RemoveFromWaitingQueue(CClientRefList::iterator pos)
 {
 	CUpDownClient* todelete = pos->GetClient();
+	m_waitingClients.erase(todelete);
+	std::pair<WaitingIPMap::iterator, WaitingIPMap::iterator> range = m_waitingIPs.equal_range(todelete->GetIP());
+	for (WaitingIPMap::iterator it = range.first; it != range.second; ++it) {
+		if (it->second == todelete) {
+			m_waitingIPs.erase(it);
+			break;
+		}
+	}
 	m_waitinglist.erase(pos);
 	theStats::RemoveWaitingClient();
 	if( todelete->IsBanned() ) {
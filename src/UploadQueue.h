@@ -28,6 +28,9 @@
 
 #include "ClientRef.h"		// Needed for CClientRefList
 #include "MD4Hash.h"		// Needed for CMD4Hash
+#include "UploadScheduler.h"	// Needed for CUploadSlotController
+
+#include <unordered_map>
 
 // Experimental extended upload queue population
 //
@@ -62,19 +65,36 @@ public:
 	const CClientRefList& GetUploadingList() const { return m_uploadinglist; }
 
 	CUpDownClient* GetWaitingClientByIP_UDP(uint32 dwIP, uint16 nUDPPort, bool bIgnorePortOnUniqueIP, bool* pbMultipleIPs = NULL);
+	// Called before the IP of a client changes, to keep the index up to date
+	void	UpdateWaitingClientIP(CUpDownClient* client, uint32 newIP);
 
 	uint16	SuspendUpload(const CMD4Hash &, bool terminate);
 	void	ResumeUpload(const CMD4Hash &);
 	CKnownFile* GetAllUploadingKnownFile() { return m_allUploadingKnownFile; }
 
+	uint16	GetMaxSlots() const;
+	// True while the number of slots is set by the slot controller
+	bool	IsAdaptingSlots() const { return m_adaptiveSlots; }
+	const CUploadSlotController& GetSlotController() const { return m_slotController; }
+
 private:
+	void	AddToWaitingQueue(CUpDownClient* client);
 	void	RemoveFromWaitingQueue(CClientRefList::iterator pos);
-	uint16	GetMaxSlots() const;
+	void	SetWaitingRanks(CClientRefList::iterator pos, uint16 rank);
+	uint64	GetUploadCapacity() const;
+	void	UpdateSlots(uint32 tick);
 	void	AddUpNextClient(CUpDownClient* directadd = 0);
 	bool	IsSuspended(const CMD4Hash& hash) { return suspendedUploadsSet.find(hash) != suspendedUploadsSet.end(); }
 	void	SortGetBestClient(CClientRef * bestClient = NULL);
+	void	SortWaitingQueue(uint32 tick);
 
+	// Waiting clients, best first by the score they had when last sorted
 	CClientRefList m_waitinglist;
+	// Indexes of the waiting clients, by client and by IP
+	typedef std::unordered_map<const CUpDownClient*, CClientRefList::iterator> WaitingClientMap;
+	WaitingClientMap m_waitingClients;
+	typedef std::unordered_multimap<uint32, CUpDownClient*> WaitingIPMap;
+	WaitingIPMap m_waitingIPs;
 	CClientRefList m_uploadinglist;
 
 #if EXTENDED_UPLOADQUEUE
@@ -87,6 +107,9 @@ private:
 	uint32	m_lastSort;
 	bool	lastupslotHighID; // VQB lowID alternation
 	bool	m_allowKicking;
+	// Sets the number of slots from their throughput, if the capacity of the uplink is known
+	CUploadSlotController m_slotController;
+	bool	m_adaptiveSlots;
 	// This KnownFile collects all currently uploading clients for display in the upload list control
 	CKnownFile * m_allUploadingKnownFile;
 };
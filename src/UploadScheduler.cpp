@@ -0,0 +1,465 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+
+#include "UploadScheduler.h"	// Interface declarations
+
+#include <algorithm>		// Needed for std::min and std::nth_element
+
+#include "ThrottledSocket.h"	// Needed for ThrottledFileSocket
+
+
+//! Longest time credited at once, which keeps the arithmetic from overflowing.
+static const uint64 MAX_REFILL_TIME = 1000000;
+
+
+CTokenBucket::CTokenBucket()
+	: m_rate(0),
+	  m_burst(0),
+	  m_tokens(0),
+	  m_fraction(0),
+	  m_lastRefill(0),
+	  m_started(false)
+{
+}
+
+
+void CTokenBucket::SetRate(uint64 rate, uint64 burst)
+{
+	m_rate = rate;
+	m_burst = burst;
+}
+
+
+void CTokenBucket::Refill(uint64 now)
+{
+	if (!m_started) {
+		m_started = true;
+		m_tokens = m_burst;
+		m_fraction = 0;
+	} else if (now > m_lastRefill) {
+		m_fraction += std::min(now - m_lastRefill, MAX_REFILL_TIME) * m_rate;
+		m_tokens += m_fraction / 1000000;
+		m_fraction %= 1000000;
+	}
+
+	if (m_tokens >= (sint64)m_burst) {
+		m_tokens = m_burst;
+		m_fraction = 0;
+	}
+
+	m_lastRefill = now;
+}
+
+
+void CTokenBucket::Consume(uint64 bytes)
+{
+	m_tokens -= bytes;
+
+	if (m_tokens < -(sint64)m_burst) {
+		m_tokens = -(sint64)m_burst;
+	}
+}
+
+
+uint64 CTokenBucket::GetWaitTime(uint64 amount) const
+{
+	if (m_tokens >= (sint64)amount) {
+		return 0;
+	} else if (m_rate == 0) {
+		return MAX_REFILL_TIME;
+	}
+
+	const uint64 needed = (amount - m_tokens) * 1000000 - m_fraction;
+
+	return (needed + m_rate - 1) / m_rate;
+}
+
+
+//! Time between adjustments of the delay-based rate.
+static const uint64 DELAY_UPDATE_INTERVAL = 200000;
+//! The delay-based rate never drops below this.
+static const uint64 DELAY_MIN_RATE = 2 * 1024;
+//! Growth per second of the delay-based rate without any queueing delay,
+//! as a fraction of the rate and at least as an absolute value.
+static const double DELAY_GROWTH = 0.5;
+static const uint64 DELAY_MIN_GROWTH = 8 * 1024;
+//! Drop per second of the delay-based rate for each target exceeded.
+static const double DELAY_DECAY = 1.0;
+//! Samples kept between updates, more are ignored.
+static const size_t DELAY_MAX_SAMPLES = 1024;
+
+
+CUploadDelayController::CUploadDelayController()
+	: m_target(50000),
+	  m_maxRate(0),
+	  m_rate(DELAY_MIN_RATE),
+	  m_currentRate(0),
+	  m_delay(0),
+	  m_sent(0),
+	  m_lastUpdate(0)
+{
+}
+
+
+void CUploadDelayController::Reset(uint64 now, uint64 rate)
+{
+	m_rate = std::max(rate, DELAY_MIN_RATE);
+	m_currentRate = rate;
+	m_delay = 0;
+	m_sent = 0;
+	m_lastUpdate = now;
+	m_samples.clear();
+}
+
+
+void CUploadDelayController::AddSample(uint32 delay)
+{
+	if (m_samples.size() < DELAY_MAX_SAMPLES) {
+		m_samples.push_back(delay);
+	}
+}
+
+
+bool CUploadDelayController::Update(uint64 now)
+{
+	if (now < m_lastUpdate + DELAY_UPDATE_INTERVAL) {
+		return false;
+	}
+
+	const double elapsed = std::min(now - m_lastUpdate, MAX_REFILL_TIME) / 1e6;
+	const uint64 sentRate = (uint64)(m_sent / elapsed);
+	m_currentRate = (m_currentRate * 3 + sentRate) / 4;
+	m_sent = 0;
+	m_lastUpdate = now;
+
+	// Without samples nothing is known about the link, so the rate is kept
+	if (!m_samples.empty() && m_target > 0) {
+		std::vector<uint32>::iterator median = m_samples.begin() + m_samples.size() / 2;
+		std::nth_element(m_samples.begin(), median, m_samples.end());
+		m_delay = *median;
+		m_samples.clear();
+
+		const double offTarget = ((double)m_target - m_delay) / m_target;
+		if (offTarget > 0) {
+			// Only grow while the rate is used, else nothing tells if it is too high
+			if (sentRate * 2 >= m_rate) {
+				const double growth = std::max<double>(m_rate * DELAY_GROWTH, DELAY_MIN_GROWTH);
+				m_rate += (uint64)(offTarget * growth * elapsed);
+			}
+		} else {
+			// At most halved per update, like TCP on loss
+			const double decay = std::min(-offTarget * DELAY_DECAY * elapsed, 0.5);
+			m_rate -= (uint64)(m_rate * decay);
+		}
+	}
+
+	m_rate = std::max(m_rate, DELAY_MIN_RATE);
+	if (m_maxRate) {
+		m_rate = std::min(m_rate, std::max(m_maxRate, DELAY_MIN_RATE));
+	}
+
+	return true;
+}
+
+
+//! Time between updates of the number of upload slots.
+static const uint32 SLOT_UPDATE_INTERVAL = 2000;
+//! Time for the rates to settle after a change to the slots.
+static const uint32 SLOT_SETTLE_TIME = 10000;
+//! Slots are opened below this utilisation, in percent.
+static const double SLOT_OPEN_BELOW = 90.0;
+//! The uplink is saturated from this utilisation on, in percent.
+static const double SLOT_SATURATED = 95.0;
+//! Time a slot gets to speed up before it may be dropped as slow.
+static const uint32 SLOT_MIN_UPLOAD_TIME = 30000;
+//! A slot is slow if it gets less than this fraction of the average rate.
+static const uint64 SLOT_SLOW_SHARE = 4;
+
+
+CUploadSlotController::CUploadSlotController()
+	: m_slots(0),
+	  m_minSlots(0),
+	  m_maxSlots(0xFFFF),
+	  m_minSlotRate(0),
+	  m_rate(0),
+	  m_utilisation(0),
+	  m_slotToDrop(NULL),
+	  m_lastUpdate(0),
+	  m_lastChange(0),
+	  m_opened(0),
+	  m_closed(0),
+	  m_dropped(0)
+{
+}
+
+
+void CUploadSlotController::Reset(uint32 now, uint16 slots)
+{
+	m_slots = std::min(std::max(slots, m_minSlots), m_maxSlots);
+	m_slotStates.clear();
+	m_rate = 0;
+	m_utilisation = 0;
+	m_slotToDrop = NULL;
+	m_lastUpdate = now;
+	m_lastChange = now;
+}
+
+
+void CUploadSlotController::SetLimits(uint16 minSlots, uint16 maxSlots)
+{
+	m_minSlots = minSlots;
+	m_maxSlots = std::max(minSlots, maxSlots);
+	m_slots = std::min(std::max(m_slots, m_minSlots), m_maxSlots);
+}
+
+
+bool CUploadSlotController::IsDue(uint32 now) const
+{
+	return now - m_lastUpdate >= SLOT_UPDATE_INTERVAL;
+}
+
+
+CUploadSlotController::Decision CUploadSlotController::Update(uint32 now, uint64 capacity, const std::vector<SlotInfo>& slots)
+{
+	const uint32 elapsed = std::max<uint32>(now - m_lastUpdate, 1);
+	m_lastUpdate = now;
+	m_slotToDrop = NULL;
+
+	// Rates over the last interval, smoothed. New slots are measured over
+	// the time they have been given.
+	SlotMap states;
+	m_rate = 0;
+	for (std::vector<SlotInfo>::const_iterator it = slots.begin(); it != slots.end(); ++it) {
+		SlotState& state = states[it->slot];
+		state.sent = it->sent;
+
+		SlotMap::const_iterator last = m_slotStates.find(it->slot);
+		if (last != m_slotStates.end() && it->sent >= last->second.sent) {
+			const uint64 rate = (it->sent - last->second.sent) * 1000 / elapsed;
+			state.rate = (last->second.rate + rate) / 2;
+		} else {
+			state.rate = it->sent * 1000 / std::max<uint32>(it->uploadTime, 1);
+		}
+		m_rate += state.rate;
+	}
+	m_slotStates.swap(states);
+	m_utilisation = capacity ? 100.0 * m_rate / capacity : 0;
+
+	if (!capacity || now - m_lastChange < SLOT_SETTLE_TIME) {
+		return SlotsKept;
+	}
+
+	if (m_utilisation < SLOT_OPEN_BELOW) {
+		// Only if the slots are all taken, and another one could be fed
+		if (slots.size() >= m_slots && m_slots < m_maxSlots
+			&& m_rate + m_minSlotRate <= capacity) {
+			++m_slots;
+			++m_opened;
+			m_lastChange = now;
+			return SlotOpened;
+		}
+	} else if (m_utilisation >= SLOT_SATURATED && !slots.empty()) {
+		const uint64 average = m_rate / slots.size();
+		if (average < m_minSlotRate && m_slots > m_minSlots) {
+			--m_slots;
+			++m_closed;
+			m_lastChange = now;
+			return SlotClosed;
+		}
+
+		uint64 slowest = average / SLOT_SLOW_SHARE;
+		for (std::vector<SlotInfo>::const_iterator it = slots.begin(); it != slots.end(); ++it) {
+			const uint64 rate = m_slotStates[it->slot].rate;
+			if (it->droppable && it->uploadTime >= SLOT_MIN_UPLOAD_TIME && rate < slowest) {
+				slowest = rate;
+				m_slotToDrop = it->slot;
+			}
+		}
+		if (m_slotToDrop) {
+			return SlowSlotFound;
+		}
+	}
+
+	return SlotsKept;
+}
+
+
+void CUploadSlotController::RemoveSlot(const void* slot)
+{
+	m_slotStates.erase(slot);
+	if (m_slotToDrop == slot) {
+		m_slotToDrop = NULL;
+	}
+}
+
+
+void CUploadSlotController::SlotDropped(uint32 now)
+{
+	RemoveSlot(m_slotToDrop);
+	++m_dropped;
+	m_lastChange = now;
+}
+
+
+uint64 CUploadSlotController::GetSlotRate(const void* slot) const
+{
+	SlotMap::const_iterator it = m_slotStates.find(slot);
+
+	return it != m_slotStates.end() ? it->second.rate : 0;
+}
+
+
+CUploadSlotScheduler::CUploadSlotScheduler()
+	: m_next(0),
+	  m_resume(false)
+{
+}
+
+
+void CUploadSlotScheduler::Add(uint32 index, ThrottledFileSocket* socket)
+{
+	Remove(socket);
+
+	if (index > m_slots.size()) {
+		index = m_slots.size();
+	}
+
+	// The turn stays with the same slot
+	if (index <= m_next && m_next < m_slots.size()) {
+		++m_next;
+	}
+
+	Slot slot = { socket, 0 };
+	m_slots.insert(m_slots.begin() + index, slot);
+}
+
+
+bool CUploadSlotScheduler::Remove(ThrottledFileSocket* socket)
+{
+	for (SlotList::iterator it = m_slots.begin(); it != m_slots.end(); ++it) {
+		if (it->socket == socket) {
+			const size_t index = it - m_slots.begin();
+			if (index < m_next) {
+				--m_next;
+			} else if (index == m_next) {
+				m_resume = false;
+			}
+
+			m_slots.erase(it);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+void CUploadSlotScheduler::Clear()
+{
+	m_slots.clear();
+	m_next = 0;
+	m_resume = false;
+}
+
+
+bool CUploadSlotScheduler::HasData() const
+{
+	for (SlotList::const_iterator it = m_slots.begin(); it != m_slots.end(); ++it) {
+		if (it->socket->HasStandardData()) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+uint32 CUploadSlotScheduler::Send(uint32 budget, uint32 quantum, uint32 minFragSize, uint32& overhead)
+{
+	uint32 spent = 0;
+	bool progress = true;
+
+	// Rounds continue until the budget is used up or nobody sends anymore
+	while (spent < budget && progress) {
+		progress = false;
+
+		for (size_t visited = 0; visited < m_slots.size() && spent < budget; ++visited) {
+			if (m_next >= m_slots.size()) {
+				m_next = 0;
+				m_resume = false;
+			}
+
+			Slot& slot = m_slots[m_next];
+			if (!slot.socket->HasStandardData()) {
+				// Unused earnings are lost, debts are kept
+				slot.deficit = std::min<sint64>(slot.deficit, 0);
+				m_resume = false;
+				++m_next;
+				continue;
+			}
+
+			if (!m_resume) {
+				slot.deficit += quantum;
+			}
+
+			if (slot.deficit <= 0) {
+				// Still paying back what it sent in excess, see below
+				progress = true;
+				m_resume = false;
+				++m_next;
+				continue;
+			}
+
+			const uint32 allowed = (uint32)std::min<sint64>(slot.deficit, budget - spent);
+			const SocketSentBytes sent = slot.socket->SendFileAndControlData(allowed, minFragSize);
+			// Sockets send whole fragments, which may be more than allowed.
+			// The excess is taken from the next turns of the slot.
+			const uint32 bytes = sent.sentBytesStandardPackets + sent.sentBytesControlPackets;
+
+			spent += bytes;
+			overhead += sent.sentBytesControlPackets;
+			slot.deficit -= bytes;
+			progress |= bytes > 0;
+
+			if (spent >= budget && slot.deficit > 0) {
+				// Out of budget, the slot goes on next time
+				m_resume = true;
+				break;
+			}
+
+			// Slots can't save up more than a turn
+			if (!slot.socket->HasStandardData()) {
+				slot.deficit = std::min<sint64>(slot.deficit, 0);
+			} else {
+				slot.deficit = std::min<sint64>(slot.deficit, quantum);
+			}
+			m_resume = false;
+			++m_next;
+		}
+	}
+
+	return spent;
+}
+// File_checked_for_headers
@@ -0,0 +1,349 @@
+//
+// This file is part of the aMule Project.
+//
+// Copyright (c) 2003-2011 aMule Team ( admin@amule.org / http://www.amule.org )
+//
+// Any parts of this program derived from the xMule, lMule or eMule project,
+// or contributed by third-party developers are copyrighted by their
+// respective authors.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+
+
+#ifndef UPLOADSCHEDULER_H
+#define UPLOADSCHEDULER_H
+
+#include "Types.h"
+
+#include <deque>
+#include <map>
+#include <vector>
+
+class ThrottledFileSocket;
+
+
+/**
+ * Token bucket limiting the upload rate.
+ *
+ * Tokens (bytes) are added at the configured rate, up to the burst size.
+ * Sending takes tokens and may leave the bucket in debt, by at most the
+ * burst size, which is repaid before anything else is sent.
+ *
+ * Times are given in microseconds, from any monotonic clock.
+ */
+class CTokenBucket
+{
+public:
+	CTokenBucket();
+
+	/**
+	 * Sets the rate in bytes per second and the burst size in bytes.
+	 *
+	 * Tokens in excess of a lowered burst size are dropped with the next refill.
+	 */
+	void SetRate(uint64 rate, uint64 burst);
+
+	/**
+	 * Adds the tokens earned since the last refill.
+	 *
+	 * The bucket starts out full at the first refill.
+	 */
+	void Refill(uint64 now);
+
+	/** Returns the available tokens, negative while in debt. */
+	sint64 GetTokens() const	{ return m_tokens; }
+
+	/** Takes the tokens for bytes sent. */
+	void Consume(uint64 bytes);
+
+	/** Returns the time until 'amount' tokens are available at the current rate. */
+	uint64 GetWaitTime(uint64 amount) const;
+
+private:
+	//! Bytes per second.
+	uint64	m_rate;
+	//! The most tokens the bucket holds, and its largest debt.
+	uint64	m_burst;
+	//! The available tokens.
+	sint64	m_tokens;
+	//! Fractions of a token earned, in millionths.
+	uint64	m_fraction;
+	//! The time of the last refill.
+	uint64	m_lastRefill;
+	//! False until the first refill.
+	bool	m_started;
+};
+
+
+/**
+ * Sets the upload rate from the queueing delay on the uplink, so uploads
+ * take what is left of the link by other traffic (LEDBAT, RFC 6817).
+ *
+ * The queueing delay is the extra round-trip time of the uploading
+ * connections, compared to the lowest seen on each of them. As one
+ * congested connection can't tell a full uplink apart from a slow peer,
+ * the median of the connections is used. The rate grows while the delay
+ * is below the target, and drops in proportion to how far it is above.
+ * It only grows while most of it is actually used.
+ *
+ * Times and delays are given in microseconds, rates in bytes per second.
+ */
+class CUploadDelayController
+{
+public:
+	CUploadDelayController();
+
+	/** Starts over at the given rate, forgetting all samples. */
+	void Reset(uint64 now, uint64 rate);
+
+	/** Sets the queueing delay to aim for. */
+	void SetTarget(uint32 delay)	{ m_target = delay; }
+
+	/** Sets the highest rate, 0 for none. */
+	void SetMaxRate(uint64 rate)	{ m_maxRate = rate; }
+
+	/** Adds the queueing delay measured on a connection. */
+	void AddSample(uint32 delay);
+
+	/** Adds bytes sent at the current rate. */
+	void AddSent(uint64 bytes)	{ m_sent += bytes; }
+
+	/**
+	 * Adjusts the rate, once every update interval.
+	 *
+	 * @return True if the rate was adjusted.
+	 */
+	bool Update(uint64 now);
+
+	/** Returns the rate to upload at. */
+	uint64 GetTargetRate() const	{ return m_rate; }
+
+	/** Returns the rate actually sent at. */
+	uint64 GetCurrentRate() const	{ return m_currentRate; }
+
+	/** Returns the last estimate of the queueing delay. */
+	uint32 GetQueueingDelay() const	{ return m_delay; }
+
+private:
+	//! The delay to aim for.
+	uint32	m_target;
+	//! The highest rate, 0 for none.
+	uint64	m_maxRate;
+	//! The rate to upload at.
+	uint64	m_rate;
+	//! The smoothed rate sent at.
+	uint64	m_currentRate;
+	//! The last queueing delay estimate.
+	uint32	m_delay;
+	//! Bytes sent since the last update.
+	uint64	m_sent;
+	//! The time of the last update.
+	uint64	m_lastUpdate;
+	//! Delays measured since the last update.
+	std::vector<uint32>	m_samples;
+};
+
+
+/**
+ * Sets the number of upload slots from the throughput measured on them.
+ *
+ * Slots are opened one at a time while the uplink is used below target,
+ * as long as what is left could feed another slot, so that slots held by
+ * slow peers don't keep the uplink idle. Once it is saturated, slots are
+ * closed while they get less than the minimum rate on average, and the
+ * slowest slot is picked to be dropped if it gets far less than the
+ * others, so its bandwidth goes to a faster peer. After every change the
+ * controller waits for the rates to settle.
+ *
+ * Times are given in milliseconds, rates in bytes per second.
+ */
+class CUploadSlotController
+{
+public:
+	//! The state of an upload slot.
+	struct SlotInfo
+	{
+		//! Identifies the slot.
+		const void*	slot;
+		//! Bytes sent on the slot since it was given.
+		uint64		sent;
+		//! Time since the slot was given.
+		uint32		uploadTime;
+		//! False if the slot must not be dropped.
+		bool		droppable;
+	};
+
+	//! The decision taken by an update.
+	enum Decision {
+		SlotsKept,
+		SlotOpened,
+		SlotClosed,
+		//! The slowest slot is to be dropped, see GetSlotToDrop.
+		SlowSlotFound
+	};
+
+	CUploadSlotController();
+
+	/** Starts over with the given number of slots. */
+	void Reset(uint32 now, uint16 slots);
+
+	/** Sets the range the number of slots is kept in. */
+	void SetLimits(uint16 minSlots, uint16 maxSlots);
+
+	/** Sets the rate a slot should get at least. */
+	void SetMinSlotRate(uint64 rate)	{ m_minSlotRate = rate; }
+
+	/** Returns true if it is time for an update. */
+	bool IsDue(uint32 now) const;
+
+	/**
+	 * Measures the slots and takes a decision.
+	 *
+	 * @param capacity The rate the uplink may be used at.
+	 * @param slots All slots given.
+	 */
+	Decision Update(uint32 now, uint64 capacity, const std::vector<SlotInfo>& slots);
+
+	/** Forgets a slot that was taken away. */
+	void RemoveSlot(const void* slot);
+
+	/** Records that the slot to drop was dropped. */
+	void SlotDropped(uint32 now);
+
+	/** Returns the number of slots to give. */
+	uint16 GetSlots() const			{ return m_slots; }
+
+	/** Returns the slot to drop, or NULL. */
+	const void* GetSlotToDrop() const	{ return m_slotToDrop; }
+
+	/** Returns the measured rate of a slot. */
+	uint64 GetSlotRate(const void* slot) const;
+
+	/** Returns the rate measured on all slots. */
+	uint64 GetRate() const			{ return m_rate; }
+
+	/** Returns the share of the capacity used, in percent. */
+	double GetUtilisation() const		{ return m_utilisation; }
+
+	uint64 GetOpened() const		{ return m_opened; }
+	uint64 GetClosed() const		{ return m_closed; }
+	uint64 GetDropped() const		{ return m_dropped; }
+
+private:
+	struct SlotState
+	{
+		//! Bytes sent on the slot at the last update.
+		uint64	sent;
+		//! The smoothed rate.
+		uint64	rate;
+	};
+
+	typedef std::map<const void*, SlotState> SlotMap;
+	//! The slots seen at the last update.
+	SlotMap	m_slotStates;
+	//! The number of slots to give.
+	uint16	m_slots;
+	uint16	m_minSlots;
+	uint16	m_maxSlots;
+	//! The rate a slot should get at least.
+	uint64	m_minSlotRate;
+	//! The rate measured on all slots.
+	uint64	m_rate;
+	//! The share of the capacity used, in percent.
+	double	m_utilisation;
+	//! The slot picked to be dropped, valid until the next update.
+	const void*	m_slotToDrop;
+	uint32	m_lastUpdate;
+	//! The time of the last change to the slots.
+	uint32	m_lastChange;
+	//! Statistics
+	uint64	m_opened;
+	uint64	m_closed;
+	uint64	m_dropped;
+};
+
+
+/**
+ * Shares the upload bandwidth between the upload slots using deficit
+ * round-robin.
+ *
+ * On its turn, a slot with data to send earns a quantum and may send as
+ * much as it has earned and not used yet. Slots without data lose what
+ * they had earned, so that idle slots can't save up bandwidth. A round
+ * that runs out of bandwidth is continued where it stopped, so every slot
+ * gets the same share no matter how the bandwidth is handed out. Sockets
+ * send whole fragments, so a slot may send more than it has earned; the
+ * excess is a debt paid back from its next turns.
+ *
+ * Not thread-safe, see UploadBandwidthThrottler.
+ */
+class CUploadSlotScheduler
+{
+public:
+	CUploadSlotScheduler();
+
+	/**
+	 * Adds a slot at the given position, or moves it there.
+	 *
+	 * An index past the end adds the slot last.
+	 */
+	void Add(uint32 index, ThrottledFileSocket* socket);
+
+	/** Removes a slot, returning false if it doesn't exist. */
+	bool Remove(ThrottledFileSocket* socket);
+
+	/** Removes all slots. */
+	void Clear();
+
+	/** Returns the number of slots. */
+	size_t GetCount() const		{ return m_slots.size(); }
+
+	/** Returns the socket of the slot at the given position. */
+	ThrottledFileSocket* GetSocket(size_t index) const	{ return m_slots[index].socket; }
+
+	/** Returns true if any slot has data to send. */
+	bool HasData() const;
+
+	/**
+	 * Lets the slots send at most 'budget' bytes in total.
+	 *
+	 * @param quantum Bytes earned by a slot per turn.
+	 * @param minFragSize Passed to the sockets.
+	 * @param overhead Increased by the bytes of control packets sent.
+	 * @return The number of bytes sent, including control packets. This
+	 *         may exceed the budget by up to a fragment per slot.
+	 */
+	uint32 Send(uint32 budget, uint32 quantum, uint32 minFragSize, uint32& overhead);
+
+private:
+	struct Slot
+	{
+		ThrottledFileSocket*	socket;
+		//! Bytes earned and not sent yet, negative if more was sent.
+		sint64			deficit;
+	};
+
+	typedef std::deque<Slot> SlotList;
+	//! Ordered so the most prioritized socket is first.
+	SlotList	m_slots;
+	//! The slot whose turn it is.
+	size_t		m_next;
+	//! True if the turn of m_next was cut short by the budget.
+	bool		m_resume;
+};
+
+#endif // UPLOADSCHEDULER_H
+// File_checked_for_headers
@@ -39,6 +39,8 @@
 #include "amuleDlg.h"			// Needed for CamuleDlg
 #include "PartFileConvert.h"
 #include "ThreadTasks.h"
+#include "PartFileWriteThread.h"
+#include "FileIOBatch.h"
 #include "Logger.h"				// Needed for EVT_MULE_LOGGING
 #include "GuiEvents.h"			// Needed for EVT_MULE_NOTIFY
 
@@ -90,6 +92,12 @@ BEGIN_EVENT_TABLE(CamuleGuiApp, wxApp)
 
 	// Disk space preallocation finished
 	EVT_MULE_ALLOC_FINISHED(CamuleGuiApp::OnFinishedAllocation)
+
+	// Part-file write thread finished a flush
+	EVT_MULE_PARTFILE_FLUSHED(CamuleGuiApp::OnFinishedPartFileFlush)
+
+	// Batched file I/O completed
+	EVT_MULE_FILEIO_BATCH(CamuleGuiApp::OnFinishedFileIOBatch)
 END_EVENT_TABLE()
 
 
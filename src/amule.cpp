@@ -52,6 +52,8 @@
 #include "ClientCreditsList.h"		// Needed for CClientCreditsList
 #include "ClientList.h"			// Needed for CClientList
 #include "ClientUDPSocket.h"		// Needed for CClientUDPSocket & CMuleUDPSocket
+#include "DownloadBufferPool.h"		// Needed for CDownloadBufferPool
+#include "FileIOBatch.h"		// Needed for CFileIOBatch
 #include "ExternalConn.h"		// Needed for ExternalConn & MuleConnection
 #include <common/FileFunctions.h>	// Needed for CDirIterator
 #include "FriendList.h"			// Needed for CFriendList
@@ -74,10 +76,15 @@
 #include "Statistics.h"			// Needed for CStatistics
 #include "TerminationProcessAmuleweb.h"	// Needed for CTerminationProcessAmuleweb
 #include "ThreadTasks.h"
+#include "PartFileWriteThread.h"
 #include "UploadQueue.h"		// Needed for CUploadQueue
+#include "UploadBlockCache.h"		// Needed for CUploadBlockCache
+#include "SharedFileHandleCache.h"	// Needed for CSharedFileHandleCache
+#include "UploadCompressor.h"		// Needed for CUploadCompressor
 #include "UploadBandwidthThrottler.h"
 #include "UserEvents.h"
 #include "ScopedPtr.h"
+#include "updownclient.h"		// Needed for CUpDownClient::OnBlocksRead
 
 #ifdef ENABLE_UPNP
 #include "UPnPBase.h"			// Needed for UPnP
@@ -293,6 +300,9 @@ int CamuleApp::OnExit()
 
 	delete downloadqueue;
 	downloadqueue = NULL;
+	CDownloadBufferPool::Purge();
+	CUploadBlockCache::Clear();
+	CSharedFileHandleCache::Clear();
 
 	delete ipfilter;
 	ipfilter = NULL;
@@ -555,8 +565,19 @@ bool CamuleApp::OnInit()
 	// Log is confusing, because log entries from background will only be printed
 	// once foreground becomes idle, and that will only be after loading
 	// of the partfiles has finished.
+	CHashingTask::SetupLanes();
 	CThreadScheduler::Start();
 
+	// Buffered download data is written to disk by this thread.
+	CDownloadBufferPool::SetLimit(thePrefs::GetDownloadBufferPoolSize());
+	CUploadBlockCache::SetLimit(thePrefs::GetUploadBlockCacheSize());
+	CSharedFileHandleCache::SetLimit(thePrefs::GetSharedFileHandleCacheSize());
+	CPartFileWriteThread::Start();
+	CUploadCompressor::Start();
+	AddDebugLogLineN(logGeneral, CFileIOBatch::IsBatched()
+		? wxT("Using io_uring for batched file I/O.")
+		: wxT("Using regular file I/O."));
+
 	// These must be initialized after the gui is loaded.
 	if (thePrefs::GetNetworkED2K()) {
 		serverlist->Init();
@@ -1348,6 +1369,17 @@ void CamuleApp::OnFinishedAllocation(CAllocFinishedEvent& evt)
 	file->AllocationFinished();
 };
 
+void CamuleApp::OnFinishedPartFileFlush(CPartFileFlushedEvent& WXUNUSED(evt))
+{
+	CPartFileWriteThread::ProcessFinishedJobs();
+}
+
+void CamuleApp::OnFinishedFileIOBatch(CFileIOBatchEvent& evt)
+{
+	// Only the upload reads are batched on the main thread
+	CUpDownClient::OnBlocksRead(evt.GetBatch());
+}
+
 void CamuleApp::OnNotifyEvent(CMuleGUIEvent& evt)
 {
 #ifdef AMULE_DAEMON
@@ -1392,6 +1424,13 @@ void CamuleApp::ShutDown()
 	// Exit thread scheduler and upload thread
 	CThreadScheduler::Terminate();
 
+	AddDebugLogLineN(logGeneral, wxT("Terminate part-file write thread."));
+	CPartFileWriteThread::Terminate();
+	CFileIOBatch::Shutdown();
+
+	AddDebugLogLineN(logGeneral, wxT("Terminate upload compression threads."));
+	CUploadCompressor::Terminate();
+
 	AddDebugLogLineN(logGeneral, wxT("Terminate upload thread."));
 	uploadBandwidthThrottler->EndThread();
 
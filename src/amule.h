@@ -86,6 +86,8 @@ class CHashingEvent;
 class CMuleInternalEvent;
 class CCompletionEvent;
 class CAllocFinishedEvent;
+class CPartFileFlushedEvent;
+class CFileIOBatchEvent;
 class wxExecuteData;
 class CLoggingEvent;
 
@@ -336,6 +338,8 @@ protected:
 	void OnFinishedAICHHashing(CHashingEvent& evt);
 	void OnFinishedCompletion(CCompletionEvent& evt);
 	void OnFinishedAllocation(CAllocFinishedEvent& evt);
+	void OnFinishedPartFileFlush(CPartFileFlushedEvent& evt);
+	void OnFinishedFileIOBatch(CFileIOBatchEvent& evt);
 	void OnFinishedHTTPDownload(CMuleInternalEvent& evt);
 	void OnHashingShutdown(CMuleInternalEvent&);
 	void OnNotifyEvent(CMuleGUIEvent& evt);
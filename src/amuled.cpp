@@ -53,6 +53,8 @@
 #include <common/Format.h>
 #include "InternalEvents.h"		// Needed for wxEVT_*
 #include "ThreadTasks.h"
+#include "PartFileWriteThread.h"
+#include "FileIOBatch.h"
 #include "GuiEvents.h"			// Needed for EVT_MULE_NOTIFY
 #include "Timer.h"			// Needed for EVT_MULE_TIMER
 
@@ -114,6 +116,12 @@ BEGIN_EVENT_TABLE(CamuleDaemonApp, wxAppConsole)
 
 	// Disk space preallocation finished
 	EVT_MULE_ALLOC_FINISHED(CamuleDaemonApp::OnFinishedAllocation)
+
+	// Part-file write thread finished a flush
+	EVT_MULE_PARTFILE_FLUSHED(CamuleDaemonApp::OnFinishedPartFileFlush)
+
+	// Batched file I/O completed
+	EVT_MULE_FILEIO_BATCH(CamuleDaemonApp::OnFinishedFileIOBatch)
 END_EVENT_TABLE()
 
 IMPLEMENT_APP(CamuleDaemonApp)
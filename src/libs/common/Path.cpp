@@ -635,6 +635,27 @@ sint64 CPath::GetFreeSpaceAt(const CPath& path)
 }
 
 
+sint64 CPath::GetDeviceAt(const CPath& path)
+{
+	wxString filesystem = path.m_filesystem;
+	while (!filesystem.IsEmpty()) {
+		wxStructStat buf;
+		if (wxStat(filesystem, &buf) == 0) {
+			return buf.st_dev;
+		}
+
+		const wxString parent = ::wxPathOnly(filesystem);
+		if (parent == filesystem) {
+			break;
+		}
+
+		filesystem = parent;
+	}
+
+	return wxInvalidOffset;
+}
+
+
 wxString CPath::TruncatePath(size_t length, bool isFilePath) const
 {
 	wxString file = GetPrintable();
@@ -195,6 +195,12 @@ public:
 	static time_t GetModificationTime(const CPath& file);
 	/** Returns the free diskspace at the specified path, or wxInvalidOffset on failure. */
 	static sint64 GetFreeSpaceAt(const CPath& path);
+	/**
+	 * Returns the id of the device containing the specified path, or wxInvalidOffset on failure.
+	 *
+	 * If the path does not exist, the device of the closest existing parent directory is returned.
+	 */
+	static sint64 GetDeviceAt(const CPath& path);
 
 private:
 	//! Contains the printable filename, for use in the UI.
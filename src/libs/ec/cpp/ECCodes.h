@@ -173,6 +173,9 @@ enum ECTagNames {
 		EC_TAG_STATS_TOTAL_RECEIVED_BYTES         = 0x0219,
 		EC_TAG_STATS_SHARED_FILE_COUNT            = 0x021A,
 		EC_TAG_STATS_KAD_NODES                    = 0x021B,
+		EC_TAG_STATS_UL_CURRENT_RATE              = 0x021C,
+		EC_TAG_STATS_UL_TARGET_RATE               = 0x021D,
+		EC_TAG_STATS_UL_QUEUEING_DELAY            = 0x021E,
 	EC_TAG_PARTFILE                           = 0x0300,
 		EC_TAG_PARTFILE_NAME                      = 0x0301,
 		EC_TAG_PARTFILE_PARTMETID                 = 0x0302,
@@ -611,6 +614,9 @@ wxString GetDebugNameECTagNames(uint16 arg)
 		case 0x0219: return wxT("EC_TAG_STATS_TOTAL_RECEIVED_BYTES");
 		case 0x021A: return wxT("EC_TAG_STATS_SHARED_FILE_COUNT");
 		case 0x021B: return wxT("EC_TAG_STATS_KAD_NODES");
+		case 0x021C: return wxT("EC_TAG_STATS_UL_CURRENT_RATE");
+		case 0x021D: return wxT("EC_TAG_STATS_UL_TARGET_RATE");
+		case 0x021E: return wxT("EC_TAG_STATS_UL_QUEUEING_DELAY");
 		case 0x0300: return wxT("EC_TAG_PARTFILE");
 		case 0x0301: return wxT("EC_TAG_PARTFILE_NAME");
 		case 0x0302: return wxT("EC_TAG_PARTFILE_PARTMETID");
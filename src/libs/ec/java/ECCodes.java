@@ -161,6 +161,9 @@ public final static short 	EC_TAG_STATS_TOTAL_SENT_BYTES             = 0x0218;
 public final static short 	EC_TAG_STATS_TOTAL_RECEIVED_BYTES         = 0x0219;
 public final static short 	EC_TAG_STATS_SHARED_FILE_COUNT            = 0x021A;
 public final static short 	EC_TAG_STATS_KAD_NODES                    = 0x021B;
+public final static short 	EC_TAG_STATS_UL_CURRENT_RATE              = 0x021C;
+public final static short 	EC_TAG_STATS_UL_TARGET_RATE               = 0x021D;
+public final static short 	EC_TAG_STATS_UL_QUEUEING_DELAY            = 0x021E;
 public final static short EC_TAG_PARTFILE                           = 0x0300;
 public final static short 	EC_TAG_PARTFILE_NAME                      = 0x0301;
 public final static short 	EC_TAG_PARTFILE_PARTMETID                 = 0x0302;
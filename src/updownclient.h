@@ -37,17 +37,20 @@
 #include <ec/cpp/ECID.h>	// Needed for CECID
 #include "BitVector.h"		// Needed for BitVector
 #include "ClientRef.h"		// Needed for debug defines
+#include "Packet.h"		// Needed for CSharedPacketData
+#include "UploadCompressor.h"	// Needed for CUploadCompressor
 
 #include <map>
 
 
 class CPartFile;
 class CClientTCPSocket;
-class CPacket;
 class CFriend;
 class CKnownFile;
 class CMemFile;
 class CAICHHash;
+class CFileIOBatch;
+struct CUploadBlockReads;
 
 
 enum EChatCaptchaState {
@@ -192,7 +195,7 @@ public:
 	bool		IsBanned() const;
 	const wxString&	GetClientFilename() const	{ return m_clientFilename; }
 	uint16		GetUDPPort() const		{ return m_nUDPPort; }
-	void		SetUDPPort(uint16 nPort)	{ m_nUDPPort = nPort; }
+	void		SetUDPPort(uint16 nPort);
 	uint8		GetUDPVersion() const		{ return m_byUDPVer; }
 	uint8		GetExtendedRequestsVersion() const { return m_byExtendedRequestsVer; }
 	bool		IsFriend() const		{ return m_Friend != NULL; }
@@ -273,6 +276,8 @@ public:
 
 	void		AddReqBlock(Requested_Block_Struct* reqblock);
 	void		CreateNextBlockPackage();
+	//! Sends the blocks of a completed batch (see MULE_EVT_FILEIO_BATCH).
+	static void	OnBlocksRead(CFileIOBatch* batch);
 	void		SetUpStartTime()		{ m_dwUploadTime = ::GetTickCount(); }
 	void		SetWaitStartTime();
 	void		ClearWaitStartTime();
@@ -345,6 +350,13 @@ public:
 	bool		DeleteFileRequest(CPartFile* file);
 	void		DeleteAllFileRequests();
 	void		SendBlockRequests();
+	// Sends the block requests deferred while the download buffers were full
+	void		ResumeBlockRequests();
+	// Returns the request of the given block, if it was requested from this source
+	const Requested_Block_Struct* FindBlockRequest(uint64 start, uint64 end) const;
+	// Drops the request of a block completed by another source (end-game mode)
+	void		CancelBlockRequest(const Requested_Block_Struct* block);
+	bool		HasCancelledBlocks() const	{ return !m_cancelledBlocks.empty(); }
 	void		ProcessBlockPacket(const uint8_t* packet, uint32 size, bool packed, bool largeblocks);
 	uint16		GetAvailablePartCount() const;
 
@@ -690,8 +702,10 @@ private:
 	uint32		m_lastRefreshedDLDisplay;
 
 	//upload
-	void CreateStandardPackets(const unsigned char* data,uint32 togo, Requested_Block_Struct* currentblock);
-	void CreatePackedPackets(const unsigned char* data,uint32 togo, Requested_Block_Struct* currentblock);
+	void SendPendingBlocks();
+	void CreateBlockPackages(CUploadBlockReads& reads);
+	void CreateStandardPackets(const CSharedPacketData& data, const CSharedPacketFile& file, uint32 togo, Requested_Block_Struct* currentblock);
+	void CreatePackedPackets(const CSharedPacketData& packed, uint32 togo, Requested_Block_Struct* currentblock);
 	uint32 CalculateScoreInternal();
 
 	uint8		m_nUploadState;
@@ -715,6 +729,22 @@ private:
 	std::list<Requested_Block_Struct*>	m_BlockRequests_queue;
 	std::list<Requested_Block_Struct*>	m_DoneBlocks_list;
 
+	//! A block read for uploading, waiting to be compressed.
+	struct PendingBlock {
+		Requested_Block_Struct		block;
+		CSharedPacketData		data;
+		//! The file to send the block from instead of data, if any.
+		CSharedPacketFile		file;
+		//! The compressed data, empty if the block is sent uncompressed.
+		CSharedPacketData		packed;
+		//! The compression, empty if no longer running.
+		CUploadCompressor::JobPtr	job;
+	};
+	//! Blocks waiting to be compressed, in the order they are sent.
+	std::list<PendingBlock>	m_pendingBlocks;
+	//! Blocks being read, sent before any others.
+	CUploadBlockReads*	m_blockReads;
+
 	//download
 	bool		m_bRemoteQueueFull;
 	uint8		m_nDownloadState;
@@ -731,10 +761,18 @@ private:
 	bool		m_bReaskPending;
 	bool		m_bUDPPending;
 	bool		m_bHashsetRequested;
+	bool		m_bBlockRequestsDeferred;
 
 	std::list<Pending_Block_Struct*>	m_PendingBlocks_list;
 	std::list<Requested_Block_Struct*>	m_DownloadBlocks_list;
 
+	// Blocks which may still be sent after their request was cancelled
+	struct CancelledBlock {
+		uint64	start;
+		uint64	end;
+	};
+	std::list<CancelledBlock>		m_cancelledBlocks;
+
 	// download speed calculation
 	float		kBpsDown;
 	uint32		msReceivedPrev;
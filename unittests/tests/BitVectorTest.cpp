@@ -0,0 +1,114 @@
+#include <muleunit/test.h>
+
+#include <BitVector.h>
+
+#include <vector>
+
+using namespace muleunit;
+
+
+/** Small deterministic generator, so failures can be reproduced. */
+static uint32 NextRandom(uint32& seed)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 16) & 0x7fff;
+}
+
+
+/** Sets each bit with a chance of 1 in 'odds', starting from all bits set or not. */
+static void SetRandomBits(BitVector& bits, uint32 size, uint32 odds, bool initial, uint32& seed)
+{
+	bits.setsize(size, initial);
+	for (uint32 i = 0; i < size; ++i) {
+		bits.set(i, NextRandom(seed) % odds == 0);
+	}
+}
+
+
+DECLARE_SIMPLE(BitVector)
+
+
+TEST(BitVector, Empty)
+{
+	BitVector a;
+	BitVector b;
+	ASSERT_FALSE(a.Any());
+	ASSERT_EQUALS(0u, a.Count());
+	ASSERT_FALSE(a.Intersects(b));
+	ASSERT_FALSE(a.HasAnyNotIn(b));
+	ASSERT_FALSE(a.AllTrue());
+}
+
+
+TEST(BitVector, BitsPastTheSize)
+{
+	// All bytes are filled, including the bits past the size
+	BitVector a;
+	a.setsize(13, true);
+	a.set(3, false);
+	BitVector b;
+	b.setsize(13, true);
+	for (uint32 i = 0; i < 13; ++i) {
+		b.set(i, false);
+	}
+
+	ASSERT_EQUALS(12u, a.Count());
+	ASSERT_FALSE(b.Any());
+	ASSERT_FALSE(b.Intersects(a));
+	ASSERT_FALSE(b.HasAnyNotIn(a));
+	ASSERT_FALSE(a.AllTrue());
+	b.SetAllTrue();
+	ASSERT_TRUE(b.AllTrue());
+	ASSERT_EQUALS(13u, b.Count());
+
+	std::vector<uint32> visited;
+	a.ForEachSet([&](uint32 i) { visited.push_back(i); });
+	ASSERT_EQUALS(12u, (uint32)visited.size());
+	ASSERT_EQUALS(12u, visited.back());
+}
+
+
+TEST(BitVector, MatchesBitwise)
+{
+	uint32 seed = 3;
+	for (uint32 size = 1; size < 300; size += 1 + size / 16) {
+		for (unsigned round = 0; round < 20; ++round) {
+			BitVector a;
+			BitVector b;
+			// Sparse vectors, so most words are empty and the results vary
+			SetRandomBits(a, size, 1 + NextRandom(seed) % (2 * size), NextRandom(seed) % 2, seed);
+			SetRandomBits(b, size, 1 + NextRandom(seed) % 3, NextRandom(seed) % 2, seed);
+
+			uint32 count = 0;
+			bool intersects = false;
+			bool notIn = false;
+			std::vector<uint32> set;
+			for (uint32 i = 0; i < size; ++i) {
+				if (a.get(i)) {
+					++count;
+					set.push_back(i);
+					intersects |= b.get(i);
+					notIn |= !b.get(i);
+				}
+			}
+
+			ASSERT_EQUALS(count, a.Count());
+			ASSERT_EQUALS(count > 0, a.Any());
+			ASSERT_EQUALS(count == size, a.AllTrue());
+			ASSERT_EQUALS(intersects, a.Intersects(b));
+			ASSERT_EQUALS(notIn, a.HasAnyNotIn(b));
+
+			std::vector<uint32> visited;
+			a.ForEachSet([&](uint32 i) { visited.push_back(i); });
+			ASSERT_TRUE(set == visited);
+		}
+	}
+
+	// Vectors of different sizes have nothing in common
+	BitVector a;
+	a.setsize(9, true);
+	BitVector b;
+	b.setsize(10, true);
+	ASSERT_FALSE(a.Intersects(b));
+	ASSERT_FALSE(a.HasAnyNotIn(b));
+}
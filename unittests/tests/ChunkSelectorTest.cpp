@@ -0,0 +1,342 @@
+#include <muleunit/test.h>
+
+#include <ChunkSelector.h>
+
+#include <vector>
+
+using namespace muleunit;
+
+
+/** The state of a chunk, as the part file sees it. */
+struct TestChunk
+{
+	//! False if the chunk has nothing left to request.
+	bool	eligible;
+	CChunkSelector::ChunkInfo	info;
+};
+
+
+/** Small deterministic generator, so failures can be reproduced. */
+static uint32 NextRandom(uint32& seed)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 16) & 0x7fff;
+}
+
+
+/**
+ * The chunk selection CPartFile::GetNextRequestedBlock did before chunks
+ * were indexed, kept as it was except for taking the criteria from the
+ * test chunks instead of the part file.
+ *
+ * Ranks all eligible chunks, and returns the ranks of all chunks (NONE if
+ * not eligible) and the chunks a source having the available ones could
+ * be sent to, i.e. those the random pick chose from.
+ */
+static std::vector<uint16> BaselineScan(const std::vector<TestChunk>& chunks, const std::vector<bool>& available,
+	uint16 veryRareBound, uint16 rareBound, std::vector<uint16>& ranks)
+{
+	struct Chunk
+	{
+		uint16 part;
+		uint16 frequency;
+		uint16 rank;
+	};
+	typedef std::vector<Chunk> ChunkList;
+
+	ranks.assign(chunks.size(), CChunkSelector::NONE);
+	ChunkList chunksList;
+	for (uint16 i = 0; i < chunks.size(); ++i) {
+		if (chunks[i].eligible) {
+			Chunk newEntry;
+			newEntry.part = i;
+			newEntry.frequency = chunks[i].info.frequency;
+			chunksList.push_back(newEntry);
+		}
+	}
+
+	// Collect and calculate criteria for all chunks
+	for (ChunkList::iterator it = chunksList.begin(); it != chunksList.end(); ++it) {
+		Chunk& cur_chunk = *it;
+		const CChunkSelector::ChunkInfo& info = chunks[cur_chunk.part].info;
+
+		// Criterion 2. Parts used for preview
+		const bool critPreview = info.preview;
+
+		// Criterion 3. Request state (downloading in process from other source(s))
+		const bool critRequested =
+			cur_chunk.frequency > veryRareBound &&
+			info.requested;
+
+		// Criterion 4. Completion
+		const uint16 critCompletion = info.completion;
+
+		// Calculate priority with all criteria
+		if(cur_chunk.frequency <= veryRareBound) {
+			// 0..xxxx unrequested + requested very rare chunks
+			cur_chunk.rank = (25 * cur_chunk.frequency) + // Criterion 1
+			((critPreview == true) ? 0 : 1) + // Criterion 2
+			(100 - critCompletion); // Criterion 4
+		} else if(critPreview == true) {
+			// 10000..10100  unrequested preview chunks
+			// 30000..30100  requested preview chunks
+			cur_chunk.rank = ((critRequested == false) ? 10000 : 30000) + // Criterion 3
+			(100 - critCompletion); // Criterion 4
+		} else if(cur_chunk.frequency <= rareBound) {
+			// 10101..1xxxx  unrequested rare chunks
+			// 30101..3xxxx  requested rare chunks
+			cur_chunk.rank = (25 * cur_chunk.frequency) +                 // Criterion 1
+			((critRequested == false) ? 10101 : 30101) + // Criterion 3
+			(100 - critCompletion); // Criterion 4
+		} else {
+			// common chunk
+			if(critRequested == false) { // Criterion 3
+				// 20000..2xxxx  unrequested common chunks
+				cur_chunk.rank = 20000 + // Criterion 3
+				(100 - critCompletion); // Criterion 4
+			} else {
+				// 40000..4xxxx  requested common chunks
+				cur_chunk.rank = 40000 + // Criterion 3
+				(critCompletion); // Criterion 4
+			}
+		}
+
+		ranks[cur_chunk.part] = cur_chunk.rank;
+	}
+
+	// Only the chunks the source has were listed
+	ChunkList sourceList;
+	for (ChunkList::const_iterator it = chunksList.begin(); it != chunksList.end(); ++it) {
+		if (available[it->part]) {
+			sourceList.push_back(*it);
+		}
+	}
+
+	// Find and count the chunk(s) with the highest priority
+	uint16 chunkCount = 0; // Number of found chunks with same priority
+	uint16 rank = 0xffff; // Highest priority found
+	for (ChunkList::iterator it = sourceList.begin(); it != sourceList.end(); ++it) {
+		const Chunk& cur_chunk = *it;
+		if(cur_chunk.rank < rank) {
+			chunkCount = 1;
+			rank = cur_chunk.rank;
+		} else if(cur_chunk.rank == rank) {
+			++chunkCount;
+		}
+	}
+
+	// The chunk picked for each of the random values
+	std::vector<uint16> candidates;
+	for (uint16 random = 1; random <= chunkCount; ++random) {
+		uint16 randomness = random;
+		for (ChunkList::iterator it = sourceList.begin(); it != sourceList.end(); ++it) {
+			const Chunk& cur_chunk = *it;
+			if(cur_chunk.rank == rank) {
+				randomness--;
+				if(randomness == 0) {
+					candidates.push_back(cur_chunk.part);
+					break;
+				}
+			}
+		}
+	}
+
+	return candidates;
+}
+
+
+static void SetRandomChunk(TestChunk& chunk, uint32& seed)
+{
+	chunk.eligible = NextRandom(seed) % 4 != 0;
+	chunk.info.frequency = NextRandom(seed) % 12;
+	chunk.info.completion = NextRandom(seed) % 101;
+	chunk.info.preview = NextRandom(seed) % 8 == 0;
+	chunk.info.requested = NextRandom(seed) % 3 == 0;
+}
+
+
+DECLARE_SIMPLE(ChunkSelector)
+
+
+TEST(ChunkSelector, Rank)
+{
+	CChunkSelector::ChunkInfo info = { 2, 40, false, true };
+
+	// Very rare, requested or not
+	ASSERT_EQUALS(25 * 2 + 1 + 60, CChunkSelector::GetRank(info, 2, 4));
+	info.preview = true;
+	ASSERT_EQUALS(25 * 2 + 60, CChunkSelector::GetRank(info, 2, 4));
+
+	// Preview
+	ASSERT_EQUALS(30000 + 60, CChunkSelector::GetRank(info, 1, 2));
+	info.requested = false;
+	ASSERT_EQUALS(10000 + 60, CChunkSelector::GetRank(info, 1, 2));
+
+	// Rare
+	info.preview = false;
+	ASSERT_EQUALS(25 * 2 + 10101 + 60, CChunkSelector::GetRank(info, 1, 2));
+	info.requested = true;
+	ASSERT_EQUALS(25 * 2 + 30101 + 60, CChunkSelector::GetRank(info, 1, 2));
+
+	// Common, the completion counts the other way round once requested
+	ASSERT_EQUALS(40000 + 40, CChunkSelector::GetRank(info, 0, 1));
+	info.requested = false;
+	ASSERT_EQUALS(20000 + 60, CChunkSelector::GetRank(info, 0, 1));
+}
+
+
+TEST(ChunkSelector, RankAtZoneBounds)
+{
+	// Ranks of the former full scan with the bounds of 60 sources,
+	// i.e. frequencies up to 6 very rare and up to 12 rare.
+	struct {
+		CChunkSelector::ChunkInfo info;
+		uint16 rank;
+	} const expected[] = {
+		{ {  0,   0, false, false },   101 },
+		{ {  6,   0, false, true  },   251 },
+		{ {  6, 100, true,  true  },   150 },
+		{ {  7,   0, false, false }, 10376 },
+		{ {  7,   0, false, true  }, 30376 },
+		{ {  7, 100, true,  false }, 10000 },
+		{ {  7,   0, true,  true  }, 30100 },
+		{ { 12,  50, false, false }, 10451 },
+		{ { 12,  50, false, true  }, 30451 },
+		{ { 13,   0, false, false }, 20100 },
+		{ { 13, 100, false, false }, 20000 },
+		{ { 13,   0, false, true  }, 40000 },
+		{ { 13, 100, false, true  }, 40100 },
+		{ { 13, 100, true,  true  }, 30000 },
+	};
+
+	for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); ++i) {
+		ASSERT_EQUALS(expected[i].rank, CChunkSelector::GetRank(expected[i].info, 6, 12));
+	}
+}
+
+
+TEST(ChunkSelector, Select)
+{
+	const uint16 partCount = 8;
+	std::vector<TestChunk> chunks(partCount);
+	for (uint16 part = 0; part < partCount; ++part) {
+		TestChunk chunk = { true, { 10, 0, false, false } };
+		chunks[part] = chunk;
+	}
+	// Two chunks share the highest priority
+	chunks[2].info.completion = 50;
+	chunks[5].info.completion = 50;
+	chunks[6].eligible = false;
+	chunks[6].info.completion = 90;
+
+	CChunkSelector selector;
+	selector.SetPartCount(partCount);
+	selector.SetBounds(1, 2);
+	selector.Refresh([&](uint16 part, CChunkSelector::ChunkInfo& info) {
+		info = chunks[part].info;
+		return chunks[part].eligible;
+	});
+	ASSERT_EQUALS(CChunkSelector::NONE, selector.GetRank(6));
+
+	std::vector<bool> available(partCount, true);
+	auto isAvailable = [&](uint16 part) { return (bool)available[part]; };
+
+	// Ties are broken by where the random start falls, wrapping around
+	ASSERT_EQUALS(2, selector.Select(isAvailable, 0));
+	ASSERT_EQUALS(2, selector.Select(isAvailable, 2));
+	ASSERT_EQUALS(5, selector.Select(isAvailable, 3));
+	ASSERT_EQUALS(5, selector.Select(isAvailable, 5));
+	ASSERT_EQUALS(2, selector.Select(isAvailable, 6));
+	ASSERT_EQUALS(2, selector.Select(isAvailable, partCount + 1));
+
+	// Only chunks the source has
+	available[2] = false;
+	ASSERT_EQUALS(5, selector.Select(isAvailable, 0));
+	available[5] = false;
+	ASSERT_EQUALS(0, selector.Select(isAvailable, 0));
+
+	// Changes are only seen once invalidated
+	chunks[6].eligible = true;
+	selector.Refresh([&](uint16 part, CChunkSelector::ChunkInfo& info) {
+		info = chunks[part].info;
+		return chunks[part].eligible;
+	});
+	ASSERT_EQUALS(0, selector.Select(isAvailable, 0));
+	selector.Invalidate(6);
+	selector.Refresh([&](uint16 part, CChunkSelector::ChunkInfo& info) {
+		info = chunks[part].info;
+		return chunks[part].eligible;
+	});
+	ASSERT_EQUALS(6, selector.Select(isAvailable, 0));
+
+	// Nothing to select
+	available.assign(partCount, false);
+	ASSERT_EQUALS(CChunkSelector::NONE, selector.Select(isAvailable, 0));
+}
+
+
+TEST(ChunkSelector, MatchesFullScan)
+{
+	uint32 seed = 42;
+	const uint16 partCount = 60;
+	std::vector<TestChunk> chunks(partCount);
+	for (uint16 part = 0; part < partCount; ++part) {
+		SetRandomChunk(chunks[part], seed);
+	}
+
+	CChunkSelector selector;
+	selector.SetPartCount(partCount);
+	uint16 veryRareBound = 1;
+	uint16 rareBound = 2;
+
+	for (unsigned round = 0; round < 500; ++round) {
+		// Change a few chunks, as sources come and go and blocks are received
+		const unsigned changes = NextRandom(seed) % 5;
+		for (unsigned i = 0; i < changes; ++i) {
+			const uint16 part = NextRandom(seed) % partCount;
+			SetRandomChunk(chunks[part], seed);
+			selector.Invalidate(part);
+		}
+		// And now and then the number of sources
+		if (NextRandom(seed) % 20 == 0) {
+			veryRareBound = 1 + NextRandom(seed) % 4;
+			rareBound = 2 * veryRareBound;
+		}
+		selector.SetBounds(veryRareBound, rareBound);
+
+		unsigned evaluated = 0;
+		selector.Refresh([&](uint16 part, CChunkSelector::ChunkInfo& info) {
+			++evaluated;
+			info = chunks[part].info;
+			return chunks[part].eligible;
+		});
+		ASSERT_TRUE(evaluated <= partCount);
+
+		// A source with some of the chunks
+		std::vector<bool> available(partCount);
+		for (uint16 part = 0; part < partCount; ++part) {
+			available[part] = NextRandom(seed) % 3 != 0;
+		}
+		auto isAvailable = [&](uint16 part) { return (bool)available[part]; };
+
+		std::vector<uint16> ranks;
+		const std::vector<uint16> candidates = BaselineScan(chunks, available, veryRareBound, rareBound, ranks);
+		for (uint16 part = 0; part < partCount; ++part) {
+			ASSERT_EQUALS(ranks[part], selector.GetRank(part));
+		}
+
+		const uint16 selected = selector.Select(isAvailable, NextRandom(seed));
+		if (candidates.empty()) {
+			ASSERT_EQUALS(CChunkSelector::NONE, selected);
+			continue;
+		}
+
+		bool found = false;
+		for (std::vector<uint16>::const_iterator it = candidates.begin(); it != candidates.end(); ++it) {
+			found |= (*it == selected);
+			// Each of the candidates can be selected
+			ASSERT_EQUALS(*it, selector.Select(isAvailable, *it));
+		}
+		ASSERT_TRUE(found);
+	}
+}
@@ -0,0 +1,141 @@
+#include <muleunit/test.h>
+
+#include <DownloadBufferPool.h>
+
+using namespace muleunit;
+
+
+/** Returns the current statistics of the pool. */
+static CDownloadBufferPool::Stats GetStats()
+{
+	CDownloadBufferPool::Stats stats;
+	CDownloadBufferPool::GetStats(stats);
+
+	return stats;
+}
+
+
+DECLARE_SIMPLE(DownloadBufferPool)
+
+
+TEST(DownloadBufferPool, Reuse)
+{
+	CDownloadBufferPool::SetLimit(0);
+	CDownloadBufferPool::Purge();
+	const CDownloadBufferPool::Stats before = GetStats();
+
+	// The usual payload of a block packet
+	uint8_t* buffer = CDownloadBufferPool::Allocate(10240);
+	ASSERT_EQUALS(before.used + 10240, GetStats().used);
+	CDownloadBufferPool::Free(buffer, 10240);
+	ASSERT_EQUALS(before.used, GetStats().used);
+	ASSERT_EQUALS(10240u, GetStats().cached);
+
+	// Sizes of the same class share buffers
+	uint8_t* reused = CDownloadBufferPool::Allocate(10000);
+	ASSERT_TRUE(reused == buffer);
+	ASSERT_EQUALS(before.reused + 1, GetStats().reused);
+	ASSERT_EQUALS(0u, GetStats().cached);
+
+	// Other classes don't
+	uint8_t* other = CDownloadBufferPool::Allocate(8192);
+	ASSERT_EQUALS(before.reused + 1, GetStats().reused);
+	ASSERT_EQUALS(before.allocations + 3, GetStats().allocations);
+
+	CDownloadBufferPool::Free(reused, 10000);
+	CDownloadBufferPool::Free(other, 8192);
+
+	// Buffers too large for any class are never cached
+	uint8_t* large = CDownloadBufferPool::Allocate(1024 * 1024);
+	CDownloadBufferPool::Free(large, 1024 * 1024);
+	ASSERT_EQUALS(10240u + 8192u, GetStats().cached);
+
+	CDownloadBufferPool::Purge();
+	ASSERT_EQUALS(0u, GetStats().cached);
+	ASSERT_EQUALS(before.used, GetStats().used);
+}
+
+
+TEST(DownloadBufferPool, Throttling)
+{
+	const size_t size = 16 * 1024;
+	const unsigned count = 64;
+
+	CDownloadBufferPool::SetLimit(count * size);
+	const CDownloadBufferPool::Stats before = GetStats();
+
+	uint8_t* buffers[count + 1];
+	for (unsigned i = 0; i < count; ++i) {
+		buffers[i] = CDownloadBufferPool::Allocate(size);
+		ASSERT_FALSE(CDownloadBufferPool::IsThrottling());
+	}
+
+	// The limit is exceeded by the next buffer
+	buffers[count] = CDownloadBufferPool::Allocate(size);
+	ASSERT_TRUE(CDownloadBufferPool::IsThrottling());
+	ASSERT_EQUALS(before.throttled + 1, GetStats().throttled);
+	ASSERT_EQUALS((uint64)(count / 4 + 1) * size, CDownloadBufferPool::GetExcess());
+
+	// Throttling continues until usage drops to three quarters of the limit
+	for (unsigned i = 0; i < count / 4; ++i) {
+		CDownloadBufferPool::Free(buffers[count - i], size);
+		ASSERT_TRUE(CDownloadBufferPool::IsThrottling());
+	}
+
+	CDownloadBufferPool::Free(buffers[count - count / 4], size);
+	ASSERT_FALSE(CDownloadBufferPool::IsThrottling());
+	ASSERT_EQUALS(0u, CDownloadBufferPool::GetExcess());
+
+	for (unsigned i = 0; i < count - count / 4; ++i) {
+		CDownloadBufferPool::Free(buffers[i], size);
+	}
+
+	// The free lists are bounded by a quarter of the limit
+	ASSERT_TRUE(GetStats().cached <= count * size / 4);
+	ASSERT_EQUALS(before.used, GetStats().used);
+
+	CDownloadBufferPool::SetLimit(0);
+	CDownloadBufferPool::Purge();
+}
+
+
+TEST(DownloadBufferPool, Parked)
+{
+	const size_t size = 16 * 1024;
+	const unsigned count = 64;
+
+	CDownloadBufferPool::SetLimit(count * size);
+	const CDownloadBufferPool::Stats before = GetStats();
+
+	// Parked data counts towards the limit, up to a quarter of it
+	ASSERT_TRUE(CDownloadBufferPool::ReserveParked(count / 4 * size));
+	ASSERT_EQUALS(before.used + count / 4 * size, GetStats().used);
+	ASSERT_EQUALS(before.parked + count / 4 * size, GetStats().parked);
+	ASSERT_FALSE(CDownloadBufferPool::ReserveParked(1));
+	ASSERT_EQUALS(before.parked + count / 4 * size, GetStats().parked);
+
+	// So throttling starts with fewer buffers
+	const unsigned buffered = count - count / 4 + 1;
+	uint8_t* buffers[buffered];
+	for (unsigned i = 0; i < buffered - 1; ++i) {
+		buffers[i] = CDownloadBufferPool::Allocate(size);
+	}
+	ASSERT_FALSE(CDownloadBufferPool::IsThrottling());
+	buffers[buffered - 1] = CDownloadBufferPool::Allocate(size);
+	ASSERT_TRUE(CDownloadBufferPool::IsThrottling());
+
+	// And ends once parked data and buffers are released
+	CDownloadBufferPool::ReleaseParked(count / 4 * size);
+	ASSERT_EQUALS(before.parked, GetStats().parked);
+	ASSERT_TRUE(CDownloadBufferPool::IsThrottling());
+	CDownloadBufferPool::Free(buffers[buffered - 1], size);
+	ASSERT_FALSE(CDownloadBufferPool::IsThrottling());
+
+	for (unsigned i = 0; i < buffered - 1; ++i) {
+		CDownloadBufferPool::Free(buffers[i], size);
+	}
+	ASSERT_EQUALS(before.used, GetStats().used);
+
+	CDownloadBufferPool::SetLimit(0);
+	CDownloadBufferPool::Purge();
+}
@@ -0,0 +1,175 @@
+#include <muleunit/test.h>
+
+#include <DownloadQueueIndex.h>
+
+#include <vector>
+
+using namespace muleunit;
+
+
+/** Returns a distinct hash for each value. */
+static CMD4Hash GetTestHash(unsigned value)
+{
+	CMD4Hash hash;
+	for (unsigned i = 0; i < MD4HASH_LENGTH; ++i) {
+		hash[i] = (unsigned char)(value * 31 + i * 7 + value / 256);
+	}
+
+	return hash;
+}
+
+
+/** The state of a source, as the download queue sees it. */
+struct TestSource
+{
+	uint32	ip;
+	uint16	port;
+	//! The number of files the client is a source of.
+	uint32	files;
+};
+
+
+DECLARE_SIMPLE(DownloadQueueIndex)
+
+
+TEST(DownloadQueueIndex, Files)
+{
+	// Only used as keys, never dereferenced
+	char storage[3];
+	CPartFile* files[3];
+	for (unsigned i = 0; i < 3; ++i) {
+		files[i] = reinterpret_cast<CPartFile*>(&storage[i]);
+	}
+
+	CDownloadQueueIndex index;
+	index.AddFile(files[0], GetTestHash(0));
+	index.AddFile(files[1], GetTestHash(1));
+	ASSERT_EQUALS(2u, index.GetFileCount());
+	ASSERT_TRUE(index.GetFile(GetTestHash(0)) == files[0]);
+	ASSERT_TRUE(index.GetFile(GetTestHash(1)) == files[1]);
+	ASSERT_TRUE(index.GetFile(GetTestHash(2)) == NULL);
+
+	// A file with the same hash takes the place of the other
+	index.AddFile(files[2], GetTestHash(0));
+	ASSERT_EQUALS(2u, index.GetFileCount());
+	ASSERT_TRUE(index.GetFile(GetTestHash(0)) == files[2]);
+
+	// Which isn't removed with the file it replaced
+	index.RemoveFile(files[0], GetTestHash(0));
+	ASSERT_TRUE(index.GetFile(GetTestHash(0)) == files[2]);
+	index.RemoveFile(files[2], GetTestHash(0));
+	ASSERT_TRUE(index.GetFile(GetTestHash(0)) == NULL);
+	ASSERT_EQUALS(1u, index.GetFileCount());
+
+	index.Clear();
+	ASSERT_EQUALS(0u, index.GetFileCount());
+	ASSERT_TRUE(index.GetFile(GetTestHash(1)) == NULL);
+}
+
+
+TEST(DownloadQueueIndex, Sources)
+{
+	char storage[2];
+	CUpDownClient* first = reinterpret_cast<CUpDownClient*>(&storage[0]);
+	CUpDownClient* second = reinterpret_cast<CUpDownClient*>(&storage[1]);
+
+	CDownloadQueueIndex index;
+	index.AddSource(first, 0x01020304, 4672);
+	ASSERT_TRUE(index.GetSource(0x01020304, 4672) == first);
+	ASSERT_TRUE(index.GetSource(0x01020304, 4673) == NULL);
+	ASSERT_TRUE(index.GetSource(0x01020305, 4672) == NULL);
+
+	// A source of two files stays until removed from both
+	index.AddSource(first, 0x01020304, 4672);
+	ASSERT_EQUALS(1u, index.GetSourceCount());
+	index.RemoveSource(first);
+	ASSERT_TRUE(index.GetSource(0x01020304, 4672) == first);
+	index.RemoveSource(first);
+	ASSERT_TRUE(index.GetSource(0x01020304, 4672) == NULL);
+	ASSERT_EQUALS(0u, index.GetSourceCount());
+
+	// Clients that aren't sources aren't indexed when they change
+	index.UpdateSource(first, 0x01020304, 4672);
+	ASSERT_TRUE(index.GetSource(0x01020304, 4672) == NULL);
+	index.RemoveSource(first);
+
+	// Sources are found by their new endpoint only
+	index.AddSource(first, 0x01020304, 0);
+	index.UpdateSource(first, 0x01020304, 4672);
+	ASSERT_TRUE(index.GetSource(0x01020304, 0) == NULL);
+	ASSERT_TRUE(index.GetSource(0x01020304, 4672) == first);
+
+	// Two sources on the same endpoint
+	index.AddSource(second, 0x01020304, 4672);
+	index.RemoveSource(first);
+	ASSERT_TRUE(index.GetSource(0x01020304, 4672) == second);
+}
+
+
+TEST(DownloadQueueIndex, Consistency)
+{
+	// Random changes to the sources, after each of which the index has to
+	// find the same sources as a search through all of them.
+	const unsigned count = 64;
+	std::vector<char> storage(count);
+	std::vector<TestSource> sources(count);
+	CDownloadQueueIndex index;
+
+	uint32 seed = 12345;
+	for (unsigned step = 0; step < 20000; ++step) {
+		seed = seed * 1103515245 + 12345;
+		const unsigned i = (seed >> 8) % count;
+		CUpDownClient* client = reinterpret_cast<CUpDownClient*>(&storage[i]);
+		TestSource& source = sources[i];
+		// Few endpoints, so that they are shared now and then
+		const uint32 ip = (seed >> 16) % 8;
+		const uint16 port = (seed >> 20) % 4;
+
+		switch ((seed >> 24) % 4) {
+			case 0:
+				if (!source.files) {
+					source.ip = ip;
+					source.port = port;
+				}
+				index.AddSource(client, source.ip, source.port);
+				++source.files;
+				break;
+			case 1:
+				if (source.files) {
+					index.RemoveSource(client);
+					--source.files;
+				}
+				break;
+			case 2:
+				index.UpdateSource(client, ip, source.port);
+				source.ip = ip;
+				break;
+			default:
+				index.UpdateSource(client, source.ip, port);
+				source.port = port;
+				break;
+		}
+
+		unsigned indexed = 0;
+		for (unsigned j = 0; j < count; ++j) {
+			indexed += sources[j].files ? 1 : 0;
+		}
+		ASSERT_EQUALS(indexed, index.GetSourceCount());
+
+		for (uint32 queryIP = 0; queryIP < 8; ++queryIP) {
+			for (uint16 queryPort = 0; queryPort < 4; ++queryPort) {
+				const CUpDownClient* found = index.GetSource(queryIP, queryPort);
+				if (found) {
+					const TestSource& foundSource = sources[reinterpret_cast<const char*>(found) - &storage[0]];
+					ASSERT_TRUE(foundSource.files > 0);
+					ASSERT_EQUALS(queryIP, foundSource.ip);
+					ASSERT_EQUALS(queryPort, foundSource.port);
+				} else {
+					for (unsigned j = 0; j < count; ++j) {
+						ASSERT_FALSE(sources[j].files && sources[j].ip == queryIP && sources[j].port == queryPort);
+					}
+				}
+			}
+		}
+	}
+}
@@ -0,0 +1,190 @@
+#include <muleunit/test.h>
+
+#include <EndGame.h>
+#include <protocol/ed2k/Constants.h>
+
+using namespace muleunit;
+
+
+static CEndGame::Candidate MakeCandidate(uint64 start, uint32 requests, uint32 transferred)
+{
+	CEndGame::Candidate candidate = { start, start + 999, requests, transferred };
+	return candidate;
+}
+
+
+DECLARE_SIMPLE(EndGame)
+
+
+TEST(EndGame, SelectBlocks)
+{
+	std::vector<CEndGame::Candidate> candidates;
+	candidates.push_back(MakeCandidate(0, 2, 0));
+	candidates.push_back(MakeCandidate(1000, 1, 500));
+	candidates.push_back(MakeCandidate(2000, 3, 0));
+	candidates.push_back(MakeCandidate(3000, 1, 100));
+	candidates.push_back(MakeCandidate(4000, 1, 100));
+
+	// Fewest requests first, then least progress, keeping the order of ties
+	CEndGame::SelectBlocks(candidates, 10);
+	ASSERT_EQUALS(4u, candidates.size());
+	ASSERT_EQUALS(3000u, candidates[0].start);
+	ASSERT_EQUALS(4000u, candidates[1].start);
+	ASSERT_EQUALS(1000u, candidates[2].start);
+	ASSERT_EQUALS(0u, candidates[3].start);
+
+	CEndGame::SelectBlocks(candidates, 2);
+	ASSERT_EQUALS(2u, candidates.size());
+	ASSERT_EQUALS(3000u, candidates[0].start);
+	ASSERT_EQUALS(4000u, candidates[1].start);
+
+	// Blocks requested the most times allowed are never selected
+	candidates.clear();
+	candidates.push_back(MakeCandidate(0, 3, 0));
+	CEndGame::SelectBlocks(candidates, 10);
+	ASSERT_TRUE(candidates.empty());
+}
+
+
+TEST(EndGame, EstimateDelay)
+{
+	ASSERT_EQUALS(2000u, CEndGame::EstimateDelay(20000, 10000));
+	ASSERT_EQUALS(0u, CEndGame::EstimateDelay(0, 10000));
+	// Stalled and slow sources are dropped after the download timeout
+	ASSERT_EQUALS((uint32)DOWNLOADTIMEOUT, CEndGame::EstimateDelay(20000, 0));
+	ASSERT_EQUALS((uint32)DOWNLOADTIMEOUT, CEndGame::EstimateDelay(150, 1));
+}
+
+
+TEST(EndGame, Stats)
+{
+	CEndGame::Stats before;
+	CEndGame::GetStats(before);
+
+	CEndGame::AddDuplicated(3);
+	CEndGame::AddWon(1500);
+	CEndGame::AddWon(500);
+	CEndGame::AddWasted(10240);
+
+	CEndGame::Stats after;
+	CEndGame::GetStats(after);
+	ASSERT_EQUALS(before.duplicated + 3, after.duplicated);
+	ASSERT_EQUALS(before.won + 2, after.won);
+	ASSERT_EQUALS(before.saved + 2000, after.saved);
+	ASSERT_EQUALS(before.wasted + 10240, after.wasted);
+}
+
+
+TEST(EndGame, FirstCopyWins)
+{
+	CEndGameRequests requests;
+	int first, copy;
+
+	CEndGame::Stats before;
+	CEndGame::GetStats(before);
+
+	// Data of incomplete ranges is written, of complete ones dropped
+	ASSERT_TRUE(requests.Receive(false, 1000));
+	ASSERT_FALSE(requests.Receive(true, 1000));
+
+	// Duplicated packets aren't counted unless blocks are requested twice
+	CEndGame::Stats after;
+	CEndGame::GetStats(after);
+	ASSERT_EQUALS(before.wasted, after.wasted);
+
+	requests.Add(&copy);
+	ASSERT_TRUE(requests.IsActive());
+	ASSERT_TRUE(requests.IsDuplicate(&copy));
+	ASSERT_FALSE(requests.IsDuplicate(&first));
+
+	// The first copy is written, the data of the other one is wasted
+	ASSERT_TRUE(requests.Receive(false, 1000));
+	ASSERT_FALSE(requests.Receive(true, 800));
+	ASSERT_FALSE(requests.Receive(true, 200));
+	CEndGame::GetStats(after);
+	ASSERT_EQUALS(before.wasted + 1000, after.wasted);
+}
+
+
+TEST(EndGame, Complete)
+{
+	CEndGameRequests requests;
+	int first, copy, other;
+	requests.Add(&copy);
+	requests.Add(&other);
+
+	CEndGame::Stats before;
+	CEndGame::GetStats(before);
+
+	// Completed by the first request, all copies are cancelled
+	std::vector<CEndGameRequests::Request> others;
+	CEndGameRequests::Request request = { &first, 0, 10000 };
+	others.push_back(request);
+	request.request = &copy;
+	request.remaining = 5000;
+	others.push_back(request);
+	request.request = &other;
+	others.push_back(request);
+
+	std::vector<size_t> cancelled = requests.Complete(&first, others);
+	ASSERT_EQUALS(2u, cancelled.size());
+	ASSERT_EQUALS(1u, cancelled[0]);
+	ASSERT_EQUALS(2u, cancelled[1]);
+
+	CEndGame::Stats after;
+	CEndGame::GetStats(after);
+	ASSERT_EQUALS(before.won, after.won);
+
+	// Nor is anything won if neither request was made in end-game mode
+	int second;
+	std::vector<CEndGameRequests::Request> firsts(1, others[0]);
+	cancelled = requests.Complete(&second, firsts);
+	ASSERT_EQUALS(1u, cancelled.size());
+	CEndGame::GetStats(after);
+	ASSERT_EQUALS(before.won, after.won);
+
+	// Completed by a copy, the first request and the other copy are
+	// cancelled, and the time the first one still needed is saved
+	others[0].remaining = 20000;
+	cancelled = requests.Complete(&copy, others);
+	ASSERT_EQUALS(2u, cancelled.size());
+	ASSERT_EQUALS(0u, cancelled[0]);
+	ASSERT_EQUALS(2u, cancelled[1]);
+	CEndGame::GetStats(after);
+	ASSERT_EQUALS(before.won + 1, after.won);
+	ASSERT_EQUALS(before.saved + 2000, after.saved);
+
+	// Once the first request is gone, a copy winning saves nothing
+	others.erase(others.begin());
+	cancelled = requests.Complete(&other, others);
+	ASSERT_EQUALS(1u, cancelled.size());
+	ASSERT_EQUALS(0u, cancelled[0]);
+	CEndGame::GetStats(after);
+	ASSERT_EQUALS(before.won + 1, after.won);
+}
+
+
+TEST(EndGame, RemoveOneCopy)
+{
+	CEndGameRequests requests;
+	int copy, other;
+	requests.Add(&copy);
+	requests.Add(&other);
+
+	// Removing a request keeps the other requests of the block
+	requests.Remove(&copy);
+	ASSERT_FALSE(requests.IsDuplicate(&copy));
+	ASSERT_TRUE(requests.IsDuplicate(&other));
+	ASSERT_TRUE(requests.IsActive());
+
+	requests.Remove(&copy);
+	ASSERT_TRUE(requests.IsDuplicate(&other));
+
+	requests.Remove(&other);
+	ASSERT_FALSE(requests.IsActive());
+
+	requests.Add(&copy);
+	requests.Add(&other);
+	requests.Clear();
+	ASSERT_FALSE(requests.IsActive());
+}
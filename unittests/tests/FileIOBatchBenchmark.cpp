@@ -0,0 +1,85 @@
+#include <muleunit/test.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <wx/stopwatch.h>
+
+#include <CFile.h>
+#include <FileIOBatch.h>
+
+using namespace muleunit;
+
+
+//! The file used by the benchmark.
+static const CPath s_testFile(wxT("FileIOBatchBenchmark.dat"));
+
+
+/** Returns the 99th percentile of the given samples. */
+static long long GetPercentile99(std::vector<long long> samples)
+{
+	std::sort(samples.begin(), samples.end());
+
+	return samples[samples.size() * 99 / 100];
+}
+
+
+DECLARE_SIMPLE(FileIOBatch)
+
+
+TEST(FileIOBatch, Throughput)
+{
+	// Batched writes against one write per run, as done by the write
+	// thread without io_uring.
+	const unsigned flushes = 100;
+	const unsigned runs = 16;
+	const size_t runSize = 8 * 1024;
+
+	CFile file;
+	ASSERT_TRUE(file.Open(s_testFile, CFile::write));
+	file.Close();
+	ASSERT_TRUE(file.Open(s_testFile, CFile::read_write));
+
+	std::vector<uint8_t> data(runSize, 0x5a);
+	CFile::IOVector buffers(1, CFile::IOVector::value_type(&data[0], data.size()));
+
+	// Runs of a flush are never adjacent, otherwise they'd be merged
+	std::vector<long long> sequential;
+	for (unsigned flush = 0; flush < flushes; ++flush) {
+		wxStopWatch timer;
+		for (unsigned run = 0; run < runs; ++run) {
+			file.WriteAtV(buffers, ((uint64)flush * runs + run) * runSize * 2);
+		}
+		sequential.push_back(timer.TimeInMicro().GetValue());
+	}
+
+	CFileIOBatch::Stats before;
+	CFileIOBatch::GetStats(before);
+
+	std::vector<long long> batched;
+	for (unsigned flush = 0; flush < flushes; ++flush) {
+		wxStopWatch timer;
+		CFileIOBatch batch;
+		for (unsigned run = 0; run < runs; ++run) {
+			batch.AddWrite(file, buffers, ((uint64)flush * runs + run) * runSize * 2);
+		}
+		batch.Execute();
+		batch.Wait();
+		batched.push_back(timer.TimeInMicro().GetValue());
+	}
+
+	CFileIOBatch::Stats after;
+	CFileIOBatch::GetStats(after);
+	ASSERT_EQUALS((uint64)flushes * runs, after.operations - before.operations);
+
+	const double megabytes = (double)flushes * runs * runSize / (1024 * 1024);
+	Print(wxString::Format(wxT("\n\tOne write per run: %.1f syscalls/MB, p99 %lld us per flush")
+		wxT("\n\tBatched (%s): %.1f syscalls/MB, p99 %lld us per flush"),
+		flushes * runs / megabytes, GetPercentile99(sequential),
+		CFileIOBatch::IsBatched() ? wxT("io_uring") : wxT("fallback"),
+		(after.syscalls - before.syscalls) / megabytes, GetPercentile99(batched)));
+
+	CFileIOBatch::Shutdown();
+	file.Close();
+	CPath::RemoveFile(s_testFile);
+}
@@ -0,0 +1,174 @@
+#include <muleunit/test.h>
+
+#include <vector>
+
+#include <CFile.h>
+#include <FileIOBatch.h>
+
+using namespace muleunit;
+
+
+//! The file used by the tests.
+static const CPath s_testFile(wxT("FileIOBatchTest.dat"));
+
+
+/** Returns the value of the test data at the given offset. */
+static uint8_t GetTestByte(uint64 offset)
+{
+	return (uint8_t)(offset * 7 + offset / 251);
+}
+
+
+/** Fills a buffer with the test data for the given offset. */
+static void FillBuffer(std::vector<uint8_t>& buffer, uint64 offset)
+{
+	for (size_t i = 0; i < buffer.size(); ++i) {
+		buffer[i] = GetTestByte(offset + i);
+	}
+}
+
+
+DECLARE_SIMPLE(FileIOBatch)
+
+
+TEST(FileIOBatch, ReadWrite)
+{
+	CFile file;
+	ASSERT_TRUE(file.Open(s_testFile, CFile::write));
+	file.Close();
+	ASSERT_TRUE(file.Open(s_testFile, CFile::read_write));
+
+	// Runs of several buffers, written out of order
+	std::vector<std::vector<uint8_t> > data(12);
+	CFileIOBatch writes;
+	for (size_t run = 0; run < 4; ++run) {
+		const uint64 offset = (3 - run) * 30000;
+
+		CFile::IOVector buffers;
+		for (size_t i = 0; i < 3; ++i) {
+			std::vector<uint8_t>& buffer = data[run * 3 + i];
+			buffer.resize(10000);
+			FillBuffer(buffer, offset + i * 10000);
+			buffers.push_back(CFile::IOVector::value_type(&buffer[0], buffer.size()));
+		}
+
+		ASSERT_EQUALS(run, writes.AddWrite(file, buffers, offset));
+	}
+
+	writes.Execute();
+	writes.Wait();
+	for (size_t i = 0; i < writes.GetCount(); ++i) {
+		writes.CheckResult(i);
+	}
+	ASSERT_EQUALS(120000u, file.GetLength());
+
+	CFileIOBatch reads;
+	std::vector<uint8_t> head(5000), middle(40000), tail(1000), beyond(1000);
+	reads.AddRead(file, 0, &head[0], head.size());
+	reads.AddRead(file, 25000, &middle[0], middle.size());
+	reads.AddRead(file, 119000, &tail[0], tail.size());
+	reads.AddRead(file, 119500, &beyond[0], beyond.size());
+	reads.Execute();
+	reads.Wait();
+
+	reads.CheckResult(0);
+	reads.CheckResult(1);
+	reads.CheckResult(2);
+	ASSERT_RAISES(CEOFException, reads.CheckResult(3));
+
+	for (size_t i = 0; i < head.size(); ++i) {
+		ASSERT_EQUALS(GetTestByte(i), head[i]);
+	}
+	for (size_t i = 0; i < middle.size(); ++i) {
+		ASSERT_EQUALS(GetTestByte(25000 + i), middle[i]);
+	}
+	for (size_t i = 0; i < tail.size(); ++i) {
+		ASSERT_EQUALS(GetTestByte(119000 + i), tail[i]);
+	}
+
+	// Operations added later are executed by the next call only
+	std::vector<uint8_t> again(100);
+	ASSERT_EQUALS(4u, reads.AddRead(file, 1000, &again[0], again.size()));
+	reads.Execute();
+	reads.Wait();
+	reads.CheckResult(4);
+	ASSERT_EQUALS(GetTestByte(1000), again[0]);
+
+	file.Close();
+	CPath::RemoveFile(s_testFile);
+}
+
+
+TEST(FileIOBatch, Concurrent)
+{
+	CFile file;
+	ASSERT_TRUE(file.Open(s_testFile, CFile::write));
+	std::vector<uint8_t> data(100000);
+	FillBuffer(data, 0);
+	file.Write(&data[0], data.size());
+	file.Close();
+	ASSERT_TRUE(file.Open(s_testFile, CFile::read));
+
+	// More operations than the ring takes at once, in batches running
+	// side by side
+	const size_t count = 300;
+	std::vector<std::vector<uint8_t> > first(count), second(count);
+	CFileIOBatch firstBatch, secondBatch;
+	for (size_t i = 0; i < count; ++i) {
+		first[i].resize(100);
+		second[i].resize(100);
+		firstBatch.AddRead(file, i * 300, &first[i][0], first[i].size());
+		secondBatch.AddRead(file, i * 300 + 100, &second[i][0], second[i].size());
+	}
+
+	CFileIOBatch::Stats before;
+	CFileIOBatch::GetStats(before);
+
+	firstBatch.Execute();
+	secondBatch.Execute();
+	secondBatch.Wait();
+	firstBatch.Wait();
+
+	CFileIOBatch::Stats after;
+	CFileIOBatch::GetStats(after);
+	ASSERT_EQUALS((uint64)2 * count, after.operations - before.operations);
+	ASSERT_EQUALS((uint64)2 * count * 100, after.bytes - before.bytes);
+
+	for (size_t i = 0; i < count; ++i) {
+		firstBatch.CheckResult(i);
+		secondBatch.CheckResult(i);
+		ASSERT_EQUALS(GetTestByte(i * 300), first[i][0]);
+		ASSERT_EQUALS(GetTestByte(i * 300 + 99), first[i][99]);
+		ASSERT_EQUALS(GetTestByte(i * 300 + 100), second[i][0]);
+	}
+
+	file.Close();
+	CPath::RemoveFile(s_testFile);
+}
+
+
+TEST(FileIOBatch, Shutdown)
+{
+	CFileIOBatch::Shutdown();
+	ASSERT_FALSE(CFileIOBatch::IsBatched());
+
+	CFile file;
+	ASSERT_TRUE(file.Open(s_testFile, CFile::write));
+	std::vector<uint8_t> data(1000);
+	FillBuffer(data, 0);
+	file.Write(&data[0], data.size());
+	file.Close();
+	ASSERT_TRUE(file.Open(s_testFile, CFile::read));
+
+	// Without the ring, batches are done before Execute returns
+	std::vector<uint8_t> buffer(500);
+	CFileIOBatch batch;
+	batch.AddRead(file, 250, &buffer[0], buffer.size());
+	batch.Execute();
+	batch.CheckResult(0);
+	ASSERT_EQUALS(GetTestByte(250), buffer[0]);
+	ASSERT_EQUALS(GetTestByte(749), buffer[499]);
+
+	file.Close();
+	CPath::RemoveFile(s_testFile);
+}
@@ -0,0 +1,239 @@
+#include <muleunit/test.h>
+
+#include "config.h"		// Needed for HAVE_SENDFILE
+
+#include <algorithm>
+#include <vector>
+
+#include <CFile.h>
+#include <MemFile.h>
+#include <Packet.h>
+#include <protocol/Protocols.h>
+#include <protocol/ed2k/Client2Client/TCP.h>
+
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+#	include <cstring>
+#	include <thread>
+#	include <arpa/inet.h>
+#	include <netinet/in.h>
+#	include <sys/sendfile.h>
+#	include <sys/socket.h>
+#	include <time.h>
+#	include <unistd.h>
+#	define TEST_SENDFILE
+#endif
+
+using namespace muleunit;
+
+
+#ifdef TEST_SENDFILE
+
+//! The file used by the benchmark.
+static const CPath s_testFile(wxT("PacketBenchmark.dat"));
+//! Size of the test file.
+static const uint32 FILE_SIZE = 16 * 1024 * 1024;
+//! Size of a requested block, and of the packets it is split into.
+static const uint32 BLOCK_SIZE = 184320;
+static const uint32 PACKET_SIZE = 10240;
+
+
+/** Returns the value of the test data at the given offset. */
+static uint8_t GetTestByte(uint64 offset)
+{
+	return (uint8_t)(offset * 7 + offset / 251);
+}
+
+
+/** Creates the test file. */
+static void CreateTestFile()
+{
+	std::vector<uint8_t> data(BLOCK_SIZE);
+	CFile file(s_testFile, CFile::write);
+	for (uint32 offset = 0; offset < FILE_SIZE; offset += data.size()) {
+		for (size_t i = 0; i < data.size(); ++i) {
+			data[i] = GetTestByte(offset + i);
+		}
+		file.Write(&data[0], std::min<size_t>(data.size(), FILE_SIZE - offset));
+	}
+}
+
+
+/** The test file, referenced by packets like a shared file when uploading. */
+class CTestPacketFile : public CPacketFile
+{
+public:
+	CTestPacketFile()
+		: m_file(s_testFile, CFile::read)
+	{}
+
+	int GetFD() const
+	{
+		return m_file.fd();
+	}
+
+	void ReadAt(void* buffer, uint64 offset, uint32 count) const
+	{
+		m_file.ReadAt(buffer, offset, count);
+	}
+
+private:
+	mutable CFile	m_file;
+};
+
+
+/** Writes the header of a sending-part packet, as created when uploading. */
+static void WritePartHeader(CMemFile& header, uint32 start, uint32 end)
+{
+	header.WriteHash(CMD4Hash());
+	header.WriteUInt32(start);
+	header.WriteUInt32(end);
+}
+
+
+/** Returns the CPU time used by the calling thread, in seconds. */
+static double GetThreadTime()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+/** Writes all of a buffer to a blocking socket. */
+static bool SendAll(int socket, const uint8_t* buffer, size_t count)
+{
+	while (count) {
+		ssize_t sent = send(socket, buffer, count, 0);
+		if (sent <= 0) {
+			return false;
+		}
+		buffer += sent;
+		count -= sent;
+	}
+
+	return true;
+}
+
+
+/** Writes all of a region of a file to a blocking socket. */
+static bool SendFileAll(int socket, int fd, off_t offset, size_t count)
+{
+	while (count) {
+		ssize_t sent = sendfile(socket, fd, &offset, count);
+		if (sent <= 0) {
+			return false;
+		}
+		count -= sent;
+	}
+
+	return true;
+}
+
+
+/**
+ * Uploads the test file over a loopback connection, packet by packet, and
+ * returns the CPU time used for sending it.
+ *
+ * @param useSendFile Sends the payloads from the file instead of reading
+ *                    each block and copying the packets into a send buffer.
+ */
+static double Upload(unsigned rounds, bool useSendFile, uint64& received)
+{
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t length = sizeof(address);
+	if (listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address))
+		|| listen(listener, 1) || getsockname(listener, (struct sockaddr*)&address, &length)) {
+		return -1;
+	}
+
+	received = 0;
+	std::thread receiver([&]() {
+		int peer = accept(listener, NULL, NULL);
+		std::vector<uint8_t> buffer(64 * 1024);
+		ssize_t count;
+		while ((count = recv(peer, &buffer[0], buffer.size(), 0)) > 0) {
+			received += count;
+		}
+		close(peer);
+	});
+
+	int sender = socket(AF_INET, SOCK_STREAM, 0);
+	bool ok = connect(sender, (struct sockaddr*)&address, sizeof(address)) == 0;
+
+	CTestPacketFile file;
+	std::vector<uint8_t> block(BLOCK_SIZE);
+	std::vector<uint8_t> sendBuffer;
+	const double start = GetThreadTime();
+
+	for (unsigned round = 0; ok && round < rounds; ++round) {
+		for (uint32 blockStart = 0; ok && blockStart + BLOCK_SIZE <= FILE_SIZE; blockStart += BLOCK_SIZE) {
+			if (!useSendFile) {
+				file.ReadAt(&block[0], blockStart, BLOCK_SIZE);
+			}
+
+			for (uint32 offset = 0; ok && offset < BLOCK_SIZE; offset += PACKET_SIZE) {
+				CMemFile header;
+				WritePartHeader(header, blockStart + offset, blockStart + offset + PACKET_SIZE);
+				const uint32 headSize = 6 + header.GetLength();
+				uint8_t head[64] = { 0 };
+				header.Seek(0, wxFromStart);
+				header.Read(head + 6, header.GetLength());
+
+				if (useSendFile) {
+					ok = SendAll(sender, head, headSize)
+						&& SendFileAll(sender, file.GetFD(), blockStart + offset, PACKET_SIZE);
+				} else {
+					// Like the socket copying the packet for the background send
+					sendBuffer.resize(headSize + PACKET_SIZE);
+					memcpy(&sendBuffer[0], head, headSize);
+					memcpy(&sendBuffer[headSize], &block[offset], PACKET_SIZE);
+					ok = SendAll(sender, &sendBuffer[0], sendBuffer.size());
+				}
+			}
+		}
+	}
+
+	const double time = GetThreadTime() - start;
+	close(sender);
+	receiver.join();
+	close(listener);
+
+	return ok ? time : -1;
+}
+
+
+DECLARE_SIMPLE(Packet)
+
+
+TEST(Packet, SendFileThroughput)
+{
+	// The CPU time needed to send a file from the page cache, compared
+	// to copying it like before.
+	const unsigned rounds = 16;
+	CreateTestFile();
+
+	const uint64 expected = (uint64)rounds * (FILE_SIZE / BLOCK_SIZE) * (BLOCK_SIZE + BLOCK_SIZE / PACKET_SIZE * (6 + 24));
+	uint64 received = 0;
+
+	const double copyTime = Upload(rounds, false, received);
+	ASSERT_TRUE(copyTime >= 0);
+	ASSERT_EQUALS(expected, received);
+
+	const double sendFileTime = Upload(rounds, true, received);
+	ASSERT_TRUE(sendFileTime >= 0);
+	ASSERT_EQUALS(expected, received);
+
+	const double gigabytes = (double)expected / (1024 * 1024 * 1024);
+	Print(wxString::Format(wxT("\n\tCopied: %.2f CPU seconds/GB")
+		wxT("\n\tSent from file: %.2f CPU seconds/GB"),
+		copyTime / gigabytes, sendFileTime / gigabytes));
+
+	CPath::RemoveFile(s_testFile);
+}
+
+#endif
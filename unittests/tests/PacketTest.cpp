@@ -0,0 +1,116 @@
+#include <muleunit/test.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <CFile.h>
+#include <MemFile.h>
+#include <Packet.h>
+#include <protocol/Protocols.h>
+#include <protocol/ed2k/Client2Client/TCP.h>
+
+using namespace muleunit;
+
+
+//! The file used by the tests.
+static const CPath s_testFile(wxT("PacketTest.dat"));
+//! Size of the test file.
+static const uint32 FILE_SIZE = 16 * 1024 * 1024;
+//! Size of a requested block, and of the packets it is split into.
+static const uint32 BLOCK_SIZE = 184320;
+static const uint32 PACKET_SIZE = 10240;
+
+
+/** Returns the value of the test data at the given offset. */
+static uint8_t GetTestByte(uint64 offset)
+{
+	return (uint8_t)(offset * 7 + offset / 251);
+}
+
+
+/** Creates the test file. */
+static void CreateTestFile()
+{
+	std::vector<uint8_t> data(BLOCK_SIZE);
+	CFile file(s_testFile, CFile::write);
+	for (uint32 offset = 0; offset < FILE_SIZE; offset += data.size()) {
+		for (size_t i = 0; i < data.size(); ++i) {
+			data[i] = GetTestByte(offset + i);
+		}
+		file.Write(&data[0], std::min<size_t>(data.size(), FILE_SIZE - offset));
+	}
+}
+
+
+/** The test file, referenced by packets like a shared file when uploading. */
+class CTestPacketFile : public CPacketFile
+{
+public:
+	CTestPacketFile()
+		: m_file(s_testFile, CFile::read)
+	{}
+
+	int GetFD() const
+	{
+		return m_file.fd();
+	}
+
+	void ReadAt(void* buffer, uint64 offset, uint32 count) const
+	{
+		m_file.ReadAt(buffer, offset, count);
+	}
+
+private:
+	mutable CFile	m_file;
+};
+
+
+/** Writes the header of a sending-part packet, as created when uploading. */
+static void WritePartHeader(CMemFile& header, uint32 start, uint32 end)
+{
+	header.WriteHash(CMD4Hash());
+	header.WriteUInt32(start);
+	header.WriteUInt32(end);
+}
+
+
+DECLARE_SIMPLE(Packet)
+
+
+TEST(Packet, FilePayload)
+{
+	CreateTestFile();
+	const CSharedPacketFile file(new CTestPacketFile());
+	const uint32 start = 3 * BLOCK_SIZE + 17;
+	CMemFile header;
+	WritePartHeader(header, start, start + PACKET_SIZE);
+
+	CPacket packet(header, file, start, PACKET_SIZE, OP_EDONKEYPROT, OP_SENDINGPART);
+	ASSERT_TRUE(packet.HasFilePayload());
+	ASSERT_EQUALS((uint32)header.GetLength() + PACKET_SIZE, packet.GetPacketSize());
+
+	// Only the head is detached, the payload is sent from the file
+	CPacket copy(packet);
+	uint32 headSize = 0;
+	CSharedPacketFile sentFile;
+	uint64 offset = 0;
+	uint8_t* head = packet.DetachPacketHead(headSize, sentFile, offset);
+	ASSERT_TRUE(sentFile == file);
+	ASSERT_EQUALS((uint64)start, offset);
+	ASSERT_EQUALS(6 + (uint32)header.GetLength(), headSize);
+	ASSERT_EQUALS((uint8_t)OP_SENDINGPART, head[5]);
+	ASSERT_EQUALS(packet.GetPacketSize(), CPacket::GetPacketSizeFromHeader(head));
+	delete [] head;
+
+	// Otherwise it is read when the packet is detached
+	ASSERT_TRUE(copy.HasFilePayload());
+	const uint32 size = copy.GetRealPacketSize();
+	uint8_t* data = copy.DetachPacket();
+	ASSERT_FALSE(copy.HasFilePayload());
+	for (uint32 i = 0; i < PACKET_SIZE; ++i) {
+		ASSERT_EQUALS(GetTestByte(start + i), data[size - PACKET_SIZE + i]);
+	}
+	delete [] data;
+
+	CPath::RemoveFile(s_testFile);
+}
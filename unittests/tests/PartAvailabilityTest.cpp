@@ -0,0 +1,130 @@
+#include <muleunit/test.h>
+
+#include <PartAvailability.h>
+#include <BitVector.h>
+
+#include <algorithm>
+#include <vector>
+
+using namespace muleunit;
+
+
+/** Small deterministic generator, so failures can be reproduced. */
+static uint32 NextRandom(uint32& seed)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 16) & 0x7fff;
+}
+
+
+/** Gives a status a random set of parts, sometimes all of them. */
+static void SetRandomStatus(BitVector& status, uint32 size, uint32& seed)
+{
+	const uint32 kind = NextRandom(seed) % 4;
+	// Starting out complete leaves the bits past the size set
+	status.setsize(size, kind == 0 || kind == 3);
+	if (kind > 1) {
+		for (uint32 part = 0; part < size; ++part) {
+			status.set(part, NextRandom(seed) % kind == 0);
+		}
+	}
+}
+
+
+DECLARE_SIMPLE(PartAvailability)
+
+
+TEST(PartAvailability, Counts)
+{
+	const uint32 partCount = 11;
+	ArrayOfUInts16 frequencies(partCount, 0);
+	CPartAvailability availability;
+	availability.Recount(frequencies);
+	ASSERT_EQUALS(0, availability.GetAvailableParts());
+	ASSERT_EQUALS(0, availability.GetMinFrequency());
+
+	BitVector complete;
+	complete.setsize(partCount, true);
+	BitVector some;
+	some.setsize(partCount, false);
+	some.set(0, true);
+	some.set(10, true);
+
+	availability.Update(frequencies, some, true);
+	ASSERT_EQUALS(2, availability.GetAvailableParts());
+	ASSERT_EQUALS(0, availability.GetMinFrequency());
+
+	availability.Update(frequencies, complete, true);
+	ASSERT_EQUALS(partCount, availability.GetAvailableParts());
+	ASSERT_EQUALS(1, availability.GetMinFrequency());
+	ASSERT_EQUALS(2, frequencies[10]);
+
+	availability.Update(frequencies, complete, true);
+	ASSERT_EQUALS(2, availability.GetMinFrequency());
+
+	availability.Update(frequencies, complete, false);
+	availability.Update(frequencies, complete, false);
+	ASSERT_EQUALS(2, availability.GetAvailableParts());
+	ASSERT_EQUALS(0, availability.GetMinFrequency());
+
+	// A status of another size doesn't count
+	BitVector other;
+	other.setsize(partCount + 1, true);
+	availability.Update(frequencies, other, true);
+	ASSERT_EQUALS(2, availability.GetAvailableParts());
+
+	// Frequencies don't drop below zero
+	availability.Update(frequencies, complete, false);
+	availability.Update(frequencies, complete, false);
+	ASSERT_EQUALS(0, availability.GetAvailableParts());
+	ASSERT_EQUALS(0, frequencies[0]);
+
+	// No parts
+	ArrayOfUInts16 none;
+	availability.Recount(none);
+	ASSERT_EQUALS(0, availability.GetAvailableParts());
+	ASSERT_EQUALS(0, availability.GetMinFrequency());
+}
+
+
+TEST(PartAvailability, MatchesFullCount)
+{
+	uint32 seed = 7;
+	const uint32 partCount = 37;
+	std::vector<BitVector> sources(40);
+	std::vector<bool> counted(sources.size(), false);
+
+	ArrayOfUInts16 frequencies(partCount, 0);
+	CPartAvailability availability;
+
+	for (unsigned round = 0; round < 2000; ++round) {
+		// A source comes, goes or sends a new status
+		const uint32 i = NextRandom(seed) % sources.size();
+		if (counted[i]) {
+			availability.Update(frequencies, sources[i], false);
+		}
+		counted[i] = NextRandom(seed) % 4 != 0;
+		if (counted[i]) {
+			// Now and then a status of another file
+			SetRandomStatus(sources[i], NextRandom(seed) % 20 ? partCount : partCount - 1, seed);
+			availability.Update(frequencies, sources[i], true);
+		}
+
+		ArrayOfUInts16 full(partCount, 0);
+		for (uint32 j = 0; j < sources.size(); ++j) {
+			if (counted[j]) {
+				CPartAvailability::AddStatus(full, sources[j]);
+			}
+		}
+		ASSERT_TRUE(full == frequencies);
+
+		uint16 available = 0;
+		uint16 minFrequency = 0xffff;
+		for (uint32 part = 0; part < partCount; ++part) {
+			available += full[part] ? 1 : 0;
+			minFrequency = std::min(minFrequency, full[part]);
+		}
+		ASSERT_EQUALS(available, availability.GetAvailableParts());
+		ASSERT_EQUALS(minFrequency, availability.GetMinFrequency());
+	}
+}
@@ -0,0 +1,290 @@
+#include <muleunit/test.h>
+
+#include <vector>
+
+#include <CFile.h>
+#include <MemFile.h>
+#include <PartFileJournal.h>
+
+using namespace muleunit;
+
+typedef CPartFileJournal::GapVector GapVector;
+typedef CPartFileJournal::GapChanges GapChanges;
+typedef CPartFileJournal::RecordList RecordList;
+
+
+//! Size of the files used for the gap tests.
+const unsigned DOMAIN_SIZE = 48;
+
+
+/** Returns the next value of a reproducible pseudo-random sequence. */
+static uint32 NextRandom(uint32& seed)
+{
+	seed = seed * 1103515245u + 12345u;
+	return seed >> 16;
+}
+
+
+/**
+ * Creates a random set of gaps. Adjacent gaps are sometimes left split,
+ * as the gap list of a part-file may contain those too.
+ */
+static GapVector CreateGaps(std::vector<bool>& isGap, uint32& seed)
+{
+	isGap.assign(DOMAIN_SIZE, false);
+	GapVector gaps;
+
+	for (unsigned pos = 0; pos < DOMAIN_SIZE; ) {
+		const unsigned length = 1 + NextRandom(seed) % 6;
+		const unsigned end = std::min(pos + length, DOMAIN_SIZE) - 1;
+		if (NextRandom(seed) % 2) {
+			if (!gaps.empty() && gaps.back().second + 1 == pos && NextRandom(seed) % 2) {
+				gaps.back().second = end;
+			} else {
+				gaps.push_back(std::make_pair((uint64)pos, (uint64)end));
+			}
+
+			for (unsigned i = pos; i <= end; ++i) {
+				isGap[i] = true;
+			}
+		}
+
+		pos = end + 1;
+	}
+
+	return gaps;
+}
+
+
+/** Appends a record containing the given value, padded to the given length. */
+static uint64 AppendRecord(const CPath& journal, uint32 value, size_t length = 4)
+{
+	CMemFile record;
+	record.WriteUInt32(value);
+	for (size_t i = 4; i < length; ++i) {
+		record.WriteUInt8((uint8)i);
+	}
+
+	return CPartFileJournal::Append(journal, record);
+}
+
+
+/** Returns the value of a record appended by AppendRecord. */
+static uint32 GetRecordValue(const std::vector<uint8_t>& record)
+{
+	return CMemFile(&record[0], record.size()).ReadUInt32();
+}
+
+
+//! The .part.met file whose journals are used by the tests.
+static const CPath s_metFile(wxT("PartFileJournalTest.part.met"));
+
+
+/** Removes the journals left by a test. */
+static void RemoveJournals()
+{
+	const CPath journals[] = {
+		CPartFileJournal::GetPath(s_metFile),
+		CPartFileJournal::GetOldPath(s_metFile)
+	};
+
+	for (size_t i = 0; i < ArraySize(journals); ++i) {
+		if (journals[i].FileExists()) {
+			CPath::RemoveFile(journals[i]);
+		}
+	}
+}
+
+
+DECLARE_SIMPLE(PartFileJournal)
+
+
+TEST(PartFileJournal, DiffGaps)
+{
+	uint32 seed = 42;
+	for (unsigned round = 0; round < 2000; ++round) {
+		std::vector<bool> before, after;
+		const GapVector beforeGaps = CreateGaps(before, seed);
+		const GapVector afterGaps = CreateGaps(after, seed);
+
+		GapChanges changes;
+		CPartFileJournal::DiffGaps(beforeGaps, afterGaps, changes);
+
+		std::vector<bool> result = before;
+		for (size_t i = 0; i < changes.size(); ++i) {
+			const CPartFileJournal::GapChange& change = changes[i];
+			ASSERT_TRUE(change.start <= change.end);
+			ASSERT_TRUE(change.end < DOMAIN_SIZE);
+			if (i) {
+				// Sorted, and adjacent changes of the same kind are merged.
+				ASSERT_TRUE(changes[i - 1].end < change.start);
+				ASSERT_TRUE(changes[i - 1].end + 1 < change.start || changes[i - 1].isGap != change.isGap);
+			}
+
+			for (uint64 pos = change.start; pos <= change.end; ++pos) {
+				// Only ranges that actually changed are listed.
+				ASSERT_TRUE(before[pos] != change.isGap);
+				result[pos] = change.isGap;
+			}
+		}
+
+		for (unsigned pos = 0; pos < DOMAIN_SIZE; ++pos) {
+			ASSERT_EQUALS((bool)after[pos], (bool)result[pos]);
+		}
+	}
+}
+
+
+TEST(PartFileJournal, DiffGapsMerged)
+{
+	GapVector gaps;
+	gaps.push_back(std::make_pair(0ull, 9ull));
+	gaps.push_back(std::make_pair(10ull, 19ull));
+	gaps.push_back(std::make_pair(100ull, 0xFFFFFFFFFFull));
+
+	GapVector merged;
+	merged.push_back(std::make_pair(0ull, 19ull));
+	merged.push_back(std::make_pair(100ull, 0xFFFFFFFFFFull));
+
+	GapChanges changes;
+	CPartFileJournal::DiffGaps(gaps, merged, changes);
+	ASSERT_EQUALS(0u, changes.size());
+
+	CPartFileJournal::DiffGaps(gaps, GapVector(), changes);
+	ASSERT_EQUALS(2u, changes.size());
+	ASSERT_EQUALS(0u, changes[0].start);
+	ASSERT_EQUALS(19u, changes[0].end);
+	ASSERT_FALSE(changes[0].isGap);
+	ASSERT_EQUALS(100u, changes[1].start);
+	ASSERT_EQUALS(0xFFFFFFFFFFull, changes[1].end);
+	ASSERT_FALSE(changes[1].isGap);
+}
+
+
+TEST(PartFileJournal, AppendAndRead)
+{
+	RemoveJournals();
+	const CPath journal = CPartFileJournal::GetPath(s_metFile);
+
+	RecordList records;
+	ASSERT_TRUE(CPartFileJournal::Read(journal, records));
+	ASSERT_EQUALS(0u, records.size());
+
+	uint64 length = 0;
+	for (uint32 i = 0; i < 10; ++i) {
+		const uint64 newLength = AppendRecord(journal, i, 4 + i * 100);
+		ASSERT_EQUALS(length + 8 + 4 + i * 100, newLength);
+		length = newLength;
+	}
+
+	ASSERT_TRUE(CPartFileJournal::Read(journal, records));
+	ASSERT_EQUALS(10u, records.size());
+	for (uint32 i = 0; i < 10; ++i) {
+		ASSERT_EQUALS(4 + i * 100, records[i].size());
+		ASSERT_EQUALS(i, GetRecordValue(records[i]));
+	}
+
+	RemoveJournals();
+}
+
+
+TEST(PartFileJournal, TornRecord)
+{
+	RemoveJournals();
+	const CPath journal = CPartFileJournal::GetPath(s_metFile);
+
+	AppendRecord(journal, 1);
+	const uint64 validLength = AppendRecord(journal, 2);
+	const uint64 fullLength = AppendRecord(journal, 3, 64);
+
+	// Every possible tear of the last record is cut off.
+	for (uint64 tornLength = fullLength - 1; tornLength > validLength; --tornLength) {
+		{
+			CFile file(journal, CFile::read_write);
+			ASSERT_TRUE(file.SetLength(tornLength));
+		}
+
+		RecordList records;
+		ASSERT_FALSE(CPartFileJournal::Read(journal, records));
+		ASSERT_EQUALS(2u, records.size());
+		ASSERT_EQUALS(validLength, (uint64)journal.GetFileSize());
+
+		// Records appended afterwards are readable again.
+		AppendRecord(journal, 3, 64);
+
+		records.clear();
+		ASSERT_TRUE(CPartFileJournal::Read(journal, records));
+		ASSERT_EQUALS(3u, records.size());
+		ASSERT_EQUALS(3u, GetRecordValue(records[2]));
+	}
+
+	RemoveJournals();
+}
+
+
+TEST(PartFileJournal, CorruptRecord)
+{
+	RemoveJournals();
+	const CPath journal = CPartFileJournal::GetPath(s_metFile);
+
+	const uint64 validLength = AppendRecord(journal, 1);
+	AppendRecord(journal, 2, 16);
+	AppendRecord(journal, 3);
+
+	{
+		// Flip a byte of the contents of the second record.
+		CFile file(journal, CFile::read_write);
+		file.Seek(validLength + 8 + 5);
+		const uint8 value = file.ReadUInt8();
+		file.Seek(validLength + 8 + 5);
+		file.WriteUInt8(value ^ 0x10);
+	}
+
+	RecordList records;
+	ASSERT_FALSE(CPartFileJournal::Read(journal, records));
+	ASSERT_EQUALS(1u, records.size());
+	ASSERT_EQUALS(1u, GetRecordValue(records[0]));
+	ASSERT_EQUALS(validLength, (uint64)journal.GetFileSize());
+
+	RemoveJournals();
+}
+
+
+TEST(PartFileJournal, Rotate)
+{
+	RemoveJournals();
+	const CPath journal = CPartFileJournal::GetPath(s_metFile);
+	const CPath oldJournal = CPartFileJournal::GetOldPath(s_metFile);
+
+	// Without a journal, there is nothing to do.
+	CPartFileJournal::Rotate(s_metFile);
+	ASSERT_FALSE(journal.FileExists());
+	ASSERT_FALSE(oldJournal.FileExists());
+
+	AppendRecord(journal, 1);
+	AppendRecord(journal, 2);
+	CPartFileJournal::Rotate(s_metFile);
+	ASSERT_FALSE(journal.FileExists());
+	ASSERT_TRUE(oldJournal.FileExists());
+
+	// A torn record at the end of the old journal is dropped when
+	// the records of a second rotation are appended to it.
+	{
+		CFile file(oldJournal, CFile::write_append);
+		const uint8 garbage[] = { 0x10, 0x00, 0x00 };
+		file.Write(garbage, sizeof(garbage));
+	}
+
+	AppendRecord(journal, 3);
+	CPartFileJournal::Rotate(s_metFile);
+	ASSERT_FALSE(journal.FileExists());
+
+	RecordList records;
+	ASSERT_TRUE(CPartFileJournal::Read(oldJournal, records));
+	ASSERT_EQUALS(3u, records.size());
+	for (uint32 i = 0; i < 3; ++i) {
+		ASSERT_EQUALS(i + 1, GetRecordValue(records[i]));
+	}
+
+	RemoveJournals();
+}
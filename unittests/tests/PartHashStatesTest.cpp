@@ -0,0 +1,152 @@
+#include <muleunit/test.h>
+
+#include <vector>
+
+#include <protocol/ed2k/Constants.h>
+
+#include "CryptoPP_Inc.h"
+#include "DownloadBufferPool.h"
+#include "MD4Hash.h"
+#include "PartHashStates.h"
+
+using namespace muleunit;
+
+
+//! The size of the blocks fed.
+static const uint32 BLOCK = 10240;
+
+
+/** Returns the bytes currently parked by all part-files. */
+static uint64 GetParked()
+{
+	CDownloadBufferPool::Stats stats;
+	CDownloadBufferPool::GetStats(stats);
+
+	return stats.parked;
+}
+
+
+/** Fills a buffer with reproducible pseudo-random data. */
+static void FillBuffer(std::vector<uint8_t>& buffer, uint32 seed)
+{
+	for (size_t i = 0; i < buffer.size(); ++i) {
+		seed = seed * 1103515245u + 12345u;
+		buffer[i] = (uint8_t)(seed >> 16);
+	}
+}
+
+
+DECLARE_SIMPLE(PartHashStates)
+
+
+TEST(PartHashStates, OutOfOrder)
+{
+	CDownloadBufferPool::SetLimit(0);
+	const uint64 before = GetParked();
+
+	std::vector<uint8_t> data(3 * BLOCK);
+	FillBuffer(data, 42);
+
+	CPartHashStates states;
+	states.Feed(0, &data[0], BLOCK);
+	ASSERT_EQUALS(before, GetParked());
+
+	// Data after a gap waits for the data before it
+	states.Feed(2 * BLOCK, &data[2 * BLOCK], BLOCK);
+	ASSERT_EQUALS(before + BLOCK, GetParked());
+	states.Feed(BLOCK, &data[BLOCK], BLOCK);
+	ASSERT_EQUALS(before, GetParked());
+
+	CMD4Hash expected;
+	CryptoPP::Weak::MD4().CalculateDigest(expected.GetHash(), &data[0], data.size());
+
+	CMD4Hash hash;
+	ASSERT_TRUE(states.GetHash(0, data.size(), hash));
+	ASSERT_TRUE(expected == hash);
+
+	// The state is discarded along with the hash
+	ASSERT_FALSE(states.GetHash(0, data.size(), hash));
+}
+
+
+TEST(PartHashStates, StartingMidPart)
+{
+	CDownloadBufferPool::SetLimit(0);
+	const uint64 before = GetParked();
+
+	std::vector<uint8_t> data(BLOCK);
+	FillBuffer(data, 4711);
+
+	// The data before it may be on disk already, as for a part downloaded
+	// in an earlier session, so nothing is parked for this part
+	CPartHashStates states;
+	const uint64 start = PARTSIZE + 18 * BLOCK;
+	states.Feed(start, &data[0], BLOCK);
+	states.Feed(start + 2 * BLOCK, &data[0], BLOCK);
+	ASSERT_EQUALS(before, GetParked());
+
+	// Not even once the start of the part arrives
+	states.Feed(PARTSIZE, &data[0], BLOCK);
+	states.Feed(PARTSIZE + 2 * BLOCK, &data[0], BLOCK);
+	ASSERT_EQUALS(before, GetParked());
+
+	CMD4Hash hash;
+	ASSERT_FALSE(states.GetHash(1, PARTSIZE, hash));
+}
+
+
+TEST(PartHashStates, Begin)
+{
+	CDownloadBufferPool::SetLimit(0);
+	const uint64 before = GetParked();
+
+	std::vector<uint8_t> data(BLOCK);
+	FillBuffer(data, 1);
+
+	// Parts without data on disk may start anywhere
+	CPartHashStates states;
+	states.Begin(2);
+	states.Feed(2 * PARTSIZE + 18 * BLOCK, &data[0], BLOCK);
+	ASSERT_EQUALS(before + BLOCK, GetParked());
+
+	// Resetting the part releases the parked data
+	states.Reset(2 * PARTSIZE, 2 * PARTSIZE);
+	ASSERT_EQUALS(before, GetParked());
+
+	states.Begin(2);
+	states.Feed(2 * PARTSIZE + 18 * BLOCK, &data[0], BLOCK);
+	ASSERT_EQUALS(before + BLOCK, GetParked());
+	states.Clear();
+	ASSERT_EQUALS(before, GetParked());
+}
+
+
+TEST(PartHashStates, ParkedLimit)
+{
+	// Parked data of all parts is limited to a quarter of the pool limit
+	CDownloadBufferPool::SetLimit(8 * BLOCK);
+	const uint64 before = GetParked();
+
+	std::vector<uint8_t> data(BLOCK);
+	FillBuffer(data, 2);
+
+	CPartHashStates states;
+	states.Begin(0);
+	states.Begin(1);
+	states.Feed(4 * BLOCK, &data[0], BLOCK);
+	states.Feed(PARTSIZE + 4 * BLOCK, &data[0], BLOCK);
+	ASSERT_EQUALS(before + 2 * BLOCK, GetParked());
+
+	// The part exceeding it is hashed from disk, dropping its parked data
+	states.Feed(PARTSIZE + 6 * BLOCK, &data[0], BLOCK);
+	ASSERT_EQUALS(before + BLOCK, GetParked());
+	states.Feed(PARTSIZE, &data[0], BLOCK);
+	ASSERT_EQUALS(before + BLOCK, GetParked());
+
+	CMD4Hash hash;
+	ASSERT_FALSE(states.GetHash(1, PARTSIZE, hash));
+	ASSERT_FALSE(states.GetHash(0, PARTSIZE, hash));
+	ASSERT_EQUALS(before, GetParked());
+
+	CDownloadBufferPool::SetLimit(0);
+}
@@ -0,0 +1,100 @@
+#include <muleunit/test.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <wx/stopwatch.h>
+
+#include <protocol/ed2k/Constants.h>
+
+#include "CryptoPP_Inc.h"
+#include "MD4Hash.h"
+#include "SHA.h"
+#include "PartHashing.h"
+
+using namespace muleunit;
+
+
+/** Fills a buffer with reproducible pseudo-random data. */
+static void FillBuffer(std::vector<uint8_t>& buffer, uint32 seed)
+{
+	for (size_t i = 0; i < buffer.size(); ++i) {
+		seed = seed * 1103515245u + 12345u;
+		buffer[i] = (uint8_t)(seed >> 16);
+	}
+}
+
+
+/**
+ * The two-pass hashing formerly used by CKnownFile::CreateHashFromInput:
+ * SHA-1 (CSHA) over 8 KB copies of the data, then MD4 over the whole part.
+ */
+static void ReferenceHashes(const uint8_t* input, uint32 length, CMD4Hash& md4, std::vector<CAICHHash>& blockHashes)
+{
+	CSHA sha;
+	uint8_t buffer[64 * 128];
+	uint32 blockPos = 0;
+
+	blockHashes.clear();
+	for (uint32 pos = 0; pos < length; ) {
+		const uint32 len = std::min<uint32>(sizeof(buffer), length - pos);
+		memcpy(buffer, input + pos, len);
+
+		for (uint32 done = 0; done < len; ) {
+			const uint32 toAdd = std::min(len - done, EMBLOCKSIZE - blockPos);
+			sha.Add(buffer + done, toAdd);
+			blockPos += toAdd;
+			done += toAdd;
+
+			if (blockPos == EMBLOCKSIZE) {
+				CAICHHash hash;
+				sha.Finish(hash);
+				blockHashes.push_back(hash);
+				sha.Reset();
+				blockPos = 0;
+			}
+		}
+
+		pos += len;
+	}
+
+	if (blockPos) {
+		CAICHHash hash;
+		sha.Finish(hash);
+		blockHashes.push_back(hash);
+	}
+
+	CryptoPP::Weak::MD4().CalculateDigest(md4.GetHash(), input, length);
+}
+
+
+
+DECLARE_SIMPLE(PartHashing)
+
+
+TEST(PartHashing, Throughput)
+{
+	// Compares the fused hashing against the former two-pass implementation.
+	const unsigned parts = 4;
+	std::vector<uint8_t> data(PARTSIZE);
+	FillBuffer(data, 42);
+
+	CMD4Hash md4;
+	std::vector<CAICHHash> blocks;
+
+	wxStopWatch reference;
+	for (unsigned i = 0; i < parts; ++i) {
+		ReferenceHashes(&data[0], PARTSIZE, md4, blocks);
+	}
+	const long referenceTime = std::max(reference.Time(), 1L);
+
+	wxStopWatch fused;
+	for (unsigned i = 0; i < parts; ++i) {
+		CreatePartHashes(&data[0], PARTSIZE, &md4, &blocks);
+	}
+	const long fusedTime = std::max(fused.Time(), 1L);
+
+	const double megabytes = (double)parts * PARTSIZE / (1024 * 1024);
+	Print(wxString::Format(wxT("\n\tTwo-pass hashing: %.1f MB/s\n\tFused hashing:    %.1f MB/s"),
+		megabytes * 1000 / referenceTime, megabytes * 1000 / fusedTime));
+}
@@ -0,0 +1,148 @@
+#include <muleunit/test.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <protocol/ed2k/Constants.h>
+
+#include "CryptoPP_Inc.h"
+#include "MD4Hash.h"
+#include "SHA.h"
+#include "PartHashing.h"
+
+using namespace muleunit;
+
+
+/** Returns the hexadecimal representation of the given bytes. */
+static wxString ToHex(const uint8_t* data, size_t length)
+{
+	wxString result;
+	for (size_t i = 0; i < length; ++i) {
+		result += wxString::Format(wxT("%02x"), data[i]);
+	}
+
+	return result;
+}
+
+
+/** Fills a buffer with reproducible pseudo-random data. */
+static void FillBuffer(std::vector<uint8_t>& buffer, uint32 seed)
+{
+	for (size_t i = 0; i < buffer.size(); ++i) {
+		seed = seed * 1103515245u + 12345u;
+		buffer[i] = (uint8_t)(seed >> 16);
+	}
+}
+
+
+/**
+ * The two-pass hashing formerly used by CKnownFile::CreateHashFromInput:
+ * SHA-1 (CSHA) over 8 KB copies of the data, then MD4 over the whole part.
+ */
+static void ReferenceHashes(const uint8_t* input, uint32 length, CMD4Hash& md4, std::vector<CAICHHash>& blockHashes)
+{
+	CSHA sha;
+	uint8_t buffer[64 * 128];
+	uint32 blockPos = 0;
+
+	blockHashes.clear();
+	for (uint32 pos = 0; pos < length; ) {
+		const uint32 len = std::min<uint32>(sizeof(buffer), length - pos);
+		memcpy(buffer, input + pos, len);
+
+		for (uint32 done = 0; done < len; ) {
+			const uint32 toAdd = std::min(len - done, EMBLOCKSIZE - blockPos);
+			sha.Add(buffer + done, toAdd);
+			blockPos += toAdd;
+			done += toAdd;
+
+			if (blockPos == EMBLOCKSIZE) {
+				CAICHHash hash;
+				sha.Finish(hash);
+				blockHashes.push_back(hash);
+				sha.Reset();
+				blockPos = 0;
+			}
+		}
+
+		pos += len;
+	}
+
+	if (blockPos) {
+		CAICHHash hash;
+		sha.Finish(hash);
+		blockHashes.push_back(hash);
+	}
+
+	CryptoPP::Weak::MD4().CalculateDigest(md4.GetHash(), input, length);
+}
+
+
+/** Checks CreatePartHashes against the reference implementation. */
+static void CheckLength(uint32 length)
+{
+	std::vector<uint8_t> data(std::max<uint32>(length, 1));
+	FillBuffer(data, length);
+
+	CMD4Hash expectedMD4;
+	std::vector<CAICHHash> expectedBlocks;
+	ReferenceHashes(&data[0], length, expectedMD4, expectedBlocks);
+
+	CMD4Hash md4;
+	std::vector<CAICHHash> blocks;
+	CreatePartHashes(&data[0], length, &md4, &blocks);
+
+	ASSERT_EQUALS(ToHex(expectedMD4.GetHash(), MD4HASH_LENGTH), ToHex(md4.GetHash(), MD4HASH_LENGTH));
+	ASSERT_EQUALS(expectedBlocks.size(), blocks.size());
+	for (size_t i = 0; i < blocks.size(); ++i) {
+		ASSERT_EQUALS(ToHex(expectedBlocks[i].GetRawHash(), HASHSIZE), ToHex(blocks[i].GetRawHash(), HASHSIZE));
+	}
+
+	// Each hash may also be created on its own.
+	CMD4Hash md4Only;
+	CreatePartHashes(&data[0], length, &md4Only, NULL);
+	ASSERT_EQUALS(ToHex(md4.GetHash(), MD4HASH_LENGTH), ToHex(md4Only.GetHash(), MD4HASH_LENGTH));
+
+	std::vector<CAICHHash> blocksOnly;
+	CreatePartHashes(&data[0], length, NULL, &blocksOnly);
+	ASSERT_EQUALS(blocks.size(), blocksOnly.size());
+	for (size_t i = 0; i < blocks.size(); ++i) {
+		ASSERT_EQUALS(ToHex(blocks[i].GetRawHash(), HASHSIZE), ToHex(blocksOnly[i].GetRawHash(), HASHSIZE));
+	}
+}
+
+
+DECLARE_SIMPLE(PartHashing)
+
+
+TEST(PartHashing, KnownValues)
+{
+	const uint8_t abc[] = { 'a', 'b', 'c' };
+
+	CMD4Hash md4;
+	std::vector<CAICHHash> blocks;
+
+	CreatePartHashes(abc, 0, &md4, &blocks);
+	ASSERT_EQUALS(wxString(wxT("31d6cfe0d16ae931b73c59d7e0c089c0")), ToHex(md4.GetHash(), MD4HASH_LENGTH));
+	ASSERT_EQUALS(0u, blocks.size());
+
+	CreatePartHashes(abc, sizeof(abc), &md4, &blocks);
+	ASSERT_EQUALS(wxString(wxT("a448017aaf21d8525fc10ae87aa6729d")), ToHex(md4.GetHash(), MD4HASH_LENGTH));
+	ASSERT_EQUALS(1u, blocks.size());
+	ASSERT_EQUALS(wxString(wxT("a9993e364706816aba3e25717850c26c9cd0d89d")), ToHex(blocks[0].GetRawHash(), HASHSIZE));
+}
+
+
+TEST(PartHashing, MatchesTwoPassHashing)
+{
+	const uint32 lengths[] = {
+		1, 63, 64, 65, 8191, 8192, 16385,
+		EMBLOCKSIZE - 1, EMBLOCKSIZE, EMBLOCKSIZE + 1,
+		3 * EMBLOCKSIZE + 4711,
+		PARTSIZE - 1, PARTSIZE
+	};
+
+	for (size_t i = 0; i < ArraySize(lengths); ++i) {
+		CheckLength(lengths[i]);
+	}
+}
@@ -0,0 +1,126 @@
+#include <muleunit/test.h>
+
+#include <FileAutoClose.h>
+#include <GetTickCount.h>
+#include <SharedFileHandleCache.h>
+
+using namespace muleunit;
+
+
+/** Returns a hash which differs for every value. */
+static CMD4Hash GetHash(uint8_t value)
+{
+	unsigned char hash[MD4HASH_LENGTH] = { 0 };
+	hash[0] = value;
+
+	return CMD4Hash(hash);
+}
+
+
+/** Returns the path of a test file. */
+static CPath GetTestFile(unsigned index)
+{
+	return CPath(wxString::Format(wxT("SharedFileHandleCacheTest%u.dat"), index));
+}
+
+
+/** Creates the test files, each containing its index. */
+static void CreateTestFiles(unsigned count)
+{
+	for (unsigned i = 0; i < count; ++i) {
+		CFile file(GetTestFile(i), CFile::write);
+		file.WriteUInt32(i);
+	}
+}
+
+
+/** Removes the test files still present. */
+static void RemoveTestFiles(unsigned count)
+{
+	for (unsigned i = 0; i < count; ++i) {
+		if (GetTestFile(i).FileExists()) {
+			CPath::RemoveFile(GetTestFile(i));
+		}
+	}
+}
+
+
+/** Returns the cached handle of a file, opening it if needed like an upload does. */
+static CSharedFileHandleCache::Handle GetHandle(unsigned index)
+{
+	CSharedFileHandleCache::Handle handle = CSharedFileHandleCache::Get(GetHash(index));
+	if (!handle) {
+		handle = CSharedFileHandleCache::Open(GetHash(index), GetTestFile(index));
+	}
+
+	return handle;
+}
+
+
+DECLARE_SIMPLE(SharedFileHandleCache)
+
+
+TEST(SharedFileHandleCache, Eviction)
+{
+	const unsigned count = 4;
+	CreateTestFiles(count);
+	CSharedFileHandleCache::Clear();
+	CSharedFileHandleCache::SetLimit(2);
+
+	CSharedFileHandleCache::Handle first = GetHandle(0);
+	ASSERT_TRUE(first);
+	ASSERT_TRUE(GetHandle(0) == first);
+	ASSERT_TRUE(GetHandle(1));
+	ASSERT_EQUALS(2u, CSharedFileHandleCache::GetCount());
+
+	// Using the first file makes the second one the least recently used
+	ASSERT_TRUE(CSharedFileHandleCache::Get(GetHash(0)) == first);
+	ASSERT_TRUE(GetHandle(2));
+	ASSERT_EQUALS(2u, CSharedFileHandleCache::GetCount());
+	ASSERT_FALSE(CSharedFileHandleCache::Get(GetHash(1)));
+	ASSERT_TRUE(CSharedFileHandleCache::Get(GetHash(0)) == first);
+
+	// Dropped handles stay usable while in use
+	CSharedFileHandleCache::Remove(GetHash(0));
+	ASSERT_EQUALS(1u, CSharedFileHandleCache::GetCount());
+	ASSERT_FALSE(CSharedFileHandleCache::Get(GetHash(0)));
+	uint32 value = 1;
+	first->ReadAt(&value, 0, sizeof(value));
+	ASSERT_EQUALS(0u, value);
+
+	// Nothing is cached while disabled
+	CSharedFileHandleCache::SetLimit(0);
+	ASSERT_EQUALS(0u, CSharedFileHandleCache::GetCount());
+	ASSERT_TRUE(GetHandle(3));
+	ASSERT_EQUALS(0u, CSharedFileHandleCache::GetCount());
+
+	RemoveTestFiles(count);
+}
+
+
+TEST(SharedFileHandleCache, RemovedFile)
+{
+	const unsigned count = 2;
+	CreateTestFiles(count);
+	CSharedFileHandleCache::Clear();
+	CSharedFileHandleCache::SetLimit(4);
+
+	ASSERT_TRUE(GetHandle(0));
+	ASSERT_TRUE(GetHandle(1));
+	CPath::RemoveFile(GetTestFile(1));
+
+	// The open handle is used until the file is checked again
+	ASSERT_TRUE(CSharedFileHandleCache::Get(GetHash(1)));
+
+	TheTime += 60;
+	ASSERT_TRUE(CSharedFileHandleCache::Get(GetHash(0)));
+	ASSERT_FALSE(CSharedFileHandleCache::Get(GetHash(1)));
+	ASSERT_EQUALS(1u, CSharedFileHandleCache::GetCount());
+
+	// Opening fails like without the cache
+	ASSERT_FALSE(GetHandle(1));
+	ASSERT_EQUALS(1u, CSharedFileHandleCache::GetCount());
+
+	CSharedFileHandleCache::SetLimit(0);
+	RemoveTestFiles(count);
+}
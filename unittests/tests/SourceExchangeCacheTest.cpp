@@ -0,0 +1,131 @@
+#include <muleunit/test.h>
+
+#include <SourceExchangeCache.h>
+#include <BitVector.h>
+
+using namespace muleunit;
+
+
+static CSourceExchangeCache::Key MakeKey(uint8 version, bool sx2)
+{
+	CSourceExchangeCache::Key key;
+	key.version = version;
+	key.options = 0;
+	key.sx2 = sx2;
+	key.hybridIDs = version >= 3;
+	return key;
+}
+
+
+static CSourceExchangeCache::Answer MakeAnswer(const void* source)
+{
+	CSourceExchangeCache::Answer answer;
+	answer.sources.push_back(source);
+	answer.records.assign(12, 0);
+	return answer;
+}
+
+
+DECLARE_SIMPLE(SourceExchangeCache)
+
+
+TEST(SourceExchangeCache, Parts)
+{
+	BitVector unknown;
+	BitVector none;
+	none.setsize(11, false);
+	// Starting out complete leaves the bits past the size set
+	BitVector some;
+	some.setsize(11, true);
+	for (uint32 part = 0; part < 11; ++part) {
+		some.set(part, part == 3 || part == 10);
+	}
+	BitVector same;
+	same.setsize(11, false);
+	same.set(3, true);
+	same.set(10, true);
+
+	CSourceExchangeCache::Key a = MakeKey(4, true);
+	CSourceExchangeCache::Key b = MakeKey(4, true);
+	a.SetParts(unknown);
+	b.SetParts(none);
+	ASSERT_TRUE(a == b);
+	ASSERT_TRUE(a.parts.empty());
+
+	a.SetParts(some);
+	ASSERT_FALSE(a == b);
+	b.SetParts(same);
+	ASSERT_TRUE(a == b);
+	ASSERT_EQUALS(2u, a.parts.size());
+
+	b.options = 1;
+	ASSERT_FALSE(a == b);
+	b = MakeKey(4, false);
+	b.SetParts(same);
+	ASSERT_FALSE(a == b);
+}
+
+
+TEST(SourceExchangeCache, Lookup)
+{
+	int sources[10];
+	CSourceExchangeCache cache;
+	CSourceExchangeCache::Stats before;
+	CSourceExchangeCache::GetStats(before);
+	const CSourceExchangeCache::Key key = MakeKey(4, true);
+	ASSERT_TRUE(cache.Find(key, 0) == NULL);
+
+	CSourceExchangeCache::Answer* answer = cache.Add(key, MakeAnswer(&sources[0]), 1000);
+	ASSERT_EQUALS(1u, answer->sources.size());
+	ASSERT_EQUALS(12u, answer->GetRecordSize());
+	ASSERT_TRUE(cache.Find(key, 1000) == answer);
+	ASSERT_TRUE(cache.Find(MakeKey(3, true), 1000) == NULL);
+	CSourceExchangeCache::Stats after;
+	CSourceExchangeCache::GetStats(after);
+	ASSERT_EQUALS(1u, after.hits - before.hits);
+	ASSERT_EQUALS(2u, after.misses - before.misses);
+
+	// Answers expire after a while, also across the wrap of the clock
+	ASSERT_TRUE(cache.Find(key, 10999) == answer);
+	ASSERT_TRUE(cache.Find(key, 11000) == NULL);
+	ASSERT_EQUALS(0u, cache.GetCount());
+	cache.Add(key, MakeAnswer(&sources[0]), 0xfffff000);
+	ASSERT_TRUE(cache.Find(key, 1000) != NULL);
+	ASSERT_TRUE(cache.Find(key, 0x2000) == NULL);
+
+	// An answer replaces the one for the same request
+	cache.Add(key, MakeAnswer(&sources[0]), 2000);
+	answer = cache.Add(key, MakeAnswer(&sources[1]), 3000);
+	ASSERT_EQUALS(1u, cache.GetCount());
+	ASSERT_TRUE(cache.Find(key, 3000) == answer);
+	ASSERT_TRUE(answer->sources[0] == &sources[1]);
+
+	cache.Invalidate();
+	ASSERT_EQUALS(0u, cache.GetCount());
+	ASSERT_TRUE(cache.Find(key, 3000) == NULL);
+}
+
+
+TEST(SourceExchangeCache, Eviction)
+{
+	int sources[10];
+	CSourceExchangeCache cache;
+	for (uint8 version = 0; version < 10; ++version) {
+		cache.Add(MakeKey(version, true), MakeAnswer(&sources[version]), 1000 + version);
+	}
+
+	// The oldest answers made room for the others
+	ASSERT_EQUALS(8u, cache.GetCount());
+	ASSERT_TRUE(cache.Find(MakeKey(0, true), 1010) == NULL);
+	ASSERT_TRUE(cache.Find(MakeKey(1, true), 1010) == NULL);
+	for (uint8 version = 2; version < 10; ++version) {
+		CSourceExchangeCache::Answer* answer = cache.Find(MakeKey(version, true), 1010);
+		ASSERT_TRUE(answer != NULL);
+		ASSERT_TRUE(answer->sources[0] == &sources[version]);
+	}
+
+	// Only the answers which are too old expire
+	ASSERT_TRUE(cache.Find(MakeKey(3, true), 11003) == NULL);
+	ASSERT_EQUALS(6u, cache.GetCount());
+	ASSERT_TRUE(cache.Find(MakeKey(9, true), 11003) != NULL);
+}
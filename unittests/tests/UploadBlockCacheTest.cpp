@@ -0,0 +1,218 @@
+#include <muleunit/test.h>
+
+#include <vector>
+
+#include <UploadBlockCache.h>
+
+using namespace muleunit;
+
+
+//! Size of the blocks used by the tests.
+const uint64 BLOCK_SIZE = 10240;
+
+
+/** Returns the current statistics of the cache. */
+static CUploadBlockCache::Stats GetStats()
+{
+	CUploadBlockCache::Stats stats;
+	CUploadBlockCache::GetStats(stats);
+
+	return stats;
+}
+
+
+/** Returns a hash which differs for every value. */
+static CMD4Hash GetHash(uint8_t value)
+{
+	unsigned char hash[MD4HASH_LENGTH] = { 0 };
+	hash[0] = value;
+
+	return CMD4Hash(hash);
+}
+
+
+/** Returns the contents of a block, which are derived from its position. */
+static std::vector<uint8_t> GetData(uint64 start)
+{
+	std::vector<uint8_t> data(BLOCK_SIZE);
+	for (size_t i = 0; i < data.size(); ++i) {
+		data[i] = (uint8_t)(start / BLOCK_SIZE + i);
+	}
+
+	return data;
+}
+
+
+/** Looks up a block, offering it to the cache on a miss like an upload does. */
+static bool Request(const CMD4Hash& hash, uint64 block)
+{
+	const uint64 start = block * BLOCK_SIZE;
+	if (CUploadBlockCache::Lookup(hash, start, start + BLOCK_SIZE)) {
+		return true;
+	}
+
+	CUploadBlockCache::BlockData data(new std::vector<uint8_t>(GetData(start)));
+	CUploadBlockCache::Insert(hash, start, start + BLOCK_SIZE, data);
+
+	return false;
+}
+
+
+DECLARE_SIMPLE(UploadBlockCache)
+
+
+TEST(UploadBlockCache, Lookup)
+{
+	CUploadBlockCache::Clear();
+	CUploadBlockCache::SetLimit(8 * BLOCK_SIZE);
+	const CUploadBlockCache::Stats before = GetStats();
+	const CMD4Hash hash = GetHash(1);
+
+	ASSERT_FALSE(Request(hash, 0));
+	ASSERT_EQUALS(before.misses + 1, GetStats().misses);
+	ASSERT_EQUALS(BLOCK_SIZE, GetStats().cached);
+
+	CUploadBlockCache::BlockData data = CUploadBlockCache::Lookup(hash, 0, BLOCK_SIZE);
+	ASSERT_TRUE(data);
+	ASSERT_TRUE(*data == GetData(0));
+	ASSERT_EQUALS(before.hits + 1, GetStats().hits);
+
+	// Other files and ranges are separate blocks
+	ASSERT_FALSE(CUploadBlockCache::Lookup(GetHash(2), 0, BLOCK_SIZE));
+	ASSERT_FALSE(CUploadBlockCache::Lookup(hash, 0, BLOCK_SIZE / 2));
+	ASSERT_EQUALS(before.misses + 3, GetStats().misses);
+
+	// The data stays valid after the block is dropped
+	CUploadBlockCache::Clear();
+	ASSERT_EQUALS(0u, GetStats().cached);
+	ASSERT_TRUE(*data == GetData(0));
+
+	// Nothing is cached while disabled
+	CUploadBlockCache::SetLimit(0);
+	ASSERT_FALSE(Request(hash, 0));
+	ASSERT_FALSE(Request(hash, 0));
+	ASSERT_EQUALS(0u, GetStats().blocks);
+}
+
+
+TEST(UploadBlockCache, Eviction)
+{
+	CUploadBlockCache::Clear();
+	CUploadBlockCache::SetLimit(4 * BLOCK_SIZE);
+	const CUploadBlockCache::Stats before = GetStats();
+	const CMD4Hash hash = GetHash(1);
+
+	for (uint64 block = 0; block < 4; ++block) {
+		ASSERT_FALSE(Request(hash, block));
+	}
+	ASSERT_EQUALS(4u, GetStats().blocks);
+
+	// Using the first block makes the second one the least recently used
+	ASSERT_TRUE(Request(hash, 0));
+
+	// Once full, a block is only admitted when requested again
+	ASSERT_FALSE(Request(hash, 4));
+	ASSERT_EQUALS(4u, GetStats().blocks);
+	ASSERT_EQUALS(before.evicted, GetStats().evicted);
+	ASSERT_FALSE(Request(hash, 4));
+	ASSERT_EQUALS(before.evicted + 1, GetStats().evicted);
+	ASSERT_TRUE(Request(hash, 4));
+
+	ASSERT_TRUE(Request(hash, 0));
+	ASSERT_FALSE(CUploadBlockCache::Lookup(hash, BLOCK_SIZE, 2 * BLOCK_SIZE));
+	ASSERT_TRUE(Request(hash, 2));
+	ASSERT_TRUE(Request(hash, 3));
+	ASSERT_EQUALS(4 * BLOCK_SIZE, GetStats().cached);
+
+	// Blocks requested once don't push out the reused ones
+	for (uint64 block = 10; block < 100; ++block) {
+		ASSERT_FALSE(Request(hash, block));
+	}
+	ASSERT_TRUE(Request(hash, 0));
+	ASSERT_TRUE(Request(hash, 2));
+	ASSERT_TRUE(Request(hash, 3));
+	ASSERT_TRUE(Request(hash, 4));
+
+	// Lowering the limit evicts immediately
+	CUploadBlockCache::SetLimit(2 * BLOCK_SIZE);
+	ASSERT_EQUALS(2u, GetStats().blocks);
+	ASSERT_TRUE(Request(hash, 4));
+	ASSERT_TRUE(Request(hash, 3));
+
+	// Blocks too large for the limit are never cached
+	CUploadBlockCache::BlockData large(new std::vector<uint8_t>(BLOCK_SIZE * 2));
+	ASSERT_FALSE(CUploadBlockCache::Insert(hash, 0, large->size(), large));
+
+	CUploadBlockCache::SetLimit(0);
+	ASSERT_EQUALS(0u, GetStats().cached);
+}
+
+
+TEST(UploadBlockCache, Invalidate)
+{
+	CUploadBlockCache::Clear();
+	CUploadBlockCache::SetLimit(16 * BLOCK_SIZE);
+	const CMD4Hash hash = GetHash(1);
+	const CMD4Hash other = GetHash(2);
+
+	for (uint64 block = 0; block < 4; ++block) {
+		Request(hash, block);
+		Request(other, block);
+	}
+	ASSERT_EQUALS(8u, GetStats().blocks);
+
+	// Blocks touching the range are dropped, like after a corrupted part
+	CUploadBlockCache::Invalidate(hash, BLOCK_SIZE + 1, 2 * BLOCK_SIZE + 1);
+	ASSERT_EQUALS(6u, GetStats().blocks);
+	ASSERT_TRUE(Request(hash, 0));
+	ASSERT_FALSE(CUploadBlockCache::Lookup(hash, BLOCK_SIZE, 2 * BLOCK_SIZE));
+	ASSERT_FALSE(CUploadBlockCache::Lookup(hash, 2 * BLOCK_SIZE, 3 * BLOCK_SIZE));
+	ASSERT_TRUE(Request(hash, 3));
+
+	// Blocks of other files are left alone
+	CUploadBlockCache::Invalidate(hash);
+	ASSERT_EQUALS(4u, GetStats().blocks);
+	ASSERT_EQUALS(4 * BLOCK_SIZE, GetStats().cached);
+	for (uint64 block = 0; block < 4; ++block) {
+		ASSERT_TRUE(Request(other, block));
+	}
+
+	CUploadBlockCache::SetLimit(0);
+}
+
+
+TEST(UploadBlockCache, Packed)
+{
+	CUploadBlockCache::Clear();
+	CUploadBlockCache::SetLimit(8 * BLOCK_SIZE);
+	const CMD4Hash hash = GetHash(1);
+	CUploadBlockCache::BlockData packed;
+
+	// Only known once the block has been compressed
+	Request(hash, 0);
+	ASSERT_FALSE(CUploadBlockCache::LookupPacked(hash, 0, BLOCK_SIZE, packed));
+
+	CUploadBlockCache::BlockData compressed(new std::vector<uint8_t>(BLOCK_SIZE / 2));
+	CUploadBlockCache::SetPacked(hash, 0, BLOCK_SIZE, compressed);
+	ASSERT_TRUE(CUploadBlockCache::LookupPacked(hash, 0, BLOCK_SIZE, packed));
+	ASSERT_TRUE(packed == compressed);
+	ASSERT_EQUALS(BLOCK_SIZE + BLOCK_SIZE / 2, GetStats().cached);
+
+	// Blocks which don't compress are remembered too
+	Request(hash, 1);
+	CUploadBlockCache::SetPacked(hash, BLOCK_SIZE, 2 * BLOCK_SIZE, CUploadBlockCache::BlockData());
+	ASSERT_TRUE(CUploadBlockCache::LookupPacked(hash, BLOCK_SIZE, 2 * BLOCK_SIZE, packed));
+	ASSERT_FALSE(packed);
+
+	// Blocks not cached are ignored
+	CUploadBlockCache::SetPacked(hash, 4 * BLOCK_SIZE, 5 * BLOCK_SIZE, compressed);
+	ASSERT_FALSE(CUploadBlockCache::LookupPacked(hash, 4 * BLOCK_SIZE, 5 * BLOCK_SIZE, packed));
+
+	// And dropped along with the block
+	CUploadBlockCache::Invalidate(hash, 0, BLOCK_SIZE);
+	ASSERT_FALSE(CUploadBlockCache::LookupPacked(hash, 0, BLOCK_SIZE, packed));
+	ASSERT_EQUALS(BLOCK_SIZE, GetStats().cached);
+
+	CUploadBlockCache::SetLimit(0);
+	CUploadBlockCache::Clear();
+}
@@ -0,0 +1,125 @@
+#include <muleunit/test.h>
+
+#include <vector>
+
+#include <zlib.h>
+
+#include <UploadCompressor.h>
+
+using namespace muleunit;
+
+
+//! Size of the blocks used by the tests.
+const size_t BLOCK_SIZE = 184320;
+
+
+/** Returns the current statistics of the compressor. */
+static CUploadCompressor::Stats GetStats()
+{
+	CUploadCompressor::Stats stats;
+	CUploadCompressor::GetStats(stats);
+
+	return stats;
+}
+
+
+/** Returns a hash which differs for every value. */
+static CMD4Hash GetHash(uint8_t value)
+{
+	unsigned char hash[MD4HASH_LENGTH] = { 0 };
+	hash[0] = value;
+
+	return CMD4Hash(hash);
+}
+
+
+/** Returns a block of text, which compresses well. */
+static CUploadBlockCache::BlockData GetText()
+{
+	const char text[] = "All work and no play makes Jack a dull boy. ";
+	std::vector<uint8_t>* data = new std::vector<uint8_t>(BLOCK_SIZE);
+	for (size_t i = 0; i < data->size(); ++i) {
+		(*data)[i] = text[(i * 7 / 5) % (sizeof(text) - 1)];
+	}
+
+	return CUploadBlockCache::BlockData(data);
+}
+
+
+/** Returns a block of noise, which doesn't compress. */
+static CUploadBlockCache::BlockData GetNoise(uint32 seed)
+{
+	std::vector<uint8_t>* data = new std::vector<uint8_t>(BLOCK_SIZE);
+	for (size_t i = 0; i < data->size(); ++i) {
+		seed = seed * 1103515245 + 12345;
+		(*data)[i] = seed >> 16;
+	}
+
+	return CUploadBlockCache::BlockData(data);
+}
+
+
+DECLARE_SIMPLE(UploadCompressor)
+
+
+TEST(UploadCompressor, Compress)
+{
+	const CUploadCompressor::Stats before = GetStats();
+	const CUploadBlockCache::BlockData data = GetText();
+
+	// Without workers, blocks are compressed right away
+	CUploadCompressor::JobPtr job = CUploadCompressor::Compress(GetHash(1), data);
+	ASSERT_TRUE(job->IsDone());
+	ASSERT_FALSE(job->IsSkipped());
+
+	const CUploadBlockCache::BlockData packed = job->GetResult();
+	ASSERT_TRUE(packed);
+	ASSERT_TRUE(packed->size() < data->size());
+
+	std::vector<uint8_t> unpacked(data->size());
+	uLongf size = unpacked.size();
+	ASSERT_EQUALS(Z_OK, uncompress(&unpacked[0], &size, &(*packed)[0], packed->size()));
+	ASSERT_EQUALS(data->size(), (size_t)size);
+	ASSERT_TRUE(unpacked == *data);
+
+	const CUploadCompressor::Stats after = GetStats();
+	ASSERT_EQUALS(before.compressed + 1, after.compressed);
+	ASSERT_EQUALS(before.input + data->size(), after.input);
+	ASSERT_EQUALS(before.saved + data->size() - packed->size(), after.saved);
+	ASSERT_TRUE(after.level >= 1 && after.level <= 9);
+}
+
+
+TEST(UploadCompressor, Uncompressible)
+{
+	const CUploadCompressor::Stats before = GetStats();
+	const CMD4Hash hash = GetHash(2);
+
+	// Blocks which don't compress are sent as they are
+	for (uint32 i = 0; i < 4; ++i) {
+		ASSERT_TRUE(CUploadCompressor::IsWorthCompressing(hash));
+		CUploadCompressor::JobPtr job = CUploadCompressor::Compress(hash, GetNoise(i));
+		ASSERT_TRUE(job->IsDone());
+		ASSERT_FALSE(job->IsSkipped());
+		ASSERT_FALSE(job->GetResult());
+	}
+	ASSERT_EQUALS(before.uncompressible + 4, GetStats().uncompressible);
+
+	// After that, the file is only checked now and then
+	for (uint32 i = 1; i < 16; ++i) {
+		ASSERT_FALSE(CUploadCompressor::IsWorthCompressing(hash));
+	}
+	ASSERT_EQUALS(before.uncompressible + 4 + 15, GetStats().uncompressible);
+	ASSERT_TRUE(CUploadCompressor::IsWorthCompressing(hash));
+
+	const CUploadBlockCache::BlockData text = GetText();
+	CUploadCompressor::JobPtr job = CUploadCompressor::Compress(hash, text);
+	ASSERT_TRUE(job->GetResult());
+	ASSERT_EQUALS(before.compressed + 1, GetStats().compressed);
+
+	// Which resets the file
+	ASSERT_TRUE(CUploadCompressor::IsWorthCompressing(hash));
+
+	// Other files are not affected
+	ASSERT_TRUE(CUploadCompressor::IsWorthCompressing(GetHash(3)));
+}
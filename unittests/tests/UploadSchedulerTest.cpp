@@ -0,0 +1,368 @@
+#include <muleunit/test.h>
+
+#include <ThrottledSocket.h>
+#include <UploadScheduler.h>
+
+using namespace muleunit;
+
+
+/**
+ * A socket with an upload slot, which sends whatever it is allowed to,
+ * rounded up to whole fragments if a fragment size is set.
+ */
+class CTestSocket : public ThrottledFileSocket
+{
+public:
+	CTestSocket(uint32 queued = 0)
+		: m_queued(queued),
+		  m_sent(0),
+		  m_fragment(0),
+		  m_blocked(false)
+	{}
+
+	SocketSentBytes SendControlData(uint32, uint32)
+	{
+		SocketSentBytes sent = { true, 0, 0 };
+		return sent;
+	}
+
+	SocketSentBytes SendFileAndControlData(uint32 maxNumberOfBytesToSend, uint32)
+	{
+		if (m_fragment) {
+			maxNumberOfBytesToSend = (maxNumberOfBytesToSend + m_fragment - 1) / m_fragment * m_fragment;
+		}
+		const uint32 count = m_blocked ? 0 : std::min(maxNumberOfBytesToSend, m_queued);
+		m_queued -= count;
+		m_sent += count;
+
+		SocketSentBytes sent = { true, count, 0 };
+		return sent;
+	}
+
+	uint32 GetLastCalledSend()	{ return 0; }
+	uint32 GetNeededBytes()		{ return 0; }
+	bool HasStandardData()		{ return m_queued > 0 && !m_blocked; }
+
+	uint32	m_queued;
+	uint32	m_sent;
+	uint32	m_fragment;
+	bool	m_blocked;
+};
+
+
+DECLARE_SIMPLE(UploadScheduler)
+
+
+TEST(UploadScheduler, TokenBucket)
+{
+	CTokenBucket bucket;
+	bucket.SetRate(1000000, 10000);
+
+	// Starts out full
+	bucket.Refill(5000000);
+	ASSERT_EQUALS(10000, bucket.GetTokens());
+	ASSERT_EQUALS(0u, bucket.GetWaitTime(10000));
+
+	// One byte per microsecond, in debt after sending more than there was
+	bucket.Consume(12000);
+	ASSERT_EQUALS(-2000, bucket.GetTokens());
+	ASSERT_EQUALS(3000u, bucket.GetWaitTime(1000));
+	bucket.Refill(5000500);
+	ASSERT_EQUALS(-1500, bucket.GetTokens());
+
+	// Tokens are saved up to the burst size only
+	bucket.Refill(6000000);
+	ASSERT_EQUALS(10000, bucket.GetTokens());
+
+	// As is the debt
+	bucket.Consume(50000);
+	ASSERT_EQUALS(-10000, bucket.GetTokens());
+
+	// Fractions of tokens aren't lost at low rates
+	bucket.SetRate(300, 10000);
+	for (uint64 now = 6000000; now <= 16000000; now += 1000) {
+		bucket.Refill(now);
+	}
+	ASSERT_EQUALS(-7000, bucket.GetTokens());
+	ASSERT_EQUALS(23333334u, bucket.GetWaitTime(0));
+}
+
+
+TEST(UploadScheduler, DelayController)
+{
+	CUploadDelayController controller;
+	controller.SetTarget(50000);
+	controller.Reset(0, 100000);
+	ASSERT_EQUALS(100000u, controller.GetTargetRate());
+
+	// Adjusted every 200 ms, keeping the rate without any samples
+	controller.AddSent(20000);
+	ASSERT_FALSE(controller.Update(100000));
+	ASSERT_TRUE(controller.Update(200000));
+	ASSERT_EQUALS(100000u, controller.GetTargetRate());
+	ASSERT_EQUALS(100000u, controller.GetCurrentRate());
+
+	// Grows without queueing delay, even if a single connection is slow
+	uint64 now = 200000;
+	uint64 rate = controller.GetTargetRate();
+	for (unsigned i = 0; i < 10; ++i) {
+		now += 200000;
+		controller.AddSample(0);
+		controller.AddSample(1000);
+		controller.AddSample(300000);
+		controller.AddSent(rate / 5);
+		ASSERT_TRUE(controller.Update(now));
+		ASSERT_TRUE(controller.GetTargetRate() > rate);
+		rate = controller.GetTargetRate();
+	}
+	ASSERT_EQUALS(1000u, controller.GetQueueingDelay());
+
+	// But not if it isn't used
+	now += 200000;
+	controller.AddSample(0);
+	controller.AddSent(rate / 20);
+	ASSERT_TRUE(controller.Update(now));
+	ASSERT_EQUALS(rate, controller.GetTargetRate());
+
+	// Stays put at the target delay
+	now += 200000;
+	controller.AddSample(50000);
+	controller.AddSent(rate / 5);
+	ASSERT_TRUE(controller.Update(now));
+	ASSERT_EQUALS(rate, controller.GetTargetRate());
+
+	// Drops above the target, but at most to half per update
+	now += 200000;
+	controller.AddSample(100000);
+	ASSERT_TRUE(controller.Update(now));
+	ASSERT_EQUALS(rate - rate / 5, controller.GetTargetRate());
+	rate = controller.GetTargetRate();
+
+	now += 200000;
+	controller.AddSample(5000000);
+	ASSERT_TRUE(controller.Update(now));
+	ASSERT_EQUALS(rate - rate / 2, controller.GetTargetRate());
+	ASSERT_EQUALS(5000000u, controller.GetQueueingDelay());
+
+	// Never above the limit, nor too low to upload at all
+	controller.SetMaxRate(50000);
+	now += 200000;
+	ASSERT_TRUE(controller.Update(now));
+	ASSERT_EQUALS(50000u, controller.GetTargetRate());
+
+	for (unsigned i = 0; i < 100; ++i) {
+		now += 200000;
+		controller.AddSample(5000000);
+		controller.Update(now);
+	}
+	ASSERT_EQUALS(2048u, controller.GetTargetRate());
+	ASSERT_EQUALS(0u, controller.GetCurrentRate());
+}
+
+
+/** Lets the slots upload at their rates for the given time, and updates the controller. */
+static CUploadSlotController::Decision UpdateSlots(CUploadSlotController& controller, uint32& now, uint64 capacity,
+	std::vector<CUploadSlotController::SlotInfo>& slots, const std::vector<uint64>& rates)
+{
+	now += 2000;
+	for (size_t i = 0; i < slots.size(); ++i) {
+		slots[i].sent += rates[i] * 2;
+		slots[i].uploadTime += 2000;
+	}
+
+	return controller.Update(now, capacity, slots);
+}
+
+
+TEST(UploadScheduler, SlotController)
+{
+	CUploadSlotController controller;
+	controller.SetLimits(2, 5);
+	controller.SetMinSlotRate(1000);
+	controller.Reset(0, 3);
+	ASSERT_EQUALS(3u, controller.GetSlots());
+
+	int ids[5];
+	std::vector<CUploadSlotController::SlotInfo> slots;
+	std::vector<uint64> rates;
+	for (unsigned i = 0; i < 3; ++i) {
+		CUploadSlotController::SlotInfo slot = { &ids[i], 0, 0, true };
+		slots.push_back(slot);
+		rates.push_back(5000);
+	}
+
+	// Slots are opened one by one while the uplink isn't used, once the rates settled
+	uint32 now = 0;
+	ASSERT_FALSE(controller.IsDue(1000));
+	ASSERT_TRUE(controller.IsDue(2000));
+	for (unsigned i = 0; i < 4; ++i) {
+		ASSERT_EQUALS(CUploadSlotController::SlotsKept, UpdateSlots(controller, now, 100000, slots, rates));
+	}
+	ASSERT_EQUALS(CUploadSlotController::SlotOpened, UpdateSlots(controller, now, 100000, slots, rates));
+	ASSERT_EQUALS(4u, controller.GetSlots());
+	ASSERT_EQUALS(15000u, controller.GetRate());
+	ASSERT_EQUALS(5000u, controller.GetSlotRate(&ids[0]));
+
+	// But only if they are taken
+	for (unsigned i = 0; i < 10; ++i) {
+		ASSERT_EQUALS(CUploadSlotController::SlotsKept, UpdateSlots(controller, now, 100000, slots, rates));
+	}
+
+	// Slow slots are dropped only once the uplink is saturated
+	CUploadSlotController::SlotInfo slow = { &ids[3], 0, 0, true };
+	slots.push_back(slow);
+	rates.push_back(500);
+	ASSERT_EQUALS(CUploadSlotController::SlotOpened, UpdateSlots(controller, now, 100000, slots, rates));
+	ASSERT_EQUALS(5u, controller.GetSlots());
+
+	CUploadSlotController::SlotInfo friendSlot = { &ids[4], 0, 0, false };
+	slots.push_back(friendSlot);
+	rates.push_back(100);
+	for (unsigned i = 0; i < 20; ++i) {
+		ASSERT_EQUALS(CUploadSlotController::SlotsKept, UpdateSlots(controller, now, 100000, slots, rates));
+	}
+	ASSERT_EQUALS(5u, controller.GetSlots());
+	ASSERT_TRUE(controller.GetSlotToDrop() == NULL);
+
+	// The slowest slot that may be dropped
+	ASSERT_EQUALS(CUploadSlotController::SlowSlotFound, UpdateSlots(controller, now, 16000, slots, rates));
+	ASSERT_TRUE(controller.GetSlotToDrop() == &ids[3]);
+	ASSERT_EQUALS(500u, controller.GetSlotRate(&ids[3]));
+	ASSERT_TRUE(controller.GetUtilisation() >= 95.0);
+
+	controller.SlotDropped(now);
+	ASSERT_TRUE(controller.GetSlotToDrop() == NULL);
+	ASSERT_EQUALS(1u, controller.GetDropped());
+	slots.erase(slots.begin() + 3);
+	rates.erase(rates.begin() + 3);
+
+	// Slots are closed while they get too little, down to the minimum
+	for (unsigned i = 0; i < 3; ++i) {
+		rates[i] = 800;
+	}
+	for (unsigned i = 0; i < 100; ++i) {
+		UpdateSlots(controller, now, 1500, slots, rates);
+	}
+	ASSERT_EQUALS(2u, controller.GetSlots());
+	ASSERT_EQUALS(2u, controller.GetOpened());
+	ASSERT_EQUALS(3u, controller.GetClosed());
+
+	// Nothing is changed without a capacity
+	rates[0] = rates[1] = rates[2] = 0;
+	for (unsigned i = 0; i < 20; ++i) {
+		ASSERT_EQUALS(CUploadSlotController::SlotsKept, UpdateSlots(controller, now, 0, slots, rates));
+	}
+	ASSERT_EQUALS(2u, controller.GetSlots());
+}
+
+
+TEST(UploadScheduler, Fairness)
+{
+	CUploadSlotScheduler scheduler;
+	CTestSocket first(1000000);
+	CTestSocket second(1000000);
+	CTestSocket idle;
+	scheduler.Add(0, &first);
+	scheduler.Add(1, &idle);
+	scheduler.Add(2, &second);
+	ASSERT_TRUE(scheduler.HasData());
+
+	// Budgets smaller than a quantum are shared over several calls
+	uint32 overhead = 0;
+	for (unsigned i = 0; i < 100; ++i) {
+		ASSERT_EQUALS(700u, scheduler.Send(700, 2600, 2600, overhead));
+	}
+	ASSERT_EQUALS(70000u, first.m_sent + second.m_sent);
+	ASSERT_TRUE(first.m_sent - second.m_sent + 2600 <= 5200);
+	ASSERT_EQUALS(0u, overhead);
+
+	// Slots without data don't save up their share
+	idle.m_queued = 100000;
+	const uint32 before = first.m_sent;
+	ASSERT_EQUALS(7800u, scheduler.Send(7800, 2600, 2600, overhead));
+	ASSERT_TRUE(idle.m_sent <= 2600);
+	ASSERT_TRUE(first.m_sent - before <= 2600);
+
+	// Blocked slots are skipped
+	first.m_blocked = true;
+	second.m_blocked = true;
+	idle.m_blocked = true;
+	ASSERT_FALSE(scheduler.HasData());
+	ASSERT_EQUALS(0u, scheduler.Send(100000, 2600, 2600, overhead));
+
+	// The rest is used by the remaining slots
+	second.m_blocked = false;
+	ASSERT_EQUALS(100000u, scheduler.Send(100000, 2600, 2600, overhead));
+
+	// Slots send less once their data runs out
+	second.m_queued = 1000;
+	ASSERT_EQUALS(1000u, scheduler.Send(100000, 2600, 2600, overhead));
+	ASSERT_FALSE(scheduler.HasData());
+}
+
+
+TEST(UploadScheduler, Fragments)
+{
+	CUploadSlotScheduler scheduler;
+	CTestSocket first(1000000);
+	CTestSocket second(1000000);
+	first.m_fragment = second.m_fragment = 2600;
+	scheduler.Add(0, &first);
+	scheduler.Add(1, &second);
+
+	// Everything sent is counted, even beyond the budget
+	uint32 overhead = 0;
+	uint32 spent = scheduler.Send(1000, 1000, 2600, overhead);
+	ASSERT_EQUALS(2600u, spent);
+	ASSERT_EQUALS(2600u, first.m_sent + second.m_sent);
+
+	// Taking the excess from the next budget, like the token bucket does,
+	// keeps the rate, and the slots still get the same share
+	sint64 tokens = 1000 - (sint64)spent;
+	for (unsigned i = 1; i < 100; ++i) {
+		tokens += 1000;
+		if (tokens > 0) {
+			const uint32 bytes = scheduler.Send(tokens, 1000, 2600, overhead);
+			tokens -= bytes;
+			spent += bytes;
+		}
+	}
+	ASSERT_EQUALS(first.m_sent + second.m_sent, spent);
+	ASSERT_TRUE(spent >= 100000 - 2600);
+	ASSERT_TRUE(spent <= 100000 + 2600);
+	ASSERT_TRUE(first.m_sent - second.m_sent + 2600 <= 5200);
+}
+
+
+TEST(UploadScheduler, Slots)
+{
+	CUploadSlotScheduler scheduler;
+	CTestSocket sockets[3];
+	scheduler.Add(0, &sockets[0]);
+	scheduler.Add(5, &sockets[1]);
+	scheduler.Add(0, &sockets[2]);
+	ASSERT_EQUALS(3u, scheduler.GetCount());
+	ASSERT_TRUE(scheduler.GetSocket(0) == &sockets[2]);
+	ASSERT_TRUE(scheduler.GetSocket(2) == &sockets[1]);
+
+	// Adding a slot again moves it
+	scheduler.Add(2, &sockets[2]);
+	ASSERT_EQUALS(3u, scheduler.GetCount());
+	ASSERT_TRUE(scheduler.GetSocket(2) == &sockets[2]);
+
+	ASSERT_TRUE(scheduler.Remove(&sockets[0]));
+	ASSERT_FALSE(scheduler.Remove(&sockets[0]));
+	ASSERT_EQUALS(2u, scheduler.GetCount());
+
+	// Removing the slot whose turn it is
+	uint32 overhead = 0;
+	sockets[1].m_queued = sockets[2].m_queued = 100000;
+	ASSERT_EQUALS(1000u, scheduler.Send(1000, 2600, 2600, overhead));
+	ASSERT_TRUE(scheduler.Remove(&sockets[1]));
+	ASSERT_EQUALS(5200u, scheduler.Send(5200, 2600, 2600, overhead));
+	ASSERT_EQUALS(5200u, sockets[2].m_sent);
+
+	scheduler.Clear();
+	ASSERT_EQUALS(0u, scheduler.GetCount());
+	ASSERT_FALSE(scheduler.HasData());
+}